@@ -0,0 +1,862 @@
+// Benchmark of the engine's hot paths on synthetic cities.
+//
+// Build (every engine source except main.cpp, which has the menu's main):
+//   g++ -std=c++17 -O2 -pthread -o bench bench.cpp
+//       $(ls *.cpp | grep -v -e '^main\.cpp$' -e '^bench\.cpp$')      (one line)
+//
+// Usage:
+//   bench [--graph grid|scalefree|all] [--sizes 500,2000,8000] [--seed N]
+//         [--budget-ms 2000] [--dir bench_data]
+//         [--out results.jsonl] [--baseline old.jsonl] [--tolerance 0.15]
+//         [--threads 1,2,4]
+//
+// For every graph and size (number of places) a city is generated:
+//   grid        side x side streets, a cheap arterial every 8th row/column
+//   scalefree   preferential attachment, two roads per new place
+// with one user per place (a quarter of them drivers), places/10 offers
+// and places/5 requests. Departure times cluster around the morning and
+// evening rush; 60% of requests ride along an existing offer's route.
+//
+// Timed: GetOrCreatePlace (new and existing names), ComputeShortestPath
+// alone and for every offer as a ComputeRoutes batch per --threads count,
+// FindReachableWithinCost (the search behind PrintReachableWithinCost)
+// one start at a time and via BoundedSearchBatch, the unbounded search
+// with Dijkstra and with delta-stepping on each --threads count (plus a
+// scaling table), OfferCandidates (the matcher's offer filter), a batch
+// of road cost updates with the route repair, publishing the road graph
+// snapshot the searches route on, MatchNextRequest, SaveAll
+// (full and incremental) and LoadAll. Each operation is sampled until
+// --budget-ms or its sample limit is reached.
+//
+// Engine isolation: for each --threads count T, T independent engines
+// (engine.h) each get their own copy of the city and route a batch of
+// shortest paths at the same time, one thread per engine (time per round,
+// plus a scaling table).
+//
+// --out writes one JSON object per measurement:
+//   {"graph":"grid","places":2000,"op":"shortest_path","samples":200,
+//    "mean_us":..., "p50_us":..., "p99_us":...}
+// --baseline reads such a file and compares p50 per (graph, places, op);
+// the exit status is 1 if any op got slower than 1 + tolerance times.
+
+#include "roads.h"
+#include "ride.h"
+#include "user.h"
+#include "storage.h"
+#include "segments.h"
+#include "pool.h"
+#include "offer_store.h"
+#include "search.h"
+#include "offer_routes.h"
+#include "road_graph.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// -------------------------
+// Options + results
+// -------------------------
+struct BenchOptions
+{
+    vector<string> graphs{"grid", "scalefree"};
+    vector<int> sizes{500, 2000, 8000};
+    unsigned seed = 1;
+    double budgetMs = 2000;
+    string dir = "bench_data";
+    string out;
+    string baseline;
+    double tolerance = 0.15;
+    vector<int> threads{1, 2, 4};
+};
+
+struct BenchResult
+{
+    string graph;
+    int places;
+    string op;
+    int samples;
+    double meanUs, p50Us, p99Us;
+};
+
+static double Percentile(vector<double>& v, double q)
+{
+    if (v.empty()) return 0;
+    size_t k = (size_t)(q * (v.size() - 1));
+    nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static BenchResult Summarize(const string& graph, int places, const char* op, vector<double>& us)
+{
+    BenchResult r{graph, places, op, (int)us.size(), 0, 0, 0};
+    for (double x : us) r.meanUs += x;
+    if (!us.empty()) r.meanUs /= us.size();
+    r.p50Us = Percentile(us, 0.50);
+    r.p99Us = Percentile(us, 0.99);
+    return r;
+}
+
+// Calls fn(i) for i = 0.. until maxSamples or the time budget is used up
+// (always at least once); one latency sample per call.
+static vector<double> Sample(int maxSamples, double budgetMs, const function<void(int)>& fn)
+{
+    vector<double> us;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < maxSamples; i++)
+    {
+        if (i > 0 && chrono::duration<double, milli>(Clock::now() - start).count() > budgetMs)
+            break;
+        Clock::time_point t0 = Clock::now();
+        fn(i);
+        us.push_back(chrono::duration<double, micro>(Clock::now() - t0).count());
+    }
+    return us;
+}
+
+// -------------------------
+// Synthetic city
+// -------------------------
+struct City
+{
+    vector<string> names;        // place i
+    vector<Place*> places;
+    vector<int> drivers;
+    vector<int> passengers;
+    vector<RideOffer*> offers;
+};
+
+static string PlaceName(char prefix, int i)
+{
+    return prefix + to_string(i);
+}
+
+// Graph generators produce undirected edges (a, b, cost); AddRoad is
+// called for both directions.
+struct Edge
+{
+    int a, b, cost;
+};
+
+static vector<Edge> GridEdges(int n, mt19937& rng)
+{
+    int side = max(1, (int)ceil(sqrt((double)n)));
+    uniform_int_distribution<int> street(3, 9), arterial(1, 3);
+    vector<Edge> edges;
+    for (int i = 0; i < n; i++)
+    {
+        int r = i / side, c = i % side;
+        if (c + 1 < side && i + 1 < n)
+            edges.push_back(Edge{i, i + 1, r % 8 == 0 ? arterial(rng) : street(rng)});
+        if (i + side < n)
+            edges.push_back(Edge{i, i + side, c % 8 == 0 ? arterial(rng) : street(rng)});
+    }
+    return edges;
+}
+
+static vector<Edge> ScaleFreeEdges(int n, mt19937& rng)
+{
+    uniform_int_distribution<int> cost(1, 20);
+    vector<Edge> edges;
+    vector<int> ends;            // every edge endpoint: degree-weighted picks
+    int seedCount = min(n, 3);
+    for (int i = 0; i < seedCount; i++)
+        for (int j = i + 1; j < seedCount; j++)
+        {
+            edges.push_back(Edge{i, j, cost(rng)});
+            ends.push_back(i);
+            ends.push_back(j);
+        }
+    for (int v = seedCount; v < n; v++)
+    {
+        int first = -1;
+        for (int k = 0; k < 2; k++)
+        {
+            int u;
+            do
+                u = ends[uniform_int_distribution<size_t>(0, ends.size() - 1)(rng)];
+            while (u == first);
+            first = u;
+            edges.push_back(Edge{v, u, cost(rng)});
+            ends.push_back(v);
+            ends.push_back(u);
+        }
+    }
+    return edges;
+}
+
+// Minutes since midnight: 40% morning rush, 40% evening rush, 20% anywhere.
+static int DepartTime(mt19937& rng)
+{
+    double pick = uniform_real_distribution<double>(0, 1)(rng);
+    double t;
+    if (pick < 0.4)
+        t = normal_distribution<double>(480, 45)(rng);
+    else if (pick < 0.8)
+        t = normal_distribution<double>(1050, 60)(rng);
+    else
+        t = uniform_real_distribution<double>(0, 1440)(rng);
+    return min(1439, max(0, (int)t));
+}
+
+// The generator's own Dijkstra (not the engine's) so that building the
+// workload does not depend on the code being measured.
+static bool RouteBetween(const City& city, const unordered_map<Place*, int>& idx,
+                         int from, int to, vector<int>& route)
+{
+    int n = (int)city.places.size();
+    vector<int> dist(n, INT_MAX), parent(n, -1);
+    typedef pair<int, int> Item;
+    priority_queue<Item, vector<Item>, greater<Item>> pq;
+    dist[from] = 0;
+    pq.push(Item(0, from));
+    while (!pq.empty())
+    {
+        Item top = pq.top();
+        pq.pop();
+        int u = top.second;
+        if (top.first > dist[u]) continue;
+        if (u == to) break;
+        for (RoadLink* e = city.places[u]->firstLink; e; e = e->next)
+        {
+            int v = idx.at(e->to);
+            if (top.first + e->cost < dist[v])
+            {
+                dist[v] = top.first + e->cost;
+                parent[v] = u;
+                pq.push(Item(dist[v], v));
+            }
+        }
+    }
+    if (dist[to] == INT_MAX) return false;
+    route.clear();
+    for (int v = to; v != -1; v = parent[v])
+        route.push_back(v);
+    reverse(route.begin(), route.end());
+    return true;
+}
+
+static void GeneratePopulation(City& city, int n, mt19937& rng)
+{
+    int userCount = n;
+    vector<int> ids(userCount);
+    for (int i = 0; i < userCount; i++) ids[i] = i + 1;
+    shuffle(ids.begin(), ids.end(), rng);   // random insertion order keeps the BST shallow
+    Engine& eng = CurrentEngine();
+    for (int id : ids)
+    {
+        int isDriver = (id % 4 == 0);
+        eng.userRoot = CreateUser(eng.userRoot, id, ("user" + to_string(id)).c_str(), isDriver);
+        (isDriver ? city.drivers : city.passengers).push_back(id);
+    }
+
+    uniform_int_distribution<int> anyPlace(0, n - 1), seats(1, 4), slack(0, 30), pastRides(0, 4);
+    int offerCount = max(20, n / 10);
+    for (int i = 0; i < offerCount; i++)
+    {
+        int a = anyPlace(rng), b = anyPlace(rng);
+        int driver = city.drivers[uniform_int_distribution<size_t>(0, city.drivers.size() - 1)(rng)];
+        RideOffer* o = CreateRideOffer(i + 1, driver, city.names[a].c_str(), city.names[b].c_str(),
+                                       DepartTime(rng), seats(rng));
+        if (o) city.offers.push_back(o);
+    }
+
+    unordered_map<Place*, int> idx;
+    for (int i = 0; i < n; i++) idx[city.places[i]] = i;
+
+    int requestCount = max(20, n / 5);
+    vector<int> route;
+    for (int i = 0; i < requestCount; i++)
+    {
+        int passenger = city.passengers[uniform_int_distribution<size_t>(0, city.passengers.size() - 1)(rng)];
+        int from = anyPlace(rng), to = anyPlace(rng), t = DepartTime(rng);
+        RideOffer* o = city.offers[uniform_int_distribution<size_t>(0, city.offers.size() - 1)(rng)];
+        if (uniform_int_distribution<int>(0, 9)(rng) < 6 &&
+            RouteBetween(city, idx, idx[o->startPlace], idx[o->endPlace], route) && route.size() > 1)
+        {
+            // A stretch of the driver's route, around the driver's departure.
+            size_t s = uniform_int_distribution<size_t>(0, route.size() - 2)(rng);
+            size_t e = uniform_int_distribution<size_t>(s + 1, route.size() - 1)(rng);
+            from = route[s];
+            to = route[e];
+            t = o->departTime;
+        }
+        CreateRideRequest(i + 1, passenger, city.names[from].c_str(), city.names[to].c_str(),
+                          max(0, t - slack(rng)), t + slack(rng));
+    }
+
+    // Past rides so that SaveAll/LoadAll carry a realistic history.
+    for (int id = 1; id <= userCount; id++)
+    {
+        int k = pastRides(rng);
+        for (int j = 0; j < k; j++)
+            AddHistory(id, uniform_int_distribution<int>(1, offerCount)(rng),
+                       city.names[anyPlace(rng)].c_str(), city.names[anyPlace(rng)].c_str(),
+                       DepartTime(rng));
+    }
+}
+
+// -------------------------
+// One graph at one size
+// -------------------------
+#define PLACE_BATCH 256          // GetOrCreatePlace calls per sample
+#define REACHABLE_BATCH 64       // starts per BoundedSearchBatch call
+#define WIDE_BOUND (INT_MAX / 2)  // reach everything
+#define TRAFFIC_BATCH 16         // road cost updates per sample
+
+static void RunCity(const BenchOptions& opt, const string& graph, int n, vector<BenchResult>& results)
+{
+    ResetInMemoryState();
+    mt19937 rng(opt.seed * 7919u + n + (graph == "grid" ? 0 : 1));
+    City city;
+    char prefix = (graph == "grid") ? 'G' : 'S';
+    for (int i = 0; i < n; i++)
+        city.names.push_back(PlaceName(prefix, i));
+
+    vector<double> us;
+    int batches = (n + PLACE_BATCH - 1) / PLACE_BATCH;
+
+    // GetOrCreatePlace: every place is new, then existing names in random order.
+    city.places.resize(n);
+    for (int b = 0; b < batches; b++)
+    {
+        int lo = b * PLACE_BATCH, hi = min(n, lo + PLACE_BATCH);
+        Clock::time_point t0 = Clock::now();
+        for (int i = lo; i < hi; i++)
+            city.places[i] = GetOrCreatePlace(city.names[i].c_str());
+        us.push_back(chrono::duration<double, micro>(Clock::now() - t0).count() / (hi - lo));
+    }
+    results.push_back(Summarize(graph, n, "place_create", us));
+
+    us.clear();
+    uniform_int_distribution<int> anyPlace(0, n - 1);
+    for (int b = 0; b < batches; b++)
+    {
+        int picks[PLACE_BATCH];
+        for (int i = 0; i < PLACE_BATCH; i++) picks[i] = anyPlace(rng);
+        Clock::time_point t0 = Clock::now();
+        for (int i = 0; i < PLACE_BATCH; i++)
+            if (GetOrCreatePlace(city.names[picks[i]].c_str()) != city.places[picks[i]])
+                cout << "place lookup mismatch\n";
+        us.push_back(chrono::duration<double, micro>(Clock::now() - t0).count() / PLACE_BATCH);
+    }
+    results.push_back(Summarize(graph, n, "place_lookup", us));
+
+    vector<Edge> edges = (graph == "grid") ? GridEdges(n, rng) : ScaleFreeEdges(n, rng);
+    for (const Edge& e : edges)
+    {
+        AddRoad(city.names[e.a].c_str(), city.names[e.b].c_str(), e.cost);
+        AddRoad(city.names[e.b].c_str(), city.names[e.a].c_str(), e.cost);
+    }
+    GeneratePopulation(city, n, rng);
+
+    // Routing
+    vector<Place*> path(n);
+    us = Sample(200, opt.budgetMs, [&](int)
+    {
+        int len;
+        ComputeShortestPath(city.places[anyPlace(rng)], city.places[anyPlace(rng)], path.data(), len);
+    });
+    results.push_back(Summarize(graph, n, "shortest_path", us));
+
+    // Every offer's route as one batch on each --threads count (time per
+    // route), checked against ComputeShortestPath.
+    vector<Place*> batchStarts, batchEnds;
+    for (RideOffer* o : city.offers)
+    {
+        batchStarts.push_back(o->startPlace);
+        batchEnds.push_back(o->endPlace);
+    }
+    int routes = (int)city.offers.size();
+    RouteBatch batch;
+    for (int t : opt.threads)
+    {
+        us = Sample(20, opt.budgetMs, [&](int)
+        {
+            ComputeRoutes(batchStarts.data(), batchEnds.data(), routes, batch, t);
+        });
+        for (double& x : us) x /= routes;
+        bool same = true;
+        for (int i = 0; i < routes; i += max(1, routes / 16))
+        {
+            int len = 0;
+            bool found = ComputeShortestPath(batchStarts[i], batchEnds[i], path.data(), len);
+            int b = batch.begin[i], blen = batch.begin[i + 1] - b;
+            same = same && (found ? len : 0) == blen &&
+                   equal(path.begin(), path.begin() + blen, batch.places.begin() + b);
+        }
+        if (!same)
+            cout << "batch route differs from ComputeShortestPath (" << graph << " " << n
+                 << ", " << t << " threads)\n";
+        results.push_back(Summarize(graph, n, ("route_batch_t" + to_string(t)).c_str(), us));
+    }
+
+    vector<ReachablePlace> reached;
+    us = Sample(200, opt.budgetMs, [&](int i)
+    {
+        FindReachableWithinCost(city.offers[i % city.offers.size()], 30, reached);
+    });
+    results.push_back(Summarize(graph, n, "reachable_30", us));
+
+    // Same searches, REACHABLE_BATCH starts per call (time per start).
+    vector<Place*> starts(REACHABLE_BATCH);
+    for (int k = 0; k < REACHABLE_BATCH; k++)
+        starts[k] = city.offers[k % city.offers.size()]->startPlace;
+    vector<int> begin;
+    SearchScratch scratch;
+    us = Sample(50, opt.budgetMs, [&](int)
+    {
+        BoundedSearchBatch(scratch, starts.data(), REACHABLE_BATCH, 30, reached, begin);
+    });
+    for (double& x : us) x /= REACHABLE_BATCH;
+    results.push_back(Summarize(graph, n, "reachable_30_batch", us));
+
+    // Unbounded reach (the whole city): Dijkstra, then delta-stepping on
+    // each --threads count. Every delta-stepping result is checked
+    // against Dijkstra's, ties in cost ordered by place id.
+    vector<ReachablePlace> expect;
+    us = Sample(20, opt.budgetMs, [&](int i)
+    {
+        FindReachableWithinCost(city.offers[i % city.offers.size()], WIDE_BOUND, expect);
+    });
+    results.push_back(Summarize(graph, n, "reachable_all", us));
+    auto byCostThenId = [](const ReachablePlace& a, const ReachablePlace& b)
+    {
+        return a.cost != b.cost ? a.cost < b.cost : a.place->id < b.place->id;
+    };
+    for (int t : opt.threads)
+    {
+        bool same = true;
+        us = Sample(20, opt.budgetMs, [&](int i)
+        {
+            ParallelBoundedSearch(city.offers[i % city.offers.size()]->startPlace, WIDE_BOUND, reached, t);
+        });
+        for (int i = 0; i < 3; i++)
+        {
+            RideOffer* o = city.offers[i % city.offers.size()];
+            FindReachableWithinCost(o, WIDE_BOUND, expect);
+            ParallelBoundedSearch(o->startPlace, WIDE_BOUND, reached, t);
+            sort(expect.begin(), expect.end(), byCostThenId);
+            same = same && reached.size() == expect.size() &&
+                   equal(reached.begin(), reached.end(), expect.begin(),
+                         [](const ReachablePlace& a, const ReachablePlace& b)
+                         { return a.place == b.place && a.cost == b.cost; });
+        }
+        if (!same)
+            cout << "delta-stepping result differs from Dijkstra (" << graph << " " << n
+                 << ", " << t << " threads)\n";
+        results.push_back(Summarize(graph, n, ("reachable_all_delta_t" + to_string(t)).c_str(), us));
+    }
+
+    // Persistence
+    string dir = opt.dir + "/" + graph + "-" + to_string(n);
+    mkdir(opt.dir.c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    us = Sample(3, opt.budgetMs, [&](int)
+    {
+        SegmentMarkAllDirty();
+        if (!SaveAll(dir.c_str())) cout << "SaveAll failed in " << dir << "\n";
+    });
+    results.push_back(Summarize(graph, n, "save_all_full", us));
+
+    us = Sample(3, opt.budgetMs, [&](int i)
+    {
+        AddHistory(city.passengers[i % city.passengers.size()], 1,
+                   city.names[0].c_str(), city.names[n - 1].c_str(), 720);
+        if (!SaveAll(dir.c_str())) cout << "SaveAll failed in " << dir << "\n";
+    });
+    results.push_back(Summarize(graph, n, "save_all_incremental", us));
+
+    us = Sample(3, opt.budgetMs, [&](int)
+    {
+        ResetInMemoryState();
+        if (!LoadAll(dir.c_str())) cout << "LoadAll failed in " << dir << "\n";
+    });
+    results.push_back(Summarize(graph, n, "load_all", us));
+
+    vector<RideOffer*> candidates;
+    us = Sample(2000, opt.budgetMs, [&](int)
+    {
+        int t = DepartTime(rng);
+        OfferCandidates(t - 30, t + 30, -1, -1, candidates);
+    });
+    results.push_back(Summarize(graph, n, "offer_filter", us));
+
+    // Live traffic: TRAFFIC_BATCH cost changes on random roads, then the
+    // offer routes they affect are recomputed (time per batch).
+    uniform_int_distribution<int> jitter(-3, 3);
+    OfferRoutesWarm();
+    us = Sample(200, opt.budgetMs, [&](int)
+    {
+        for (int k = 0; k < TRAFFIC_BATCH; k++)
+        {
+            const Edge& e = edges[rng() % edges.size()];
+            UpdateRoadCost(city.names[e.a].c_str(), city.names[e.b].c_str(), max(1, e.cost + jitter(rng)));
+        }
+        OfferRoutesWarm();
+    });
+    results.push_back(Summarize(graph, n, "road_cost_update", us));
+    // Read-copy-update: copying the live lists into a new published graph
+    // after one cost edit (the next search would do it otherwise).
+    us = Sample(50, opt.budgetMs, [&](int i)
+    {
+        const Edge& e = edges[i % edges.size()];
+        UpdateRoadCost(city.names[e.a].c_str(), city.names[e.b].c_str(), e.cost + 1);
+        PublishRoadGraph();
+    });
+    results.push_back(Summarize(graph, n, "road_graph_publish", us));
+
+    // Matching below sees the generated city, routed from scratch.
+    for (const Edge& e : edges)
+        UpdateRoadCost(city.names[e.a].c_str(), city.names[e.b].c_str(), e.cost);
+    RoadGraphChanged();
+
+    // Matching runs on the reloaded state. An unmatched request goes back
+    // on top of the heap, so it is dropped (untimed) to reach the next one.
+    int matched = 0;
+    us.clear();
+    Clock::time_point start = Clock::now();
+    Engine& eng = CurrentEngine();
+    while (eng.requestHead && chrono::duration<double, milli>(Clock::now() - start).count() <= opt.budgetMs)
+    {
+        int id = eng.requestHead->requestId;
+        Clock::time_point t0 = Clock::now();
+        int ok = MatchNextRequest();
+        us.push_back(chrono::duration<double, micro>(Clock::now() - t0).count());
+        matched += ok;
+        if (!ok)
+            eng.requestPool.Free(RemoveRequestById(id));
+    }
+    results.push_back(Summarize(graph, n, "match_next_request", us));
+    cout << "  " << graph << " " << n << ": " << edges.size() * 2 << " roads, "
+         << city.offers.size() << " offers, " << matched << "/" << us.size() << " requests matched\n";
+}
+
+// -------------------------
+// Independent engines
+// -------------------------
+#define ENGINE_PATHS 32          // shortest paths per engine and round
+
+// The calling thread's engine gets a fresh city of its own.
+static void BuildEngineCity(const string& graph, int n, unsigned seed, City& city)
+{
+    mt19937 rng(seed);
+    char prefix = (graph == "grid") ? 'G' : 'S';
+    for (int i = 0; i < n; i++)
+    {
+        city.names.push_back(PlaceName(prefix, i));
+        city.places.push_back(GetOrCreatePlace(city.names[i].c_str()));
+    }
+    vector<Edge> edges = (graph == "grid") ? GridEdges(n, rng) : ScaleFreeEdges(n, rng);
+    for (const Edge& e : edges)
+    {
+        AddRoad(city.names[e.a].c_str(), city.names[e.b].c_str(), e.cost);
+        AddRoad(city.names[e.b].c_str(), city.names[e.a].c_str(), e.cost);
+    }
+    GeneratePopulation(city, n, rng);
+}
+
+// One round: every engine routes ENGINE_PATHS paths on its own thread. With
+// nothing shared between engines the round time stays flat as T grows, up
+// to the core count.
+static void RunEngines(const BenchOptions& opt, const string& graph, int n, vector<BenchResult>& results)
+{
+    for (int t : opt.threads)
+    {
+        vector<unique_ptr<Engine>> engines;
+        vector<City> cities(t);
+        vector<thread> workers;
+        for (int k = 0; k < t; k++)
+        {
+            engines.emplace_back(new Engine());
+            workers.emplace_back([&, k]()
+            {
+                EngineScope use(*engines[k]);
+                BuildEngineCity(graph, n, opt.seed * 7919u + n + k, cities[k]);
+            });
+        }
+        for (thread& w : workers) w.join();
+
+        vector<double> us = Sample(50, opt.budgetMs, [&](int round)
+        {
+            vector<thread> routers;
+            for (int k = 0; k < t; k++)
+                routers.emplace_back([&, k]()
+                {
+                    EngineScope use(*engines[k]);
+                    City& city = cities[k];
+                    mt19937 rng(round * 31 + k);
+                    uniform_int_distribution<int> anyPlace(0, n - 1);
+                    vector<Place*> path(n);
+                    int len;
+                    for (int i = 0; i < ENGINE_PATHS; i++)
+                        ComputeShortestPath(city.places[anyPlace(rng)], city.places[anyPlace(rng)], path.data(), len);
+                });
+            for (thread& r : routers) r.join();
+        });
+        results.push_back(Summarize(graph, n, ("engines_t" + to_string(t)).c_str(), us));
+    }
+}
+
+// -------------------------
+// Output + baseline comparison
+// -------------------------
+static void PrintTable(const vector<BenchResult>& results)
+{
+    char buf[160];
+    snprintf(buf, sizeof(buf), "%-10s %8s %-22s %8s %12s %12s %12s\n",
+             "graph", "places", "op", "samples", "mean (us)", "p50 (us)", "p99 (us)");
+    cout << buf;
+    for (const BenchResult& r : results)
+    {
+        snprintf(buf, sizeof(buf), "%-10s %8d %-22s %8d %12.2f %12.2f %12.2f\n",
+                 r.graph.c_str(), r.places, r.op.c_str(), r.samples, r.meanUs, r.p50Us, r.p99Us);
+        cout << buf;
+    }
+}
+
+// p50 of delta-stepping per thread count, against one thread and Dijkstra.
+static void PrintScaling(const vector<BenchResult>& results, const vector<int>& threads)
+{
+    char buf[160];
+    cout << "\nDelta-stepping scaling (reachable_all, p50):\n";
+    snprintf(buf, sizeof(buf), "%-10s %8s %8s %12s %14s %14s\n",
+             "graph", "places", "threads", "p50 (us)", "vs 1 thread", "vs Dijkstra");
+    cout << buf;
+    for (const BenchResult& seq : results)
+    {
+        if (seq.op != "reachable_all") continue;
+        const BenchResult* one = nullptr;
+        for (int t : threads)
+            for (const BenchResult& r : results)
+                if (r.graph == seq.graph && r.places == seq.places && r.op == "reachable_all_delta_t" + to_string(t))
+                {
+                    if (!one) one = &r;
+                    snprintf(buf, sizeof(buf), "%-10s %8d %8d %12.2f %13.2fx %13.2fx\n",
+                             r.graph.c_str(), r.places, t, r.p50Us,
+                             r.p50Us > 0 ? one->p50Us / r.p50Us : 0.0,
+                             r.p50Us > 0 ? seq.p50Us / r.p50Us : 0.0);
+                    cout << buf;
+                }
+    }
+}
+
+// Rounds of T engines in parallel: paths per second over all engines.
+static void PrintEngineScaling(const vector<BenchResult>& results, const vector<int>& threads)
+{
+    char buf[160];
+    cout << "\nIndependent engines (" << ENGINE_PATHS << " paths per engine and round, p50):\n";
+    snprintf(buf, sizeof(buf), "%-10s %8s %8s %12s %14s %14s\n",
+             "graph", "places", "engines", "p50 (us)", "paths/s", "vs 1 engine");
+    cout << buf;
+    for (const BenchResult& seq : results)
+    {
+        if (seq.op != "shortest_path") continue;
+        double one = 0;
+        for (int t : threads)
+            for (const BenchResult& r : results)
+                if (r.graph == seq.graph && r.places == seq.places && r.op == "engines_t" + to_string(t))
+                {
+                    double rate = r.p50Us > 0 ? t * ENGINE_PATHS * 1e6 / r.p50Us : 0.0;
+                    if (one == 0) one = rate / t;
+                    snprintf(buf, sizeof(buf), "%-10s %8d %8d %12.2f %14.0f %13.2fx\n",
+                             r.graph.c_str(), r.places, t, r.p50Us, rate, one > 0 ? rate / one : 0.0);
+                    cout << buf;
+                }
+    }
+}
+
+static bool WriteResults(const string& path, const vector<BenchResult>& results)
+{
+    ofstream out(path);
+    char buf[256];
+    for (const BenchResult& r : results)
+    {
+        snprintf(buf, sizeof(buf),
+                 "{\"graph\":\"%s\",\"places\":%d,\"op\":\"%s\",\"samples\":%d,"
+                 "\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f}\n",
+                 r.graph.c_str(), r.places, r.op.c_str(), r.samples, r.meanUs, r.p50Us, r.p99Us);
+        out << buf;
+    }
+    return (bool)out;
+}
+
+// Values of our own output format only: "key":"text" or "key":number.
+static bool FieldOf(const string& line, const char* key, string& value)
+{
+    string pat = string("\"") + key + "\":";
+    size_t p = line.find(pat);
+    if (p == string::npos) return false;
+    p += pat.size();
+    if (p < line.size() && line[p] == '"')
+    {
+        size_t e = line.find('"', p + 1);
+        if (e == string::npos) return false;
+        value = line.substr(p + 1, e - p - 1);
+        return true;
+    }
+    size_t e = line.find_first_of(",}", p);
+    value = line.substr(p, e == string::npos ? string::npos : e - p);
+    return true;
+}
+
+static bool ReadResults(const string& path, vector<BenchResult>& results)
+{
+    ifstream in(path);
+    if (!in) return false;
+    string line, graph, places, op, p50;
+    while (getline(in, line))
+    {
+        if (!FieldOf(line, "graph", graph) || !FieldOf(line, "places", places) ||
+            !FieldOf(line, "op", op) || !FieldOf(line, "p50_us", p50))
+            continue;
+        results.push_back(BenchResult{graph, atoi(places.c_str()), op, 0, 0, atof(p50.c_str()), 0});
+    }
+    return true;
+}
+
+// Returns the number of regressions.
+static int CompareBaseline(const vector<BenchResult>& base, const vector<BenchResult>& now, double tolerance)
+{
+    char buf[160];
+    int regressions = 0;
+    snprintf(buf, sizeof(buf), "%-10s %8s %-22s %12s %12s %8s\n",
+             "graph", "places", "op", "base p50", "p50", "ratio");
+    cout << buf;
+    for (const BenchResult& r : now)
+    {
+        const BenchResult* b = nullptr;
+        for (const BenchResult& x : base)
+            if (x.graph == r.graph && x.places == r.places && x.op == r.op)
+                b = &x;
+        if (!b || b->p50Us <= 0) continue;
+
+        double ratio = r.p50Us / b->p50Us;
+        bool slower = ratio > 1.0 + tolerance;
+        regressions += slower;
+        snprintf(buf, sizeof(buf), "%-10s %8d %-22s %12.2f %12.2f %7.2fx%s\n",
+                 r.graph.c_str(), r.places, r.op.c_str(), b->p50Us, r.p50Us, ratio,
+                 slower ? "  REGRESSION" : (ratio < 1.0 - tolerance ? "  faster" : ""));
+        cout << buf;
+    }
+    return regressions;
+}
+
+// -------------------------
+// Command line
+// -------------------------
+// "500,2000,8000"; every value at least `least`.
+static bool ParseIntList(const string& v, long least, vector<int>& out)
+{
+    out.clear();
+    for (const char* p = v.c_str(); *p; )
+    {
+        char* end;
+        long n = strtol(p, &end, 10);
+        if (end == p || n < least) return false;
+        out.push_back((int)n);
+        p = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') return false;
+    }
+    return !out.empty();
+}
+
+static bool ParseArgs(int argc, char** argv, BenchOptions& opt)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string a = argv[i];
+        if (i + 1 >= argc) return false;
+        string v = argv[++i];
+        if (a == "--graph")
+        {
+            if (v == "all") opt.graphs = {"grid", "scalefree"};
+            else if (v == "grid" || v == "scalefree") opt.graphs = {v};
+            else return false;
+        }
+        else if (a == "--sizes")
+        {
+            if (!ParseIntList(v, 4, opt.sizes)) return false;
+        }
+        else if (a == "--threads")
+        {
+            if (!ParseIntList(v, 1, opt.threads)) return false;
+        }
+        else if (a == "--seed") opt.seed = (unsigned)strtoul(v.c_str(), nullptr, 10);
+        else if (a == "--budget-ms") opt.budgetMs = atof(v.c_str());
+        else if (a == "--dir") opt.dir = v;
+        else if (a == "--out") opt.out = v;
+        else if (a == "--baseline") opt.baseline = v;
+        else if (a == "--tolerance") opt.tolerance = atof(v.c_str());
+        else return false;
+    }
+    return !opt.sizes.empty();
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions opt;
+    if (!ParseArgs(argc, argv, opt))
+    {
+        cout << "usage: " << argv[0] << " [--graph grid|scalefree|all] [--sizes 500,2000,8000]\n"
+             << "       [--seed N] [--budget-ms 2000] [--dir bench_data]\n"
+             << "       [--out results.jsonl] [--baseline old.jsonl] [--tolerance 0.15]\n"
+             << "       [--threads 1,2,4]\n";
+        return 2;
+    }
+
+    cout << "offer filter: " << OfferFilterKernel() << "\n";
+    vector<BenchResult> results;
+    for (const string& graph : opt.graphs)
+        for (int n : opt.sizes)
+        {
+            RunCity(opt, graph, n, results);
+            RunEngines(opt, graph, n, results);
+        }
+    PrintTable(results);
+    PrintScaling(results, opt.threads);
+    PrintEngineScaling(results, opt.threads);
+
+    if (!opt.out.empty() && !WriteResults(opt.out, results))
+    {
+        cout << "Cannot write " << opt.out << "\n";
+        return 2;
+    }
+
+    if (!opt.baseline.empty())
+    {
+        vector<BenchResult> base;
+        if (!ReadResults(opt.baseline, base))
+        {
+            cout << "Cannot read " << opt.baseline << "\n";
+            return 2;
+        }
+        cout << "\nCompared with " << opt.baseline << " (tolerance " << opt.tolerance * 100 << "%):\n";
+        int regressions = CompareBaseline(base, results, opt.tolerance);
+        cout << regressions << " regression(s)\n";
+        return regressions ? 1 : 0;
+    }
+    return 0;
+}
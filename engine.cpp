@@ -0,0 +1,81 @@
+#include "engine.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+using namespace std;
+
+static mutex partLock;
+static int partCount = 0;
+static void (*partDestroy[ENGINE_MAX_PARTS])(void*);
+static void (*partStop[ENGINE_MAX_PARTS])(void*);
+static int partStopStage[ENGINE_MAX_PARTS];
+
+int EnginePartId(void (*destroy)(void*), void (*stop)(void*), int stopStage)
+{
+    lock_guard<mutex> g(partLock);
+    if (partCount == ENGINE_MAX_PARTS)
+    {
+        fprintf(stderr, "engine: more than %d part types\n", ENGINE_MAX_PARTS);
+        abort();
+    }
+    partDestroy[partCount] = destroy;
+    partStop[partCount] = stop;
+    partStopStage[partCount] = stopStage;
+    return partCount++;
+}
+
+Engine::Engine()
+    : placeHead(nullptr), offerHead(nullptr), requestHead(nullptr),
+      requestCount(0), activeRideTable(), userRoot(nullptr)
+{
+    for (int i = 0; i < ENGINE_MAX_PARTS; i++)
+        parts[i].store(nullptr);
+}
+
+// Part types register in the order they are first used, so destroying by
+// slot says nothing about who still needs whom: every worker is stopped
+// first. A stage may create parts of a later one (the matcher can start a
+// save); those are stopped when their stage comes. Pool helpers need no
+// stop: they only run jobs while a caller waits in ThreadPool::Run, and
+// those callers are stopped here. Parts then go before the members.
+Engine::~Engine()
+{
+    EngineScope use(*this);
+    for (int stage = 0; stage < ENGINE_STOP_STAGES; stage++)
+        for (int i = 0; i < ENGINE_MAX_PARTS; i++)
+        {
+            void* p = parts[i].load();
+            if (p && partStop[i] && partStopStage[i] == stage)
+                partStop[i](p);
+        }
+
+    for (int i = ENGINE_MAX_PARTS - 1; i >= 0; i--)
+    {
+        void* p = parts[i].exchange(nullptr);
+        if (p)
+            partDestroy[i](p);
+    }
+}
+
+// -------------------------
+// Thread binding
+// -------------------------
+static Engine defaultEngine;
+static thread_local Engine* boundEngine = nullptr;
+
+Engine& CurrentEngine()
+{
+    return boundEngine ? *boundEngine : defaultEngine;
+}
+
+EngineScope::EngineScope(Engine& e) : previous(boundEngine)
+{
+    boundEngine = &e;
+}
+
+EngineScope::~EngineScope()
+{
+    boundEngine = previous;
+}
@@ -0,0 +1,133 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+// One ride-sharing engine: a city (or shard) with its own road network,
+// users, offers, requests, node pools, journal and caches.
+//
+// The core APIs stay free functions (roads.h, ride.h, user.h, ...) and
+// work on the engine bound to the calling thread. Every thread starts out
+// on the process's default engine, so single-engine code never sees one.
+// Independent engines run side by side from threads of their own:
+//
+//     Engine city;
+//     thread t([&] { EngineScope use(city); LoadAll("city_a"); ... });
+//
+// An engine is still used by one thread at a time. Helper threads started
+// by its own calls (ThreadPool::Run, LoadAll, background saves and map
+// reloads, the journal flusher, the ingest matcher) are bound to it for
+// their work. Metrics and traces stay process-wide and add up over all
+// engines.
+//
+// The structures several modules share are plain members. State private
+// to one module (journal, caches, indexes) is an engine part: the module's
+// own struct, created on first use by EnginePart<T>(). A part that runs
+// threads declares
+//     static const int STOP_STAGE = ...;   // EngineStopStage
+//     void Stop();                         // joins them; may run twice
+// and the destructor stops every part, stage by stage, before it destroys
+// any: a worker may still reach into other parts until it is joined.
+
+#include "pool.h"
+
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+#define ENGINE_MAX_PARTS 16
+
+enum EngineStopStage
+{
+    ENGINE_STOP_MUTATORS,     // threads that change the engine (ingest matcher)
+    ENGINE_STOP_BACKGROUND,   // work they may have started (saves, map reloads)
+    ENGINE_STOP_JOURNAL,      // the flusher, once nothing appends
+    ENGINE_STOP_STAGES
+};
+
+struct Engine
+{
+    // Road network (roads.h)
+    Place* placeHead;
+    std::vector<int> roadProfiles;      // ROAD_PROFILE_POINTS costs per profile
+
+    // Rides (ride.h)
+    RideOffer* offerHead;
+    RideRequest* requestHead;
+    int requestCount;
+    std::vector<RideRequest*> requestHeap;   // pending, min-heap on `earliest`
+    ActiveRide* activeRideTable[ACTIVE_RIDE_TABLE_SIZE];
+
+    // Users (user.h)
+    User* userRoot;
+
+    // Node pools (pool.h): graph chain
+    NodePool<Place> placePool;
+    NodePool<RoadLink> roadLinkPool;
+    NodePool<RideOffer> offerPool;
+    NodePool<RideRequest> requestPool;
+    NodePool<ActiveRide> activeRidePool;
+    NodePool<PassengerNode> passengerPool;
+    StringArena placeNames;
+
+    // user chain
+    NodePool<User> userPool;
+    NodePool<HistoryNode> historyPool;
+    StringArena userStrings;
+
+    std::atomic<void*> parts[ENGINE_MAX_PARTS];   // by EnginePartId
+
+    Engine();
+    ~Engine();
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+};
+
+// The engine bound to this thread (the default engine if none is).
+Engine& CurrentEngine();
+
+// Binds e to the calling thread for the scope's lifetime.
+struct EngineScope
+{
+    Engine* previous;
+
+    explicit EngineScope(Engine& e);
+    ~EngineScope();
+    EngineScope(const EngineScope&) = delete;
+    EngineScope& operator=(const EngineScope&) = delete;
+};
+
+// Registers a part type and returns its slot; aborts past ENGINE_MAX_PARTS.
+// stop is nullptr for parts without threads.
+int EnginePartId(void (*destroy)(void*), void (*stop)(void*), int stopStage);
+
+template <class T, class = void>
+struct EnginePartStop
+{
+    static constexpr void (*fn)(void*) = nullptr;
+    static constexpr int stage = 0;
+};
+
+template <class T>
+struct EnginePartStop<T, std::void_t<decltype(T::STOP_STAGE)>>
+{
+    static void fn(void* p) { static_cast<T*>(p)->Stop(); }
+    static constexpr int stage = T::STOP_STAGE;
+};
+
+template <class T>
+T& EnginePart(Engine& e = CurrentEngine())
+{
+    static const int id = EnginePartId([](void* p) { delete static_cast<T*>(p); },
+                                       EnginePartStop<T>::fn, EnginePartStop<T>::stage);
+    void* p = e.parts[id].load(std::memory_order_acquire);
+    if (!p)
+    {
+        T* made = new T();
+        if (e.parts[id].compare_exchange_strong(p, made))
+            p = made;
+        else
+            delete made;        // another thread of this engine was first
+    }
+    return *static_cast<T*>(p);
+}
+
+#endif
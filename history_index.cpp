@@ -0,0 +1,283 @@
+#include "history_index.h"
+#include "user.h"
+#include "engine.h"
+
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+using namespace std;
+
+// -------------------------
+// Index storage
+// -------------------------
+struct HistoryRow
+{
+    int userId;
+    int rideId;
+    int fromId;   // dictionary ids
+    int toId;
+    int time;
+};
+
+struct PlaceHistory
+{
+    vector<int> trips;                   // row indexes, sorted by time
+    int hourly[HISTORY_HOURS_PER_DAY];
+};
+
+struct HistoryIndex
+{
+    vector<HistoryRow> rows;
+    vector<char*> names;                         // dictionary id -> name
+    unordered_map<string, int> nameIds;          // name -> dictionary id
+    vector<PlaceHistory> places;                 // dictionary id -> trips
+    unordered_map<int, vector<int>> users;       // userId -> row indexes
+    int hourly[HISTORY_HOURS_PER_DAY];
+
+    ~HistoryIndex()
+    {
+        for (char* n : names)
+            delete[] n;
+    }
+};
+
+static HistoryIndex& History()
+{
+    return EnginePart<HistoryIndex>();
+}
+
+static int InternPlace(const char* name)
+{
+    HistoryIndex& hx = History();
+    auto it = hx.nameIds.find(name);
+    if (it != hx.nameIds.end())
+        return it->second;
+
+    int id = (int)hx.names.size();
+    char* copy = new char[strlen(name) + 1];
+    strcpy(copy, name);
+    hx.names.push_back(copy);
+    hx.nameIds[copy] = id;
+
+    hx.places.emplace_back();
+    memset(hx.places.back().hourly, 0, sizeof(hx.places.back().hourly));
+    return id;
+}
+
+static int FindPlaceId(const char* name)
+{
+    HistoryIndex& hx = History();
+    auto it = hx.nameIds.find(name);
+    return (it == hx.nameIds.end()) ? -1 : it->second;
+}
+
+// Rows mostly arrive in time order, so this is an append in the common case.
+static void InsertByTime(vector<int>& list, int row)
+{
+    HistoryIndex& hx = History();
+    int t = hx.rows[row].time;
+    auto pos = upper_bound(list.begin(), list.end(), t,
+                           [&](int time, int r) { return time < hx.rows[r].time; });
+    list.insert(pos, row);
+}
+
+static void CollectRange(const vector<int>& list, int t1, int t2, vector<HistoryRecord>& out)
+{
+    HistoryIndex& hx = History();
+    auto lo = lower_bound(list.begin(), list.end(), t1,
+                          [&](int r, int time) { return hx.rows[r].time < time; });
+    for (auto it = lo; it != list.end() && hx.rows[*it].time <= t2; ++it)
+    {
+        const HistoryRow& row = hx.rows[*it];
+        HistoryRecord rec;
+        rec.userId = row.userId;
+        rec.rideId = row.rideId;
+        rec.from = hx.names[row.fromId];
+        rec.to = hx.names[row.toId];
+        rec.time = row.time;
+        out.push_back(rec);
+    }
+}
+
+static int CountRange(const vector<int>& list, int t1, int t2)
+{
+    HistoryIndex& hx = History();
+    if (t1 > t2) return 0;
+    auto lo = lower_bound(list.begin(), list.end(), t1,
+                          [&](int r, int time) { return hx.rows[r].time < time; });
+    auto hi = upper_bound(list.begin(), list.end(), t2,
+                          [&](int time, int r) { return time < hx.rows[r].time; });
+    return (int)(hi - lo);
+}
+
+// -------------------------
+// Maintenance
+// -------------------------
+int HourOfTime(int time)
+{
+    int h = (time / HISTORY_HOUR_LENGTH) % HISTORY_HOURS_PER_DAY;
+    return (h < 0) ? h + HISTORY_HOURS_PER_DAY : h;
+}
+
+void HistoryIndexAdd(int userId, int isDriver, int rideId,
+                     const char* from, const char* to, int time)
+{
+    HistoryIndex& hx = History();
+    HistoryRow row;
+    row.userId = userId;
+    row.rideId = rideId;
+    row.fromId = InternPlace(from);
+    row.toId = InternPlace(to);
+    row.time = time;
+
+    int idx = (int)hx.rows.size();
+    hx.rows.push_back(row);
+
+    InsertByTime(hx.users[userId], idx);
+
+    if (isDriver == 1)
+        return;
+
+    // passenger row == one trip
+    int h = HourOfTime(time);
+    hx.hourly[h]++;
+
+    PlaceHistory& pf = hx.places[row.fromId];
+    InsertByTime(pf.trips, idx);
+    pf.hourly[h]++;
+
+    if (row.toId != row.fromId)
+    {
+        PlaceHistory& pt = hx.places[row.toId];
+        InsertByTime(pt.trips, idx);
+        pt.hourly[h]++;
+    }
+}
+
+void ClearHistoryIndex()
+{
+    HistoryIndex& hx = History();
+    for (char* n : hx.names)
+        delete[] n;
+    hx.rows.clear();
+    hx.names.clear();
+    hx.nameIds.clear();
+    hx.places.clear();
+    hx.users.clear();
+    memset(hx.hourly, 0, sizeof(hx.hourly));
+}
+
+// -------------------------
+// Queries
+// -------------------------
+// Lazily loaded users are read in here first: one user for a per-user
+// query. Place and hourly aggregates only index the rows of the users
+// still on disk, from their groups, and leave them there; a user indexed
+// that way needs no loading for per-user queries either.
+int QueryUserRides(int userId, int t1, int t2, vector<HistoryRecord>& out)
+{
+    HistoryIndex& hx = History();
+    User* u = SearchUser(CurrentEngine().userRoot, userId);
+    if (u && !u->historyIndexed)
+        EnsureUserHistory(u);
+    size_t before = out.size();
+    auto it = hx.users.find(userId);
+    if (it != hx.users.end())
+        CollectRange(it->second, t1, t2, out);
+    return (int)(out.size() - before);
+}
+
+int QueryPlaceRides(const char* place, int t1, int t2, vector<HistoryRecord>& out)
+{
+    HistoryIndex& hx = History();
+    IndexHistoryOnDisk(CurrentEngine().userRoot);
+    size_t before = out.size();
+    int id = FindPlaceId(place);
+    if (id >= 0)
+        CollectRange(hx.places[id].trips, t1, t2, out);
+    return (int)(out.size() - before);
+}
+
+int PlaceTripCount(const char* place, int t1, int t2)
+{
+    HistoryIndex& hx = History();
+    IndexHistoryOnDisk(CurrentEngine().userRoot);
+    int id = FindPlaceId(place);
+    if (id < 0) return 0;
+    return CountRange(hx.places[id].trips, t1, t2);
+}
+
+void PlaceHourlyTripCounts(const char* place, int counts[HISTORY_HOURS_PER_DAY])
+{
+    HistoryIndex& hx = History();
+    IndexHistoryOnDisk(CurrentEngine().userRoot);
+    int id = FindPlaceId(place);
+    for (int h = 0; h < HISTORY_HOURS_PER_DAY; h++)
+        counts[h] = (id < 0) ? 0 : hx.places[id].hourly[h];
+}
+
+void HourlyTripCounts(int counts[HISTORY_HOURS_PER_DAY])
+{
+    HistoryIndex& hx = History();
+    IndexHistoryOnDisk(CurrentEngine().userRoot);
+    for (int h = 0; h < HISTORY_HOURS_PER_DAY; h++)
+        counts[h] = hx.hourly[h];
+}
+
+// -------------------------
+// Printing
+// -------------------------
+static void PrintRecords(const vector<HistoryRecord>& recs)
+{
+    for (const HistoryRecord& r : recs)
+    {
+        cout << "  User: " << r.userId
+             << " | Ride ID: " << r.rideId
+             << " | From: " << r.from
+             << " | To: " << r.to
+             << " | Time: " << r.time << '\n';
+    }
+}
+
+void PrintUserRidesInRange(int userId, int t1, int t2)
+{
+    vector<HistoryRecord> recs;
+    int n = QueryUserRides(userId, t1, t2, recs);
+    cout << n << " ride(s) of user " << userId
+         << " in [" << t1 << ", " << t2 << "]:\n";
+    PrintRecords(recs);
+}
+
+void PrintPlaceRidesInRange(const char* place, int t1, int t2)
+{
+    vector<HistoryRecord> recs;
+    int n = QueryPlaceRides(place, t1, t2, recs);
+    cout << n << " trip(s) through " << place
+         << " in [" << t1 << ", " << t2 << "]:\n";
+    PrintRecords(recs);
+}
+
+void PrintHourlyTripCounts(const char* place)
+{
+    int counts[HISTORY_HOURS_PER_DAY];
+    if (place)
+    {
+        PlaceHourlyTripCounts(place, counts);
+        cout << "Trips per hour through " << place << ":\n";
+    }
+    else
+    {
+        HourlyTripCounts(counts);
+        cout << "Trips per hour (all places):\n";
+    }
+
+    for (int h = 0; h < HISTORY_HOURS_PER_DAY; h++)
+    {
+        if (counts[h] == 0) continue;
+        cout << "  " << (h < 10 ? "0" : "") << h << ":00  " << counts[h] << '\n';
+    }
+}
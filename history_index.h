@@ -0,0 +1,52 @@
+#ifndef HISTORY_INDEX_H
+#define HISTORY_INDEX_H
+
+// History queries — secondary indexes over ride history.
+//
+// Every AddHistory call also feeds these indexes, so time-range and
+// aggregate questions are answered without walking each user's
+// HistoryNode BST:
+//   per user  -> rows sorted by time
+//   per place -> passenger rows (one per trip) sorted by time,
+//                plus per-hour trip counts
+//   global    -> per-hour trip counts
+//
+// A "trip" is one matched passenger. Each match writes a driver row and
+// a passenger row with the same data, so trip counts and place queries
+// only use passenger rows.
+
+#include <vector>
+
+#define HISTORY_HOUR_LENGTH 60    // time units per hour (times are minutes)
+#define HISTORY_HOURS_PER_DAY 24
+
+struct HistoryRecord
+{
+    int userId;
+    int rideId;
+    const char* from;   // owned by the index dictionary
+    const char* to;
+    int time;
+};
+
+// Maintenance (called from AddHistory / ResetInMemoryState)
+void HistoryIndexAdd(int userId, int isDriver, int rideId,
+                     const char* from, const char* to, int time);
+void ClearHistoryIndex();
+
+// Queries — inclusive range [t1, t2]; results are in time order.
+int QueryUserRides(int userId, int t1, int t2, std::vector<HistoryRecord>& out);
+int QueryPlaceRides(const char* place, int t1, int t2, std::vector<HistoryRecord>& out);
+
+// Aggregates
+int PlaceTripCount(const char* place, int t1, int t2);
+void PlaceHourlyTripCounts(const char* place, int counts[HISTORY_HOURS_PER_DAY]);
+void HourlyTripCounts(int counts[HISTORY_HOURS_PER_DAY]);
+int HourOfTime(int time);
+
+// Printing helpers for the demo menu
+void PrintUserRidesInRange(int userId, int t1, int t2);
+void PrintPlaceRidesInRange(const char* place, int t1, int t2);
+void PrintHourlyTripCounts(const char* place);
+
+#endif
@@ -0,0 +1,366 @@
+#include "history_segment.h"
+
+#include "storage.h"
+
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// -------------------------
+// Varints
+// -------------------------
+static void PutVarint(string& b, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        b.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    b.push_back((char)v);
+}
+
+static void PutZigzag(string& b, int64_t v)
+{
+    PutVarint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+struct ByteReader
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    bool ok = true;
+
+    uint64_t Varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (p >= end) break;
+            unsigned char c = *p++;
+            v |= (uint64_t)(c & 0x7F) << shift;
+            if (!(c & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    int64_t Zigzag()
+    {
+        uint64_t v = Varint();
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+};
+
+static bool ReadVarint(istream& in, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = in.get();
+        if (c == EOF) return false;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+// -------------------------
+// Writing
+// -------------------------
+bool WriteHistorySegmentHeader(ostream& out, uint32_t groupCount, uint64_t rowCount)
+{
+    char counts[12];
+    memcpy(counts, &groupCount, 4);
+    memcpy(counts + 4, &rowCount, 8);
+    uint32_t crc = Crc32(counts, sizeof(counts));
+    out.write(HISTORY_SEGMENT_MAGIC, 8);
+    out.write(counts, sizeof(counts));
+    out.write((const char*)&crc, 4);
+    return (bool)out;
+}
+
+bool WriteHistoryGroup(ostream& out, int userId, const HistoryItem* items, int n)
+{
+    string payload;
+    PutZigzag(payload, userId);
+    PutVarint(payload, (uint64_t)n);
+
+    // Dictionary of the place names used by this user.
+    unordered_map<string, int> ids;
+    vector<const char*> names;
+    vector<int> fromIdx(n), toIdx(n);
+    for (int i = 0; i < n; i++)
+    {
+        const char* ends[2] = {items[i].from, items[i].to};
+        int* slots[2] = {&fromIdx[i], &toIdx[i]};
+        for (int k = 0; k < 2; k++)
+        {
+            auto it = ids.find(ends[k]);
+            if (it == ids.end())
+            {
+                it = ids.emplace(ends[k], (int)names.size()).first;
+                names.push_back(ends[k]);
+            }
+            *slots[k] = it->second;
+        }
+    }
+    PutVarint(payload, names.size());
+    for (const char* s : names)
+    {
+        size_t len = strlen(s);
+        PutVarint(payload, len);
+        payload.append(s, len);
+    }
+
+    int64_t prev = 0;
+    for (int i = 0; i < n; i++)
+    {
+        PutZigzag(payload, (int64_t)items[i].time - prev);
+        prev = items[i].time;
+    }
+    prev = 0;
+    for (int i = 0; i < n; i++)
+    {
+        PutZigzag(payload, (int64_t)items[i].rideId - prev);
+        prev = items[i].rideId;
+    }
+    for (int i = 0; i < n; i++)
+        PutVarint(payload, (uint64_t)fromIdx[i]);
+    for (int i = 0; i < n; i++)
+        PutVarint(payload, (uint64_t)toIdx[i]);
+
+    string head;
+    PutVarint(head, payload.size());
+    uint32_t crc = Crc32(payload.data(), payload.size());
+    head.append((const char*)&crc, 4);
+
+    out.write(head.data(), head.size());
+    out.write(payload.data(), payload.size());
+    return (bool)out;
+}
+
+// -------------------------
+// Reading
+// -------------------------
+bool IsHistorySegmentMagic(const char* magic)
+{
+    return memcmp(magic, HISTORY_SEGMENT_MAGIC, 8) == 0 ||
+           memcmp(magic, HISTORY_SEGMENT_MAGIC_V1, 8) == 0;
+}
+
+bool IsHistorySegment(istream& in)
+{
+    char magic[8];
+    streampos start = in.tellg();
+    in.read(magic, 8);
+    bool yes = in.gcount() == 8 && IsHistorySegmentMagic(magic);
+    in.clear();
+    in.seekg(start);
+    return yes;
+}
+
+// Smallest encodings: a group is a 1-byte length, the crc and three
+// 1-byte varints; a row is four 1-byte varints.
+static const uint64_t MIN_GROUP_BYTES = 1 + 4 + 3;
+static const uint64_t MIN_ROW_BYTES = 4;
+
+bool ReadHistorySegmentHeader(istream& in, uint32_t& groupCount, uint64_t& rowCount,
+                              uint64_t& bytesLeft)
+{
+    char magic[8];
+    in.read(magic, 8);
+    if (in.gcount() != 8 || !IsHistorySegmentMagic(magic))
+        return false;
+    char counts[12];
+    in.read(counts, sizeof(counts));
+    if (!in) return false;
+    if (memcmp(magic, HISTORY_SEGMENT_MAGIC, 8) == 0)
+    {
+        uint32_t crc;
+        in.read((char*)&crc, 4);
+        if (!in || Crc32(counts, sizeof(counts)) != crc)
+            return false;
+    }
+    memcpy(&groupCount, counts, 4);
+    memcpy(&rowCount, counts + 4, 8);
+
+    streampos body = in.tellg();
+    in.seekg(0, ios::end);
+    streampos end = in.tellg();
+    in.seekg(body);
+    if (!in || end < body)
+        return false;
+    bytesLeft = (uint64_t)(end - body);
+    return groupCount <= bytesLeft / MIN_GROUP_BYTES && rowCount <= bytesLeft / MIN_ROW_BYTES;
+}
+
+// Raw group = varint payloadLen | u32 crc | payload
+static bool ParseGroupPayload(const string& payload, HistoryGroup& g)
+{
+    size_t len = payload.size();
+    ByteReader r;
+    r.p = (const unsigned char*)payload.data();
+    r.end = r.p + len;
+
+    g.userId = (int)r.Zigzag();
+    uint64_t n = r.Varint();
+    uint64_t dictSize = r.Varint();
+    if (!r.ok || n > len || dictSize > len)
+        return false;
+
+    g.dict.resize(dictSize);
+    for (uint64_t i = 0; i < dictSize; i++)
+    {
+        uint64_t slen = r.Varint();
+        if (!r.ok || slen > (uint64_t)(r.end - r.p))
+            return false;
+        g.dict[i].assign((const char*)r.p, slen);
+        r.p += slen;
+    }
+
+    g.times.resize(n);
+    g.rideIds.resize(n);
+    g.fromIdx.resize(n);
+    g.toIdx.resize(n);
+
+    int64_t prev = 0;
+    for (uint64_t i = 0; i < n; i++)
+        g.times[i] = (int)(prev += r.Zigzag());
+    prev = 0;
+    for (uint64_t i = 0; i < n; i++)
+        g.rideIds[i] = (int)(prev += r.Zigzag());
+    for (uint64_t i = 0; i < n; i++)
+        g.fromIdx[i] = (int)r.Varint();
+    for (uint64_t i = 0; i < n; i++)
+        g.toIdx[i] = (int)r.Varint();
+
+    if (!r.ok)
+        return false;
+    for (uint64_t i = 0; i < n; i++)
+        if ((uint64_t)g.fromIdx[i] >= dictSize || (uint64_t)g.toIdx[i] >= dictSize)
+            return false;
+    return true;
+}
+
+bool ReadHistoryGroup(istream& in, HistoryGroup& g, uint64_t& bytesLeft)
+{
+    streampos start = in.tellg();
+    uint64_t len;
+    if (!ReadVarint(in, len))
+        return false;
+    uint32_t crc;
+    in.read((char*)&crc, 4);
+    if (!in) return false;
+
+    uint64_t head = (uint64_t)(in.tellg() - start);
+    if (head > bytesLeft || len > bytesLeft - head)
+        return false;
+    bytesLeft -= head + len;
+
+    string payload(len, '\0');
+    in.read(&payload[0], (streamsize)len);
+    if ((uint64_t)in.gcount() != len || Crc32(payload.data(), len) != crc)
+        return false;
+    return ParseGroupPayload(payload, g);
+}
+
+bool ReadHistoryGroupAt(int fd, uint64_t offset, string& raw)
+{
+    // Header is at most 10 (varint) + 4 bytes.
+    unsigned char head[14];
+    ssize_t got = pread(fd, head, sizeof(head), (off_t)offset);
+    if (got <= 0) return false;
+
+    uint64_t len = 0;
+    int used = 0;
+    for (int shift = 0; used < got && shift < 64; shift += 7)
+    {
+        unsigned char c = head[used++];
+        len |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) break;
+    }
+    if (used + 4 > got)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || offset + used + 4 > (uint64_t)st.st_size ||
+        len > (uint64_t)st.st_size - offset - used - 4)
+        return false;
+    size_t total = (size_t)used + 4 + (size_t)len;
+    raw.resize(total);
+    size_t done = 0;
+    while (done < total)
+    {
+        ssize_t n = pread(fd, &raw[done], total - done, (off_t)(offset + done));
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+bool DecodeHistoryGroup(const string& raw, HistoryGroup& g)
+{
+    ByteReader r;
+    r.p = (const unsigned char*)raw.data();
+    r.end = r.p + raw.size();
+    uint64_t len = r.Varint();
+    if (!r.ok || (size_t)(r.end - r.p) < 4 + len)
+        return false;
+    uint32_t crc;
+    memcpy(&crc, r.p, 4);
+    string payload((const char*)r.p + 4, len);
+    if (Crc32(payload.data(), len) != crc)
+        return false;
+    return ParseGroupPayload(payload, g);
+}
+
+// -------------------------
+// Offset index (history.idx)
+// -------------------------
+bool WriteHistoryOffsets(ostream& out, uint64_t datSize, const vector<HistoryOffset>& entries)
+{
+    uint32_t count = (uint32_t)entries.size();
+    uint32_t crc = Crc32(entries.data(), entries.size() * sizeof(HistoryOffset));
+    out.write(HISTORY_OFFSETS_MAGIC, 8);
+    out.write((const char*)&datSize, 8);
+    out.write((const char*)&count, 4);
+    out.write((const char*)&crc, 4);
+    out.write((const char*)entries.data(), (streamsize)(entries.size() * sizeof(HistoryOffset)));
+    return (bool)out;
+}
+
+bool ReadHistoryOffsets(const string& path, uint64_t datSize, vector<HistoryOffset>& entries)
+{
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+
+    char magic[8];
+    uint64_t size;
+    uint32_t count, crc;
+    in.read(magic, 8);
+    in.read((char*)&size, 8);
+    in.read((char*)&count, 4);
+    in.read((char*)&crc, 4);
+    if (!in || memcmp(magic, HISTORY_OFFSETS_MAGIC, 8) != 0 || size != datSize)
+        return false;
+
+    entries.resize(count);
+    in.read((char*)entries.data(), (streamsize)(count * sizeof(HistoryOffset)));
+    if (!in || Crc32(entries.data(), count * sizeof(HistoryOffset)) != crc)
+        return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (entries[i].offset >= datSize)
+            return false;
+        if (i > 0 && entries[i - 1].userId >= entries[i].userId)
+            return false;
+    }
+    return true;
+}
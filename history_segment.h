@@ -0,0 +1,93 @@
+#ifndef HISTORY_SEGMENT_H
+#define HISTORY_SEGMENT_H
+
+// Compact history.dat — rows grouped by user, stored column by column.
+//
+// File:
+//   magic[8] "RSHIST\0\2" | u32 groupCount | u64 rowCount | u32 crc(counts)
+//   group*
+//
+// Group (one per user with history, self-contained):
+//   varint payloadLen | u32 crc(payload) | payload
+//   payload:
+//     zigzag userId | varint rows
+//     varint dictSize | dictSize x (varint len, bytes)   place names
+//     rows x zigzag (time   - previous time)
+//     rows x zigzag (rideId - previous rideId)
+//     rows x varint from (dictionary index)
+//     rows x varint to   (dictionary index)
+//
+// Times are sorted inside a group (BST in-order), so their deltas are
+// small; the dictionary replaces repeated place names with 1-byte codes.
+// Text history.dat files (no magic) and version 1 files ("RSHIST\0\1",
+// no header crc) are still accepted by LoadAll. Readers check every count
+// and length against the bytes left in the file before allocating.
+//
+// history.idx — written next to history.dat by every save:
+//   magic[8] "RSHIDX\0\1" | u64 history.dat size | u32 count | u32 crc(entries)
+//   count x HistoryOffset   (sorted by userId)
+// LoadAll uses it to leave history on disk and read a user's group only
+// when it is first needed (see EnsureUserHistory in user.h).
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#define HISTORY_SEGMENT_MAGIC "RSHIST\0\2"
+#define HISTORY_SEGMENT_MAGIC_V1 "RSHIST\0\1"
+#define HISTORY_OFFSETS_MAGIC "RSHIDX\0\1"
+#define HISTORY_OFFSETS_FILE "history.idx"
+
+struct HistoryItem
+{
+    int rideId;
+    const char* from;
+    const char* to;
+    int time;
+};
+
+struct HistoryGroup
+{
+    int userId;
+    std::vector<std::string> dict;
+    std::vector<int> times;
+    std::vector<int> rideIds;
+    std::vector<int> fromIdx;
+    std::vector<int> toIdx;
+
+    int Count() const { return (int)times.size(); }
+    const char* From(int i) const { return dict[fromIdx[i]].c_str(); }
+    const char* To(int i) const { return dict[toIdx[i]].c_str(); }
+};
+
+struct HistoryOffset
+{
+    int32_t userId;
+    uint32_t rows;
+    uint64_t offset;    // of the group inside history.dat
+};
+
+// Writing
+bool WriteHistorySegmentHeader(std::ostream& out, uint32_t groupCount, uint64_t rowCount);
+bool WriteHistoryGroup(std::ostream& out, int userId, const HistoryItem* items, int n);
+
+// Reading (streaming, one group at a time). The header read sets
+// bytesLeft to the rest of the file; each group read takes from it.
+bool IsHistorySegmentMagic(const char* magic);   // 8 bytes, either version
+bool IsHistorySegment(std::istream& in);   // peeks at the magic
+bool ReadHistorySegmentHeader(std::istream& in, uint32_t& groupCount, uint64_t& rowCount,
+                              uint64_t& bytesLeft);
+bool ReadHistoryGroup(std::istream& in, HistoryGroup& g, uint64_t& bytesLeft);   // false at end or on corruption
+
+// Random access for lazy loading (pread, safe to share the fd)
+bool ReadHistoryGroupAt(int fd, uint64_t offset, std::string& raw);   // raw group bytes
+bool DecodeHistoryGroup(const std::string& raw, HistoryGroup& g);
+
+// history.idx; Read fails unless it matches a history.dat of datSize bytes
+bool WriteHistoryOffsets(std::ostream& out, uint64_t datSize,
+                         const std::vector<HistoryOffset>& entries);
+bool ReadHistoryOffsets(const std::string& path, uint64_t datSize,
+                        std::vector<HistoryOffset>& entries);
+
+#endif
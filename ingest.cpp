@@ -0,0 +1,388 @@
+#include "ingest.h"
+
+#include "ride.h"
+#include "offer_routes.h"
+#include "metrics.h"
+#include "trace.h"
+#include "engine.h"
+#include "journal.h"
+#include "road_graph.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// -------------------------
+// Queue
+// -------------------------
+// Bounded ring of preallocated slots (Vyukov). A producer claims the next
+// position with a CAS on `enqueue`, fills the slot in place and publishes
+// it through the slot's sequence number; the matcher reads slots in
+// position order and hands each back one lap ahead. A producer between
+// claiming and publishing hides the slots behind it, so a pop can come
+// back empty while posts are in flight; the matcher just tries again
+// after its idle wait. Nothing is allocated after the ring.
+struct IngestEvent
+{
+    int type = INGEST_OFFER;
+    int id = 0;
+    int userId = 0;
+    int a = 0, b = 0;          // depart/capacity or earliest/latest
+    char from[INGEST_NAME_MAX];
+    char to[INGEST_NAME_MAX];
+    Clock::time_point posted;
+};
+
+struct IngestSlot
+{
+    atomic<size_t> seq;
+    IngestEvent e;
+};
+
+static_assert((INGEST_RING_SIZE & (INGEST_RING_SIZE - 1)) == 0, "INGEST_RING_SIZE must be a power of two");
+
+// One per engine.
+struct IngestState
+{
+    vector<IngestSlot> ring;
+    alignas(64) atomic<size_t> enqueue{0};  // producers
+    alignas(64) size_t dequeue = 0;         // matcher
+
+    // Closing: producers count themselves in `posting` before they check
+    // `closed`, so once StopIngest has set it and seen posting == 0 every
+    // accepted event is in the ring.
+    atomic<bool> closed{false};
+    atomic<int> posting{0};
+
+    thread matcher;
+    atomic<bool> running{false};
+    atomic<bool> stopping{false};
+    atomic<bool> sleeping{false};   // producers notify only then (no lock:
+                                    // a missed wakeup costs one idle wait)
+    mutex lock;                     // idle waits and drain waits only
+    condition_variable wake, drained;
+
+    atomic<unsigned long long> posted{0}, refused{0}, applied{0}, rejected{0}, batches{0}, matched{0};
+
+    IngestState() : ring(INGEST_RING_SIZE)
+    {
+        for (size_t i = 0; i < ring.size(); i++)
+            ring[i].seq.store(i, memory_order_relaxed);
+    }
+
+    ~IngestState()
+    {
+        Stop();
+    }
+
+    // Engine shutdown (engine.h)
+    static const int STOP_STAGE = ENGINE_STOP_MUTATORS;
+    void Stop()
+    {
+        closed = true;
+        while (posting.load() != 0)
+            this_thread::yield();
+        if (!matcher.joinable())
+            return;
+        stopping = true;
+        wake.notify_one();
+        matcher.join();
+    }
+
+    // Claims a slot; nullptr if the ring is full. Publish it afterwards.
+    IngestEvent* Claim(size_t& pos)
+    {
+        pos = enqueue.load(memory_order_relaxed);
+        while (true)
+        {
+            IngestSlot& slot = ring[pos & (INGEST_RING_SIZE - 1)];
+            intptr_t diff = (intptr_t)slot.seq.load(memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (enqueue.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    return &slot.e;
+            }
+            else if (diff < 0)
+                return nullptr;
+            else
+                pos = enqueue.load(memory_order_relaxed);
+        }
+    }
+
+    void Publish(size_t pos)
+    {
+        ring[pos & (INGEST_RING_SIZE - 1)].seq.store(pos + 1, memory_order_release);
+    }
+
+    // Matcher only: the next published event, or nullptr. Release it
+    // before the next Pop.
+    IngestEvent* Pop()
+    {
+        IngestSlot& slot = ring[dequeue & (INGEST_RING_SIZE - 1)];
+        if (slot.seq.load(memory_order_acquire) != dequeue + 1)
+            return nullptr;
+        return &slot.e;
+    }
+
+    void Release()
+    {
+        ring[dequeue & (INGEST_RING_SIZE - 1)].seq.store(dequeue + INGEST_RING_SIZE, memory_order_release);
+        dequeue++;
+    }
+};
+
+static IngestState& Ingest()
+{
+    return EnginePart<IngestState>();
+}
+
+// -------------------------
+// Producers
+// -------------------------
+static bool NameFits(const char* name)
+{
+    return strlen(name) < INGEST_NAME_MAX;
+}
+
+static void CopyName(char* dst, const char* src)
+{
+    memcpy(dst, src, strlen(src) + 1);
+}
+
+// Claims a slot and lets fill() write it. False (nothing posted) if the
+// queue is closed, or the ring is full while no matcher runs to empty it.
+template <class Fill>
+static bool Post(Fill fill)
+{
+    IngestState& st = Ingest();
+    st.posting.fetch_add(1);
+    IngestEvent* e = nullptr;
+    size_t pos = 0;
+    if (!st.closed.load())
+    {
+        while (!(e = st.Claim(pos)) && st.running.load())
+            this_thread::yield();
+        if (e)
+        {
+            fill(*e);
+            e->posted = Clock::now();
+            st.posted.fetch_add(1, memory_order_relaxed);
+            st.Publish(pos);
+        }
+    }
+    st.posting.fetch_sub(1);
+    if (!e)
+    {
+        st.refused.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    if (st.sleeping.load(memory_order_acquire))
+        st.wake.notify_one();
+    return true;
+}
+
+static bool Refuse()
+{
+    Ingest().refused.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+bool IngestOffer(int offerId, int driverId, const char* start, const char* end,
+                 int departTime, int capacity)
+{
+    if (!NameFits(start) || !NameFits(end))
+        return Refuse();
+    return Post([&](IngestEvent& e)
+    {
+        e.type = INGEST_OFFER;
+        e.id = offerId;
+        e.userId = driverId;
+        e.a = departTime;
+        e.b = capacity;
+        CopyName(e.from, start);
+        CopyName(e.to, end);
+    });
+}
+
+bool IngestRequest(int requestId, int passengerId, const char* from, const char* to,
+                   int earliest, int latest)
+{
+    if (!NameFits(from) || !NameFits(to))
+        return Refuse();
+    return Post([&](IngestEvent& e)
+    {
+        e.type = INGEST_REQUEST;
+        e.id = requestId;
+        e.userId = passengerId;
+        e.a = earliest;
+        e.b = latest;
+        CopyName(e.from, from);
+        CopyName(e.to, to);
+    });
+}
+
+bool IngestCancel(int requestId)
+{
+    return Post([&](IngestEvent& e)
+    {
+        e.type = INGEST_CANCEL;
+        e.id = requestId;
+    });
+}
+
+// -------------------------
+// Matcher
+// -------------------------
+static bool Apply(const IngestEvent* e)
+{
+    switch (e->type)
+    {
+    case INGEST_OFFER:
+        return CreateRideOffer(e->id, e->userId, e->from, e->to, e->a, e->b) != nullptr;
+    case INGEST_REQUEST:
+        return CreateRideRequest(e->id, e->userId, e->from, e->to, e->a, e->b) != nullptr;
+    case INGEST_CANCEL:
+        return CancelRideRequest(e->id);
+    }
+    return false;
+}
+
+// Applies up to INGEST_BATCH events, then routes and matches once for all
+// of them. Returns how many were applied.
+static int DrainBatch(IngestState& st)
+{
+    IngestEvent* e = st.Pop();
+    if (!e)
+        return 0;
+
+    METRIC_TIMER(MH_INGEST_BATCH);
+    TRACE_SPAN("ingest_batch");
+    int n = 0, rejected = 0;
+    bool offers = false;
+    for (; e; e = (n < INGEST_BATCH) ? st.Pop() : nullptr)
+    {
+        if (!Apply(e))
+            rejected++;
+        offers = offers || e->type == INGEST_OFFER;
+        METRIC_INC(MC_INGEST_EVENTS);
+#if RS_METRICS
+        MetricObserveNs(MH_INGEST_QUEUED, (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+                                              Clock::now() - e->posted).count());
+#endif
+        st.Release();
+        n++;
+    }
+    TRACE_ARG("events", n);
+
+    if (offers)
+        OfferRoutesWarm();
+    Engine& eng = CurrentEngine();
+    unsigned long long matched = 0;
+    while (eng.requestHead)
+    {
+        // An unmatched request goes back on top of the heap: stop there.
+        if (!MatchNextRequest()) break;
+        matched++;
+    }
+    // The matcher owns the engine here: adopt a reloaded map, publish.
+    AdoptRoadGraph();
+    PublishRoadGraph();
+    JournalMaybeCompact();
+
+    METRIC_INC(MC_INGEST_BATCHES);
+    METRIC_ADD(MC_INGEST_REJECTS, rejected);
+    st.rejected.fetch_add(rejected, memory_order_relaxed);
+    st.matched.fetch_add(matched, memory_order_relaxed);
+    st.batches.fetch_add(1, memory_order_relaxed);
+    {
+        lock_guard<mutex> g(st.lock);
+        st.applied.fetch_add(n, memory_order_release);
+    }
+    st.drained.notify_all();
+    return n;
+}
+
+static void MatcherLoop(IngestState& st, Engine* eng)
+{
+    EngineScope use(*eng);
+    while (true)
+    {
+        if (DrainBatch(st) > 0)
+            continue;
+        // StopIngest sets stopping only after every accepted post is
+        // published: one more empty drain after seeing it means done.
+        if (st.stopping.load())
+        {
+            if (DrainBatch(st) > 0)
+                continue;
+            break;
+        }
+        unique_lock<mutex> g(st.lock);
+        st.sleeping.store(true);
+        st.wake.wait_for(g, chrono::milliseconds(INGEST_IDLE_WAIT_MS));
+        st.sleeping.store(false);
+    }
+    {
+        lock_guard<mutex> g(st.lock);
+        st.running = false;
+    }
+    st.drained.notify_all();
+}
+
+// -------------------------
+// Public API
+// -------------------------
+bool StartIngest()
+{
+    IngestState& st = Ingest();
+    if (st.running.load())
+        return false;
+    if (st.matcher.joinable())
+        st.matcher.join();
+    st.stopping = false;
+    st.running = true;
+    st.closed = false;
+    st.matcher = thread(MatcherLoop, ref(st), &CurrentEngine());
+    return true;
+}
+
+void StopIngest()
+{
+    Ingest().Stop();
+}
+
+bool IngestRunning()
+{
+    return Ingest().running.load();
+}
+
+bool WaitIngestDrained()
+{
+    IngestState& st = Ingest();
+    unsigned long long target = st.posted.load();
+    unique_lock<mutex> g(st.lock);
+    st.drained.wait(g, [&] { return st.applied.load() >= target || !st.running.load(); });
+    return st.applied.load() >= target;
+}
+
+IngestStats IngestStatus()
+{
+    IngestState& st = Ingest();
+    IngestStats s;
+    s.posted = st.posted.load();
+    s.refused = st.refused.load();
+    s.applied = st.applied.load();
+    s.rejected = st.rejected.load();
+    s.batches = st.batches.load();
+    s.matched = st.matched.load();
+    return s;
+}
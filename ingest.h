@@ -0,0 +1,68 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+// Ingestion queue in front of the matcher.
+//
+// Any number of producer threads (network handlers, replay readers) post
+// create-offer, create-request and cancel events. Posting claims a slot of
+// a preallocated ring with one CAS and copies the event into it: it never
+// allocates and never takes a lock. It only waits while the ring is full
+// and a matcher runs to empty it.
+//
+// One matcher thread per engine drains the queue in batches of up to
+// INGEST_BATCH events and applies them in posting order through the core
+// APIs (ride.h). After each batch the new offers are routed together
+// (OfferRoutesWarm) and pending requests are matched oldest first until
+// one finds no offer, as on a replay tick. While the matcher runs it owns
+// the engine: other threads only post, and call StopIngest before using
+// the engine directly again. Destroying the engine stops it first.
+//
+// Posts go to the calling thread's engine (engine.h). Events posted before
+// the first StartIngest wait for it. StopIngest closes the queue first:
+// every post is either accepted, and then applied before StopIngest
+// returns, or refused (false). Posts stay refused until the next
+// StartIngest.
+
+#define INGEST_BATCH 256           // events applied between match passes
+#define INGEST_IDLE_WAIT_MS 1      // matcher sleep when the queue is empty
+#define INGEST_RING_SIZE 16384     // slots per engine; a power of two
+#define INGEST_NAME_MAX 64         // place names up to 63 bytes
+
+enum IngestEventType
+{
+    INGEST_OFFER,
+    INGEST_REQUEST,
+    INGEST_CANCEL
+};
+
+// Producers, any thread. False if the event was refused: the queue is
+// closed, a name is too long, or the ring is full with no matcher running.
+bool IngestOffer(int offerId, int driverId, const char* start, const char* end,
+                 int departTime, int capacity);
+bool IngestRequest(int requestId, int passengerId, const char* from, const char* to,
+                   int earliest, int latest);
+bool IngestCancel(int requestId);
+
+// Engine thread: starts the matcher, bound to this engine. False if it is
+// already running.
+bool StartIngest();
+// Closes the queue, applies every accepted event, then stops the matcher.
+void StopIngest();
+bool IngestRunning();
+
+// Blocks until every event posted before the call is applied. False if no
+// matcher is running.
+bool WaitIngestDrained();
+
+struct IngestStats
+{
+    unsigned long long posted;
+    unsigned long long refused;      // not posted (see the producers)
+    unsigned long long applied;      // includes rejects
+    unsigned long long rejected;     // create or cancel failed
+    unsigned long long batches;
+    unsigned long long matched;
+};
+IngestStats IngestStatus();
+
+#endif
@@ -0,0 +1,760 @@
+#include "journal.h"
+
+#include "storage.h"
+#include "segments.h"
+#include "roads.h"
+#include "ride.h"
+#include "user.h"
+#include "trace.h"
+#include "engine.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <climits>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// -------------------------
+// State
+// -------------------------
+struct JournalState
+{
+    atomic<bool> open{false};      // read by the hooks without the lock
+    string dir;
+    int fd = -1;
+    int segment = 0;
+
+    uint64_t nextLsn = 1;
+    uint64_t lastLsn = 0;          // last appended
+    uint64_t durableLsn = 0;       // last on disk
+    uint64_t bytesSinceCheckpoint = 0;
+
+    string buffer;                 // records waiting for group commit
+    bool writing = false;
+    bool stopping = false;
+
+    mutex mtx;
+    condition_variable wake;       // flusher
+    condition_variable durable;    // waiters on a write in flight
+    thread flusher;
+
+    ~JournalState()
+    {
+        Stop();
+    }
+
+    // Engine shutdown (engine.h) and JournalClose: flushes and closes.
+    static const int STOP_STAGE = ENGINE_STOP_JOURNAL;
+    void Stop()
+    {
+        if (!open)
+            return;
+        {
+            lock_guard<mutex> lk(mtx);
+            open = false;
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        close(fd);
+        fd = -1;
+    }
+};
+
+static JournalState& Journal()
+{
+    return EnginePart<JournalState>();
+}
+
+// JournalSuspendScope depth of the calling thread.
+static thread_local int suspendDepth = 0;
+
+static const size_t RECORD_HEADER = 4 + 4 + 8 + 1;
+
+// -------------------------
+// Files
+// -------------------------
+static string SegmentPath(const string& dir, int segment)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "journal.%06d.log", segment);
+    return JoinPath(dir.c_str(), name);
+}
+
+static vector<int> ListSegments(const string& dir)
+{
+    vector<int> segs;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return segs;
+    while (dirent* e = readdir(d))
+    {
+        int n;
+        char tail[8];
+        if (sscanf(e->d_name, "journal.%d.%7s", &n, tail) == 2 && strcmp(tail, "log") == 0)
+            segs.push_back(n);
+    }
+    closedir(d);
+    sort(segs.begin(), segs.end());
+    return segs;
+}
+
+static uint64_t ReadCheckpoint(const string& dir)
+{
+    FILE* f = fopen(JoinPath(dir.c_str(), JOURNAL_CHECKPOINT_FILE).c_str(), "r");
+    if (!f) return 0;
+    unsigned long long lsn = 0;
+    if (fscanf(f, "%llu", &lsn) != 1) lsn = 0;
+    fclose(f);
+    return lsn;
+}
+
+static bool WriteAll(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool ReadFile(const string& path, string& out)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        out.append(chunk, n);
+    fclose(f);
+    return true;
+}
+
+// -------------------------
+// Record encoding
+// -------------------------
+static void PutU32(string& b, uint32_t v)
+{
+    char raw[4];
+    memcpy(raw, &v, 4);
+    b.append(raw, 4);
+}
+
+static void PutI32(string& b, int v)
+{
+    PutU32(b, (uint32_t)v);
+}
+
+static void PutStr(string& b, const char* s)
+{
+    uint32_t len = (uint32_t)strlen(s);
+    PutU32(b, len);
+    b.append(s, len);
+}
+
+struct RecordReader
+{
+    const char* p;
+    const char* end;
+    bool ok = true;
+
+    int I32()
+    {
+        if (end - p < 4) { ok = false; return 0; }
+        uint32_t v;
+        memcpy(&v, p, 4);
+        p += 4;
+        return (int)v;
+    }
+
+    string Str()
+    {
+        uint32_t len = (uint32_t)I32();
+        if (!ok || (size_t)(end - p) < len) { ok = false; return string(); }
+        string s(p, len);
+        p += len;
+        return s;
+    }
+};
+
+// -------------------------
+// Group commit
+// -------------------------
+static void FlushLocked(JournalState& j, unique_lock<mutex>& lk)
+{
+    while (j.writing)
+        j.durable.wait(lk);
+    if (j.buffer.empty() || j.fd < 0)
+        return;
+
+    string out;
+    out.swap(j.buffer);
+    uint64_t upto = j.lastLsn;
+    int fd = j.fd;
+    j.writing = true;
+
+    lk.unlock();
+    bool ok = WriteAll(fd, out.data(), out.size()) && fdatasync(fd) == 0;
+    lk.lock();
+
+    j.writing = false;
+    if (ok)
+        j.durableLsn = upto;
+    else
+        fprintf(stderr, "journal: write failed, records up to LSN %llu may be lost\n",
+                (unsigned long long)upto);
+    j.durable.notify_all();
+}
+
+// Gets its state passed in: the flusher may still run while the engine's
+// parts are being destroyed.
+static void FlusherLoop(JournalState& j)
+{
+    unique_lock<mutex> lk(j.mtx);
+    while (true)
+    {
+        j.wake.wait_for(lk, chrono::milliseconds(JOURNAL_COMMIT_INTERVAL_MS), [&]
+                        { return j.stopping || j.buffer.size() >= JOURNAL_COMMIT_BYTES; });
+        FlushLocked(j, lk);
+        if (j.stopping)
+            break;
+    }
+}
+
+static void Append(JournalRecordType type, const string& payload)
+{
+    JournalState& j = Journal();
+    if (suspendDepth > 0 || !j.open)
+        return;
+
+    lock_guard<mutex> lk(j.mtx);
+    uint64_t lsn = j.nextLsn++;
+
+    string rec;
+    rec.reserve(RECORD_HEADER + payload.size());
+    PutU32(rec, (uint32_t)payload.size());
+    PutU32(rec, 0);  // crc, patched below
+    rec.append((const char*)&lsn, 8);
+    rec.push_back((char)type);
+    rec.append(payload);
+    uint32_t crc = Crc32(rec.data() + 8, rec.size() - 8);
+    memcpy(&rec[4], &crc, 4);
+
+    j.buffer.append(rec);
+    j.lastLsn = lsn;
+    j.bytesSinceCheckpoint += rec.size();
+    if (j.buffer.size() >= JOURNAL_COMMIT_BYTES)
+        j.wake.notify_one();
+}
+
+// Scans a segment; calls apply(lsn, type, reader) per intact record and
+// stops at the first torn or corrupt one. Returns the highest LSN seen.
+template <typename Fn>
+static uint64_t ScanSegment(const string& path, Fn apply)
+{
+    string data;
+    if (!ReadFile(path, data))
+        return 0;
+
+    uint64_t maxLsn = 0;
+    size_t pos = 0;
+    while (data.size() - pos >= RECORD_HEADER)
+    {
+        uint32_t len, crc;
+        uint64_t lsn;
+        memcpy(&len, &data[pos], 4);
+        memcpy(&crc, &data[pos + 4], 4);
+        if (data.size() - pos - RECORD_HEADER < len)
+            break;
+        if (Crc32(&data[pos + 8], 8 + 1 + len) != crc)
+            break;
+        memcpy(&lsn, &data[pos + 8], 8);
+        JournalRecordType type = (JournalRecordType)(unsigned char)data[pos + 16];
+
+        RecordReader r;
+        r.p = data.data() + pos + RECORD_HEADER;
+        r.end = r.p + len;
+        apply(lsn, type, r);
+
+        if (lsn > maxLsn) maxLsn = lsn;
+        pos += RECORD_HEADER + len;
+    }
+    return maxLsn;
+}
+
+static uint64_t HighestLsn(const string& dir)
+{
+    // The newest save may cover records whose segments are gone.
+    uint64_t maxLsn = ReadCheckpoint(dir);
+    SegmentManifest m;
+    if (ReadSegmentManifest(dir.c_str(), m) && m.lsn > maxLsn)
+        maxLsn = m.lsn;
+    for (int seg : ListSegments(dir))
+    {
+        uint64_t m = ScanSegment(SegmentPath(dir, seg), [](uint64_t, JournalRecordType, RecordReader&) {});
+        if (m > maxLsn) maxLsn = m;
+    }
+    return maxLsn;
+}
+
+// -------------------------
+// Lifecycle
+// -------------------------
+bool JournalOpen(const char* baseDir)
+{
+    JournalState& j = Journal();
+    if (j.open)
+        return true;
+
+    string dir = baseDir ? baseDir : ".";
+    vector<int> segs = ListSegments(dir);
+
+    // Always start a fresh segment so a torn tail from a crash is never
+    // followed by new records.
+    int segment = segs.empty() ? 1 : segs.back() + 1;
+    int fd = open(SegmentPath(dir, segment).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+
+    uint64_t last = HighestLsn(dir);
+
+    j.dir = dir;
+    j.fd = fd;
+    j.segment = segment;
+    j.lastLsn = last;
+    j.durableLsn = last;
+    j.nextLsn = last + 1;
+    j.bytesSinceCheckpoint = 0;
+    j.stopping = false;
+    j.open = true;
+    j.flusher = thread(FlusherLoop, ref(j));
+    return true;
+}
+
+void JournalClose()
+{
+    Journal().Stop();
+}
+
+bool JournalIsOpen()
+{
+    return Journal().open;
+}
+
+void JournalSync()
+{
+    JournalState& j = Journal();
+    if (!j.open) return;
+    unique_lock<mutex> lk(j.mtx);
+    FlushLocked(j, lk);
+}
+
+JournalSuspendScope::JournalSuspendScope()
+{
+    suspendDepth++;
+}
+
+JournalSuspendScope::~JournalSuspendScope()
+{
+    suspendDepth--;
+}
+
+// -------------------------
+// Mutation hooks
+// -------------------------
+void JournalUserCreate(int userId, const char* name, int isDriver)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, userId);
+    PutStr(b, name);
+    PutI32(b, isDriver);
+    Append(JR_USER_CREATE, b);
+}
+
+void JournalRoadAdd(const char* from, const char* to, int cost)
+{
+    if (!Journal().open) return;
+    string b;
+    PutStr(b, from);
+    PutStr(b, to);
+    PutI32(b, cost);
+    Append(JR_ROAD_ADD, b);
+}
+
+void JournalRoadCost(const char* from, const char* to, int cost)
+{
+    if (!Journal().open) return;
+    string b;
+    PutStr(b, from);
+    PutStr(b, to);
+    PutI32(b, cost);
+    Append(JR_ROAD_COST, b);
+}
+
+void JournalRoadsReplace(const char* from, const RoadSpec* roads, int n)
+{
+    if (!Journal().open) return;
+    string b;
+    PutStr(b, from);
+    PutI32(b, n);
+    for (int i = 0; i < n; i++)
+    {
+        PutStr(b, roads[i].to);
+        PutI32(b, roads[i].cost);
+        PutI32(b, roads[i].profile ? 1 : 0);
+        for (int h = 0; roads[i].profile && h < ROAD_PROFILE_POINTS; h++)
+            PutI32(b, roads[i].profile[h]);
+    }
+    Append(JR_ROADS_REPLACE, b);
+}
+
+void JournalRoadProfile(const char* from, const char* to, const int* costs)
+{
+    if (!Journal().open) return;
+    string b;
+    PutStr(b, from);
+    PutStr(b, to);
+    PutI32(b, costs ? 1 : 0);
+    for (int i = 0; costs && i < ROAD_PROFILE_POINTS; i++)
+        PutI32(b, costs[i]);
+    Append(JR_ROAD_PROFILE, b);
+}
+
+void JournalOfferCreate(int offerId, int driverId, const char* start, const char* end,
+                        int departTime, int capacity)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, offerId);
+    PutI32(b, driverId);
+    PutStr(b, start);
+    PutStr(b, end);
+    PutI32(b, departTime);
+    PutI32(b, capacity);
+    Append(JR_OFFER_CREATE, b);
+}
+
+void JournalRequestCreate(int requestId, int passengerId, const char* from, const char* to,
+                          int earliest, int latest)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, requestId);
+    PutI32(b, passengerId);
+    PutStr(b, from);
+    PutStr(b, to);
+    PutI32(b, earliest);
+    PutI32(b, latest);
+    Append(JR_REQUEST_CREATE, b);
+}
+
+void JournalRequestMatch(int requestId, int offerId)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, requestId);
+    PutI32(b, offerId);
+    Append(JR_REQUEST_MATCH, b);
+}
+
+void JournalRequestCancel(int requestId)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, requestId);
+    Append(JR_REQUEST_CANCEL, b);
+}
+
+void JournalActiveRideAdd(int rideId, int offerId, int passengerId)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, rideId);
+    PutI32(b, offerId);
+    PutI32(b, passengerId);
+    Append(JR_ACTIVE_RIDE_ADD, b);
+}
+
+void JournalHistoryAdd(int userId, int rideId, const char* from, const char* to, int time)
+{
+    if (!Journal().open) return;
+    string b;
+    PutI32(b, userId);
+    PutI32(b, rideId);
+    PutStr(b, from);
+    PutStr(b, to);
+    PutI32(b, time);
+    Append(JR_HISTORY_ADD, b);
+}
+
+// -------------------------
+// Checkpoints
+// -------------------------
+static bool SameDir(const char* baseDir)
+{
+    JournalState& j = Journal();
+    return j.open && j.dir == (baseDir ? baseDir : ".");
+}
+
+JournalCheckpoint JournalBeginCheckpoint(const char* baseDir)
+{
+    JournalState& j = Journal();
+    JournalCheckpoint cp;
+    if (!SameDir(baseDir))
+    {
+        cp.lsn = HighestLsn(baseDir ? baseDir : ".");
+        cp.firstKeptSegment = INT_MAX;
+        return cp;
+    }
+
+    // Rotate so everything up to the returned LSN sits in older segments.
+    unique_lock<mutex> lk(j.mtx);
+    FlushLocked(j, lk);
+    int fd = open(SegmentPath(j.dir, j.segment + 1).c_str(),
+                  O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0)
+    {
+        close(j.fd);
+        j.fd = fd;
+        j.segment++;
+    }
+    j.bytesSinceCheckpoint = j.buffer.size();
+    cp.lsn = j.lastLsn;
+    cp.firstKeptSegment = j.segment;
+    return cp;
+}
+
+// May run on the background save thread.
+void JournalEndCheckpoint(const char* baseDir, const JournalCheckpoint& cp, bool saved)
+{
+    if (!saved)
+        return;
+    TRACE_SPAN("journal_checkpoint");
+
+    // The manifest committed cp.lsn together with the files: the old
+    // checkpoint file would only name an older point.
+    string dir = baseDir ? baseDir : ".";
+    unlink(JoinPath(dir.c_str(), JOURNAL_CHECKPOINT_FILE).c_str());
+
+    // The saved files now cover every record in the older segments.
+    for (int seg : ListSegments(dir))
+    {
+        if (seg >= cp.firstKeptSegment)
+            continue;
+        unlink(SegmentPath(dir, seg).c_str());
+    }
+}
+
+void JournalMaybeCompact()
+{
+    JournalState& j = Journal();
+    if (!j.open)
+        return;
+    {
+        lock_guard<mutex> lk(j.mtx);
+        if (j.bytesSinceCheckpoint < JOURNAL_COMPACT_BYTES)
+            return;
+    }
+    if (BackgroundSaveRunning())
+        return;
+    SaveAllInBackground(j.dir.c_str());
+}
+
+// -------------------------
+// Replay
+// -------------------------
+static void ApplyRecord(JournalRecordType type, RecordReader& r)
+{
+    switch (type)
+    {
+    case JR_USER_CREATE:
+    {
+        int id = r.I32();
+        string name = r.Str();
+        int isDriver = r.I32();
+        Engine& eng = CurrentEngine();
+        if (r.ok) eng.userRoot = CreateUser(eng.userRoot, id, name.c_str(), isDriver);
+        break;
+    }
+    case JR_ROAD_ADD:
+    {
+        string from = r.Str();
+        string to = r.Str();
+        int cost = r.I32();
+        if (r.ok) AddRoad(from.c_str(), to.c_str(), cost);
+        break;
+    }
+    case JR_ROAD_COST:
+    {
+        string from = r.Str();
+        string to = r.Str();
+        int cost = r.I32();
+        if (r.ok) UpdateRoadCost(from.c_str(), to.c_str(), cost);
+        break;
+    }
+    case JR_ROADS_REPLACE:
+    {
+        string from = r.Str();
+        int n = r.I32();
+        if (!r.ok || n < 0) break;
+        vector<string> to(n);
+        vector<int> profiles((size_t)n * ROAD_PROFILE_POINTS);
+        vector<RoadSpec> roads(n);
+        for (int i = 0; i < n && r.ok; i++)
+        {
+            to[i] = r.Str();
+            roads[i].cost = r.I32();
+            bool has = r.I32() != 0;
+            for (int h = 0; has && h < ROAD_PROFILE_POINTS; h++)
+                profiles[(size_t)i * ROAD_PROFILE_POINTS + h] = r.I32();
+            roads[i].profile = has ? profiles.data() + (size_t)i * ROAD_PROFILE_POINTS : nullptr;
+        }
+        for (int i = 0; i < n; i++)
+            roads[i].to = to[i].c_str();
+        if (r.ok) ReplaceRoadsFrom(from.c_str(), roads.data(), n);
+        break;
+    }
+    case JR_ROAD_PROFILE:
+    {
+        string from = r.Str();
+        string to = r.Str();
+        bool has = r.I32() != 0;
+        int costs[ROAD_PROFILE_POINTS];
+        for (int i = 0; has && i < ROAD_PROFILE_POINTS; i++)
+            costs[i] = r.I32();
+        if (r.ok) SetRoadProfile(from.c_str(), to.c_str(), has ? costs : nullptr);
+        break;
+    }
+    case JR_OFFER_CREATE:
+    {
+        int offerId = r.I32();
+        int driverId = r.I32();
+        string start = r.Str();
+        string end = r.Str();
+        int depart = r.I32();
+        int cap = r.I32();
+        if (r.ok) CreateRideOffer(offerId, driverId, start.c_str(), end.c_str(), depart, cap);
+        break;
+    }
+    case JR_REQUEST_CREATE:
+    {
+        int requestId = r.I32();
+        int passengerId = r.I32();
+        string from = r.Str();
+        string to = r.Str();
+        int earliest = r.I32();
+        int latest = r.I32();
+        if (r.ok) CreateRideRequest(requestId, passengerId, from.c_str(), to.c_str(), earliest, latest);
+        break;
+    }
+    case JR_REQUEST_MATCH:
+    {
+        int requestId = r.I32();
+        int offerId = r.I32();
+        if (r.ok) ReplayRequestMatch(requestId, offerId);
+        break;
+    }
+    case JR_REQUEST_CANCEL:
+    {
+        int requestId = r.I32();
+        if (r.ok) CancelRideRequest(requestId);
+        break;
+    }
+    case JR_ACTIVE_RIDE_ADD:
+    {
+        int rideId = r.I32();
+        int offerId = r.I32();
+        int passengerId = r.I32();
+        if (r.ok) ReplayActiveRideAdd(rideId, offerId, passengerId);
+        break;
+    }
+    case JR_HISTORY_ADD:
+    {
+        int userId = r.I32();
+        int rideId = r.I32();
+        string from = r.Str();
+        string to = r.Str();
+        int time = r.I32();
+        if (r.ok) AddHistory(userId, rideId, from.c_str(), to.c_str(), time);
+        break;
+    }
+    }
+}
+
+bool JournalReplay(const char* baseDir)
+{
+    return JournalReplayFrom(baseDir, ReadCheckpoint(baseDir ? baseDir : "."));
+}
+
+bool JournalReplayFrom(const char* baseDir, uint64_t fromLsn)
+{
+    JournalState& j = Journal();
+    TRACE_SPAN("journal_replay");
+    string dir = baseDir ? baseDir : ".";
+    uint64_t expected = fromLsn + 1;
+    bool gap = false;
+
+    if (SameDir(baseDir))
+        JournalSync();
+
+    JournalSuspendScope quiet;
+    for (int seg : ListSegments(dir))
+    {
+        ScanSegment(SegmentPath(dir, seg),
+                    [&](uint64_t lsn, JournalRecordType type, RecordReader& r)
+                    {
+                        if (gap || lsn < expected)
+                            return;
+                        if (lsn > expected)
+                        {
+                            // Records were compacted away by a newer checkpoint.
+                            gap = true;
+                            return;
+                        }
+                        ApplyRecord(type, r);
+                        expected++;
+                    });
+    }
+
+    if (gap)
+    {
+        fprintf(stderr, "journal: missing records after LSN %llu, load the newest checkpoint\n",
+                (unsigned long long)(expected - 1));
+        return false;
+    }
+
+    if (SameDir(baseDir))
+    {
+        lock_guard<mutex> lk(j.mtx);
+        if (j.nextLsn < expected)
+        {
+            j.nextLsn = expected;
+            j.lastLsn = expected - 1;
+        }
+    }
+    return true;
+}
+
+uint64_t JournalCurrentLsn(const char* baseDir)
+{
+    JournalState& j = Journal();
+    if (!SameDir(baseDir))
+        return HighestLsn(baseDir ? baseDir : ".");
+    lock_guard<mutex> lk(j.mtx);
+    return j.lastLsn;
+}
@@ -0,0 +1,106 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// Write-ahead journal — incremental persistence between SaveAll calls.
+//
+// Every mutation of the engine is appended as one record to the current
+// segment file (journal.NNNNNN.log) in the journal directory:
+//   [u32 payloadLen][u32 crc][u64 lsn][u8 type][payload]
+//
+// Appends only copy the record into a memory buffer. A flusher thread
+// writes and fdatasync()s the buffer every JOURNAL_COMMIT_INTERVAL_MS
+// (group commit), so the matcher never waits on the disk.
+//
+// SaveAll is the checkpoint: it rotates to a new segment, writes the
+// segment files, commits them with the covered LSN in one manifest rename
+// (segments.h) and only then deletes the old segments. A crash anywhere
+// in between leaves either the old files with the old LSN or the new ones
+// with the new LSN, so no record is applied twice. LoadAll replays every
+// record newer than the manifest's LSN (checkpoint.lsn for layouts saved
+// before the manifest carried it). Binary snapshots keep their own LSN in
+// the header and never delete segments.
+
+#include <cstdint>
+
+struct RoadSpec;
+
+#define JOURNAL_CHECKPOINT_FILE "checkpoint.lsn"
+#define JOURNAL_COMMIT_INTERVAL_MS 5
+#define JOURNAL_COMMIT_BYTES (256 * 1024)        // flush early past this
+#define JOURNAL_COMPACT_BYTES (8 * 1024 * 1024)  // checkpoint past this
+
+enum JournalRecordType
+{
+    JR_USER_CREATE = 1,
+    JR_ROAD_ADD,
+    JR_OFFER_CREATE,
+    JR_REQUEST_CREATE,
+    JR_REQUEST_MATCH,
+    JR_ACTIVE_RIDE_ADD,
+    JR_HISTORY_ADD,
+    JR_ROAD_PROFILE,
+    JR_ROAD_COST,
+    JR_ROADS_REPLACE,
+    JR_REQUEST_CANCEL
+};
+
+// Lifecycle
+bool JournalOpen(const char* baseDir = ".");
+void JournalClose();
+bool JournalIsOpen();
+
+// Blocks until everything appended so far is on disk.
+void JournalSync();
+
+// Replay/load code holds one of these so rebuilt records are not logged
+// a second time. It only quiets the calling thread: threads a loader
+// starts take their own.
+struct JournalSuspendScope
+{
+    JournalSuspendScope();
+    ~JournalSuspendScope();
+    JournalSuspendScope(const JournalSuspendScope&) = delete;
+    JournalSuspendScope& operator=(const JournalSuspendScope&) = delete;
+};
+
+// Mutation hooks (no-ops when the journal is closed or suspended; any
+// thread of the engine)
+void JournalUserCreate(int userId, const char* name, int isDriver);
+void JournalRoadAdd(const char* from, const char* to, int cost);
+void JournalRoadProfile(const char* from, const char* to, const int* costs);   // nullptr: cleared
+void JournalRoadCost(const char* from, const char* to, int cost);
+void JournalRoadsReplace(const char* from, const RoadSpec* roads, int n);
+void JournalOfferCreate(int offerId, int driverId, const char* start, const char* end,
+                        int departTime, int capacity);
+void JournalRequestCreate(int requestId, int passengerId, const char* from, const char* to,
+                          int earliest, int latest);
+void JournalRequestMatch(int requestId, int offerId);
+void JournalRequestCancel(int requestId);
+void JournalActiveRideAdd(int rideId, int offerId, int passengerId);
+void JournalHistoryAdd(int userId, int rideId, const char* from, const char* to, int time);
+
+// Checkpoint protocol used by SaveAll / SaveAllInBackground
+struct JournalCheckpoint
+{
+    uint64_t lsn;              // last record covered by the save
+    int firstKeptSegment;      // older segments are deleted on success
+};
+// The save must commit cp.lsn together with its files.
+JournalCheckpoint JournalBeginCheckpoint(const char* baseDir);
+void JournalEndCheckpoint(const char* baseDir, const JournalCheckpoint& cp, bool saved);
+
+// Applies all records after the checkpoint (called at the end of LoadAll):
+// JournalReplay starts after checkpoint.lsn, for the older layouts.
+// Fails if records between the checkpoint and the log were compacted away.
+bool JournalReplay(const char* baseDir);
+bool JournalReplayFrom(const char* baseDir, uint64_t fromLsn);
+
+// Last LSN covered by the in-memory state (binary snapshots store it).
+// Without an open journal for baseDir this is the newest LSN on disk.
+uint64_t JournalCurrentLsn(const char* baseDir);
+
+// Starts a background SaveAll once the journal has grown past
+// JOURNAL_COMPACT_BYTES.
+void JournalMaybeCompact();
+
+#endif
@@ -4,21 +4,26 @@
 #include <fstream>
 #include <limits>
 #include <cstring>
+#include <cstdlib>
 
 #include "roads.h"
 #include "ride.h"
 #include "user.h"
 #include "storage.h"
+#include "history_index.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "segments.h"
+#include "replay.h"
+#include "server.h"
+#include "road_graph.h"
+#include "search.h"
+#include "metrics.h"
+#include "trace.h"
+#include "engine.h"
 
 using namespace std;
 
-// --------- GLOBALS (declared extern in headers) ----------
-Place *placeHead = nullptr;
-User *userRoot = nullptr;
-RideOffer *offerHead = nullptr;
-RideRequest *requestHead = nullptr;
-int requestCount = 0;
-
 static void ClearCinLine()
 {
     cin.clear();
@@ -46,18 +51,6 @@ static string ReadToken(const char *prompt)
     return s;
 }
 
-static void ResetInMemoryState()
-{
-    // NOTE: This intentionally does not free all allocated memory (demo program).
-    // It resets heads/counters so LoadAll() rebuilds cleanly.
-    placeHead = nullptr;
-    userRoot = nullptr;
-    offerHead = nullptr;
-    requestHead = nullptr;
-    requestCount = 0;
-    ClearActiveRides();
-}
-
 static void Menu()
 {
     cout << "\n============================\n";
@@ -79,11 +72,114 @@ static void Menu()
     cout << "14) SAVE ALL (Phase 10)\n";
     cout << "15) LOAD ALL (Phase 10)\n";
     cout << "16) Reset in-memory state (for testing load)\n";
+    cout << "17) User rides in time range\n";
+    cout << "18) Trips through a place in time range\n";
+    cout << "19) Trip counts per hour (all places or one place)\n";
+    cout << "20) SAVE binary snapshot (snapshot.bin)\n";
+    cout << "21) LOAD binary snapshot (snapshot.bin)\n";
+    cout << "22) Start write-ahead journal (journal.*.log)\n";
+    cout << "23) SAVE ALL in background (engine keeps running)\n";
+    cout << "24) Background save status\n";
+    cout << "25) Print metrics (counters, latencies)\n";
+    cout << "26) Export metrics (Prometheus text) to metrics.prom\n";
+    cout << "27) Start/stop span tracing\n";
+    cout << "28) Write recorded spans to trace.json (Chrome/Perfetto)\n";
+    cout << "29) Set road cost by hour of day (time-dependent)\n";
+    cout << "30) Update road cost (live traffic)\n";
+    cout << "31) Reload road network from roads.txt in background (hot swap)\n";
+    cout << "32) Route between two places on the published road graph\n";
     cout << "0) Exit\n";
 }
 
-int main()
+// Non-interactive modes:
+//   main --replay events.jsonl [--ingest N] [--load dir] [--metrics out.prom] [--trace out.json]
+//   main --serve unix:/path.sock|tcp:PORT [--load dir] [--metrics out.prom] [--trace out.json]
+// --serve runs the socket server (server.h) until SIGINT/SIGTERM on the
+// --load directory (default: the current one): it loads it, journals to
+// it and SAVE writes to it;
+// --load loads a directory first and journals every change to it, so the
+// replay modes only run unjournaled without one;
+// --ingest posts the offers, requests and cancels from N producer threads
+// through the ingestion queue instead of applying them in order;
+// --metrics prints the metrics after the replay and exports them;
+// --trace records spans during the load and replay and writes them.
+static int RunCommandLine(int argc, char** argv)
+{
+    const char* replayPath = nullptr;
+    const char* serveAddress = nullptr;
+    int producers = 0;
+    const char* loadDir = nullptr;
+    const char* metricsPath = nullptr;
+    const char* tracePath = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replayPath = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            serveAddress = argv[++i];
+        else if (strcmp(argv[i], "--ingest") == 0 && i + 1 < argc)
+            producers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+            loadDir = argv[++i];
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+            metricsPath = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else
+        {
+            replayPath = serveAddress = nullptr;
+            break;
+        }
+    }
+    if (!replayPath == !serveAddress)
+    {
+        cout << "Usage: " << argv[0] << " [--replay events.jsonl [--ingest N] [--load dir] [--metrics out.prom] [--trace out.json]]\n"
+             << "       " << argv[0] << " [--serve unix:/path.sock|tcp:PORT [--load dir] [--metrics out.prom] [--trace out.json]]\n";
+        return 2;
+    }
+
+    if (tracePath)
+        TraceStart();
+    const char* dataDir = (serveAddress && !loadDir) ? "." : loadDir;
+    if (dataDir && !LoadAll(dataDir))
+    {
+        cout << "Load failed: " << dataDir << "\n";
+        return 1;
+    }
+    if (dataDir && !JournalOpen(dataDir))
+    {
+        cout << "Could not open journal in " << dataDir << "\n";
+        return 1;
+    }
+    bool ok;
+    if (serveAddress)
+        ok = RunServer(serveAddress, dataDir);
+    else
+        ok = producers > 0 ? RunIngestReplay(replayPath, producers) : RunReplay(replayPath);
+    WaitBackgroundSave();
+    JournalClose();
+    if (tracePath && !TraceFlush(tracePath))
+    {
+        cout << "Could not write trace to " << tracePath << "\n";
+        return 1;
+    }
+    if (metricsPath)
+    {
+        PrintMetrics();
+        if (!ExportMetricsPrometheus(metricsPath))
+        {
+            cout << "Could not export metrics to " << metricsPath << "\n";
+            return 1;
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv)
 {
+    if (argc > 1)
+        return RunCommandLine(argc, argv);
+
     cout << "Ride Sharing System — interactive demo\n";
     cout << "Tip: Create users first (drivers + passengers), then roads, then offers/requests.\n";
 
@@ -94,6 +190,9 @@ int main()
 
         if (choice == 0)
         {
+            WaitBackgroundSave();
+            WaitRoadGraphReload();
+            JournalClose();
             cout << "Goodbye.\n";
             break;
         }
@@ -129,12 +228,13 @@ int main()
             int id = ReadInt("User ID (int): ");
             string name = ReadToken("Name (no spaces): ");
             int isDriver = ReadInt("Driver? (1=yes, 0=no): ");
-            userRoot = CreateUser(userRoot, id, name.c_str(), isDriver);
+            Engine& eng = CurrentEngine();
+            eng.userRoot = CreateUser(eng.userRoot, id, name.c_str(), isDriver);
             cout << "User created.\n";
             break;
         }
         case 5:
-            PrintAllUsers(userRoot);
+            PrintAllUsers(CurrentEngine().userRoot);
             break;
         case 6:
         {
@@ -188,7 +288,7 @@ int main()
         {
             int offerId = ReadInt("Offer ID to use as start point: ");
             int bound = ReadInt("Cost bound: ");
-            RideOffer *o = offerHead;
+            RideOffer *o = CurrentEngine().offerHead;
             while (o && o->offerId != offerId)
                 o = o->next;
             if (!o)
@@ -208,7 +308,7 @@ int main()
         case 14:
         {
             bool ok = SaveAll(".");
-            cout << (ok ? "Saved: users.dat, roads.dat, offers.dat, active_rides.dat, history.dat\n"
+            cout << (ok ? "Saved changed segments to " SEGMENT_DIR "/ (users, roads, offers, active rides, history)\n"
                         : "Save failed.\n");
             break;
         }
@@ -216,17 +316,158 @@ int main()
         {
             ResetInMemoryState();
             bool ok = LoadAll(".");
-            cout << (ok ? "Loaded all data from .dat files.\n" : "Load failed.\n");
+            cout << (ok ? "Loaded " SEGMENT_DIR "/" SEGMENT_MANIFEST " (or the older .dat files) and replayed the journal.\n"
+                        : "Load failed.\n");
             break;
         }
         case 16:
             ResetInMemoryState();
             cout << "State reset.\n";
             break;
+        case 17:
+        {
+            int userId = ReadInt("User ID: ");
+            int t1 = ReadInt("From time: ");
+            int t2 = ReadInt("To time: ");
+            PrintUserRidesInRange(userId, t1, t2);
+            break;
+        }
+        case 18:
+        {
+            string place = ReadToken("Place: ");
+            int t1 = ReadInt("From time: ");
+            int t2 = ReadInt("To time: ");
+            PrintPlaceRidesInRange(place.c_str(), t1, t2);
+            break;
+        }
+        case 19:
+        {
+            string place = ReadToken("Place (* for all): ");
+            PrintHourlyTripCounts(place == "*" ? nullptr : place.c_str());
+            break;
+        }
+        case 20:
+        {
+            bool ok = SaveSnapshot(".");
+            cout << (ok ? "Saved: " SNAPSHOT_FILE "\n" : "Snapshot save failed.\n");
+            break;
+        }
+        case 21:
+        {
+            ResetInMemoryState();
+            bool ok = LoadSnapshot(".");
+            cout << (ok ? "Loaded snapshot from " SNAPSHOT_FILE "\n" : "Snapshot load failed.\n");
+            break;
+        }
+        case 22:
+        {
+            bool ok = JournalOpen(".");
+            cout << (ok ? "Journal started; every change is logged until the next SAVE ALL.\n"
+                        : "Could not open journal.\n");
+            break;
+        }
+        case 23:
+        {
+            bool ok = SaveAllInBackground(".");
+            cout << (ok ? "Background save started.\n" : "Could not start background save.\n");
+            break;
+        }
+        case 24:
+        {
+            int last = LastBackgroundSaveResult();
+            if (BackgroundSaveRunning())
+                cout << "Background save in progress.\n";
+            else if (last < 0)
+                cout << "No background save yet.\n";
+            else
+                cout << (last ? "Last background save succeeded.\n" : "Last background save failed.\n");
+            break;
+        }
+        case 25:
+            PrintMetrics();
+            break;
+        case 26:
+        {
+            bool ok = ExportMetricsPrometheus("metrics.prom");
+            cout << (ok ? "Exported metrics to metrics.prom\n" : "Metrics export failed.\n");
+            break;
+        }
+        case 27:
+            if (TraceRunning())
+                TraceStop();
+            else
+                TraceStart();
+            cout << (TraceRunning() ? "Tracing on.\n" : "Tracing off.\n");
+            break;
+        case 28:
+        {
+            uint64_t written = 0, dropped = 0;
+            if (TraceFlush("trace.json", &written, &dropped))
+                cout << "Wrote " << written << " spans to trace.json (" << dropped << " overwritten)\n";
+            else
+                cout << "Trace write failed.\n";
+            break;
+        }
+        case 29:
+        {
+            string from = ReadToken("From: ");
+            string to = ReadToken("To: ");
+            cout << "Cost at the start of each hour 0..23 (-1 first to clear):\n";
+            int costs[ROAD_PROFILE_POINTS];
+            costs[0] = ReadInt("Hour 0: ");
+            bool clear = costs[0] < 0;
+            for (int h = 1; !clear && h < ROAD_PROFILE_POINTS; h++)
+                costs[h] = ReadInt(("Hour " + to_string(h) + ": ").c_str());
+            bool ok = SetRoadProfile(from.c_str(), to.c_str(), clear ? nullptr : costs);
+            cout << (ok ? "Road profile set.\n"
+                        : "No such road, or a cost is negative or drops by more than 60 in an hour.\n");
+            break;
+        }
+        case 30:
+        {
+            string from = ReadToken("From: ");
+            string to = ReadToken("To: ");
+            int cost = ReadInt("New cost: ");
+            bool ok = UpdateRoadCost(from.c_str(), to.c_str(), cost);
+            cout << (ok ? "Road cost updated.\n"
+                        : "No such road without an hourly profile, or the cost is negative.\n");
+            break;
+        }
+        case 31:
+            ReloadRoadNetworkInBackground("roads.txt");
+            cout << "Reloading roads.txt in the background.\n";
+            break;
+        case 32:
+        {
+            string from = ReadToken("From: ");
+            string to = ReadToken("To: ");
+            Place *a = FindPlace(from.c_str());
+            Place *b = FindPlace(to.c_str());
+            RouteBatch route;
+            ComputeRoutes(&a, &b, 1, route, 1);   // publishes pending edits first
+            unsigned long long version = PublishedRoadGraphVersion();
+            if (route.places.empty())
+                cout << "No route (graph version " << version << ").\n";
+            else
+            {
+                cout << "Route (graph version " << version << ", cost " << route.arrive.back() << "):";
+                for (Place *p : route.places)
+                    cout << ' ' << p->name;
+                cout << "\n";
+            }
+            break;
+        }
         default:
             cout << "Unknown option.\n";
             break;
         }
+
+        // Safe point: take in a reloaded map, then let readers see edits.
+        int adopted = AdoptRoadGraph();
+        if (adopted >= 0)
+            cout << "Adopted the reloaded road network (" << adopted << " places changed).\n";
+        PublishRoadGraph();
+        JournalMaybeCompact();
     }
 
     return 0;
@@ -0,0 +1,370 @@
+#include "metrics.h"
+
+#include "roads.h"
+#include "ride.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// -------------------------
+// Names
+// -------------------------
+struct CounterInfo
+{
+    const char* family;      // rs_<family>_total
+    const char* label;       // value of the "type" label or nullptr
+    const char* help;
+};
+
+static const CounterInfo kCounters[MC_COUNTER_COUNT] = {
+    {"place_lookups", nullptr, "Place name lookups"},
+    {"place_chain_steps", nullptr, "Place hash chain entries compared"},
+    {"roads_added", nullptr, "Roads added"},
+    {"road_cost_updates", nullptr, "Road cost updates applied (UpdateRoadCost)"},
+    {"shortest_path_calls", nullptr, "ComputeShortestPath calls"},
+    {"reachable_calls", nullptr, "FindReachableWithinCost calls"},
+    {"dijkstra_nodes", nullptr, "Dijkstra priority queue pops"},
+    {"dijkstra_edges", nullptr, "Dijkstra edges relaxed"},
+    {"match_attempts", nullptr, "MatchNextRequest calls with a pending request"},
+    {"match_success", nullptr, "Requests matched to an offer"},
+    {"offers_scanned", nullptr, "Offer rows filtered while matching"},
+    {"offers_candidates", nullptr, "Offers passing the seat and time filter"},
+    {"subpath_comparisons", nullptr, "Place comparisons in subpath checks"},
+    {"subpath_prefilter_rejects", nullptr, "Offers rejected by the route signature"},
+    {"route_cache_hits", nullptr, "Driver routes reused from the offer route cache"},
+    {"route_cache_misses", nullptr, "Driver routes computed for the offer route cache"},
+    {"route_cache_repairs", nullptr, "Cached driver routes dropped by road cost updates"},
+    {"heap_inserts", nullptr, "Request heap inserts"},
+    {"heap_extracts", nullptr, "Request heap extracts and removals"},
+    {"heap_swaps", nullptr, "Request heap sift swaps"},
+    {"active_ride_probes", nullptr, "Active ride hash chain entries visited"},
+    {"user_search_steps", nullptr, "User BST nodes visited by SearchUser"},
+    {"history_adds", nullptr, "History rows added"},
+    {"history_lazy_loads", nullptr, "User histories read from disk on demand"},
+    {"saves", nullptr, "SaveAll calls"},
+    {"loads", nullptr, "LoadAll calls"},
+    {"segments_written", nullptr, "Segment files written by saves"},
+    {"ingest_events", nullptr, "Ingested events applied by the matcher thread"},
+    {"ingest_rejects", nullptr, "Ingested events whose create or cancel failed"},
+    {"ingest_batches", nullptr, "Batches drained from the ingestion queue"},
+    {"server_connections", nullptr, "Connections accepted by the server loop"},
+    {"server_commands", nullptr, "Commands run by the server loop"},
+    {"allocations", "place", "Objects allocated by node type"},
+    {"allocations", "road_link", nullptr},
+    {"allocations", "user", nullptr},
+    {"allocations", "history_node", nullptr},
+    {"allocations", "offer", nullptr},
+    {"allocations", "request", nullptr},
+    {"allocations", "active_ride", nullptr},
+    {"allocations", "passenger_node", nullptr},
+};
+
+static const char* const kHistograms[MH_HISTOGRAM_COUNT][2] = {
+    {"match", "MatchNextRequest latency"},
+    {"shortest_path", "ComputeShortestPath latency"},
+    {"reachable", "FindReachableWithinCost latency"},
+    {"history_load", "Lazy history group load latency"},
+    {"save_all", "SaveAll latency"},
+    {"load_all", "LoadAll latency"},
+    {"ingest_batch", "Ingestion batch apply and match latency"},
+    {"ingest_queued", "Ingested event latency from post to applied"},
+};
+
+// -------------------------
+// Per-thread shards
+// -------------------------
+// Only the owning thread writes a shard, so a relaxed load + store is
+// enough; readers may see a value one update behind.
+struct MetricShard
+{
+    atomic<uint64_t> counters[MC_COUNTER_COUNT];
+    atomic<uint64_t> buckets[MH_HISTOGRAM_COUNT][METRIC_BUCKETS];
+    atomic<uint64_t> sumNs[MH_HISTOGRAM_COUNT];
+
+    MetricShard() { Clear(); }
+
+    void Clear()
+    {
+        for (auto& c : counters) c.store(0, memory_order_relaxed);
+        for (auto& h : buckets)
+            for (auto& b : h) b.store(0, memory_order_relaxed);
+        for (auto& s : sumNs) s.store(0, memory_order_relaxed);
+    }
+};
+
+struct MetricTotals
+{
+    uint64_t counters[MC_COUNTER_COUNT] = {};
+    uint64_t buckets[MH_HISTOGRAM_COUNT][METRIC_BUCKETS] = {};
+    uint64_t sumNs[MH_HISTOGRAM_COUNT] = {};
+
+    void Add(const MetricShard& s)
+    {
+        for (int i = 0; i < MC_COUNTER_COUNT; i++)
+            counters[i] += s.counters[i].load(memory_order_relaxed);
+        for (int h = 0; h < MH_HISTOGRAM_COUNT; h++)
+        {
+            for (int b = 0; b < METRIC_BUCKETS; b++)
+                buckets[h][b] += s.buckets[h][b].load(memory_order_relaxed);
+            sumNs[h] += s.sumNs[h].load(memory_order_relaxed);
+        }
+    }
+
+    uint64_t Count(int h) const
+    {
+        uint64_t n = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) n += buckets[h][b];
+        return n;
+    }
+};
+
+static mutex gShardLock;
+static vector<MetricShard*> gShards;
+static MetricTotals gRetired;        // threads that have exited
+
+static inline void Bump(atomic<uint64_t>& a, uint64_t n)
+{
+    a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#if RS_METRICS
+
+struct ShardOwner
+{
+    MetricShard* shard;
+
+    ShardOwner() : shard(new MetricShard)
+    {
+        lock_guard<mutex> g(gShardLock);
+        gShards.push_back(shard);
+    }
+    ~ShardOwner()
+    {
+        lock_guard<mutex> g(gShardLock);
+        gRetired.Add(*shard);
+        for (size_t i = 0; i < gShards.size(); i++)
+            if (gShards[i] == shard)
+            {
+                gShards[i] = gShards.back();
+                gShards.pop_back();
+                break;
+            }
+        delete shard;
+    }
+};
+
+static thread_local MetricShard* tlsShard = nullptr;
+
+static MetricShard& LocalShard()
+{
+    if (!tlsShard)
+    {
+        static thread_local ShardOwner owner;
+        tlsShard = owner.shard;
+    }
+    return *tlsShard;
+}
+
+void MetricAdd(MetricCounter c, uint64_t n)
+{
+    Bump(LocalShard().counters[c], n);
+}
+
+void MetricObserveNs(MetricHistogram h, uint64_t ns)
+{
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;   // ns < 2^b
+    if (b >= METRIC_BUCKETS) b = METRIC_BUCKETS - 1;
+    MetricShard& s = LocalShard();
+    Bump(s.buckets[h][b], 1);
+    Bump(s.sumNs[h], ns);
+}
+
+#endif
+
+bool MetricsEnabled()
+{
+    return RS_METRICS != 0;
+}
+
+// Approximate while other threads are updating their shards.
+void MetricsReset()
+{
+    lock_guard<mutex> g(gShardLock);
+    for (MetricShard* s : gShards) s->Clear();
+    gRetired = MetricTotals();
+}
+
+static MetricTotals Collect()
+{
+    lock_guard<mutex> g(gShardLock);
+    MetricTotals t = gRetired;
+    for (MetricShard* s : gShards) t.Add(*s);
+    return t;
+}
+
+// Upper bound (ns) of the bucket holding quantile q.
+static double QuantileNs(const MetricTotals& t, int h, double q)
+{
+    uint64_t n = t.Count(h);
+    if (n == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (n - 1)) + 1, seen = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++)
+    {
+        seen += t.buckets[h][b];
+        if (seen >= rank) return (double)(1ULL << b);
+    }
+    return (double)(1ULL << (METRIC_BUCKETS - 1));
+}
+
+// -------------------------
+// Gauges (read from the tables at dump time)
+// -------------------------
+struct MetricGauges
+{
+    int places = 0;
+    int pendingRequests = 0;
+    int activeRides = 0;
+    int activeRideBucketsUsed = 0;
+    int activeRideChainMax = 0;
+};
+
+static MetricGauges CollectGauges()
+{
+    MetricGauges g;
+    g.places = PlaceCount();
+    g.pendingRequests = PendingRequestCount();
+    for (int i = 0; i < ActiveRideTableSize(); i++)
+    {
+        int len = 0;
+        for (ActiveRide* r = ActiveRideBucketHead(i); r; r = r->next)
+            len++;
+        g.activeRides += len;
+        g.activeRideBucketsUsed += (len > 0);
+        if (len > g.activeRideChainMax) g.activeRideChainMax = len;
+    }
+    return g;
+}
+
+// -------------------------
+// Output
+// -------------------------
+void PrintMetrics()
+{
+    if (!MetricsEnabled())
+    {
+        cout << "Metrics are compiled out (RS_METRICS=0).\n";
+        return;
+    }
+    MetricTotals t = Collect();
+    MetricGauges g = CollectGauges();
+    char buf[160];
+
+    cout << "Counters:\n";
+    for (int i = 0; i < MC_COUNTER_COUNT; i++)
+    {
+        if (!t.counters[i]) continue;
+        string name = kCounters[i].family;
+        if (kCounters[i].label) name = name + "[" + kCounters[i].label + "]";
+        snprintf(buf, sizeof(buf), "  %-32s %14llu\n", name.c_str(), (unsigned long long)t.counters[i]);
+        cout << buf;
+    }
+
+    cout << "Latency (us; percentiles are bucket upper bounds):\n";
+    snprintf(buf, sizeof(buf), "  %-16s %10s %12s %12s %12s\n", "op", "count", "mean", "p50", "p99");
+    cout << buf;
+    for (int h = 0; h < MH_HISTOGRAM_COUNT; h++)
+    {
+        uint64_t n = t.Count(h);
+        if (!n) continue;
+        snprintf(buf, sizeof(buf), "  %-16s %10llu %12.2f %12.2f %12.2f\n", kHistograms[h][0],
+                 (unsigned long long)n, t.sumNs[h] / 1000.0 / n,
+                 QuantileNs(t, h, 0.50) / 1000.0, QuantileNs(t, h, 0.99) / 1000.0);
+        cout << buf;
+    }
+
+    cout << "Tables:\n";
+    cout << "  places " << g.places << ", pending requests " << g.pendingRequests << "\n";
+    cout << "  active rides " << g.activeRides << " in " << g.activeRideBucketsUsed << "/"
+         << ActiveRideTableSize() << " buckets, longest chain " << g.activeRideChainMax << "\n";
+}
+
+string MetricsPrometheusText()
+{
+    string out;
+    char buf[256];
+    if (!MetricsEnabled())
+        return out;
+    MetricTotals t = Collect();
+    MetricGauges g = CollectGauges();
+
+    for (int i = 0; i < MC_COUNTER_COUNT; i++)
+    {
+        const CounterInfo& c = kCounters[i];
+        if (c.help)
+        {
+            snprintf(buf, sizeof(buf), "# HELP rs_%s_total %s\n# TYPE rs_%s_total counter\n",
+                     c.family, c.help, c.family);
+            out += buf;
+        }
+        if (c.label)
+            snprintf(buf, sizeof(buf), "rs_%s_total{type=\"%s\"} %llu\n", c.family, c.label,
+                     (unsigned long long)t.counters[i]);
+        else
+            snprintf(buf, sizeof(buf), "rs_%s_total %llu\n", c.family, (unsigned long long)t.counters[i]);
+        out += buf;
+    }
+
+    for (int h = 0; h < MH_HISTOGRAM_COUNT; h++)
+    {
+        const char* name = kHistograms[h][0];
+        snprintf(buf, sizeof(buf), "# HELP rs_%s_seconds %s\n# TYPE rs_%s_seconds histogram\n",
+                 name, kHistograms[h][1], name);
+        out += buf;
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS - 1; b++)
+        {
+            cumulative += t.buckets[h][b];
+            snprintf(buf, sizeof(buf), "rs_%s_seconds_bucket{le=\"%.9g\"} %llu\n", name,
+                     (double)(1ULL << b) / 1e9, (unsigned long long)cumulative);
+            out += buf;
+        }
+        cumulative += t.buckets[h][METRIC_BUCKETS - 1];
+        snprintf(buf, sizeof(buf), "rs_%s_seconds_bucket{le=\"+Inf\"} %llu\nrs_%s_seconds_sum %.9f\nrs_%s_seconds_count %llu\n",
+                 name, (unsigned long long)cumulative, name, t.sumNs[h] / 1e9, name,
+                 (unsigned long long)cumulative);
+        out += buf;
+    }
+
+    const pair<const char*, int> gauges[] = {
+        {"places", g.places},
+        {"pending_requests", g.pendingRequests},
+        {"active_rides", g.activeRides},
+        {"active_ride_buckets_used", g.activeRideBucketsUsed},
+        {"active_ride_chain_max", g.activeRideChainMax},
+    };
+    for (const auto& gauge : gauges)
+    {
+        snprintf(buf, sizeof(buf), "# TYPE rs_%s gauge\nrs_%s %d\n", gauge.first, gauge.first, gauge.second);
+        out += buf;
+    }
+    return out;
+}
+
+bool ExportMetricsPrometheus(const char* path)
+{
+    if (!MetricsEnabled())
+        return false;
+    string tmp = string(path) + ".tmp";
+    {
+        ofstream out(tmp);
+        out << MetricsPrometheusText();
+        if (!out) return false;
+    }
+    return rename(tmp.c_str(), path) == 0;   // scrapers never see a partial file
+}
@@ -0,0 +1,137 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Hot-path instrumentation: event counters and latency histograms.
+//
+// Every thread bumps its own shard (plain relaxed stores, no shared cache
+// lines, no locks); a dump sums all live shards plus those of threads
+// that already exited. Histograms use power-of-two nanosecond buckets.
+//
+// Build with -DRS_METRICS=0 to compile every hook out; the dump functions
+// then report that metrics are disabled.
+//
+//   METRIC_INC(MC_OFFERS_SCANNED);
+//   METRIC_ADD(MC_DIJKSTRA_EDGES, n);
+//   METRIC_TIMER(MH_MATCH);          // times the rest of the scope
+
+#include <cstdint>
+#include <string>
+
+#ifndef RS_METRICS
+#define RS_METRICS 1
+#endif
+
+enum MetricCounter
+{
+    // roads.cpp
+    MC_PLACE_LOOKUPS = 0,
+    MC_PLACE_CHAIN_STEPS,        // hash chain entries compared
+    MC_ROADS_ADDED,
+    MC_ROAD_COST_UPDATES,
+    // ride.cpp — routing
+    MC_SHORTEST_PATH_CALLS,
+    MC_REACHABLE_CALLS,
+    MC_DIJKSTRA_NODES,           // queue pops
+    MC_DIJKSTRA_EDGES,           // edges relaxed
+    // ride.cpp — matching
+    MC_MATCH_ATTEMPTS,
+    MC_MATCH_SUCCESS,
+    MC_OFFERS_SCANNED,
+    MC_OFFERS_CANDIDATES,        // passed the seat + time filter
+    MC_SUBPATH_COMPARISONS,
+    MC_SUBPATH_PREFILTER_REJECTS, // pickup/dropoff not in the route signature
+    MC_ROUTE_CACHE_HITS,
+    MC_ROUTE_CACHE_MISSES,       // driver routes computed
+    MC_ROUTE_CACHE_REPAIRS,      // cached routes dropped by road cost updates
+    MC_HEAP_INSERTS,
+    MC_HEAP_EXTRACTS,
+    MC_HEAP_SWAPS,
+    MC_ACTIVE_RIDE_PROBES,       // chain entries visited in activeRideTable
+    // user.cpp
+    MC_USER_SEARCH_STEPS,
+    MC_HISTORY_ADDS,
+    MC_HISTORY_LAZY_LOADS,
+    // storage.cpp
+    MC_SAVES,
+    MC_LOADS,
+    MC_SEGMENTS_WRITTEN,
+    // ingest.cpp
+    MC_INGEST_EVENTS,            // events applied by the matcher thread
+    MC_INGEST_REJECTS,           // events whose create/cancel failed
+    MC_INGEST_BATCHES,
+    // server.cpp
+    MC_SERVER_CONNECTIONS,
+    MC_SERVER_COMMANDS,
+    // allocations by node type
+    MC_ALLOC_PLACE,
+    MC_ALLOC_ROAD_LINK,
+    MC_ALLOC_USER,
+    MC_ALLOC_HISTORY_NODE,
+    MC_ALLOC_OFFER,
+    MC_ALLOC_REQUEST,
+    MC_ALLOC_ACTIVE_RIDE,
+    MC_ALLOC_PASSENGER_NODE,
+    MC_COUNTER_COUNT
+};
+
+enum MetricHistogram
+{
+    MH_MATCH = 0,
+    MH_SHORTEST_PATH,
+    MH_REACHABLE,
+    MH_HISTORY_LOAD,
+    MH_SAVE_ALL,
+    MH_LOAD_ALL,
+    MH_INGEST_BATCH,             // applying one batch and matching after it
+    MH_INGEST_QUEUED,            // post -> applied, per event
+    MH_HISTOGRAM_COUNT
+};
+
+#define METRIC_BUCKETS 40        // bucket i: latency < 2^i ns (last one is +Inf)
+
+bool MetricsEnabled();
+void MetricsReset();
+
+// Human-readable summary (counters, p50/p99 per histogram, table gauges).
+void PrintMetrics();
+
+// Prometheus text exposition format.
+std::string MetricsPrometheusText();
+bool ExportMetricsPrometheus(const char* path);
+
+#if RS_METRICS
+
+#include <chrono>
+
+void MetricAdd(MetricCounter c, uint64_t n);
+void MetricObserveNs(MetricHistogram h, uint64_t ns);
+
+struct MetricScopeTimer
+{
+    MetricHistogram h;
+    std::chrono::steady_clock::time_point start;
+
+    explicit MetricScopeTimer(MetricHistogram hist)
+        : h(hist), start(std::chrono::steady_clock::now()) {}
+    ~MetricScopeTimer()
+    {
+        MetricObserveNs(h, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+#define METRIC_CONCAT2(a, b) a##b
+#define METRIC_CONCAT(a, b) METRIC_CONCAT2(a, b)
+#define METRIC_ADD(c, n) MetricAdd((c), (uint64_t)(n))
+#define METRIC_INC(c) MetricAdd((c), 1)
+#define METRIC_TIMER(h) MetricScopeTimer METRIC_CONCAT(metricTimer_, __LINE__)(h)
+
+#else
+
+#define METRIC_ADD(c, n) ((void)sizeof(n))   // keeps local tallies "used"
+#define METRIC_INC(c) ((void)0)
+#define METRIC_TIMER(h) ((void)0)
+
+#endif
+
+#endif
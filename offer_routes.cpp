@@ -0,0 +1,397 @@
+#include "offer_routes.h"
+#include "metrics.h"
+#include "search.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <climits>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// -------------------------
+// Cache
+// -------------------------
+// Routes live back to back in one int arena:
+//   ids[len], arrive[len], map[mapCap]
+// The whole cache is dropped when the road graph changes. Road cost
+// updates only drop the routes they can affect (RepairRoutes); a dropped
+// route keeps its arena space until most of the arena is dead, then the
+// live routes are compacted.
+struct CachedRoute
+{
+    RideOffer* offer;        // nullptr once dropped
+    int begin;               // arena offset of ids; -1 = no route
+    int len;
+    int mapCap;
+    int cost;                // travel time; -1 = no route
+    uint64_t sig[4];
+};
+
+struct RouteCache
+{
+    vector<CachedRoute> routes;
+    vector<int> arena;
+    size_t deadInts = 0;     // arena ints of dropped routes
+    unsigned long long routesVersion = 0;
+
+    // Reverse index: road (from id, to id) -> slots of the routes using
+    // it. Slots of dropped routes are skipped when the road changes.
+    unordered_map<uint64_t, vector<int>> edgeRoutes;
+};
+
+static RouteCache& Cache()
+{
+    return EnginePart<RouteCache>();
+}
+
+static inline uint64_t EdgeKey(int fromId, int toId)
+{
+    return ((uint64_t)(uint32_t)fromId << 32) | (uint32_t)toId;
+}
+
+static inline unsigned SigBit(int id)
+{
+    return ((uint32_t)id * 2654435761u) >> 24;    // 0..255
+}
+
+static inline unsigned MapSlot(int id, int cap)
+{
+    return ((uint32_t)id * 2246822519u) & (unsigned)(cap - 1);
+}
+
+static void DropAllRoutes()
+{
+    RouteCache& rc = Cache();
+    rc.routes.clear();
+    rc.arena.clear();
+    rc.edgeRoutes.clear();
+    rc.deadInts = 0;
+}
+
+void OfferRoutesReset()
+{
+    RouteCache& rc = Cache();
+    DropAllRoutes();
+    rc.routesVersion = 0;
+}
+
+// path == nullptr: the driver cannot reach the end place.
+static int StoreRoute(RideOffer* o, Place* const* path, const int* arrive, int len)
+{
+    RouteCache& rc = Cache();
+    CachedRoute r;
+    r.offer = o;
+    r.begin = -1;
+    r.len = 0;
+    r.mapCap = 0;
+    r.cost = -1;
+    r.sig[0] = r.sig[1] = r.sig[2] = r.sig[3] = 0;
+
+    if (path)
+    {
+        int cap = 4;
+        while (cap < 2 * len) cap <<= 1;
+        r.begin = (int)rc.arena.size();
+        r.len = len;
+        r.mapCap = cap;
+        r.cost = len > 0 ? arrive[len - 1] - arrive[0] : 0;
+        rc.arena.resize(rc.arena.size() + 2 * len + cap, -1);
+        int* ids = rc.arena.data() + r.begin;
+        copy(arrive, arrive + len, ids + len);
+        int* map = ids + 2 * len;
+        for (int i = 0; i < len; i++)
+        {
+            int id = path[i]->id;
+            ids[i] = id;
+            unsigned b = SigBit(id);
+            r.sig[b >> 6] |= 1ULL << (b & 63);
+            unsigned s = MapSlot(id, cap);
+            while (map[s] >= 0)
+                s = (s + 1) & (cap - 1);
+            map[s] = i;
+        }
+        for (int i = 0; i + 1 < len; i++)
+            rc.edgeRoutes[EdgeKey(ids[i], ids[i + 1])].push_back((int)rc.routes.size());
+    }
+
+    o->routeSlot = (int)rc.routes.size();
+    rc.routes.push_back(r);
+    return o->routeSlot;
+}
+
+static int AddRoute(RideOffer* o)
+{
+    static thread_local vector<Place*> path;
+    static thread_local vector<int> arrive;
+    if ((int)path.size() < PlaceCount())
+    {
+        path.resize(PlaceCount());
+        arrive.resize(PlaceCount());
+    }
+    int len = 0;
+    bool found = o->startPlace && o->endPlace &&
+                 ComputeShortestPathAt(o->startPlace, o->endPlace, o->departTime,
+                                       path.data(), len, arrive.data());
+    return StoreRoute(o, found ? path.data() : nullptr, arrive.data(), len);
+}
+
+static void ViewOf(const CachedRoute& r, RouteView& out)
+{
+    RouteCache& rc = Cache();
+    out.ids = rc.arena.data() + r.begin;
+    out.arrive = out.ids + r.len;
+    out.len = r.len;
+    out.map = out.ids + 2 * r.len;
+    out.mapCap = r.mapCap;
+    out.sig = r.sig;
+}
+
+static int DropRoute(int slot)
+{
+    RouteCache& rc = Cache();
+    CachedRoute& r = rc.routes[slot];
+    if (!r.offer)
+        return 0;
+    r.offer = nullptr;
+    if (r.begin >= 0)
+        rc.deadInts += 2 * r.len + r.mapCap;
+    return 1;
+}
+
+// Moves the live routes to the front of a fresh arena and renumbers
+// their slots (offers and reverse index).
+static void CompactRoutes()
+{
+    RouteCache& rc = Cache();
+    vector<CachedRoute> live;
+    vector<int> packed;
+    packed.reserve(rc.arena.size() - rc.deadInts);
+    rc.edgeRoutes.clear();
+    for (const CachedRoute& r : rc.routes)
+    {
+        if (!r.offer)
+            continue;
+        CachedRoute c = r;
+        if (r.begin >= 0)
+        {
+            c.begin = (int)packed.size();
+            packed.insert(packed.end(), rc.arena.begin() + r.begin,
+                          rc.arena.begin() + r.begin + 2 * r.len + r.mapCap);
+            for (int i = 0; i + 1 < r.len; i++)
+                rc.edgeRoutes[EdgeKey(packed[c.begin + i], packed[c.begin + i + 1])].push_back((int)live.size());
+        }
+        c.offer->routeSlot = (int)live.size();
+        live.push_back(c);
+    }
+    rc.routes.swap(live);
+    rc.arena.swap(packed);
+    rc.deadInts = 0;
+}
+
+// A road that got more expensive only affects the routes using it, which
+// the reverse index names. One that got cheaper (u -> v) can shorten a
+// route start -> end it is not on (or tie with it) only if
+//     d(start, u) + newCost + d(v, end) <= route cost,
+// so one search toward u and one from v, bounded by the costliest route,
+// settle every route at once. With road profiles the static costs are no
+// lower bound and only newCost <= route cost is checked; likewise when
+// there are so many cheaper roads that searching would cost more than
+// recomputing the routes.
+static void RepairRoutes()
+{
+    RouteCache& rc = Cache();
+    const vector<RoadCostChange>& changes = RoadCostChanges();
+    static thread_local vector<const RoadCostChange*> cheaper;
+    cheaper.clear();
+    long long dropped = 0;
+    for (const RoadCostChange& c : changes)
+    {
+        if (c.newCost < c.oldCost)
+            cheaper.push_back(&c);
+        auto it = rc.edgeRoutes.find(EdgeKey(c.from->id, c.to->id));
+        if (it == rc.edgeRoutes.end())
+            continue;
+        for (int slot : it->second)
+            dropped += DropRoute(slot);
+        rc.edgeRoutes.erase(it);
+    }
+
+    int live = 0, maxCost = 0;
+    for (const CachedRoute& r : rc.routes)
+        if (r.offer && r.cost > 0)
+        {
+            live++;
+            maxCost = max(maxCost, r.cost);
+        }
+    bool search = RoadProfileCount() == 0 && (int)cheaper.size() * 8 <= live;
+
+    static thread_local vector<ReachablePlace> toU, fromV;
+    static thread_local vector<int> distToU, distFromV;     // by place id, INT_MAX: beyond the bound
+    if ((int)distToU.size() < PlaceCount())
+    {
+        distToU.resize(PlaceCount(), INT_MAX);
+        distFromV.resize(PlaceCount(), INT_MAX);
+    }
+    for (const RoadCostChange* c : cheaper)
+    {
+        if (live == 0 || c->newCost >= maxCost)
+            continue;
+        toU.clear();
+        fromV.clear();
+        if (search)
+        {
+            SearchScratch& scratch = ThreadSearchScratch();
+            BoundedSearchToward(scratch, c->from, maxCost - c->newCost, toU);
+            BoundedSearch(scratch, c->to, maxCost - c->newCost, fromV);
+            for (const ReachablePlace& p : toU)
+                distToU[p.place->id] = p.cost;
+            for (const ReachablePlace& p : fromV)
+                distFromV[p.place->id] = p.cost;
+        }
+        for (int slot = 0; slot < (int)rc.routes.size(); slot++)
+        {
+            const CachedRoute& r = rc.routes[slot];
+            if (!r.offer || r.cost < c->newCost)
+                continue;
+            long long via = c->newCost;
+            if (search)
+                via += (long long)distToU[rc.arena[r.begin]] + distFromV[rc.arena[r.begin + r.len - 1]];
+            if (via <= r.cost)    // a tie may change which path Dijkstra picks
+            {
+                dropped += DropRoute(slot);
+                live--;
+            }
+        }
+        for (const ReachablePlace& p : toU)
+            distToU[p.place->id] = INT_MAX;
+        for (const ReachablePlace& p : fromV)
+            distFromV[p.place->id] = INT_MAX;
+    }
+    ClearRoadCostChanges();
+    METRIC_ADD(MC_ROUTE_CACHE_REPAIRS, dropped);
+
+    if (rc.deadInts > rc.arena.size() / 2)
+        CompactRoutes();
+}
+
+static void SyncRoutesVersion()
+{
+    RouteCache& rc = Cache();
+    if (rc.routesVersion != RoadGraphVersion())
+    {
+        DropAllRoutes();
+        ClearRoadCostChanges();
+        rc.routesVersion = RoadGraphVersion();
+    }
+    else if (!RoadCostChanges().empty())
+        RepairRoutes();
+}
+
+static bool HasRoute(const RideOffer* o)
+{
+    RouteCache& rc = Cache();
+    int slot = o->routeSlot;
+    return slot >= 0 && slot < (int)rc.routes.size() && rc.routes[slot].offer == o;
+}
+
+int OfferRoutesWarm(int threads)
+{
+    SyncRoutesVersion();
+    vector<RideOffer*> missing;
+    vector<Place*> starts, ends;
+    vector<int> departs;
+    for (RideOffer* o = CurrentEngine().offerHead; o; o = o->next)
+    {
+        if (HasRoute(o) || o->seatsLeft <= 0)
+            continue;
+        missing.push_back(o);
+        starts.push_back(o->startPlace);
+        ends.push_back(o->endPlace);
+        departs.push_back(o->departTime);
+    }
+    if (missing.empty())
+        return 0;
+
+    static thread_local RouteBatch batch;
+    ComputeRoutes(starts.data(), ends.data(), (int)missing.size(), batch, threads, departs.data());
+    for (size_t i = 0; i < missing.size(); i++)
+    {
+        int b = batch.begin[i], len = batch.begin[i + 1] - b;
+        StoreRoute(missing[i], len > 0 ? batch.places.data() + b : nullptr,
+                   batch.arrive.data() + b, len);
+    }
+    METRIC_ADD(MC_ROUTE_CACHE_MISSES, missing.size());
+    return (int)missing.size();
+}
+
+bool OfferRoute(RideOffer* o, RouteView& out)
+{
+    RouteCache& rc = Cache();
+    SyncRoutesVersion();
+
+    int slot = o->routeSlot;
+    if (HasRoute(o))
+        METRIC_INC(MC_ROUTE_CACHE_HITS);
+    else
+    {
+        METRIC_INC(MC_ROUTE_CACHE_MISSES);
+        slot = AddRoute(o);
+    }
+
+    const CachedRoute& r = rc.routes[slot];
+    if (r.begin < 0)
+        return false;
+    ViewOf(r, out);
+    return true;
+}
+
+// -------------------------
+// Containment
+// -------------------------
+static inline bool SigHas(const uint64_t* sig, int id)
+{
+    unsigned b = SigBit(id);
+    return (sig[b >> 6] >> (b & 63)) & 1;
+}
+
+static int PositionOf(const RouteView& route, int id)
+{
+    unsigned s = MapSlot(id, route.mapCap);
+    while (route.map[s] >= 0)
+    {
+        if (route.ids[route.map[s]] == id)
+            return route.map[s];
+        s = (s + 1) & (route.mapCap - 1);
+    }
+    return -1;
+}
+
+bool RouteStretch(const RouteView& route, int fromId, int toId, int& first, int& last)
+{
+    if (!SigHas(route.sig, fromId) || !SigHas(route.sig, toId))
+    {
+        METRIC_INC(MC_SUBPATH_PREFILTER_REJECTS);
+        return false;
+    }
+    first = PositionOf(route, fromId);
+    last = PositionOf(route, toId);
+    return first >= 0 && last >= first;
+}
+
+bool RouteMatches(const RouteView& route, int first, const int* ids, int len)
+{
+    if (first < 0 || first + len > route.len)
+        return false;
+
+    int compared = 0;
+    bool ok = true;
+    for (int j = 0; j < len && ok; j++)
+    {
+        compared++;
+        ok = route.ids[first + j] == ids[j];
+    }
+    METRIC_ADD(MC_SUBPATH_COMPARISONS, compared);
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef OFFER_ROUTES_H
+#define OFFER_ROUTES_H
+
+// Driver routes cached per offer for the subpath check in matching.
+//
+// An offer's route is the time-dependent shortest path leaving at its
+// departTime, so it only depends on the road graph (costs and profiles)
+// and is computed once per RoadGraphVersion(); road cost updates
+// (UpdateRoadCost) drop only the routes they can change. It is kept as an
+// array of place ids with the arrival time at each. Next to it the cache
+// keeps
+//   - a 256-bit signature of the ids on the route: a pickup or dropoff
+//     whose bit is clear is rejected with one load, no route walk;
+//   - a position map (open addressing, id -> index on the route), so the
+//     pickup is found in O(1) and containment costs O(pLen).
+// Shortest paths never repeat a place, so the pickup's position is unique.
+//
+// Used by the matcher's thread only; OfferRoutesWarm fans the route
+// searches out to worker threads itself.
+
+#include "ride.h"
+
+#include <cstdint>
+
+struct RouteView
+{
+    const int* ids;
+    const int* arrive;        // arrival time at ids[i]
+    int len;
+    const int* map;           // mapCap slots: index into ids, or -1
+    int mapCap;               // power of two
+    const uint64_t* sig;      // 4 words
+};
+
+// false if the driver cannot reach endPlace (cached as well).
+bool OfferRoute(RideOffer* o, RouteView& out);
+
+// Does the route pass fromId and later toId? Their positions go to
+// first <= last.
+bool RouteStretch(const RouteView& route, int fromId, int toId, int& first, int& last);
+
+// Is ids[0..len) the stretch of the route starting at position first?
+bool RouteMatches(const RouteView& route, int first, const int* ids, int len);
+
+// Computes the routes of every offer with seats left that has none cached
+// (e.g. a burst of new offers) as one parallel batch (search.h); threads
+// <= 0 uses the whole pool. Returns how many were computed.
+int OfferRoutesWarm(int threads = 0);
+
+void OfferRoutesReset();
+
+#endif
@@ -0,0 +1,290 @@
+#include "offer_store.h"
+#include "engine.h"
+
+#include <climits>
+#include <cstdint>
+
+#if RS_OFFER_STORE && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OFFER_STORE_X86 1
+#else
+#define OFFER_STORE_X86 0
+#endif
+
+using namespace std;
+
+// Place test: offer routes are simple paths and the request's places must
+// appear on one in order, so with fromId != toId an offer ending at
+// fromId or starting at toId can never match.
+static int EndNot(int fromId, int toId)
+{
+    return fromId != toId ? fromId : INT_MIN;
+}
+
+static int StartNot(int fromId, int toId)
+{
+    return fromId != toId ? toId : INT_MIN;
+}
+
+#if RS_OFFER_STORE
+
+// -------------------------
+// Store
+// -------------------------
+struct OfferStore
+{
+    bool valid = false;
+    vector<int32_t> departTime;
+    vector<int32_t> seatsLeft;
+    vector<int32_t> startId;
+    vector<int32_t> endId;
+    vector<RideOffer*> offers;
+
+    void Clear()
+    {
+        departTime.clear();
+        seatsLeft.clear();
+        startId.clear();
+        endId.clear();
+        offers.clear();
+    }
+
+    void Append(RideOffer* o)
+    {
+        o->storeRow = (int)offers.size();
+        departTime.push_back(o->departTime);
+        seatsLeft.push_back(o->seatsLeft);
+        startId.push_back(o->startPlace ? o->startPlace->id : -1);
+        endId.push_back(o->endPlace ? o->endPlace->id : -1);
+        offers.push_back(o);
+    }
+};
+
+static OfferStore& Offers()
+{
+    return EnginePart<OfferStore>();
+}
+
+static void RebuildOfferStore()
+{
+    OfferStore& store = Offers();
+    vector<RideOffer*> list;
+    for (RideOffer* o = CurrentEngine().offerHead; o; o = o->next)
+        list.push_back(o);
+    store.Clear();
+    for (size_t i = list.size(); i-- > 0; )
+        store.Append(list[i]);
+    store.valid = true;
+}
+
+void OfferStoreAdd(RideOffer* o)
+{
+    OfferStore& store = Offers();
+    // Only in sync if o went on top of the list the store was built from.
+    if (store.valid && o == CurrentEngine().offerHead &&
+        o->next == (store.offers.empty() ? nullptr : store.offers.back()))
+        store.Append(o);
+    else
+        store.valid = false;
+}
+
+void OfferStoreSeatsChanged(RideOffer* o)
+{
+    OfferStore& store = Offers();
+    if (store.valid && o->storeRow >= 0 && o->storeRow < (int)store.offers.size() &&
+        store.offers[o->storeRow] == o)
+        store.seatsLeft[o->storeRow] = o->seatsLeft;
+    else
+        store.valid = false;
+}
+
+void OfferStoreReset()
+{
+    Offers().valid = false;
+}
+
+// -------------------------
+// Filter kernels
+// -------------------------
+struct OfferColumns
+{
+    const int32_t* depart;
+    const int32_t* seats;
+    const int32_t* start;
+    const int32_t* end;
+
+    OfferColumns At(int r) const { return OfferColumns{depart + r, seats + r, start + r, end + r}; }
+};
+
+// Rows pass with seats > 0, earliest <= depart <= latest, end != endNot
+// and start != startNot (INT_MIN: no place test; ids are >= -1).
+struct OfferQuery
+{
+    int earliest, latest;
+    int endNot, startNot;
+};
+
+// mask bit r is set iff row r is a candidate; every word is written.
+typedef void (*OfferFilterFn)(const OfferColumns& c, int n, const OfferQuery& q, uint64_t* mask);
+
+static void FilterScalar(const OfferColumns& c, int n, const OfferQuery& q, uint64_t* mask)
+{
+    for (int w = 0; w * 64 < n; w++)
+    {
+        uint64_t bits = 0;
+        int end = min(n, w * 64 + 64);
+        for (int r = w * 64; r < end; r++)
+            bits |= (uint64_t)(c.seats[r] > 0 && c.depart[r] >= q.earliest && c.depart[r] <= q.latest &&
+                               c.end[r] != q.endNot && c.start[r] != q.startNot) << (r - w * 64);
+        mask[w] = bits;
+    }
+}
+
+#if OFFER_STORE_X86
+
+__attribute__((target("sse2")))
+static void FilterSse2(const OfferColumns& c, int n, const OfferQuery& q, uint64_t* mask)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_set1_epi32(q.earliest);
+    const __m128i hi = _mm_set1_epi32(q.latest);
+    const __m128i endNot = _mm_set1_epi32(q.endNot);
+    const __m128i startNot = _mm_set1_epi32(q.startNot);
+    int full = n / 64;
+    for (int w = 0; w < full; w++)
+    {
+        uint64_t bits = 0;
+        for (int k = 0; k < 16; k++)
+        {
+            int r = w * 64 + k * 4;
+            __m128i d = _mm_loadu_si128((const __m128i*)(c.depart + r));
+            __m128i s = _mm_loadu_si128((const __m128i*)(c.seats + r));
+            __m128i a = _mm_loadu_si128((const __m128i*)(c.start + r));
+            __m128i b = _mm_loadu_si128((const __m128i*)(c.end + r));
+            __m128i outside = _mm_or_si128(_mm_cmpgt_epi32(lo, d), _mm_cmpgt_epi32(d, hi));
+            outside = _mm_or_si128(outside, _mm_or_si128(_mm_cmpeq_epi32(b, endNot),
+                                                         _mm_cmpeq_epi32(a, startNot)));
+            __m128i ok = _mm_andnot_si128(outside, _mm_cmpgt_epi32(s, zero));
+            bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(ok)) << (k * 4);
+        }
+        mask[w] = bits;
+    }
+    if (full * 64 < n)
+        FilterScalar(c.At(full * 64), n - full * 64, q, mask + full);
+}
+
+__attribute__((target("avx2")))
+static void FilterAvx2(const OfferColumns& c, int n, const OfferQuery& q, uint64_t* mask)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lo = _mm256_set1_epi32(q.earliest);
+    const __m256i hi = _mm256_set1_epi32(q.latest);
+    const __m256i endNot = _mm256_set1_epi32(q.endNot);
+    const __m256i startNot = _mm256_set1_epi32(q.startNot);
+    int full = n / 64;
+    for (int w = 0; w < full; w++)
+    {
+        uint64_t bits = 0;
+        for (int k = 0; k < 8; k++)
+        {
+            int r = w * 64 + k * 8;
+            __m256i d = _mm256_loadu_si256((const __m256i*)(c.depart + r));
+            __m256i s = _mm256_loadu_si256((const __m256i*)(c.seats + r));
+            __m256i a = _mm256_loadu_si256((const __m256i*)(c.start + r));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(c.end + r));
+            __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(lo, d), _mm256_cmpgt_epi32(d, hi));
+            outside = _mm256_or_si256(outside, _mm256_or_si256(_mm256_cmpeq_epi32(b, endNot),
+                                                               _mm256_cmpeq_epi32(a, startNot)));
+            __m256i ok = _mm256_andnot_si256(outside, _mm256_cmpgt_epi32(s, zero));
+            bits |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(ok)) << (k * 8);
+        }
+        mask[w] = bits;
+    }
+    if (full * 64 < n)
+        FilterScalar(c.At(full * 64), n - full * 64, q, mask + full);
+}
+
+#endif
+
+struct OfferFilterChoice
+{
+    OfferFilterFn fn;
+    const char* name;
+};
+
+static OfferFilterChoice PickKernel()
+{
+#if OFFER_STORE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return OfferFilterChoice{FilterAvx2, "avx2"};
+    if (__builtin_cpu_supports("sse2"))
+        return OfferFilterChoice{FilterSse2, "sse2"};
+#endif
+    return OfferFilterChoice{FilterScalar, "scalar"};
+}
+
+static const OfferFilterChoice& Kernel()
+{
+    static const OfferFilterChoice choice = PickKernel();
+    return choice;
+}
+
+const char* OfferFilterKernel()
+{
+    return Kernel().name;
+}
+
+int OfferCandidates(int earliest, int latest, int fromId, int toId, vector<RideOffer*>& out)
+{
+    OfferStore& store = Offers();
+    out.clear();
+    if (!store.valid)
+        RebuildOfferStore();
+
+    int n = (int)store.offers.size();
+    static thread_local vector<uint64_t> mask;
+    mask.resize((size_t)(n + 63) / 64);
+    OfferColumns cols{store.departTime.data(), store.seatsLeft.data(), store.startId.data(), store.endId.data()};
+    OfferQuery q{earliest, latest, EndNot(fromId, toId), StartNot(fromId, toId)};
+    Kernel().fn(cols, n, q, mask.data());
+
+    // Highest row first = list order.
+    for (int w = (int)mask.size() - 1; w >= 0; w--)
+    {
+        uint64_t bits = mask[w];
+        while (bits)
+        {
+            int b = 63 - __builtin_clzll(bits);
+            bits &= ~(1ULL << b);
+            out.push_back(store.offers[w * 64 + b]);
+        }
+    }
+    return n;
+}
+
+#else
+
+void OfferStoreAdd(RideOffer*) {}
+void OfferStoreSeatsChanged(RideOffer*) {}
+void OfferStoreReset() {}
+
+const char* OfferFilterKernel()
+{
+    return "list";
+}
+
+int OfferCandidates(int earliest, int latest, int fromId, int toId, vector<RideOffer*>& out)
+{
+    out.clear();
+    int n = 0;
+    int endNot = EndNot(fromId, toId), startNot = StartNot(fromId, toId);
+    for (RideOffer* o = CurrentEngine().offerHead; o; o = o->next, n++)
+        if (o->seatsLeft > 0 && o->departTime >= earliest && o->departTime <= latest &&
+            (o->endPlace ? o->endPlace->id : -1) != endNot &&
+            (o->startPlace ? o->startPlace->id : -1) != startNot)
+            out.push_back(o);
+    return n;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef OFFER_STORE_H
+#define OFFER_STORE_H
+
+// Structure-of-arrays copy of the offer list for candidate filtering.
+//
+// MatchNextRequest needs every offer with seats left whose departTime is
+// inside the request window. Walking offerHead chases one pointer per
+// offer; the store keeps departTime, seatsLeft and the start/end place
+// ids in parallel arrays, and a SIMD kernel turns them into a candidate
+// bitmask (AVX2 or SSE2 picked at runtime, scalar elsewhere). The place
+// ids only drop offers that cannot hold the request's path in order: the
+// route check in the matcher still decides.
+//
+// Rows are kept in reverse list order: CreateRideOffer pushes at the list
+// head and appends a row, so walking the mask from the last row down
+// gives the same order as walking the list. Any other change to the list
+// (loaders, reset) calls OfferStoreReset and the store is rebuilt from
+// the list on its next use.
+//
+// Build with -DRS_OFFER_STORE=0 to filter by walking the list instead.
+
+#include "ride.h"
+
+#include <vector>
+
+#ifndef RS_OFFER_STORE
+#define RS_OFFER_STORE 1
+#endif
+
+void OfferStoreAdd(RideOffer* o);              // o was just pushed at offerHead
+void OfferStoreSeatsChanged(RideOffer* o);
+void OfferStoreReset();
+
+// Offers with seatsLeft > 0 and earliest <= departTime <= latest, in list
+// order. Unless fromId == toId (-1, -1: any places), offers ending at
+// fromId or starting at toId are left out. Returns how many offers were
+// examined.
+int OfferCandidates(int earliest, int latest, int fromId, int toId,
+                    std::vector<RideOffer*>& out);
+
+const char* OfferFilterKernel();               // "avx2", "sse2", "scalar" or "list"
+
+#endif
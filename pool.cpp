@@ -0,0 +1,17 @@
+#include "pool.h"
+#include "engine.h"
+
+void ResetNodePools()
+{
+    Engine& eng = CurrentEngine();
+    eng.placePool.Reset();
+    eng.roadLinkPool.Reset();
+    eng.offerPool.Reset();
+    eng.requestPool.Reset();
+    eng.activeRidePool.Reset();
+    eng.passengerPool.Reset();
+    eng.placeNames.Reset();
+    eng.userPool.Reset();
+    eng.historyPool.Reset();
+    eng.userStrings.Reset();
+}
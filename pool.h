@@ -0,0 +1,159 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Typed node pools for the engine structures.
+//
+// Nodes are carved out of NODE_POOL_CHUNK-sized chunks instead of one
+// `new` each; freed nodes go on an intrusive freelist and are handed out
+// again first (requests, active rides and passenger nodes churn during
+// matching). Strings (place, user and history names) come from bump
+// arenas.
+//
+// Reset() releases every node of a pool at once: the chunks are kept and
+// reused by the next load, so reset + reload cycles stop growing memory.
+// Nothing is destructed — the node types are plain structs.
+//
+// The pools are members of the engine (engine.h). A pool is not
+// thread-safe. LoadAll rebuilds two chains in parallel and each pool is
+// only used by one of them:
+//   graph chain  placePool, roadLinkPool, offerPool, requestPool,
+//                activeRidePool, passengerPool, placeNames
+//   user chain   userPool, historyPool, userStrings
+
+#include "ride.h"
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#define NODE_POOL_CHUNK 1024              // nodes per chunk
+#define STRING_ARENA_CHUNK (64 * 1024)    // bytes per chunk
+
+template <class T>
+class NodePool
+{
+public:
+    NodePool() : current(0), used(0), freeList(nullptr), live(0) {}
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+    ~NodePool()
+    {
+        for (Slot* c : chunks) delete[] c;
+    }
+
+    T* Alloc()
+    {
+        live++;
+        if (freeList)
+        {
+            Slot* s = freeList;
+            freeList = s->next;
+            return new (s) T;
+        }
+        if (current == chunks.size())
+            chunks.push_back(new Slot[NODE_POOL_CHUNK]);
+        Slot* s = &chunks[current][used];
+        if (++used == NODE_POOL_CHUNK)
+        {
+            current++;
+            used = 0;
+        }
+        return new (s) T;
+    }
+
+    void Free(T* p)
+    {
+        if (!p) return;
+        Slot* s = reinterpret_cast<Slot*>(p);
+        s->next = freeList;
+        freeList = s;
+        live--;
+    }
+
+    // O(1): forget every node, keep the chunks.
+    void Reset()
+    {
+        current = 0;
+        used = 0;
+        freeList = nullptr;
+        live = 0;
+    }
+
+    size_t Live() const { return live; }
+    size_t Capacity() const { return chunks.size() * NODE_POOL_CHUNK; }
+
+private:
+    union Slot
+    {
+        Slot* next;
+        alignas(T) unsigned char node[sizeof(T)];
+    };
+
+    std::vector<Slot*> chunks;
+    size_t current;          // chunk being carved
+    size_t used;             // slots taken in it
+    Slot* freeList;
+    size_t live;
+};
+
+class StringArena
+{
+public:
+    StringArena() : current(0), used(0) {}
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+    ~StringArena()
+    {
+        for (Chunk& c : chunks) delete[] c.data;
+    }
+
+    char* Copy(const char* s)
+    {
+        size_t n = strlen(s) + 1;
+        char* out = Take(n);
+        memcpy(out, s, n);
+        return out;
+    }
+
+    // O(1): the chunks are reused from the first one.
+    void Reset()
+    {
+        current = 0;
+        used = 0;
+    }
+
+private:
+    struct Chunk
+    {
+        char* data;
+        size_t size;
+    };
+
+    char* Take(size_t n)
+    {
+        while (current < chunks.size() && used + n > chunks[current].size)
+        {
+            current++;
+            used = 0;
+        }
+        if (current == chunks.size())
+        {
+            size_t size = n > STRING_ARENA_CHUNK ? n : STRING_ARENA_CHUNK;
+            chunks.push_back(Chunk{new char[size], size});
+        }
+        char* out = chunks[current].data + used;
+        used += n;
+        return out;
+    }
+
+    std::vector<Chunk> chunks;
+    size_t current;
+    size_t used;
+};
+
+// Releases every node in bulk. Only valid once nothing points into the
+// pools any more (see ResetInMemoryState).
+void ResetNodePools();
+
+#endif
@@ -0,0 +1,487 @@
+#include "replay.h"
+
+#include "roads.h"
+#include "ride.h"
+#include "user.h"
+#include "offer_routes.h"
+#include "ingest.h"
+#include "journal.h"
+#include "road_graph.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// -------------------------
+// Minimal JSONL parsing
+// -------------------------
+// Each line is one flat object of string and integer values. Strings are
+// unescaped and NUL-terminated in place, so no allocation per event.
+#define REPLAY_MAX_FIELDS 16
+
+struct JsonField
+{
+    const char* key;
+    const char* str;     // nullptr for numbers
+    long long num;
+};
+
+struct JsonLine
+{
+    JsonField fields[REPLAY_MAX_FIELDS];
+    int count;
+
+    const JsonField* Find(const char* key) const
+    {
+        for (int i = 0; i < count; i++)
+            if (strcmp(fields[i].key, key) == 0)
+                return &fields[i];
+        return nullptr;
+    }
+
+    bool Str(const char* key, const char*& out) const
+    {
+        const JsonField* f = Find(key);
+        if (!f || !f->str) return false;
+        out = f->str;
+        return true;
+    }
+
+    bool Int(const char* key, int& out) const
+    {
+        const JsonField* f = Find(key);
+        if (!f || f->str) return false;
+        out = (int)f->num;
+        return true;
+    }
+};
+
+static inline char* SkipSpace(char* p, char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+// Parses a quoted string at p (pointing at '"'); returns the position
+// after the closing quote or nullptr.
+static char* ParseString(char* p, char* end, const char*& out)
+{
+    if (p >= end || *p != '"') return nullptr;
+    char* src = ++p;
+    char* dst = p;
+    out = p;
+    while (src < end && *src != '"')
+    {
+        if (*src == '\\' && src + 1 < end)
+        {
+            src++;
+            switch (*src)
+            {
+            case 'n': *dst++ = '\n'; break;
+            case 't': *dst++ = '\t'; break;
+            default:  *dst++ = *src; break;   // \" \\ \/
+            }
+            src++;
+        }
+        else
+        {
+            *dst++ = *src++;
+        }
+    }
+    if (src >= end) return nullptr;
+    *dst = '\0';
+    return src + 1;
+}
+
+static bool ParseJsonLine(char* p, char* end, JsonLine& line)
+{
+    line.count = 0;
+    p = SkipSpace(p, end);
+    if (p >= end || *p != '{') return false;
+    p = SkipSpace(p + 1, end);
+    if (p < end && *p == '}') return true;
+
+    while (p < end)
+    {
+        if (line.count == REPLAY_MAX_FIELDS) return false;
+        JsonField& f = line.fields[line.count];
+        char* next = ParseString(p, end, f.key);
+        if (!next) return false;
+        p = SkipSpace(next, end);
+        if (p >= end || *p != ':') return false;
+        p = SkipSpace(p + 1, end);
+
+        if (p < end && *p == '"')
+        {
+            p = ParseString(p, end, f.str);
+            if (!p) return false;
+        }
+        else
+        {
+            char* numEnd;
+            f.str = nullptr;
+            f.num = strtoll(p, &numEnd, 10);
+            if (numEnd == p) return false;
+            p = numEnd;
+        }
+        line.count++;
+
+        p = SkipSpace(p, end);
+        if (p < end && *p == ',') { p = SkipSpace(p + 1, end); continue; }
+        return p < end && *p == '}';
+    }
+    return false;
+}
+
+// -------------------------
+// Event types + latency samples
+// -------------------------
+enum ReplayOp
+{
+    OP_USER,
+    OP_ROAD,
+    OP_OFFER,
+    OP_REQUEST,
+    OP_MATCH,
+    OP_ADVANCE,
+    OP_ROAD_COST,
+    OP_CANCEL,
+    OP_COUNT
+};
+
+static const char* const kOpNames[OP_COUNT] = {
+    "user", "road", "offer", "request", "match", "advance_time", "road_cost", "cancel"};
+
+static int OpOf(const char* type)
+{
+    for (int i = 0; i < OP_COUNT; i++)
+        if (strcmp(type, kOpNames[i]) == 0)
+            return i;
+    return -1;
+}
+
+struct ReplayStats
+{
+    vector<uint32_t> latencyNs[OP_COUNT];   // one sample per event
+    long long events = 0;
+    long long errors = 0;
+    long long matched = 0;
+    int clock = 0;
+};
+
+static uint32_t Percentile(vector<uint32_t>& v, double q)
+{
+    if (v.empty()) return 0;
+    size_t k = (size_t)(q * (v.size() - 1));
+    nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// -------------------------
+// Applying one event
+// -------------------------
+static bool ApplyEvent(int op, const JsonLine& e, ReplayStats& st)
+{
+    const char *name, *from, *to;
+    int id, other, a, b, cost;
+
+    switch (op)
+    {
+    case OP_USER:
+    {
+        if (!e.Int("id", id) || !e.Str("name", name)) return false;
+        if (!e.Int("driver", other)) other = 0;
+        Engine& eng = CurrentEngine();
+        if (SearchUser(eng.userRoot, id)) return false;   // ids are unique
+        eng.userRoot = CreateUser(eng.userRoot, id, name, other);
+        return true;
+    }
+
+    case OP_ROAD:
+        if (!e.Str("from", from) || !e.Str("to", to) || !e.Int("cost", cost)) return false;
+        AddRoad(from, to, cost);
+        return true;
+
+    case OP_OFFER:
+        if (!e.Int("id", id) || !e.Int("driver", other) || !e.Str("from", from) ||
+            !e.Str("to", to) || !e.Int("depart", a) || !e.Int("capacity", b))
+            return false;
+        return CreateRideOffer(id, other, from, to, a, b) != nullptr;
+
+    case OP_REQUEST:
+        if (!e.Int("id", id) || !e.Int("passenger", other) || !e.Str("from", from) ||
+            !e.Str("to", to) || !e.Int("earliest", a) || !e.Int("latest", b))
+            return false;
+        return CreateRideRequest(id, other, from, to, a, b) != nullptr;
+
+    case OP_MATCH:
+        if (!e.Int("count", a)) a = 1;
+        for (int i = 0; i < a; i++)
+            st.matched += MatchNextRequest();
+        return true;
+
+    case OP_ADVANCE:
+        if (!e.Int("to", a)) return false;
+        st.clock = max(st.clock, a);
+        OfferRoutesWarm();   // this tick's new offers, routed in parallel
+        while (CurrentEngine().requestHead && CurrentEngine().requestHead->earliest <= st.clock)
+        {
+            // An unmatched request goes back on top of the heap: stop there.
+            if (!MatchNextRequest()) break;
+            st.matched++;
+        }
+        AdoptRoadGraph();               // a tick is the replay's safe point
+        PublishRoadGraph();
+        JournalMaybeCompact();
+        return true;
+
+    case OP_ROAD_COST:
+        if (!e.Str("from", from) || !e.Str("to", to) || !e.Int("cost", cost)) return false;
+        return UpdateRoadCost(from, to, cost);
+
+    case OP_CANCEL:
+        if (!e.Int("id", id)) return false;
+        return CancelRideRequest(id);
+    }
+    return false;
+}
+
+static bool ReadWholeFile(const char* path, vector<char>& data)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    data.resize((size_t)st.st_size);
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t n = read(fd, data.data() + done, data.size() - done);
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+    data.resize(done);
+    data.push_back('\0');   // numbers at the very end stop here
+    return true;
+}
+
+// -------------------------
+// Public API
+// -------------------------
+bool RunReplay(const char* path)
+{
+    vector<char> data;
+    if (!ReadWholeFile(path, data))
+    {
+        cout << "Cannot read " << path << "\n";
+        return false;
+    }
+
+    typedef chrono::steady_clock Clock;
+    ReplayStats st;
+    JsonLine line;
+    long long lineNo = 0;
+
+    Clock::time_point start = Clock::now();
+    char* p = data.data();
+    char* end = p + data.size() - 1;
+    while (p < end)
+    {
+        char* nl = (char*)memchr(p, '\n', (size_t)(end - p));
+        char* stop = nl ? nl : end;
+        char* s = SkipSpace(p, stop);
+        char* next = nl ? nl + 1 : end;
+        lineNo++;
+        if (s == stop || *s == '#')
+        {
+            p = next;
+            continue;
+        }
+
+        const char* type;
+        int op;
+        if (!ParseJsonLine(s, stop, line) || !line.Str("type", type) || (op = OpOf(type)) < 0)
+        {
+            if (st.errors++ < 10)
+                cout << path << ":" << lineNo << ": bad event\n";
+            p = next;
+            continue;
+        }
+
+        Clock::time_point t0 = Clock::now();
+        bool ok = ApplyEvent(op, line, st);
+        Clock::time_point t1 = Clock::now();
+        st.latencyNs[op].push_back((uint32_t)min<long long>(
+            chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count(), UINT32_MAX));
+        st.events++;
+        if (!ok && st.errors++ < 10)
+            cout << path << ":" << lineNo << ": " << kOpNames[op] << " event failed\n";
+        p = next;
+    }
+    double secs = chrono::duration<double>(Clock::now() - start).count();
+
+    // Report
+    char buf[160];
+    snprintf(buf, sizeof(buf), "Replayed %lld events in %.3f s (%.0f events/s), %lld matched, %lld errors\n",
+             st.events, secs, secs > 0 ? st.events / secs : 0.0, st.matched, st.errors);
+    cout << buf;
+    snprintf(buf, sizeof(buf), "%-14s %10s %12s %12s\n", "event", "count", "p50 (us)", "p99 (us)");
+    cout << buf;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        vector<uint32_t>& v = st.latencyNs[op];
+        if (v.empty()) continue;
+        size_t n = v.size();
+        double p50 = Percentile(v, 0.50) / 1000.0;
+        double p99 = Percentile(v, 0.99) / 1000.0;
+        snprintf(buf, sizeof(buf), "%-14s %10zu %12.2f %12.2f\n", kOpNames[op], n, p50, p99);
+        cout << buf;
+    }
+    return true;
+}
+
+// -------------------------
+// Through the ingestion queue
+// -------------------------
+struct IngestLine
+{
+    int op;
+    int id, user, a, b;
+    const char *from, *to;   // inside the file buffer
+};
+
+bool RunIngestReplay(const char* path, int producers)
+{
+    vector<char> data;
+    if (!ReadWholeFile(path, data))
+    {
+        cout << "Cannot read " << path << "\n";
+        return false;
+    }
+    producers = max(1, producers);
+
+    // Parse everything; set-up events go in now, the rest is kept.
+    ReplayStats st;
+    JsonLine line;
+    vector<IngestLine> posts;
+    long long lineNo = 0, setup = 0, skipped = 0;
+    char* p = data.data();
+    char* end = p + data.size() - 1;
+    while (p < end)
+    {
+        char* nl = (char*)memchr(p, '\n', (size_t)(end - p));
+        char* stop = nl ? nl : end;
+        char* s = SkipSpace(p, stop);
+        char* next = nl ? nl + 1 : end;
+        lineNo++;
+        p = next;
+        if (s == stop || *s == '#')
+            continue;
+
+        const char* type;
+        int op;
+        if (!ParseJsonLine(s, stop, line) || !line.Str("type", type) || (op = OpOf(type)) < 0)
+        {
+            if (st.errors++ < 10)
+                cout << path << ":" << lineNo << ": bad event\n";
+            continue;
+        }
+
+        IngestLine in = {op, 0, 0, 0, 0, nullptr, nullptr};
+        bool ok = true;
+        switch (op)
+        {
+        case OP_USER:
+        case OP_ROAD:
+        case OP_ROAD_COST:
+            ok = ApplyEvent(op, line, st);
+            setup++;
+            break;
+        case OP_OFFER:
+            ok = line.Int("id", in.id) && line.Int("driver", in.user) && line.Str("from", in.from) &&
+                 line.Str("to", in.to) && line.Int("depart", in.a) && line.Int("capacity", in.b);
+            break;
+        case OP_REQUEST:
+            ok = line.Int("id", in.id) && line.Int("passenger", in.user) && line.Str("from", in.from) &&
+                 line.Str("to", in.to) && line.Int("earliest", in.a) && line.Int("latest", in.b);
+            break;
+        case OP_CANCEL:
+            ok = line.Int("id", in.id);
+            break;
+        default:
+            skipped++;
+            continue;
+        }
+        if (!ok)
+        {
+            if (st.errors++ < 10)
+                cout << path << ":" << lineNo << ": " << kOpNames[op] << " event failed\n";
+        }
+        else if (op == OP_OFFER || op == OP_REQUEST || op == OP_CANCEL)
+            posts.push_back(in);
+    }
+
+    typedef chrono::steady_clock Clock;
+    IngestStats before = IngestStatus();
+    if (!StartIngest())
+    {
+        cout << "Ingestion is already running\n";
+        return false;
+    }
+    Clock::time_point start = Clock::now();
+    vector<thread> threads;
+    Engine& eng = CurrentEngine();
+    for (int k = 0; k < producers; k++)
+        threads.emplace_back([&, k]()
+        {
+            EngineScope use(eng);
+            for (size_t i = k; i < posts.size(); i += producers)
+            {
+                const IngestLine& in = posts[i];
+                if (in.op == OP_OFFER)
+                    IngestOffer(in.id, in.user, in.from, in.to, in.a, in.b);
+                else if (in.op == OP_REQUEST)
+                    IngestRequest(in.id, in.user, in.from, in.to, in.a, in.b);
+                else
+                    IngestCancel(in.id);
+            }
+        });
+    for (thread& t : threads)
+        t.join();
+    double postSecs = chrono::duration<double>(Clock::now() - start).count();
+    WaitIngestDrained();
+    double secs = chrono::duration<double>(Clock::now() - start).count();
+    StopIngest();
+    IngestStats after = IngestStatus();
+
+    char buf[200];
+    snprintf(buf, sizeof(buf), "Set up %lld events, skipped %lld (match/advance_time), %lld errors\n",
+             setup, skipped, st.errors);
+    cout << buf;
+    unsigned long long applied = after.applied - before.applied;
+    snprintf(buf, sizeof(buf), "Ingested %llu events from %d producers in %.3f s (%.0f events/s; posting took %.3f s)\n",
+             applied, producers, secs, secs > 0 ? applied / secs : 0.0, postSecs);
+    cout << buf;
+    snprintf(buf, sizeof(buf), "%llu batches, %llu matched, %llu rejected, %llu refused\n",
+             after.batches - before.batches, after.matched - before.matched,
+             after.rejected - before.rejected, after.refused - before.refused);
+    cout << buf;
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Non-interactive replay of a JSONL event log through the core APIs.
+//
+// One flat JSON object per line, selected by "type":
+//   {"type":"user","id":1,"name":"ali","driver":1}
+//   {"type":"road","from":"A","to":"B","cost":4}
+//   {"type":"offer","id":7,"driver":1,"from":"A","to":"C","depart":480,"capacity":3}
+//   {"type":"request","id":9,"passenger":2,"from":"A","to":"B","earliest":470,"latest":500}
+//   {"type":"match","count":1}                  MatchNextRequest, count times
+//   {"type":"advance_time","to":500}
+//   {"type":"road_cost","from":"A","to":"B","cost":9}   live traffic update
+//   {"type":"cancel","id":9}                    drops a pending request
+// advance_time moves the replay clock, routes the offers created since the
+// last tick as one parallel batch, and matches pending requests whose
+// earliest time has been reached, oldest first, until one finds no offer.
+// road_cost changes every A -> B road; the cached offer routes it affects
+// are repaired together at the next match or tick.
+//
+// Lines that are empty or start with '#' are skipped. Afterwards the
+// throughput and the p50/p99 latency of every event type are printed.
+
+bool RunReplay(const char* path);
+
+// The same log through the ingestion queue (ingest.h). user, road and
+// road_cost events are applied first, in order; offer, request and cancel
+// events are then posted by `producers` threads (every producers-th event
+// each) while the matcher thread drains them. match and advance_time are
+// skipped: the matcher matches after every batch. Prints the throughput.
+bool RunIngestReplay(const char* path, int producers);
+
+#endif
@@ -1,15 +1,22 @@
 #include "ride.h"
+#include "journal.h"
+#include "segments.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pool.h"
+#include "offer_store.h"
+#include "offer_routes.h"
+#include "search.h"
+#include "engine.h"
 #include <iostream>
 #include <cstring>
 #include <climits>
+#include <vector>
 
 using namespace std;
 
-#define MAX_REQUESTS 1000
-#define ACTIVE_RIDE_TABLE_SIZE 101
-
-RideRequest *requestHeap[MAX_REQUESTS];
-ActiveRide *activeRideTable[ACTIVE_RIDE_TABLE_SIZE] = {nullptr};
+// Pending requests (Engine::requestHeap) are a binary min-heap on
+// `earliest`; it grows on demand.
 
 static int HashRideId(int rideId);
 
@@ -21,7 +28,7 @@ int ActiveRideTableSize()
 ActiveRide* ActiveRideBucketHead(int idx)
 {
     if (idx < 0 || idx >= ACTIVE_RIDE_TABLE_SIZE) return nullptr;
-    return activeRideTable[idx];
+    return CurrentEngine().activeRideTable[idx];
 }
 
 static void FreePassengerList(PassengerNode* p)
@@ -29,30 +36,39 @@ static void FreePassengerList(PassengerNode* p)
     while (p)
     {
         PassengerNode* nxt = p->next;
-        delete p;
+        CurrentEngine().passengerPool.Free(p);
         p = nxt;
     }
 }
 
 void ClearActiveRides()
 {
+    Engine& eng = CurrentEngine();
     for (int i = 0; i < ACTIVE_RIDE_TABLE_SIZE; i++)
     {
-        ActiveRide* cur = activeRideTable[i];
+        ActiveRide* cur = eng.activeRideTable[i];
         while (cur)
         {
             ActiveRide* nxt = cur->next;
             FreePassengerList(cur->passengers);
-            delete cur;
+            eng.activeRidePool.Free(cur);
             cur = nxt;
         }
-        activeRideTable[i] = nullptr;
+        eng.activeRideTable[i] = nullptr;
     }
 }
 
+// The nodes are released with their pools (ResetNodePools).
+void ForgetActiveRides()
+{
+    Engine& eng = CurrentEngine();
+    for (int i = 0; i < ACTIVE_RIDE_TABLE_SIZE; i++)
+        eng.activeRideTable[i] = nullptr;
+}
+
 static RideOffer* FindOfferById(int offerId)
 {
-    RideOffer* o = offerHead;
+    RideOffer* o = CurrentEngine().offerHead;
     while (o)
     {
         if (o->offerId == offerId) return o;
@@ -66,23 +82,33 @@ void StorageInsertActiveRide(int rideId, int offerId, const int* passengerIds, i
     RideOffer* offer = FindOfferById(offerId);
     if (!offer) return;
 
+    StorageAttachActiveRide(rideId, offer, passengerIds, passengerCount);
+}
+
+// Same as above when the loader already resolved the offer.
+void StorageAttachActiveRide(int rideId, RideOffer* offer, const int* passengerIds, int passengerCount)
+{
+    Engine& eng = CurrentEngine();
     int idx = HashRideId(rideId);
 
-    ActiveRide* ar = new ActiveRide;
+    ActiveRide* ar = eng.activeRidePool.Alloc();
     ar->rideId = rideId;
     ar->offer = offer;
     ar->passengers = nullptr;
+    METRIC_INC(MC_ALLOC_ACTIVE_RIDE);
+    METRIC_ADD(MC_ALLOC_PASSENGER_NODE, passengerCount);
 
     for (int i = passengerCount - 1; i >= 0; i--)
     {
-        PassengerNode* p = new PassengerNode;
+        PassengerNode* p = eng.passengerPool.Alloc();
         p->passengerId = passengerIds[i];
         p->next = ar->passengers;
         ar->passengers = p;
     }
 
-    ar->next = activeRideTable[idx];
-    activeRideTable[idx] = ar;
+    ar->next = eng.activeRideTable[idx];
+    eng.activeRideTable[idx] = ar;
+    SegmentMarkDirty(SEG_ACTIVE_RIDES, rideId);
 }
 
 static int HashRideId(int rideId)
@@ -93,9 +119,10 @@ static int HashRideId(int rideId)
 ActiveRide *FindActiveRide(int rideId)
 {
     int idx = HashRideId(rideId);
-    ActiveRide *cur = activeRideTable[idx];
+    ActiveRide *cur = CurrentEngine().activeRideTable[idx];
     while (cur)
     {
+        METRIC_INC(MC_ACTIVE_RIDE_PROBES);
         if (cur->rideId == rideId)
             return cur;
         cur = cur->next;
@@ -105,27 +132,37 @@ ActiveRide *FindActiveRide(int rideId)
 
 void InsertActiveRide(RideOffer *offer, int passengerId)
 {
+    JournalActiveRideAdd(offer->offerId, offer->offerId, passengerId);
+
+    Engine& eng = CurrentEngine();
     int idx = HashRideId(offer->offerId);
 
-    ActiveRide *ar = new ActiveRide;
+    ActiveRide *ar = eng.activeRidePool.Alloc();
     ar->rideId = offer->offerId;
     ar->offer = offer;
 
-    PassengerNode *p = new PassengerNode;
+    PassengerNode *p = eng.passengerPool.Alloc();
     p->passengerId = passengerId;
     p->next = nullptr;
     ar->passengers = p;
+    METRIC_INC(MC_ALLOC_ACTIVE_RIDE);
+    METRIC_INC(MC_ALLOC_PASSENGER_NODE);
 
-    ar->next = activeRideTable[idx];
-    activeRideTable[idx] = ar;
+    ar->next = eng.activeRideTable[idx];
+    eng.activeRideTable[idx] = ar;
+    SegmentMarkDirty(SEG_ACTIVE_RIDES, ar->rideId);
 }
 
 void AddPassengerToActiveRide(ActiveRide *ar, int passengerId)
 {
-    PassengerNode *p = new PassengerNode;
+    JournalActiveRideAdd(ar->rideId, ar->offer ? ar->offer->offerId : -1, passengerId);
+
+    PassengerNode *p = CurrentEngine().passengerPool.Alloc();
     p->passengerId = passengerId;
     p->next = ar->passengers;
     ar->passengers = p;
+    METRIC_INC(MC_ALLOC_PASSENGER_NODE);
+    SegmentMarkDirty(SEG_ACTIVE_RIDES, ar->rideId);
 }
 
 // Forward declaration
@@ -149,7 +186,9 @@ RideOffer *CreateRideOffer(int offerId, int driverId,
                            const char *start, const char *end,
                            int departTime, int capacity)
 {
-    RideOffer *o = new RideOffer;
+    Engine& eng = CurrentEngine();
+    RideOffer *o = eng.offerPool.Alloc();
+    METRIC_INC(MC_ALLOC_OFFER);
 
     o->offerId = offerId;
     o->driverId = driverId;
@@ -159,34 +198,123 @@ RideOffer *CreateRideOffer(int offerId, int driverId,
     o->capacity = capacity;
     o->seatsLeft = capacity;
 
-    o->next = offerHead;
-    offerHead = o;
+    o->next = eng.offerHead;
+    o->storeRow = -1;
+    o->routeSlot = -1;
+    eng.offerHead = o;
+    OfferStoreAdd(o);
 
+    JournalOfferCreate(offerId, driverId, start, end, departTime, capacity);
+    SegmentMarkDirty(SEG_OFFERS, offerId);
     return o;
 }
 
 void swapRequests(int i, int j)
 {
-    RideRequest *tmp = requestHeap[i];
-    requestHeap[i] = requestHeap[j];
-    requestHeap[j] = tmp;
-
-    requestHeap[i]->heapIndex = i;
-    requestHeap[j]->heapIndex = j;
+    METRIC_INC(MC_HEAP_SWAPS);
+    vector<RideRequest *> &heap = CurrentEngine().requestHeap;
+    RideRequest *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+
+    heap[i]->heapIndex = i;
+    heap[j]->heapIndex = j;
 }
 
 void heapifyUp(int i)
 {
+    const vector<RideRequest *> &heap = CurrentEngine().requestHeap;
     while (i > 0)
     {
         int p = (i - 1) / 2;
-        if (requestHeap[p]->earliest <= requestHeap[i]->earliest)
+        if (heap[p]->earliest <= heap[i]->earliest)
             break;
         swapRequests(p, i);
         i = p;
     }
 }
 
+void heapifyDown(int i)
+{
+    const Engine &eng = CurrentEngine();
+    const vector<RideRequest *> &heap = eng.requestHeap;
+    while (true)
+    {
+        int l = 2 * i + 1, r = 2 * i + 2, s = i;
+        if (l < eng.requestCount &&
+            heap[l]->earliest < heap[s]->earliest)
+            s = l;
+        if (r < eng.requestCount &&
+            heap[r]->earliest < heap[s]->earliest)
+            s = r;
+        if (s == i)
+            break;
+        swapRequests(i, s);
+        i = s;
+    }
+}
+
+static void InsertRequest(RideRequest *r)
+{
+    METRIC_INC(MC_HEAP_INSERTS);
+    Engine &eng = CurrentEngine();
+    int idx = eng.requestCount++;
+    if ((int)eng.requestHeap.size() < eng.requestCount)
+        eng.requestHeap.resize(eng.requestCount);
+    eng.requestHeap[idx] = r;
+    r->heapIndex = idx;
+
+    heapifyUp(idx);
+    eng.requestHead = eng.requestHeap[0];
+    SegmentMarkDirty(SEG_REQUESTS, 0);
+}
+
+// ---------------- STORAGE: PENDING REQUESTS ----------------
+int PendingRequestCount()
+{
+    return CurrentEngine().requestCount;
+}
+
+RideRequest *PendingRequestAt(int i)
+{
+    const Engine &eng = CurrentEngine();
+    return (i >= 0 && i < eng.requestCount) ? eng.requestHeap[i] : nullptr;
+}
+
+// `saved` is a requestHeap array as written by a save, so it already is
+// a heap: restoring copies it and sets heapIndex, O(n) with no sifting.
+void StorageRestoreRequests(RideRequest **saved, int n)
+{
+    Engine &eng = CurrentEngine();
+    if (eng.requestCount > 0)
+    {
+        // Merging into a live queue: insert one by one.
+        for (int i = 0; i < n; i++)
+            InsertRequest(saved[i]);
+        return;
+    }
+
+    if ((int)eng.requestHeap.size() < n)
+        eng.requestHeap.resize(n);
+    bool isHeap = true;
+    for (int i = 0; i < n; i++)
+    {
+        eng.requestHeap[i] = saved[i];
+        eng.requestHeap[i]->heapIndex = i;
+        if (i > 0 && eng.requestHeap[(i - 1) / 2]->earliest > eng.requestHeap[i]->earliest)
+            isHeap = false;
+    }
+    eng.requestCount = n;
+
+    // Edited or foreign files: bottom-up heapify, still O(n).
+    if (!isHeap)
+        for (int i = n / 2 - 1; i >= 0; i--)
+            heapifyDown(i);
+
+    eng.requestHead = (eng.requestCount > 0) ? eng.requestHeap[0] : nullptr;
+    SegmentMarkDirty(SEG_REQUESTS, 0);
+}
+
 RideRequest *CreateRideRequest(int requestId, int passengerId,
                                const char *from, const char *to,
                                int earliest, int latest)
@@ -194,7 +322,8 @@ RideRequest *CreateRideRequest(int requestId, int passengerId,
     if (!PassengerExists(passengerId))
         return nullptr;
 
-    RideRequest *r = new RideRequest;
+    RideRequest *r = CurrentEngine().requestPool.Alloc();
+    METRIC_INC(MC_ALLOC_REQUEST);
     r->requestId = requestId;
     r->passengerId = passengerId;
     r->fromPlace = GetOrCreatePlace(from);
@@ -202,20 +331,16 @@ RideRequest *CreateRideRequest(int requestId, int passengerId,
     r->earliest = earliest;
     r->latest = latest;
 
-    int idx = requestCount++;
-    requestHeap[idx] = r;
-    r->heapIndex = idx;
-
-    heapifyUp(idx);
-    requestHead = requestHeap[0];
+    InsertRequest(r);
 
+    JournalRequestCreate(requestId, passengerId, from, to, earliest, latest);
     return r;
 }
 
 // ---------------- PRINT OFFERS (DEBUG) ----------------
 void PrintOffers()
 {
-    RideOffer *o = offerHead;
+    RideOffer *o = CurrentEngine().offerHead;
     cout << "Ride Offers:\n\n";
     while (o)
     {
@@ -232,9 +357,10 @@ void PrintOffers()
 void PrintRequests()
 {
     cout << "Ride Requests (heap order):\n";
-    for (int i = 0; i < requestCount; i++)
+    const Engine &eng = CurrentEngine();
+    for (int i = 0; i < eng.requestCount; i++)
     {
-        RideRequest* r = requestHeap[i];
+        RideRequest* r = eng.requestHeap[i];
         if (!r) continue;
         cout << "RequestID: " << r->requestId
              << " | Passenger: " << r->passengerId
@@ -248,309 +374,290 @@ void PrintRequests()
 
 
 
-    // ---------- Helper: store distance to a place ----------
-    struct DistEntry
+// ---------- Dijkstra (search.cpp) ----------
+int FindReachableWithinCost(RideOffer *offer, int costBound, vector<ReachablePlace> &out, int threads)
 {
-    Place *place;
-    int dist;
-};
-
-// ---------- Simple Min Priority Queue (array-based) ----------
-struct MinPQ
-{
-    Place *p[100];
-    int d[100];
-    int size;
-
-    MinPQ() { size = 0; }
-
-    void push(Place *place, int dist)
-    {
-        int i = size++;
-        p[i] = place;
-        d[i] = dist;
-        while (i > 0 && d[(i - 1) / 2] > d[i])
-        {
-            swap(d[i], d[(i - 1) / 2]);
-            swap(p[i], p[(i - 1) / 2]);
-            i = (i - 1) / 2;
-        }
-    }
-
-    void pop(Place *&place, int &dist)
-    {
-        place = p[0];
-        dist = d[0];
-        p[0] = p[--size];
-        d[0] = d[size];
-        int i = 0;
-        while (true)
-        {
-            int l = 2 * i + 1, r = 2 * i + 2, s = i;
-            if (l < size && d[l] < d[s])
-                s = l;
-            if (r < size && d[r] < d[s])
-                s = r;
-            if (s == i)
-                break;
-            swap(d[i], d[s]);
-            swap(p[i], p[s]);
-            i = s;
-        }
-    }
-
-    bool empty() { return size == 0; }
-};
+    out.clear();
+    if (!offer || !offer->startPlace)
+        return 0;
+    METRIC_TIMER(MH_REACHABLE);
+    TRACE_SPAN("reachable");
+    if (threads > 1)
+        return ParallelBoundedSearch(offer->startPlace, costBound, out, threads);
+    return BoundedSearch(ThreadSearchScratch(), offer->startPlace, costBound, out);
+}
 
-// ---------- MAIN FUNCTION ----------
 void PrintReachableWithinCost(RideOffer *offer, int costBound)
 {
     if (!offer || !offer->startPlace)
         return;
 
-    DistEntry dist[100];
-    int distCount = 0;
-
-    auto getIndex = [&](Place *p)
-    {
-        for (int i = 0; i < distCount; i++)
-            if (dist[i].place == p)
-                return i;
-        dist[distCount].place = p;
-        dist[distCount].dist = INT_MAX;
-        return distCount++;
-    };
-
-    MinPQ pq;
-
-    int startIdx = getIndex(offer->startPlace);
-    dist[startIdx].dist = 0;
-    pq.push(offer->startPlace, 0);
+    vector<ReachablePlace> reached;
+    FindReachableWithinCost(offer, costBound, reached);
 
     cout << "Reachable areas within cost " << costBound << ":";
-
-    while (!pq.empty())
-    {
-        Place *u;
-        int d_u;
-        pq.pop(u, d_u);
-
-        if (d_u > costBound)
-            break;
-
-        cout << "- " << u->name << " (cost=" << d_u << ")" << endl;
-
-        RoadLink *edge = u->firstLink;
-        while (edge)
-        {
-            Place *v = edge->to;
-            int newDist = d_u + edge->cost;
-
-            if (newDist <= costBound)
-            {
-                int vIdx = getIndex(v);
-                if (newDist < dist[vIdx].dist)
-                {
-                    dist[vIdx].dist = newDist;
-                    pq.push(v, newDist);
-                }
-            }
-            edge = edge->next;
-        }
-    }
+    for (const ReachablePlace &r : reached)
+        cout << "- " << r.place->name << " (cost=" << r.cost << ")" << endl;
 }
 
+// `path` must hold PlaceCount() entries.
 bool ComputeShortestPath(
     Place *start,
     Place *end,
     Place *path[],
     int &pathLen)
 {
-    Place *places[100];
-    int dist[100];
-    Place *parent[100];
-    int count = 0;
-
-    auto getIndex = [&](Place *p)
-    {
-        for (int i = 0; i < count; i++)
-            if (places[i] == p)
-                return i;
-        places[count] = p;
-        dist[count] = INT_MAX;
-        parent[count] = nullptr;
-        return count++;
-    };
-
-    MinPQ pq;
-
-    int s = getIndex(start);
-    dist[s] = 0;
-    pq.push(start, 0);
-
-    while (!pq.empty())
-    {
-        Place *u;
-        int d;
-        pq.pop(u, d);
-
-        int uIdx = getIndex(u);
-        if (u == end)
-            break;
-
-        RoadLink *e = u->firstLink;
-        while (e)
-        {
-            Place *v = e->to;
-            int vIdx = getIndex(v);
-            int nd = d + e->cost;
-
-            if (nd < dist[vIdx])
-            {
-                dist[vIdx] = nd;
-                parent[vIdx] = u;
-                pq.push(v, nd);
-            }
-            e = e->next;
-        }
-    }
-
-    int endIdx = getIndex(end);
-    if (dist[endIdx] == INT_MAX)
-        return false;
-
-    // reconstruct path (reverse)
-    pathLen = 0;
-    Place *cur = end;
-    while (cur)
-    {
-        path[pathLen++] = cur;
-        int i = getIndex(cur);
-        cur = parent[i];
-    }
-
-    // reverse
-    for (int i = 0; i < pathLen / 2; i++)
-        swap(path[i], path[pathLen - 1 - i]);
+    METRIC_INC(MC_SHORTEST_PATH_CALLS);
+    METRIC_TIMER(MH_SHORTEST_PATH);
+    TRACE_SPAN("shortest_path");
+    return ShortestPathSearch(ThreadSearchScratch(), start, end, path, pathLen);
+}
 
-    return true;
+bool ComputeShortestPathAt(
+    Place *start,
+    Place *end,
+    int departTime,
+    Place *path[],
+    int &pathLen,
+    int *arrivals)
+{
+    METRIC_INC(MC_SHORTEST_PATH_CALLS);
+    METRIC_TIMER(MH_SHORTEST_PATH);
+    TRACE_SPAN("shortest_path");
+    return ShortestPathSearchAt(ThreadSearchScratch(), start, end, departTime,
+                                path, pathLen, arrivals);
 }
 
+// Knuth-Morris-Pratt over the passenger path: O(dLen + pLen).
 bool IsSubPath(
     Place *driverPath[], int dLen,
     Place *passengerPath[], int pLen)
 {
     if (pLen > dLen)
         return false;
+    if (pLen == 0)
+        return true;
+
+    TRACE_SPAN("subpath_check");
+    static thread_local vector<int> fail;
+    fail.resize(pLen);
+    fail[0] = 0;
+    for (int j = 1, k = 0; j < pLen; j++)
+    {
+        while (k > 0 && passengerPath[j] != passengerPath[k])
+            k = fail[k - 1];
+        if (passengerPath[j] == passengerPath[k])
+            k++;
+        fail[j] = k;
+    }
 
-    for (int i = 0; i <= dLen - pLen; i++)
+    long long compared = 0;
+    for (int i = 0, k = 0; i < dLen; i++)
     {
-        bool match = true;
-        for (int j = 0; j < pLen; j++)
+        compared++;
+        while (k > 0 && driverPath[i] != passengerPath[k])
         {
-            if (driverPath[i + j] != passengerPath[j])
-            {
-                match = false;
-                break;
-            }
+            k = fail[k - 1];
+            compared++;
         }
-        if (match)
+        if (driverPath[i] == passengerPath[k])
+            k++;
+        if (k == pLen)
+        {
+            METRIC_ADD(MC_SUBPATH_COMPARISONS, compared);
             return true;
+        }
     }
+    METRIC_ADD(MC_SUBPATH_COMPARISONS, compared);
     return false;
 }
 
 RideRequest *ExtractMinRequest()
 {
-    if (requestCount == 0)
+    Engine &eng = CurrentEngine();
+    if (eng.requestCount == 0)
         return nullptr;
 
-    RideRequest *minReq = requestHeap[0];
-    requestHeap[0] = requestHeap[--requestCount];
+    RideRequest *minReq = eng.requestHeap[0];
+    METRIC_INC(MC_HEAP_EXTRACTS);
+    eng.requestHeap[0] = eng.requestHeap[--eng.requestCount];
 
-    if (requestCount > 0)
+    if (eng.requestCount > 0)
     {
-        requestHeap[0]->heapIndex = 0;
-        int i = 0;
-        while (true)
-        {
-            int l = 2 * i + 1, r = 2 * i + 2, s = i;
-            if (l < requestCount &&
-                requestHeap[l]->earliest < requestHeap[s]->earliest)
-                s = l;
-            if (r < requestCount &&
-                requestHeap[r]->earliest < requestHeap[s]->earliest)
-                s = r;
-            if (s == i)
-                break;
-            swapRequests(i, s);
-            i = s;
-        }
+        eng.requestHeap[0]->heapIndex = 0;
+        heapifyDown(0);
     }
 
-    requestHead = (requestCount > 0) ? requestHeap[0] : nullptr;
+    eng.requestHead = (eng.requestCount > 0) ? eng.requestHeap[0] : nullptr;
+    SegmentMarkDirty(SEG_REQUESTS, 0);
     return minReq;
 }
 
+// Removes an arbitrary pending request (uses heapIndex, O(log n) after the lookup).
+RideRequest *RemoveRequestById(int requestId)
+{
+    Engine &eng = CurrentEngine();
+    int i = 0;
+    while (i < eng.requestCount && eng.requestHeap[i]->requestId != requestId)
+        i++;
+    if (i == eng.requestCount)
+        return nullptr;
+
+    RideRequest *r = eng.requestHeap[i];
+    METRIC_INC(MC_HEAP_EXTRACTS);
+    eng.requestHeap[i] = eng.requestHeap[--eng.requestCount];
+    if (i < eng.requestCount)
+    {
+        eng.requestHeap[i]->heapIndex = i;
+        heapifyUp(i);
+        heapifyDown(eng.requestHeap[i]->heapIndex);
+    }
+
+    eng.requestHead = (eng.requestCount > 0) ? eng.requestHeap[0] : nullptr;
+    SegmentMarkDirty(SEG_REQUESTS, 0);
+    return r;
+}
+
 int MatchNextRequest()
 {
+    METRIC_TIMER(MH_MATCH);
+    TRACE_SPAN("match");
     RideRequest *req = ExtractMinRequest();
     if (!req)
         return 0;
-
-    RideOffer *off = offerHead;
-
-    while (off)
+    METRIC_INC(MC_MATCH_ATTEMPTS);
+    TRACE_ARG("request", req->requestId);
+
+    // Candidate filtering and route checks (ends with the function)
+    TRACE_SPAN("scan_offers");
+    static thread_local vector<RideOffer *> candidates;
+    static thread_local vector<Place *> pp;
+    static thread_local vector<int> pids;
+
+    int scanned = OfferCandidates(req->earliest, req->latest, req->fromPlace->id,
+                                  req->toPlace->id, candidates);
+    METRIC_ADD(MC_OFFERS_SCANNED, scanned);
+    METRIC_ADD(MC_OFFERS_CANDIDATES, candidates.size());
+
+    // Driver routes come from the offer route cache. The passenger's route
+    // is the shortest path leaving at the pickup time; without road
+    // profiles it is the same for every offer and computed once.
+    bool timed = RoadProfileCount() > 0;
+    bool havePath = false;
+    int pl = 0, pathAt = 0;
+
+    for (RideOffer *off : candidates)
     {
-        if (off->seatsLeft > 0 &&
-            off->departTime >= req->earliest &&
-            off->departTime <= req->latest)
+        RouteView route;
+        int first = 0, last = 0;
+        bool contained;
         {
-            Place *dp[100], *pp[100];
-            int dl, pl;
-
-            if (ComputeShortestPath(off->startPlace, off->endPlace, dp, dl) &&
-                ComputeShortestPath(req->fromPlace, req->toPlace, pp, pl) &&
-                IsSubPath(dp, dl, pp, pl))
+            TRACE_SPAN("subpath_check");
+            contained = OfferRoute(off, route) &&
+                        RouteStretch(route, req->fromPlace->id, req->toPlace->id, first, last);
+            if (contained && (!havePath || (timed && route.arrive[first] != pathAt)))
             {
-                off->seatsLeft--;
-
-                ActiveRide *ar = FindActiveRide(off->offerId);
-                if (!ar)
-                    InsertActiveRide(off, req->passengerId);
-                else
-                    AddPassengerToActiveRide(ar, req->passengerId);
-
-                // Phase 9 — Track completed rides (treat successful match as completion)
+                havePath = true;
+                pathAt = route.arrive[first];
+                if ((int)pp.size() < PlaceCount())
+                    pp.resize(PlaceCount());
+                if (!ComputeShortestPathAt(req->fromPlace, req->toPlace, pathAt, pp.data(), pl))
+                    pl = 0;
+                pids.resize(pl);
+                for (int i = 0; i < pl; i++)
+                    pids[i] = pp[i]->id;
+            }
+            contained = contained && pl == last - first + 1 &&
+                        RouteMatches(route, first, pids.data(), pl);
+        }
+        if (contained)
+        {
+            TRACE_SPAN("commit_match");
+            TRACE_ARG("offer", off->offerId);
+            JournalRequestMatch(req->requestId, off->offerId);
+            off->seatsLeft--;
+            OfferStoreSeatsChanged(off);
+            SegmentMarkDirty(SEG_OFFERS, off->offerId);
+
+            ActiveRide *ar = FindActiveRide(off->offerId);
+            if (!ar)
+                InsertActiveRide(off, req->passengerId);
+            else
+                AddPassengerToActiveRide(ar, req->passengerId);
+
+            // Phase 9 — Track completed rides (treat successful match as completion)
+            {
+                User* driver = SearchUser(CurrentEngine().userRoot, off->driverId);
+                if (driver && driver->isDriver == 1)
                 {
-                    User* driver = SearchUser(userRoot, off->driverId);
-                    if (driver && driver->isDriver == 1)
-                        driver->completedRides++;
+                    driver->completedRides++;
+                    SegmentMarkDirty(SEG_USERS, driver->userId);
                 }
+            }
 
-                AddHistory(off->driverId, off->offerId,
-                           req->fromPlace->name, req->toPlace->name,
-                           off->departTime);
+            AddHistory(off->driverId, off->offerId,
+                       req->fromPlace->name, req->toPlace->name,
+                       off->departTime);
 
-                AddHistory(req->passengerId, off->offerId,
-                           req->fromPlace->name, req->toPlace->name,
-                           off->departTime);
+            AddHistory(req->passengerId, off->offerId,
+                       req->fromPlace->name, req->toPlace->name,
+                       off->departTime);
 
-                delete req;
-                return 1;
-            }
+            CurrentEngine().requestPool.Free(req);
+            METRIC_INC(MC_MATCH_SUCCESS);
+            return 1;
         }
-        off = off->next;
     }
 
-    // no match → reinsert
-    CreateRideRequest(req->requestId, req->passengerId,
-                      req->fromPlace->name, req->toPlace->name,
-                      req->earliest, req->latest);
-    delete req;
+    // no match → reinsert (same request, nothing new to journal)
+    InsertRequest(req);
     return 0;
 }
 
+bool CancelRideRequest(int requestId)
+{
+    RideRequest *req = RemoveRequestById(requestId);
+    if (!req)
+        return false;
+    JournalRequestCancel(requestId);
+    CurrentEngine().requestPool.Free(req);
+    return true;
+}
+
+// ---------------- JOURNAL REPLAY ----------------
+void ReplayRequestMatch(int requestId, int offerId)
+{
+    RideRequest *req = RemoveRequestById(requestId);
+    CurrentEngine().requestPool.Free(req);
+
+    RideOffer *off = FindOfferById(offerId);
+    if (!off)
+        return;
+    off->seatsLeft--;
+    OfferStoreSeatsChanged(off);
+    SegmentMarkDirty(SEG_OFFERS, off->offerId);
+
+    User *driver = SearchUser(CurrentEngine().userRoot, off->driverId);
+    if (driver && driver->isDriver == 1)
+    {
+        driver->completedRides++;
+        SegmentMarkDirty(SEG_USERS, driver->userId);
+    }
+}
+
+void ReplayActiveRideAdd(int rideId, int offerId, int passengerId)
+{
+    ActiveRide *ar = FindActiveRide(rideId);
+    if (ar)
+    {
+        AddPassengerToActiveRide(ar, passengerId);
+        return;
+    }
+    RideOffer *off = FindOfferById(offerId);
+    if (off)
+        StorageAttachActiveRide(rideId, off, &passengerId, 1);
+}
+
 // =======================================================
 // TEST CODE: Verify Ride Creation, Matching, and Reachability
 // File: test_ride.cpp
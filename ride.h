@@ -6,6 +6,7 @@
 #include "user.h"
 #include <iostream>
 #include <climits>
+#include <vector>
 
 // Forward declarations
 
@@ -22,6 +23,8 @@ struct RideOffer {
     int capacity;
     int seatsLeft;
     RideOffer* next;
+    int storeRow;      // row in the offer store (offer_store.h)
+    int routeSlot;     // cached route (offer_routes.h), -1 if none yet
 };
 
 // =======================
@@ -57,12 +60,10 @@ struct ActiveRide {
 
 
 // =======================
-// GLOBAL LIST HEADS
-// (defined in ride.cpp)
+// LIST HEADS
+// (Engine::offerHead, requestHead, requestCount — engine.h)
 // =======================
-extern RideOffer* offerHead;
-extern RideRequest* requestHead;
-extern int requestCount;
+#define ACTIVE_RIDE_TABLE_SIZE 101
 
 // =======================
 // STORAGE HOOKS (Phase 10)
@@ -70,7 +71,18 @@ extern int requestCount;
 int ActiveRideTableSize();
 ActiveRide* ActiveRideBucketHead(int idx);
 void ClearActiveRides();
+void ForgetActiveRides();     // empties the table without freeing (bulk reset)
 void StorageInsertActiveRide(int rideId, int offerId, const int* passengerIds, int passengerCount);
+void StorageAttachActiveRide(int rideId, RideOffer* offer, const int* passengerIds, int passengerCount);
+
+// Pending requests, saved in heap array order
+int PendingRequestCount();
+RideRequest* PendingRequestAt(int i);
+void StorageRestoreRequests(RideRequest** saved, int n);
+
+// Journal replay (journal.cpp) — re-applies one logged match step
+void ReplayRequestMatch(int requestId, int offerId);
+void ReplayActiveRideAdd(int rideId, int offerId, int passengerId);
 
 // =======================
 // CORE FUNCTIONS
@@ -95,6 +107,9 @@ RideRequest* CreateRideRequest(
 
 int MatchNextRequest();
 
+// Drops a pending request (journaled); false if no such request is pending.
+bool CancelRideRequest(int requestId);
+
 // =======================
 // DEBUG / UTILITY
 // =======================
@@ -110,10 +125,22 @@ void PrintRequests();
 // =======================
 // STEP 1.4 – DIJKSTRA
 // =======================
+struct ReachablePlace
+{
+    Place* place;
+    int cost;
+};
+
+// Places reachable from the offer's start within costBound, in order of
+// increasing cost; returns how many were found. threads > 1 runs the
+// parallel delta-stepping search (search.h) instead of Dijkstra.
+int FindReachableWithinCost(RideOffer* offer, int costBound, std::vector<ReachablePlace>& out,
+                            int threads = 1);
 void PrintReachableWithinCost(RideOffer* offer, int costBound);
 
 int MatchNextRequest();
 RideRequest* ExtractMinRequest();
+RideRequest* RemoveRequestById(int requestId);
 bool IsSubPath(
     Place* driverPath[], int dLen,
     Place* passengerPath[], int pLen
@@ -124,6 +151,16 @@ bool ComputeShortestPath(
     Place* path[],
     int& pathLen
 );
+// Same, leaving at departTime over the time-dependent road costs;
+// arrivals (optional) gets the arrival time at each place on the path.
+bool ComputeShortestPathAt(
+    Place* start,
+    Place* end,
+    int departTime,
+    Place* path[],
+    int& pathLen,
+    int* arrivals = nullptr
+);
 
 
 #endif // RIDE_H
@@ -0,0 +1,393 @@
+#include "road_graph.h"
+#include "storage.h"
+#include "metrics.h"
+#include "trace.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+int RoadGraph::Find(const char* name) const
+{
+    auto it = index.find(name);
+    return it == index.end() ? -1 : it->second;
+}
+
+// -------------------------
+// Epochs
+// -------------------------
+// A reader claims a free slot and stores the global epoch it saw there,
+// then loads the graph. A swap bumps the epoch after exchanging the
+// pointer and retires the old graph with the new epoch R: a reader whose
+// slot holds >= R loaded the pointer after the swap, so the old graph
+// can go once no slot holds a smaller, non-zero epoch.
+struct RetiredGraph
+{
+    RoadGraph* graph;
+    unsigned long long epoch;
+};
+
+// One per engine. A graph is retired once neither slot holds it.
+struct GraphPublisher
+{
+    atomic<RoadGraph*> currentGraph{nullptr};
+    atomic<RoadGraph*> liveGraph{nullptr};
+    atomic<unsigned long long> globalEpoch{1};
+    atomic<unsigned long long> readerEpoch[RCU_MAX_READERS];   // 0: free
+
+    mutex publishLock;                  // swaps and the retired list
+    vector<RetiredGraph> retiredGraphs;
+    unsigned long long publishCount = 0;
+
+    // Engine thread
+    unsigned long long publishedEdits = ULLONG_MAX;   // RoadEditCount() of liveGraph
+    int publishedPlaces = -1;                          // PlaceCount() of liveGraph
+    unsigned long long adoptedVersion = 0;
+
+    // Background reload
+    thread worker;
+    atomic<bool> running{false};
+    atomic<int> lastResult{-1};         // -1 none, 0 failed, 1 ok
+
+    GraphPublisher()
+    {
+        for (int i = 0; i < RCU_MAX_READERS; i++)
+            readerEpoch[i].store(0);
+    }
+
+    // Engine shutdown (engine.h): lets a reload finish.
+    static const int STOP_STAGE = ENGINE_STOP_BACKGROUND;
+    void Stop()
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+
+    ~GraphPublisher()
+    {
+        Stop();
+        for (RetiredGraph& r : retiredGraphs)
+            delete r.graph;
+        if (liveGraph.load() != currentGraph.load())
+            delete liveGraph.load();
+        delete currentGraph.load();
+    }
+};
+
+static GraphPublisher& Publisher(Engine& e = CurrentEngine())
+{
+    return EnginePart<GraphPublisher>(e);
+}
+
+RoadGraphRead::RoadGraphRead() : RoadGraphRead(CurrentEngine())
+{
+}
+
+RoadGraphRead::RoadGraphRead(Engine& engine)
+{
+    static atomic<unsigned> nextStart{0};
+    static thread_local unsigned start = nextStart.fetch_add(1) % RCU_MAX_READERS;
+
+    GraphPublisher& pub = Publisher(engine);
+    unsigned long long e = pub.globalEpoch.load();
+    for (unsigned i = start;; i = (i + 1) % RCU_MAX_READERS)
+    {
+        unsigned long long free = 0;
+        if (pub.readerEpoch[i].compare_exchange_strong(free, e))
+        {
+            pin = &pub.readerEpoch[i];
+            break;
+        }
+        if ((i + 1) % RCU_MAX_READERS == start)
+            this_thread::yield();       // every slot taken: wait for one
+    }
+    graph = pub.currentGraph.load();
+    live = pub.liveGraph.load();
+}
+
+RoadGraphRead::~RoadGraphRead()
+{
+    pin->store(0);
+}
+
+// publishLock held.
+static void ReclaimGraphs(GraphPublisher& pub)
+{
+    unsigned long long oldest = ULLONG_MAX;
+    for (int i = 0; i < RCU_MAX_READERS; i++)
+    {
+        unsigned long long e = pub.readerEpoch[i].load();
+        if (e != 0)
+            oldest = min(oldest, e);
+    }
+    size_t kept = 0;
+    for (RetiredGraph& r : pub.retiredGraphs)
+    {
+        if (r.epoch <= oldest)
+            delete r.graph;
+        else
+            pub.retiredGraphs[kept++] = r;
+    }
+    pub.retiredGraphs.resize(kept);
+}
+
+// publishLock held. Puts g in the reader slot, the live slot or both.
+static void SwapGraph(GraphPublisher& pub, RoadGraph* g, bool current, bool live)
+{
+    g->version = ++pub.publishCount;
+    RoadGraph* oldCurrent = current ? pub.currentGraph.exchange(g) : nullptr;
+    RoadGraph* oldLive = live ? pub.liveGraph.exchange(g) : nullptr;
+    unsigned long long retired = pub.globalEpoch.fetch_add(1) + 1;
+    for (RoadGraph* old : {oldCurrent, oldLive == oldCurrent ? nullptr : oldLive})
+        if (old && old != pub.currentGraph.load() && old != pub.liveGraph.load())
+            pub.retiredGraphs.push_back(RetiredGraph{old, retired});
+    ReclaimGraphs(pub);
+}
+
+unsigned long long PublishedRoadGraphVersion()
+{
+    GraphPublisher& pub = Publisher();
+    lock_guard<mutex> g(pub.publishLock);
+    return pub.publishCount;
+}
+
+int RetiredRoadGraphs()
+{
+    GraphPublisher& pub = Publisher();
+    lock_guard<mutex> g(pub.publishLock);
+    ReclaimGraphs(pub);
+    return (int)pub.retiredGraphs.size();
+}
+
+// -------------------------
+// Building
+// -------------------------
+static int InternName(RoadGraph& g, const char* name)
+{
+    auto it = g.index.find(name);
+    if (it != g.index.end())
+        return it->second;
+    int id = (int)g.names.size();
+    g.names.push_back(name);
+    g.index.emplace(name, id);
+    return id;
+}
+
+// Copy of the live lists; place index = Place::id.
+static RoadGraph* GraphFromLive(int places)
+{
+    RoadGraph* g = new RoadGraph();
+    g->fromFile = false;
+    vector<Place*>& byId = g->places;
+    byId.resize(places);
+    for (Place* p = CurrentEngine().placeHead; p; p = p->next)
+        byId[p->id] = p;
+
+    g->names.resize(places);
+    g->index.reserve(places);
+    g->begin.assign(places + 1, 0);
+    for (int i = 0; i < places; i++)
+    {
+        g->names[i] = byId[i]->name;
+        g->index.emplace(g->names[i], i);
+        g->begin[i] = (int)g->to.size();
+        for (RoadLink* e = byId[i]->firstLink; e; e = e->next)
+        {
+            g->to.push_back(e->to->id);
+            g->cost.push_back(e->cost);
+            g->profile.push_back(e->profile);
+        }
+    }
+    g->begin[places] = (int)g->to.size();
+    g->profiles = CurrentEngine().roadProfiles;
+    return g;
+}
+
+// Roads keep their file order within each place, as AddRoad would.
+static RoadGraph* GraphFromFile(const char* path)
+{
+    struct FileRoad
+    {
+        int from, to, cost, profile;
+    };
+    RoadGraph* g = new RoadGraph();
+    g->fromFile = true;
+    vector<FileRoad> roads;
+    unordered_map<string, int> profileRows;
+
+    bool ok = ForEachRoadInFile(path, [&](const char* from, const char* to, int cost, const int* profile)
+    {
+        FileRoad r;
+        r.from = InternName(*g, from);
+        r.to = InternName(*g, to);
+        r.cost = cost;
+        r.profile = -1;
+        if (profile && ValidRoadProfile(profile))    // else unprofiled, as LoadAll does
+        {
+            string key((const char*)profile, ROAD_PROFILE_POINTS * sizeof(int));
+            auto it = profileRows.find(key);
+            if (it == profileRows.end())
+            {
+                it = profileRows.emplace(key, (int)(g->profiles.size() / ROAD_PROFILE_POINTS)).first;
+                g->profiles.insert(g->profiles.end(), profile, profile + ROAD_PROFILE_POINTS);
+            }
+            r.profile = it->second;
+        }
+        roads.push_back(r);
+    });
+    if (!ok)
+    {
+        delete g;
+        return nullptr;
+    }
+
+    // Counting sort by source place (stable).
+    int places = g->Places();
+    g->begin.assign(places + 1, 0);
+    for (const FileRoad& r : roads)
+        g->begin[r.from + 1]++;
+    for (int i = 0; i < places; i++)
+        g->begin[i + 1] += g->begin[i];
+    g->to.resize(roads.size());
+    g->cost.resize(roads.size());
+    g->profile.resize(roads.size());
+    vector<int> fill(g->begin.begin(), g->begin.end() - 1);
+    for (const FileRoad& r : roads)
+    {
+        int k = fill[r.from]++;
+        g->to[k] = r.to;
+        g->cost[k] = r.cost;
+        g->profile[k] = r.profile;
+    }
+    return g;
+}
+
+// -------------------------
+// Publishing (engine thread)
+// -------------------------
+// A new place without roads changes no edit count but must be routable.
+bool PublishRoadGraph()
+{
+    GraphPublisher& pub = Publisher();
+    int places = PlaceCount();
+    if (RoadEditCount() == pub.publishedEdits && places == pub.publishedPlaces)
+        return false;
+    TRACE_SPAN("road_graph_publish");
+    RoadGraph* g = GraphFromLive(places);
+
+    lock_guard<mutex> lock(pub.publishLock);
+    RoadGraph* cur = pub.currentGraph.load();
+    // Readers keep the reload until it is adopted: it replaces these roads.
+    bool waiting = cur && cur->fromFile && cur->version > pub.adoptedVersion;
+    SwapGraph(pub, g, !waiting, true);
+    pub.publishedEdits = RoadEditCount();
+    pub.publishedPlaces = places;
+    return true;
+}
+
+static bool SameRoads(const Place* p, const RoadGraph& g, int i)
+{
+    int k = g.begin[i];
+    for (const RoadLink* e = p->firstLink; e; e = e->next, k++)
+    {
+        if (k == g.begin[i + 1] || e->cost != g.cost[k] ||
+            strcmp(e->to->name, g.names[g.to[k]].c_str()) != 0)
+            return false;
+        int row = g.profile[k];
+        if ((e->profile < 0) != (row < 0))
+            return false;
+        if (row >= 0 &&
+            memcmp(RoadProfileCosts(e->profile),
+                   g.profiles.data() + (size_t)row * ROAD_PROFILE_POINTS,
+                   ROAD_PROFILE_POINTS * sizeof(int)) != 0)
+            return false;
+    }
+    return k == g.begin[i + 1];
+}
+
+int AdoptRoadGraph()
+{
+    GraphPublisher& pub = Publisher();
+    RoadGraphRead read;
+    const RoadGraph* g = read.graph;
+    if (!g || !g->fromFile || g->version <= pub.adoptedVersion)
+        return -1;
+    TRACE_SPAN("road_graph_adopt");
+
+    int changed = 0;
+    vector<RoadSpec> specs;
+    for (int i = 0; i < g->Places(); i++)
+    {
+        Place* p = FindPlace(g->names[i].c_str());
+        if (p && SameRoads(p, *g, i))
+            continue;
+        specs.clear();
+        for (int k = g->begin[i]; k < g->begin[i + 1]; k++)
+        {
+            int row = g->profile[k];
+            specs.push_back(RoadSpec{g->names[g->to[k]].c_str(), g->cost[k],
+                                     row >= 0 ? g->profiles.data() + (size_t)row * ROAD_PROFILE_POINTS : nullptr});
+        }
+        if (ReplaceRoadsFrom(g->names[i].c_str(), specs.data(), (int)specs.size()))
+            changed++;
+    }
+    // Places the new map no longer has keep existing (offers may start
+    // there) but lose their roads.
+    for (Place* p = CurrentEngine().placeHead; p; p = p->next)
+    {
+        if (p->firstLink && g->Find(p->name) < 0)
+        {
+            ReplaceRoadsFrom(p->name, nullptr, 0);
+            changed++;
+        }
+    }
+
+    pub.adoptedVersion = g->version;
+    return changed;
+}
+
+// -------------------------
+// Background reload
+// -------------------------
+void WaitRoadGraphReload()
+{
+    Publisher().Stop();
+}
+
+bool RoadGraphReloadRunning()
+{
+    return Publisher().running.load();
+}
+
+int LastRoadGraphReloadResult()
+{
+    return Publisher().lastResult.load();
+}
+
+// The worker only touches the publisher it was started for.
+bool ReloadRoadNetworkInBackground(const char* path)
+{
+    WaitRoadGraphReload();
+    GraphPublisher& pub = Publisher();
+    pub.running = true;
+    pub.worker = thread([&pub, file = string(path)]()
+    {
+        TRACE_SPAN("road_graph_reload");
+        RoadGraph* g = GraphFromFile(file.c_str());
+        if (g)
+        {
+            lock_guard<mutex> lock(pub.publishLock);
+            SwapGraph(pub, g, true, false);
+        }
+        pub.lastResult = g ? 1 : 0;
+        pub.running = false;
+    });
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef ROAD_GRAPH_H
+#define ROAD_GRAPH_H
+
+// Read-copy-update road graph.
+//
+// The live road lists (placeHead, RoadLink chains) belong to the engine
+// thread and are only edited there; each engine (engine.h) publishes its
+// own graphs. Every search routes on an immutable copy instead: a
+// RoadGraph is a CSR snapshot of the whole network published behind an
+// atomic pointer. A reader pins the current epoch, loads the pointer and
+// routes without taking a lock. A replaced graph is freed once every
+// reader that pinned it has let go (epoch-based reclamation), so a swap
+// never waits for readers and readers never wait for a swap.
+//
+// Two graphs are published: `live`, the latest copy of the live lists
+// (place index = Place::id), which the engine's own searches use
+// (search.h), and `graph`, what other readers see, which is the same copy
+// unless a reloaded map is waiting to be adopted.
+//
+// Map updates: ReloadRoadNetworkInBackground parses the file and builds
+// the new graph on its own thread, then swaps it in; readers see it
+// immediately. The engine thread adopts it into the live lists at its
+// next safe point (AdoptRoadGraph), replacing only the places whose roads
+// differ, so its pause is one comparison pass plus the changed places.
+// Edits made through roads.h are published by the next search or the
+// engine loop's PublishRoadGraph, whichever comes first.
+
+#include "roads.h"
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define RCU_MAX_READERS 128        // readers pinned at the same time
+
+struct RoadGraph
+{
+    unsigned long long version;       // publish order, from 1
+    bool fromFile;                    // built by a reload (to be adopted)
+    std::vector<std::string> names;   // by place index
+    std::unordered_map<std::string, int> index;
+    std::vector<int> begin;           // CSR rows, Places() + 1 entries
+    std::vector<int> to;              // per road: place index
+    std::vector<int> cost;
+    std::vector<int> profile;         // per road: row in profiles, -1: none
+    std::vector<int> profiles;        // ROAD_PROFILE_POINTS costs per row
+    std::vector<Place*> places;       // copies of the live lists: Place by
+                                      // index, engine thread only; else empty
+
+    int Places() const { return (int)names.size(); }
+    int Find(const char* name) const; // -1 if unknown
+
+    // RoadCostAt for road k entered at time t.
+    int CostAt(int k, int t) const
+    {
+        return profile[k] < 0 ? cost[k]
+                              : ProfileCostAt(profiles.data() + (size_t)profile[k] * ROAD_PROFILE_POINTS, t);
+    }
+};
+
+struct Engine;
+
+// Pins the current graph for the reader's lifetime; any thread. The
+// default constructor reads the calling thread's engine.
+struct RoadGraphRead
+{
+    const RoadGraph* graph;           // nullptr until one was published
+    const RoadGraph* live;            // copy of the live lists, likewise
+    std::atomic<unsigned long long>* pin;   // reader epoch slot
+
+    RoadGraphRead();
+    explicit RoadGraphRead(Engine& engine);
+    ~RoadGraphRead();
+    RoadGraphRead(const RoadGraphRead&) = delete;
+    RoadGraphRead& operator=(const RoadGraphRead&) = delete;
+};
+
+// Engine thread: publishes a copy of the live lists if they changed since
+// the last publish. While a reloaded graph waits to be adopted only `live`
+// is replaced. Returns false if nothing was published. The searches call
+// it first, so they never route on a stale copy.
+bool PublishRoadGraph();
+
+// Engine thread: brings the live lists in line with a reloaded graph
+// (journaled per place). Returns how many places changed, -1 if there is
+// nothing to adopt. Engine loops call it at their safe point, followed by
+// PublishRoadGraph.
+int AdoptRoadGraph();
+
+// Builds a graph from a roads.txt-style file on a background thread and
+// swaps it in. Returns false if the reload could not start.
+bool ReloadRoadNetworkInBackground(const char* path);
+bool RoadGraphReloadRunning();
+void WaitRoadGraphReload();
+int LastRoadGraphReloadResult();      // -1 none yet, 0 failed, 1 ok
+
+unsigned long long PublishedRoadGraphVersion();   // 0: none
+int RetiredRoadGraphs();              // replaced graphs not freed yet
+
+#endif
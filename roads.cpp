@@ -1,5 +1,13 @@
 #include "roads.h"
+#include "journal.h"
+#include "segments.h"
+#include "metrics.h"
+#include "pool.h"
+#include "engine.h"
 
+#include <atomic>
+#include <string>
+#include <unordered_map>
 
 
 RoadLink* appendNodetoRoadList(RoadLink* head, RoadLink* new_node)
@@ -15,51 +23,364 @@ RoadLink* appendNodetoRoadList(RoadLink* head, RoadLink* new_node)
     return head;
 }
 
-Place *GetOrCreatePlace(const char *name)
+// ---------------- ENGINE STATE ----------------
+// Graph versions are unique across engines, so caches keyed by them
+// (search.cpp) cannot mistake one engine's graph for another's.
+static std::atomic<unsigned long long> nextGraphVersion{1};
+
+struct RoadState
+{
+    // Place name index: chained hash table over Place::hashNext; doubles
+    // when the load factor passes 1. The list tail is kept so new places
+    // append in O(1).
+    Place **placeBuckets = nullptr;
+    int placeBucketCount = 0;
+    int placeIndexed = 0;
+    Place *placeTail = nullptr;
+
+    unsigned long long roadGraphVersion = nextGraphVersion++;
+    std::vector<RoadCostChange> roadCostLog;
+    unsigned long long roadEdits = 0;
+    std::unordered_map<std::string, int> profileIndex;   // interned profiles by their cost bytes
+
+    ~RoadState() { delete[] placeBuckets; }
+};
+
+static RoadState &Roads()
+{
+    return EnginePart<RoadState>();
+}
+
+// ---------------- PLACE NAME INDEX ----------------
+static unsigned HashPlaceName(const char *name)
+{
+    unsigned h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+        h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+void ClearPlaceIndex()
+{
+    RoadState &rs = Roads();
+    delete[] rs.placeBuckets;
+    rs.placeBuckets = nullptr;
+    rs.placeBucketCount = 0;
+    rs.placeIndexed = 0;
+    rs.placeTail = nullptr;
+    RoadGraphChanged();
+}
+
+unsigned long long RoadGraphVersion()
 {
-    Place *current = placeHead;
-    Place *prev = nullptr;
+    return Roads().roadGraphVersion;
+}
 
-    while (current != nullptr && strcmp(current->name, name) != 0)
+void RoadGraphChanged()
+{
+    RoadState &rs = Roads();
+    rs.roadGraphVersion = nextGraphVersion++;
+    rs.roadEdits++;
+    rs.roadCostLog.clear();
+}
+
+unsigned long long RoadEditCount()
+{
+    return Roads().roadEdits;
+}
+
+static void GrowPlaceIndex()
+{
+    RoadState &rs = Roads();
+    int newCount = rs.placeBucketCount ? rs.placeBucketCount * 2 : 64;
+    Place **nb = new Place *[newCount]();
+    for (int i = 0; i < rs.placeBucketCount; i++)
     {
-        prev = current;
-        current = current->next;
+        Place *p = rs.placeBuckets[i];
+        while (p)
+        {
+            Place *nxt = p->hashNext;
+            unsigned b = HashPlaceName(p->name) & (newCount - 1);
+            p->hashNext = nb[b];
+            nb[b] = p;
+            p = nxt;
+        }
     }
+    delete[] rs.placeBuckets;
+    rs.placeBuckets = nb;
+    rs.placeBucketCount = newCount;
+}
 
-    if (current != nullptr)
-        return current;
+static void IndexPlace(Place *p)
+{
+    RoadState &rs = Roads();
+    if (rs.placeIndexed + 1 > rs.placeBucketCount)
+        GrowPlaceIndex();
+    unsigned b = HashPlaceName(p->name) & (rs.placeBucketCount - 1);
+    p->hashNext = rs.placeBuckets[b];
+    rs.placeBuckets[b] = p;
+    p->id = rs.placeIndexed++;
+}
+
+// The list head can be reset by callers (ResetInMemoryState); rebuild
+// the index from the list whenever it no longer matches.
+static void SyncPlaceIndex()
+{
+    Engine &eng = CurrentEngine();
+    RoadState &rs = EnginePart<RoadState>(eng);
+    if (rs.placeTail && eng.placeHead)
+        return;
+    ClearPlaceIndex();
+    for (Place *p = eng.placeHead; p; p = p->next)
+    {
+        IndexPlace(p);
+        rs.placeTail = p;
+    }
+}
+
+Place *FindPlace(const char *name)
+{
+    RoadState &rs = Roads();
+    SyncPlaceIndex();
+    METRIC_INC(MC_PLACE_LOOKUPS);
+    if (!rs.placeBucketCount)
+        return nullptr;
+    Place *p = rs.placeBuckets[HashPlaceName(name) & (rs.placeBucketCount - 1)];
+    int steps = 0;
+    while (p && (steps++, strcmp(p->name, name) != 0))
+        p = p->hashNext;
+    METRIC_ADD(MC_PLACE_CHAIN_STEPS, steps);
+    return p;
+}
 
-    Place *newPlace = new Place;
-    newPlace->name = new char[strlen(name) + 1];
-    strcpy(newPlace->name, name);
+int PlaceCount()
+{
+    RoadState &rs = Roads();
+    SyncPlaceIndex();
+    return rs.placeIndexed;
+}
+
+Place *AppendPlace(const char *name)
+{
+    Engine &eng = CurrentEngine();
+    RoadState &rs = EnginePart<RoadState>(eng);
+    SyncPlaceIndex();
+
+    Place *newPlace = eng.placePool.Alloc();
+    METRIC_INC(MC_ALLOC_PLACE);
+    newPlace->name = eng.placeNames.Copy(name);
     newPlace->firstLink = nullptr;
     newPlace->next = nullptr;
 
-    if (prev == nullptr)
-        placeHead = newPlace;
+    if (rs.placeTail == nullptr)
+        eng.placeHead = newPlace;
     else
-        prev->next = newPlace;
+        rs.placeTail->next = newPlace;
+    rs.placeTail = newPlace;
 
+    IndexPlace(newPlace);
     return newPlace;
 }
 
-void AddRoad(const char *from, const char *to, int cost)
+Place *GetOrCreatePlace(const char *name)
+{
+    Place *current = FindPlace(name);
+    if (current != nullptr)
+        return current;
+
+    return AppendPlace(name);
+}
+
+RoadLink *AddRoad(const char *from, const char *to, int cost)
 {
     Place *fromPlace = GetOrCreatePlace(from);
     Place *toPlace = GetOrCreatePlace(to);
 
-    RoadLink *newRoad = new RoadLink;
+    RoadLink *newRoad = CurrentEngine().roadLinkPool.Alloc();
+    METRIC_INC(MC_ALLOC_ROAD_LINK);
+    METRIC_INC(MC_ROADS_ADDED);
     newRoad->cost = cost;
     newRoad->to = toPlace;
     newRoad->next = nullptr;
+    newRoad->profile = -1;
 
     fromPlace->firstLink =
         appendNodetoRoadList(fromPlace->firstLink, newRoad);
+    RoadGraphChanged();
+
+    JournalRoadAdd(from, to, cost);
+    SegmentMarkDirty(SEG_ROADS, 0);
+    return newRoad;
+}
+
+// ---------------- TIME-DEPENDENT COSTS ----------------
+bool ValidRoadProfile(const int *costs)
+{
+    for (int i = 0; i < ROAD_PROFILE_POINTS; i++)
+        if (costs[i] < 0 || costs[i] - costs[(i + 1) % ROAD_PROFILE_POINTS] > ROAD_PROFILE_STEP)
+            return false;
+    return true;
+}
+
+int InternRoadProfile(const int *costs)
+{
+    if (!ValidRoadProfile(costs))
+        return -1;
+
+    RoadState &rs = Roads();
+    std::string key((const char *)costs, ROAD_PROFILE_POINTS * sizeof(int));
+    auto it = rs.profileIndex.find(key);
+    if (it != rs.profileIndex.end())
+        return it->second;
+    int id = RoadProfileCount();
+    std::vector<int> &profiles = CurrentEngine().roadProfiles;
+    profiles.insert(profiles.end(), costs, costs + ROAD_PROFILE_POINTS);
+    rs.profileIndex.emplace(key, id);
+    return id;
+}
+
+bool SetLinkProfile(RoadLink *link, const int *costs)
+{
+    int profile = costs ? InternRoadProfile(costs) : -1;
+    if (costs && profile < 0)
+        return false;
+    if (link->profile == profile)
+        return true;
+    link->profile = profile;
+    RoadGraphChanged();
+    SegmentMarkDirty(SEG_ROADS, 0);
+    return true;
+}
+
+bool SetRoadProfile(const char *from, const char *to, const int *costs)
+{
+    Place *a = FindPlace(from);
+    Place *b = FindPlace(to);
+    if (!a || !b)
+        return false;
+    bool found = false;
+    for (RoadLink *e = a->firstLink; e; e = e->next)
+    {
+        if (e->to != b)
+            continue;
+        if (!SetLinkProfile(e, costs))
+            return false;
+        found = true;
+    }
+    if (found)
+        JournalRoadProfile(from, to, costs);
+    return found;
+}
+
+int RoadProfileCount()
+{
+    return (int)(CurrentEngine().roadProfiles.size() / ROAD_PROFILE_POINTS);
+}
+
+const int *RoadProfileCosts(int profile)
+{
+    return CurrentEngine().roadProfiles.data() + (size_t)profile * ROAD_PROFILE_POINTS;
+}
+
+void ClearRoadProfiles()
+{
+    CurrentEngine().roadProfiles.clear();
+    Roads().profileIndex.clear();
+}
+
+// ---------------- LIVE COST UPDATES ----------------
+bool UpdateRoadCost(const char *from, const char *to, int cost)
+{
+    if (cost < 0)
+        return false;
+    Place *a = FindPlace(from);
+    Place *b = FindPlace(to);
+    if (!a || !b)
+        return false;
+
+    RoadState &rs = Roads();
+    bool found = false;
+    for (RoadLink *e = a->firstLink; e; e = e->next)
+    {
+        // RoadCostAt never reads `cost` of a profiled road.
+        if (e->to != b || e->profile >= 0)
+            continue;
+        found = true;
+        if (e->cost == cost)
+            continue;
+        rs.roadCostLog.push_back(RoadCostChange{a, b, e->cost, cost});
+        e->cost = cost;
+    }
+    if (!found)
+        return false;
+
+    rs.roadEdits++;
+    METRIC_INC(MC_ROAD_COST_UPDATES);
+    JournalRoadCost(from, to, cost);
+    SegmentMarkDirty(SEG_ROADS, 0);
+    if (rs.roadCostLog.size() > ROAD_COST_LOG_MAX)
+        RoadGraphChanged();
+    return true;
+}
+
+int UpdateRoadCosts(const RoadCostUpdate *updates, int n)
+{
+    int applied = 0;
+    for (int i = 0; i < n; i++)
+        if (UpdateRoadCost(updates[i].from, updates[i].to, updates[i].cost))
+            applied++;
+    return applied;
+}
+
+const std::vector<RoadCostChange> &RoadCostChanges()
+{
+    return Roads().roadCostLog;
+}
+
+void ClearRoadCostChanges()
+{
+    Roads().roadCostLog.clear();
+}
+
+// ---------------- WHOLE-PLACE REPLACEMENT ----------------
+bool ReplaceRoadsFrom(const char *from, const RoadSpec *roads, int n)
+{
+    // Check everything before the old roads go, as SetRoadProfile does.
+    for (int i = 0; i < n; i++)
+        if (roads[i].profile && !ValidRoadProfile(roads[i].profile))
+            return false;
+
+    Place *p = GetOrCreatePlace(from);
+    for (RoadLink *e = p->firstLink; e;)
+    {
+        RoadLink *next = e->next;
+        CurrentEngine().roadLinkPool.Free(e);
+        e = next;
+    }
+    p->firstLink = nullptr;
+
+    RoadLink *last = nullptr;
+    for (int i = 0; i < n; i++)
+    {
+        RoadLink *link = CurrentEngine().roadLinkPool.Alloc();
+        METRIC_INC(MC_ALLOC_ROAD_LINK);
+        link->to = GetOrCreatePlace(roads[i].to);
+        link->cost = roads[i].cost;
+        link->profile = roads[i].profile ? InternRoadProfile(roads[i].profile) : -1;
+        link->next = nullptr;
+        if (last) last->next = link; else p->firstLink = link;
+        last = link;
+    }
+    RoadGraphChanged();
+
+    JournalRoadsReplace(from, roads, n);
+    SegmentMarkDirty(SEG_ROADS, 0);
+    return true;
 }
 
 void printGraph()
 {
-    Place *p = placeHead;
+    Place *p = CurrentEngine().placeHead;
 
     while (p != nullptr)
     {
@@ -69,7 +390,15 @@ void printGraph()
         while (link != nullptr)
         {
             cout << "  -> " << link->to->name
-                 << " (cost: " << link->cost << ")" << endl;
+                 << " (cost: " << link->cost;
+            if (link->profile >= 0)
+            {
+                cout << ", by hour:";
+                const int *costs = RoadProfileCosts(link->profile);
+                for (int h = 0; h < ROAD_PROFILE_POINTS; h++)
+                    cout << ' ' << costs[h];
+            }
+            cout << ")" << endl;
             link = link->next;
         }
 
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <sstream>
 #include <cstring>
+#include <vector>
 
 using namespace std;
 
@@ -16,6 +17,7 @@ struct RoadLink
     Place *to;
     int cost;
     RoadLink *next;
+    int profile;       // time-dependent cost (RoadProfileCosts), -1: always `cost`
 };
 
 struct Place
@@ -23,15 +25,112 @@ struct Place
     char *name;
     RoadLink *firstLink;
     Place *next;
+    Place *hashNext;   // chain in the place name index
+    int id;            // dense, in list order (0 .. PlaceCount()-1)
 };
 
-// global head
-extern Place *placeHead;
+// The place list starts at Engine::placeHead (engine.h).
 
 // function declarations
 RoadLink* appendNodetoRoadList(RoadLink* head, RoadLink* new_node);
 Place* GetOrCreatePlace(const char *name);
-void AddRoad(const char *from, const char *to, int cost);
+Place* FindPlace(const char *name);
+Place* AppendPlace(const char *name);   // caller knows the name is new
+void ClearPlaceIndex();
+int PlaceCount();
+
+// Bumped whenever roads are added or the place list is rebuilt; anything
+// derived from routes (offer_routes.h) is stale once it changes.
+unsigned long long RoadGraphVersion();
+void RoadGraphChanged();              // for loaders that link roads directly
+unsigned long long RoadEditCount();   // graph changes plus cost updates
+
+RoadLink* AddRoad(const char *from, const char *to, int cost);
+
+// ---------------- TIME-DEPENDENT COSTS ----------------
+// A profile gives a road's cost at the start of every hour of the day;
+// in between the cost is interpolated linearly, and times wrap around
+// the day (minutes, like departTime). Profiles are interned: roads with
+// the same costs share one row of Engine::roadProfiles.
+//
+// A profile may not drop by more than ROAD_PROFILE_STEP from one hour to
+// the next, so leaving later never means arriving earlier (FIFO) and the
+// time-dependent Dijkstra (ComputeShortestPathAt) stays exact.
+#define ROAD_PROFILE_POINTS 24
+#define ROAD_PROFILE_STEP 60           // minutes between points
+#define ROAD_DAY_MINUTES (ROAD_PROFILE_POINTS * ROAD_PROFILE_STEP)
+
+bool ValidRoadProfile(const int *costs);           // not negative and FIFO; any thread
+int InternRoadProfile(const int *costs);           // -1: not valid
+bool SetLinkProfile(RoadLink *link, const int *costs);   // costs == nullptr clears
+// Every from -> to road; false if there is none or the profile is invalid.
+bool SetRoadProfile(const char *from, const char *to, const int *costs);
+int RoadProfileCount();
+const int *RoadProfileCosts(int profile);          // ROAD_PROFILE_POINTS costs
+void ClearRoadProfiles();
+
+// Cost at time t on a row of ROAD_PROFILE_POINTS costs.
+inline int ProfileCostAt(const int *c, int t)
+{
+    int m = t % ROAD_DAY_MINUTES;
+    if (m < 0) m += ROAD_DAY_MINUTES;
+    int h = m / ROAD_PROFILE_STEP;
+    int c0 = c[h], c1 = c[(h + 1) % ROAD_PROFILE_POINTS];
+    return c0 + (c1 - c0) * (m % ROAD_PROFILE_STEP) / ROAD_PROFILE_STEP;
+}
+
+inline int RoadCostAt(const RoadLink *e, int t)
+{
+    return e->profile < 0 ? e->cost : ProfileCostAt(RoadProfileCosts(e->profile), t);
+}
+
+// ---------------- LIVE COST UPDATES ----------------
+// Traffic updates change the cost of existing roads in place. They do not
+// bump RoadGraphVersion() (that drops every cached route); each change is
+// logged instead so caches repair only what depends on the road
+// (offer_routes.cpp). RoadGraphChanged() clears the log, as does a log
+// that grows past ROAD_COST_LOG_MAX (it then counts as a graph change).
+// Profiled roads follow their profile and are left alone: set a new
+// profile (SetRoadProfile) to change them.
+#define ROAD_COST_LOG_MAX 65536
+
+struct RoadCostUpdate
+{
+    const char *from;
+    const char *to;
+    int cost;
+};
+
+struct RoadCostChange
+{
+    Place *from;
+    Place *to;
+    int oldCost;
+    int newCost;
+};
+
+// Every unprofiled from -> to road; false if there is none or cost is
+// negative.
+bool UpdateRoadCost(const char *from, const char *to, int cost);
+// Applies a batch, returns how many updates found their road.
+int UpdateRoadCosts(const RoadCostUpdate *updates, int n);
+const std::vector<RoadCostChange> &RoadCostChanges();
+void ClearRoadCostChanges();
+
+// ---------------- WHOLE-PLACE REPLACEMENT ----------------
+// Used to adopt a new map (road_graph.h): swaps every road leaving `from`
+// for the given ones in one journaled step. Places are never removed,
+// offers and requests keep pointing at them. False, with nothing changed
+// or journaled, if any profile is not valid.
+struct RoadSpec
+{
+    const char *to;
+    int cost;
+    const int *profile;  // ROAD_PROFILE_POINTS costs or nullptr
+};
+
+bool ReplaceRoadsFrom(const char *from, const RoadSpec *roads, int n);
+
 void printGraph();
 
 #endif
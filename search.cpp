@@ -0,0 +1,649 @@
+#include "search.h"
+#include "road_graph.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+// -------------------------
+// Scratch
+// -------------------------
+void SearchScratch::Begin(int places)
+{
+    if ((int)stamp.size() < places)
+    {
+        dist.resize(places);
+        parent.resize(places);
+        stamp.resize(places, generation);
+    }
+    if (++generation == 0)
+    {
+        // Wrapped: old stamps could look current again.
+        fill(stamp.begin(), stamp.end(), 0u);
+        generation = 1;
+    }
+    heapSize = 0;
+}
+
+SearchScratch& ThreadSearchScratch()
+{
+    static thread_local SearchScratch scratch;
+    return scratch;
+}
+
+// The searches route on the engine's published copy of its live lists
+// (road_graph.h), republished first if the roads changed. Members are
+// initialized in order, so the copy is current before `read` pins it.
+struct RoutingGraph
+{
+    bool republished;
+    RoadGraphRead read;
+    const RoadGraph& g;
+
+    RoutingGraph() : republished(PublishRoadGraph()), read(), g(*read.live) {}
+};
+
+static inline void Relax(SearchScratch& s, Place* v, int nd, Place* from)
+{
+    s.stamp[v->id] = s.generation;
+    s.dist[v->id] = nd;
+    s.parent[v->id] = from;
+}
+
+// ---------- Min priority queue (binary heap in the scratch) ----------
+static void HeapPush(SearchScratch& s, Place* place, int dist)
+{
+    int i = s.heapSize++;
+    if ((int)s.heapPlace.size() < s.heapSize)
+    {
+        s.heapPlace.resize(s.heapSize);
+        s.heapDist.resize(s.heapSize);
+    }
+    vector<Place*>& p = s.heapPlace;
+    vector<int>& d = s.heapDist;
+    p[i] = place;
+    d[i] = dist;
+    while (i > 0 && d[(i - 1) / 2] > d[i])
+    {
+        swap(d[i], d[(i - 1) / 2]);
+        swap(p[i], p[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+static void HeapPop(SearchScratch& s, Place*& place, int& dist)
+{
+    vector<Place*>& p = s.heapPlace;
+    vector<int>& d = s.heapDist;
+    int& size = s.heapSize;
+    place = p[0];
+    dist = d[0];
+    p[0] = p[--size];
+    d[0] = d[size];
+    int i = 0;
+    while (true)
+    {
+        int l = 2 * i + 1, r = 2 * i + 2, m = i;
+        if (l < size && d[l] < d[m])
+            m = l;
+        if (r < size && d[r] < d[m])
+            m = r;
+        if (m == i)
+            break;
+        swap(d[i], d[m]);
+        swap(p[i], p[m]);
+        i = m;
+    }
+}
+
+// -------------------------
+// Bounded search
+// -------------------------
+// Places at equal cost are reported in id order, which the parallel search
+// can reproduce; the heap's own order among them depends on its shape.
+static bool CostThenId(const ReachablePlace& a, const ReachablePlace& b)
+{
+    return a.cost != b.cost ? a.cost < b.cost : a.place->id < b.place->id;
+}
+
+static void SortTies(vector<ReachablePlace>& out, size_t first)
+{
+    for (size_t i = first; i < out.size(); )
+    {
+        size_t j = i + 1;
+        while (j < out.size() && out[j].cost == out[i].cost)
+            j++;
+        if (j - i > 1)
+            sort(out.begin() + i, out.begin() + j, CostThenId);
+        i = j;
+    }
+}
+
+static int BoundedSearchFrom(SearchScratch& s, const RoadGraph& g, Place* start, int costBound,
+                             vector<ReachablePlace>& out)
+{
+    size_t first = out.size();
+    long long pops = 0, relaxed = 0;
+
+    Relax(s, start, 0, nullptr);
+    HeapPush(s, start, 0);
+
+    while (s.heapSize > 0)
+    {
+        Place* u;
+        int d_u;
+        HeapPop(s, u, d_u);
+        pops++;
+
+        if (d_u > costBound)
+            break;
+        if (d_u > s.dist[u->id])
+            continue;   // stale entry, u was settled at a lower cost
+
+        out.push_back(ReachablePlace{u, d_u});
+
+        for (int k = g.begin[u->id]; k < g.begin[u->id + 1]; k++)
+        {
+            Place* v = g.places[g.to[k]];
+            int newDist = d_u + g.cost[k];
+            relaxed++;
+            if (newDist <= costBound && newDist < s.DistOf(v->id))
+            {
+                Relax(s, v, newDist, u);
+                HeapPush(s, v, newDist);
+            }
+        }
+    }
+    SortTies(out, first);
+    METRIC_INC(MC_REACHABLE_CALLS);
+    METRIC_ADD(MC_DIJKSTRA_NODES, pops);
+    METRIC_ADD(MC_DIJKSTRA_EDGES, relaxed);
+    return (int)(out.size() - first);
+}
+
+int BoundedSearch(SearchScratch& s, Place* start, int costBound, vector<ReachablePlace>& out)
+{
+    out.clear();
+    if (!start)
+        return 0;
+    RoutingGraph r;
+    s.Begin(r.g.Places());
+    return BoundedSearchFrom(s, r.g, start, costBound, out);
+}
+
+int BoundedSearchBatch(SearchScratch& s, Place* const* starts, int n, int costBound,
+                       vector<ReachablePlace>& out, vector<int>& begin)
+{
+    out.clear();
+    begin.resize(n + 1);
+    RoutingGraph r;
+    for (int i = 0; i < n; i++)
+    {
+        begin[i] = (int)out.size();
+        if (!starts[i])
+            continue;
+        s.Begin(r.g.Places());
+        BoundedSearchFrom(s, r.g, starts[i], costBound, out);
+    }
+    begin[n] = (int)out.size();
+    return (int)out.size();
+}
+
+// -------------------------
+// Reverse bounded search
+// -------------------------
+// Incoming roads per place id (CSR), one per engine, rebuilt when
+// RoadGraphVersion() changes. Roads are kept as indices into the routing
+// copy, whose layout cost updates leave alone, so they need no rebuild.
+struct ReverseGraph
+{
+    unsigned long long version = 0;
+    vector<int> begin;          // PlaceCount() + 1
+    vector<int> from;           // place index
+    vector<int> road;           // road index in the routing copy
+};
+
+static ReverseGraph& SyncReverseGraph(const RoadGraph& routing)
+{
+    ReverseGraph& g = EnginePart<ReverseGraph>();
+    int places = routing.Places();
+    if (g.version == RoadGraphVersion() && (int)g.begin.size() == places + 1)
+        return g;
+
+    g.begin.assign(places + 1, 0);
+    for (int v : routing.to)
+        g.begin[v + 1]++;
+    for (int i = 0; i < places; i++)
+        g.begin[i + 1] += g.begin[i];
+    g.from.resize(g.begin[places]);
+    g.road.resize(g.begin[places]);
+    vector<int> fill(g.begin.begin(), g.begin.end() - 1);
+    for (int u = 0; u < places; u++)
+        for (int e = routing.begin[u]; e < routing.begin[u + 1]; e++)
+        {
+            int k = fill[routing.to[e]]++;
+            g.from[k] = u;
+            g.road[k] = e;
+        }
+    g.version = RoadGraphVersion();
+    return g;
+}
+
+int BoundedSearchToward(SearchScratch& s, Place* target, int costBound, vector<ReachablePlace>& out)
+{
+    out.clear();
+    if (!target)
+        return 0;
+    RoutingGraph r;
+    ReverseGraph& g = SyncReverseGraph(r.g);
+    s.Begin(r.g.Places());
+    long long pops = 0, relaxed = 0;
+
+    Relax(s, target, 0, nullptr);
+    HeapPush(s, target, 0);
+
+    while (s.heapSize > 0)
+    {
+        Place* v;
+        int d_v;
+        HeapPop(s, v, d_v);
+        pops++;
+
+        if (d_v > costBound)
+            break;
+        if (d_v > s.dist[v->id])
+            continue;
+
+        out.push_back(ReachablePlace{v, d_v});
+
+        for (int k = g.begin[v->id]; k < g.begin[v->id + 1]; k++)
+        {
+            Place* u = r.g.places[g.from[k]];
+            int newDist = d_v + r.g.cost[g.road[k]];
+            relaxed++;
+            if (newDist <= costBound && newDist < s.DistOf(u->id))
+            {
+                Relax(s, u, newDist, v);
+                HeapPush(s, u, newDist);
+            }
+        }
+    }
+    METRIC_INC(MC_REACHABLE_CALLS);
+    METRIC_ADD(MC_DIJKSTRA_NODES, pops);
+    METRIC_ADD(MC_DIJKSTRA_EDGES, relaxed);
+    return (int)out.size();
+}
+
+// -------------------------
+// Point to point
+// -------------------------
+// timed: labels are arrival times from departTime and every road costs
+// RoadCostAt(label); the profiles are FIFO, so settling in label order
+// stays exact. Otherwise labels are static path costs from 0. arrivals
+// (optional) gets the label of every place on the path.
+static bool ShortestPathOver(SearchScratch& s, const RoadGraph& g, Place* start, Place* end,
+                             bool timed, int departTime,
+                             Place* path[], int& pathLen, int* arrivals)
+{
+    long long pops = 0, relaxed = 0;
+    s.Begin(g.Places());
+    int d0 = timed ? departTime : 0;
+    Relax(s, start, d0, nullptr);
+    HeapPush(s, start, d0);
+
+    while (s.heapSize > 0)
+    {
+        Place* u;
+        int d;
+        HeapPop(s, u, d);
+        pops++;
+
+        if (u == end)
+            break;
+
+        for (int k = g.begin[u->id]; k < g.begin[u->id + 1]; k++)
+        {
+            Place* v = g.places[g.to[k]];
+            int nd = d + (timed ? g.CostAt(k, d) : g.cost[k]);
+            relaxed++;
+            if (nd < s.DistOf(v->id))
+            {
+                Relax(s, v, nd, u);
+                HeapPush(s, v, nd);
+            }
+        }
+    }
+    METRIC_ADD(MC_DIJKSTRA_NODES, pops);
+    METRIC_ADD(MC_DIJKSTRA_EDGES, relaxed);
+
+    if (!s.Seen(end->id))
+        return false;
+
+    // reconstruct path (reverse)
+    pathLen = 0;
+    for (Place* cur = end; cur; cur = s.parent[cur->id])
+        path[pathLen++] = cur;
+    for (int i = 0; i < pathLen / 2; i++)
+        swap(path[i], path[pathLen - 1 - i]);
+    for (int i = 0; arrivals && i < pathLen; i++)
+        arrivals[i] = s.dist[path[i]->id];
+    return true;
+}
+
+bool ShortestPathSearch(SearchScratch& s, Place* start, Place* end, Place* path[], int& pathLen)
+{
+    RoutingGraph r;
+    return ShortestPathOver(s, r.g, start, end, false, 0, path, pathLen, nullptr);
+}
+
+bool ShortestPathSearchAt(SearchScratch& s, Place* start, Place* end, int departTime,
+                          Place* path[], int& pathLen, int* arrivals)
+{
+    RoutingGraph r;
+    return ShortestPathOver(s, r.g, start, end, true, departTime, path, pathLen, arrivals);
+}
+
+// -------------------------
+// Batch routes
+// -------------------------
+#define ROUTE_BATCH_CHUNK 8          // queries claimed at a time
+
+// One per engine.
+struct RouteBatchState
+{
+    mutex lock;                         // one batch at a time
+    vector<vector<Place*>> found;       // per worker, paths back to back
+    vector<vector<int>> foundArrive;    // per worker, labels along them
+    vector<int> owner, offset, length;  // per query
+};
+
+void ComputeRoutes(Place* const* starts, Place* const* ends, int n, RouteBatch& out,
+                   int threads, const int* departs)
+{
+    TRACE_SPAN("route_batch");
+    TRACE_ARG("routes", n);
+    out.places.clear();
+    out.arrive.clear();
+    out.begin.assign(n + 1, 0);
+    if (n <= 0)
+        return;
+
+    ThreadPool& pool = SharedThreadPool();
+    if (threads <= 0)
+        threads = pool.MaxWorkers();
+    threads = max(1, min(threads, min(pool.MaxWorkers(), (n + ROUTE_BATCH_CHUNK - 1) / ROUTE_BATCH_CHUNK)));
+
+    // Workers only read the copy pinned here.
+    RoutingGraph r;
+    int places = r.g.Places();
+    RouteBatchState& st = EnginePart<RouteBatchState>();
+    lock_guard<mutex> g(st.lock);
+    vector<vector<Place*>>& found = st.found;
+    vector<vector<int>>& foundArrive = st.foundArrive;
+    vector<int>& owner = st.owner;
+    vector<int>& offset = st.offset;
+    vector<int>& length = st.length;
+    if ((int)found.size() < threads)
+    {
+        found.resize(threads);
+        foundArrive.resize(threads);
+    }
+    owner.resize(n);
+    offset.resize(n);
+    length.resize(n);
+
+    atomic<int> next{0};
+    pool.Run(threads, [&](int w)
+    {
+        TRACE_SPAN("route_batch_worker");
+        SearchScratch& scratch = ThreadSearchScratch();
+        static thread_local vector<Place*> path;
+        static thread_local vector<int> arrive;
+        if ((int)path.size() < places)
+        {
+            path.resize(places);
+            arrive.resize(places);
+        }
+        vector<Place*>& mine = found[w];
+        vector<int>& mineArrive = foundArrive[w];
+        mine.clear();
+        mineArrive.clear();
+        long long computed = 0;
+        while (true)
+        {
+            int b = next.fetch_add(ROUTE_BATCH_CHUNK, memory_order_relaxed);
+            if (b >= n)
+                break;
+            for (int i = b; i < min(n, b + ROUTE_BATCH_CHUNK); i++)
+            {
+                int len = 0;
+                owner[i] = w;
+                offset[i] = (int)mine.size();
+                if (starts[i] && ends[i] &&
+                    ShortestPathOver(scratch, r.g, starts[i], ends[i], departs != nullptr,
+                                     departs ? departs[i] : 0, path.data(), len, arrive.data()))
+                {
+                    mine.insert(mine.end(), path.begin(), path.begin() + len);
+                    mineArrive.insert(mineArrive.end(), arrive.begin(), arrive.begin() + len);
+                }
+                else
+                    len = 0;
+                length[i] = len;
+                computed++;
+            }
+        }
+        METRIC_ADD(MC_SHORTEST_PATH_CALLS, computed);
+    });
+
+    for (int i = 0; i < n; i++)
+        out.begin[i + 1] = out.begin[i] + length[i];
+    out.places.resize(out.begin[n]);
+    out.arrive.resize(out.begin[n]);
+    for (int i = 0; i < n; i++)
+    {
+        copy(found[owner[i]].begin() + offset[i], found[owner[i]].begin() + offset[i] + length[i],
+             out.places.begin() + out.begin[i]);
+        copy(foundArrive[owner[i]].begin() + offset[i],
+             foundArrive[owner[i]].begin() + offset[i] + length[i],
+             out.arrive.begin() + out.begin[i]);
+    }
+}
+
+// -------------------------
+// Parallel delta-stepping
+// -------------------------
+// Buckets hold places by dist / delta. Bucket i is emptied in phases that
+// relax the light edges (cost <= delta) of its places in parallel; places
+// improved back into bucket i are expanded again. Once it stays empty, the
+// heavy edges of every place settled in it are relaxed, which only feeds
+// later buckets. Distances are lowered with a CAS, so the result does not
+// depend on the interleaving.
+#define DELTA_PARALLEL_MIN 256      // smaller frontiers are relaxed inline
+#define DELTA_CHUNK 64              // frontier entries claimed at a time
+
+// One per engine.
+struct DeltaState
+{
+    mutex lock;                     // one parallel search at a time
+    unique_ptr<atomic<int>[]> dist;
+    vector<int> expanded;           // dist at the last light expansion, INT_MAX if none
+    vector<int> settledIn;          // bucket whose heavy pass includes the place, -1 if none
+    int capacity = 0;
+
+    vector<vector<Place*>> buckets;
+    vector<Place*> frontier, settled, touched;
+    vector<vector<Place*>> improved, newlyTouched;   // per worker
+
+    unsigned long long deltaVersion = 0;
+    int autoDelta = 1;
+};
+
+static void EnsureDeltaCapacity(DeltaState& st, int places)
+{
+    if (places <= st.capacity)
+        return;
+    unique_ptr<atomic<int>[]> dist(new atomic<int>[places]);
+    for (int i = 0; i < places; i++)
+        dist[i].store(INT_MAX, memory_order_relaxed);
+    st.dist = move(dist);
+    st.expanded.assign(places, INT_MAX);
+    st.settledIn.assign(places, -1);
+    st.capacity = places;
+}
+
+static int AutoDelta(DeltaState& st, const RoadGraph& g)
+{
+    if (st.deltaVersion != RoadGraphVersion())
+    {
+        long long sum = 0, roads = (long long)g.cost.size();
+        for (int c : g.cost)
+            sum += c;
+        st.autoDelta = roads ? max(1, (int)(sum / roads)) : 1;
+        st.deltaVersion = RoadGraphVersion();
+    }
+    return st.autoDelta;
+}
+
+static void RelaxEdges(DeltaState& st, const RoadGraph& g, const vector<Place*>& list, bool light,
+                       int delta, int costBound, int threads)
+{
+    atomic<size_t> next{0};
+    auto work = [&](int w)
+    {
+        vector<Place*>& improved = st.improved[w];
+        vector<Place*>& newlyTouched = st.newlyTouched[w];
+        long long relaxed = 0;
+        while (true)
+        {
+            size_t b = next.fetch_add(DELTA_CHUNK, memory_order_relaxed);
+            if (b >= list.size())
+                break;
+            size_t e = min(list.size(), b + DELTA_CHUNK);
+            for (size_t k = b; k < e; k++)
+            {
+                Place* u = list[k];
+                int d = st.dist[u->id].load(memory_order_relaxed);
+                for (int e = g.begin[u->id]; e < g.begin[u->id + 1]; e++)
+                {
+                    if ((g.cost[e] <= delta) != light)
+                        continue;
+                    relaxed++;
+                    int nd = d + g.cost[e];
+                    if (nd > costBound)
+                        continue;
+                    atomic<int>& dv = st.dist[g.to[e]];
+                    int cur = dv.load(memory_order_relaxed);
+                    while (nd < cur)
+                    {
+                        if (dv.compare_exchange_weak(cur, nd, memory_order_relaxed))
+                        {
+                            improved.push_back(g.places[g.to[e]]);
+                            if (cur == INT_MAX)
+                                newlyTouched.push_back(g.places[g.to[e]]);
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        METRIC_ADD(MC_DIJKSTRA_EDGES, relaxed);
+    };
+
+    if (threads <= 1 || (int)list.size() < DELTA_PARALLEL_MIN)
+        work(0);
+    else
+        SharedThreadPool().Run(threads, work);
+
+    // Bucket the improved places (duplicates are skipped when expanded).
+    for (size_t w = 0; w < st.improved.size(); w++)
+    {
+        for (Place* v : st.improved[w])
+        {
+            size_t b = (size_t)(st.dist[v->id].load(memory_order_relaxed) / delta);
+            if (b >= st.buckets.size())
+                st.buckets.resize(b + 1);
+            st.buckets[b].push_back(v);
+        }
+        st.improved[w].clear();
+        st.touched.insert(st.touched.end(), st.newlyTouched[w].begin(), st.newlyTouched[w].end());
+        st.newlyTouched[w].clear();
+    }
+}
+
+int ParallelBoundedSearch(Place* start, int costBound, vector<ReachablePlace>& out,
+                          int threads, int delta)
+{
+    out.clear();
+    if (!start || costBound < 0)
+        return 0;
+    threads = max(1, min(threads, SharedThreadPool().MaxWorkers()));
+    if (threads == 1)
+        return BoundedSearch(ThreadSearchScratch(), start, costBound, out);
+    TRACE_SPAN("reachable_delta");
+    METRIC_INC(MC_REACHABLE_CALLS);
+
+    RoutingGraph r;
+    DeltaState& st = EnginePart<DeltaState>();
+    lock_guard<mutex> g(st.lock);
+    if (delta <= 0)
+        delta = AutoDelta(st, r.g);
+    EnsureDeltaCapacity(st, r.g.Places());
+    if ((int)st.improved.size() < threads)
+    {
+        st.improved.resize(threads);
+        st.newlyTouched.resize(threads);
+    }
+
+    st.dist[start->id].store(0, memory_order_relaxed);
+    st.touched.push_back(start);
+    st.buckets.resize(1);
+    st.buckets[0].push_back(start);
+
+    long long expandedCount = 0;
+    for (size_t i = 0; i < st.buckets.size(); i++)
+    {
+        st.settled.clear();
+        while (!st.buckets[i].empty())
+        {
+            st.frontier.clear();
+            for (Place* u : st.buckets[i])
+            {
+                int d = st.dist[u->id].load(memory_order_relaxed);
+                if ((size_t)(d / delta) != i || st.expanded[u->id] == d)
+                    continue;   // stale entry or already expanded at this distance
+                st.expanded[u->id] = d;
+                st.frontier.push_back(u);
+                if (st.settledIn[u->id] != (int)i)
+                {
+                    st.settledIn[u->id] = (int)i;
+                    st.settled.push_back(u);
+                }
+            }
+            st.buckets[i].clear();
+            expandedCount += st.frontier.size();
+            RelaxEdges(st, r.g, st.frontier, true, delta, costBound, threads);
+        }
+        RelaxEdges(st, r.g, st.settled, false, delta, costBound, threads);
+    }
+    METRIC_ADD(MC_DIJKSTRA_NODES, expandedCount);
+
+    out.reserve(st.touched.size());
+    for (Place* p : st.touched)
+    {
+        out.push_back(ReachablePlace{p, st.dist[p->id].load(memory_order_relaxed)});
+        st.dist[p->id].store(INT_MAX, memory_order_relaxed);
+        st.expanded[p->id] = INT_MAX;
+        st.settledIn[p->id] = -1;
+    }
+    st.touched.clear();
+    st.buckets.clear();
+    sort(out.begin(), out.end(), CostThenId);
+    return (int)out.size();
+}
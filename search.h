@@ -0,0 +1,97 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+// Dijkstra over the road graph with reusable scratch space.
+//
+// Every search routes on the engine's published copy of its road lists
+// (road_graph.h), republishing it first if roads changed since; call them
+// from the engine thread.
+//
+// Per-place state (distance, parent) lives in arrays indexed by Place::id
+// and stamped with a generation number, so starting a search is O(1) and
+// nothing is allocated once the arrays have grown to the graph size.
+// A scratch serves one search at a time: use one per thread (the
+// ThreadSearchScratch() default) or one per worker.
+//
+// Point-to-point results are identical to the list-scanning search this
+// replaced: the heap sees the same pushes in the same order. Bounded
+// searches report places at equal cost in id order.
+
+#include "ride.h"
+
+#include <vector>
+
+struct SearchScratch
+{
+    std::vector<int> dist;
+    std::vector<Place*> parent;
+    std::vector<unsigned> stamp;     // dist/parent of id valid iff stamp[id] == generation
+    unsigned generation;
+    std::vector<Place*> heapPlace;
+    std::vector<int> heapDist;
+    int heapSize;
+
+    SearchScratch() : generation(0), heapSize(0) {}
+
+    // New search over `places` ids (PlaceCount() unless the caller knows
+    // the graph is not changing under it).
+    void Begin(int places);
+
+    bool Seen(int id) const { return stamp[id] == generation; }
+    int DistOf(int id) const { return Seen(id) ? dist[id] : INT_MAX; }
+};
+
+SearchScratch& ThreadSearchScratch();
+
+// Places reachable from start within costBound, appended to out in order
+// of increasing cost, then id (out is cleared first). Returns how many.
+int BoundedSearch(SearchScratch& s, Place* start, int costBound, std::vector<ReachablePlace>& out);
+
+// One bounded search per start, results back to back in out: the places
+// reached from starts[i] are out[begin[i] .. begin[i + 1]). begin gets
+// n + 1 entries. Returns out.size().
+int BoundedSearchBatch(SearchScratch& s, Place* const* starts, int n, int costBound,
+                       std::vector<ReachablePlace>& out, std::vector<int>& begin);
+
+// The other direction: places that reach target within costBound, with
+// their cost to it, in order of increasing cost. Walks the incoming roads,
+// indexed once per RoadGraphVersion(); one caller thread at a time.
+int BoundedSearchToward(SearchScratch& s, Place* target, int costBound, std::vector<ReachablePlace>& out);
+
+// Delta-stepping version of BoundedSearch for wide bounds on large graphs:
+// each bucket of width delta (0 = mean road cost) is relaxed in parallel
+// on up to `threads` workers of SharedThreadPool(). Returns exactly what
+// BoundedSearch returns, and runs BoundedSearch itself on one worker. One
+// parallel search runs at a time per engine.
+int ParallelBoundedSearch(Place* start, int costBound, std::vector<ReachablePlace>& out,
+                          int threads, int delta = 0);
+
+// Shortest start -> end path into path[] (PlaceCount() entries).
+bool ShortestPathSearch(SearchScratch& s, Place* start, Place* end, Place* path[], int& pathLen);
+
+// Time-dependent version: leaves start at departTime and pays RoadCostAt()
+// on arrival at each road (roads.h). arrivals, if given, gets the arrival
+// time at every place on the path (PlaceCount() entries).
+bool ShortestPathSearchAt(SearchScratch& s, Place* start, Place* end, int departTime,
+                          Place* path[], int& pathLen, int* arrivals = nullptr);
+
+// Shortest paths for many (start, end) pairs at once, e.g. every offer
+// created since the last tick. Pairs are spread over up to `threads`
+// workers of SharedThreadPool() (<= 0: all of them); each worker searches
+// with its own ThreadSearchScratch() over the same pinned copy.
+// Path i is places[begin[i] .. begin[i + 1]), empty if end is unreachable
+// (a start == end path holds one place). With departs, route i is the
+// time-dependent path leaving at departs[i]. arrive runs parallel to
+// places: the arrival time (static: the cost so far) at each place.
+// One batch runs at a time per engine.
+struct RouteBatch
+{
+    std::vector<Place*> places;
+    std::vector<int> arrive;
+    std::vector<int> begin;
+};
+
+void ComputeRoutes(Place* const* starts, Place* const* ends, int n, RouteBatch& out,
+                   int threads = 0, const int* departs = nullptr);
+
+#endif
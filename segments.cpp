@@ -0,0 +1,262 @@
+#include "segments.h"
+
+#include "storage.h"
+#include "trace.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char* const kKindNames[SEG_KIND_COUNT] = {
+    "users", "roads", "offers", "active_rides", "history", "requests"};
+
+// -------------------------
+// Dirty state
+// -------------------------
+struct SegmentTracker
+{
+    mutex lock;
+    set<int> dirty[SEG_KIND_COUNT];
+    bool full = true;            // nothing on disk matches the engine yet
+    string dir;                  // directory of `current`
+    SegmentManifest current;
+    uint64_t lastGen = 0;        // never reuse a generation, even after a failed save
+};
+
+static SegmentTracker& Segments()
+{
+    return EnginePart<SegmentTracker>();
+}
+
+int SegmentOfKey(int key)
+{
+    return key >> SEGMENT_SHIFT;
+}
+
+int SegmentFirstKey(int segment)
+{
+    return (int)((unsigned)segment << SEGMENT_SHIFT);
+}
+
+int SegmentLastKey(int segment)
+{
+    return SegmentFirstKey(segment) + ((1 << SEGMENT_SHIFT) - 1);
+}
+
+void SegmentMarkDirty(SegmentKind kind, int key)
+{
+    SegmentTracker& tracker = Segments();
+    int seg = (kind == SEG_ROADS || kind == SEG_REQUESTS) ? 0 : SegmentOfKey(key);
+    lock_guard<mutex> g(tracker.lock);
+    tracker.dirty[kind].insert(seg);
+}
+
+void SegmentMarkAllDirty()
+{
+    SegmentTracker& tracker = Segments();
+    lock_guard<mutex> g(tracker.lock);
+    tracker.full = true;
+    for (int k = 0; k < SEG_KIND_COUNT; k++)
+        tracker.dirty[k].clear();
+}
+
+bool SegmentNeedsFullSave(const char* baseDir)
+{
+    SegmentTracker& tracker = Segments();
+    lock_guard<mutex> g(tracker.lock);
+    return tracker.full || tracker.dir != (baseDir ? baseDir : ".");
+}
+
+// -------------------------
+// Files
+// -------------------------
+string SegmentPath(const char* baseDir, const SegmentEntry& e, const char* ext)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "%s/%s-%d-%llu%s", SEGMENT_DIR, kKindNames[e.kind],
+             e.segment, (unsigned long long)e.gen, ext);
+    return JoinPath(baseDir, name);
+}
+
+static bool EntryLess(const SegmentEntry& a, const SegmentEntry& b)
+{
+    return a.kind != b.kind ? a.kind < b.kind : a.segment < b.segment;
+}
+
+bool ReadSegmentManifest(const char* baseDir, SegmentManifest& m)
+{
+    ifstream in(JoinPath(baseDir, SEGMENT_DIR "/" SEGMENT_MANIFEST));
+    string magic;
+    int version;
+    size_t count;
+    if (!(in >> magic >> version >> m.generation >> count) || magic != "RSSEG" ||
+        (version != 1 && version != 2))
+        return false;
+    m.hasLsn = version == 2;
+    m.lsn = 0;
+    if (m.hasLsn && !(in >> m.lsn))
+        return false;
+
+    m.entries.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        SegmentEntry e;
+        if (!(in >> e.kind >> e.segment >> e.gen) || e.kind < 0 || e.kind >= SEG_KIND_COUNT)
+            return false;
+        m.entries.push_back(e);
+    }
+    sort(m.entries.begin(), m.entries.end(), EntryLess);
+    return true;
+}
+
+static bool SyncPath(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+}
+
+bool WriteSegmentManifest(const char* baseDir, const SegmentManifest& m)
+{
+    string path = JoinPath(baseDir, SEGMENT_DIR "/" SEGMENT_MANIFEST);
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp);
+        if (!out) return false;
+        out << "RSSEG 2\n" << m.generation << ' ' << m.entries.size() << ' ' << m.lsn << '\n';
+        for (const SegmentEntry& e : m.entries)
+            out << e.kind << ' ' << e.segment << ' ' << e.gen << '\n';
+        out.flush();
+        if (!out) return false;
+    }
+    if (!SyncPath(tmp) || rename(tmp.c_str(), path.c_str()) != 0)
+        return false;
+    return SyncPath(JoinPath(baseDir, SEGMENT_DIR)) && SyncPath(baseDir ? baseDir : ".");
+}
+
+// -------------------------
+// Save protocol
+// -------------------------
+SegmentSavePlan SegmentPlanSave(const char* baseDir, const vector<int> present[SEG_KIND_COUNT],
+                                uint64_t lsn)
+{
+    SegmentTracker& tracker = Segments();
+    string dir = baseDir ? baseDir : ".";
+    mkdir(JoinPath(baseDir, SEGMENT_DIR).c_str(), 0755);
+
+    lock_guard<mutex> g(tracker.lock);
+    SegmentSavePlan plan;
+    plan.dir = dir;
+    plan.full = tracker.full || tracker.dir != dir;
+
+    // Start from what is on disk in this directory.
+    SegmentManifest old;
+    if (!plan.full)
+        old = tracker.current;
+    else if (!ReadSegmentManifest(baseDir, old))
+        old = SegmentManifest();
+
+    uint64_t gen = max(old.generation, tracker.lastGen) + 1;
+    tracker.lastGen = gen;
+    plan.next.generation = gen;
+    plan.next.lsn = lsn;
+    plan.next.hasLsn = true;
+
+    if (plan.full)
+    {
+        for (int k = 0; k < SEG_KIND_COUNT; k++)
+            for (int seg : present[k])
+                plan.write.push_back(SegmentEntry{k, seg, gen});
+        if (find_if(plan.write.begin(), plan.write.end(),
+                    [](const SegmentEntry& e) { return e.kind == SEG_ROADS; }) == plan.write.end())
+            plan.write.push_back(SegmentEntry{SEG_ROADS, 0, gen});
+        sort(plan.write.begin(), plan.write.end(), EntryLess);
+        plan.next.entries = plan.write;
+        plan.drop = old.entries;
+    }
+    else
+    {
+        for (int k = 0; k < SEG_KIND_COUNT; k++)
+            for (int seg : tracker.dirty[k])
+                plan.write.push_back(SegmentEntry{k, seg, gen});
+
+        // Merge: rewritten segments replace their old entry.
+        size_t i = 0, j = 0;
+        while (i < old.entries.size() || j < plan.write.size())
+        {
+            if (j == plan.write.size() ||
+                (i < old.entries.size() && EntryLess(old.entries[i], plan.write[j])))
+            {
+                plan.next.entries.push_back(old.entries[i++]);
+            }
+            else
+            {
+                if (i < old.entries.size() && !EntryLess(plan.write[j], old.entries[i]))
+                    plan.drop.push_back(old.entries[i++]);
+                plan.next.entries.push_back(plan.write[j++]);
+            }
+        }
+    }
+
+    for (int k = 0; k < SEG_KIND_COUNT; k++)
+        tracker.dirty[k].clear();
+    tracker.full = false;
+    return plan;
+}
+
+bool SegmentCommit(const SegmentSavePlan& plan)
+{
+    TRACE_SPAN("save_commit");
+    const char* dir = plan.dir.c_str();
+    if (!WriteSegmentManifest(dir, plan.next))
+        return false;
+
+    // Old files are garbage now; a crash before this only leaves litter.
+    for (const SegmentEntry& e : plan.drop)
+    {
+        unlink(SegmentPath(dir, e, ".dat").c_str());
+        if (e.kind == SEG_HISTORY)
+            unlink(SegmentPath(dir, e, ".idx").c_str());
+    }
+    return true;
+}
+
+void SegmentSaveDone(const SegmentSavePlan& plan, bool ok)
+{
+    SegmentTracker& tracker = Segments();
+    lock_guard<mutex> g(tracker.lock);
+    if (ok)
+    {
+        tracker.dir = plan.dir;
+        tracker.current = plan.next;
+        return;
+    }
+
+    // Nothing was committed: the segments are still dirty.
+    if (plan.full)
+        tracker.full = true;
+    for (const SegmentEntry& e : plan.write)
+        tracker.dirty[e.kind].insert(e.segment);
+}
+
+void SegmentLoaded(const char* baseDir, const SegmentManifest& m)
+{
+    SegmentTracker& tracker = Segments();
+    lock_guard<mutex> g(tracker.lock);
+    tracker.dir = baseDir ? baseDir : ".";
+    tracker.current = m;
+    tracker.full = false;
+    for (int k = 0; k < SEG_KIND_COUNT; k++)
+        tracker.dirty[k].clear();
+}
@@ -0,0 +1,101 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+// Segmented .dat layout with dirty tracking — SaveAll only rewrites the
+// parts of the state that changed since the last save.
+//
+// Records are split into segments by key:
+//   users, history     userId  >> SEGMENT_SHIFT
+//   offers             offerId >> SEGMENT_SHIFT
+//   active rides       rideId  >> SEGMENT_SHIFT
+//   roads              one segment (the graph is saved as a whole)
+//   pending requests   one segment (requestHeap in array order)
+// Each segment is a file in <baseDir>/segments/ with the same format as
+// the matching whole .dat file (history segments also get their .idx):
+//   users-<segment>-<gen>.dat, history-<segment>-<gen>.idx, ...
+// <gen> is the save generation that wrote the file, so a rewrite never
+// touches the live copy.
+//
+// segments/MANIFEST names the live file of every segment:
+//   RSSEG 2
+//   <generation> <entryCount> <lsn>
+//   <kind> <segment> <gen>        (one line per segment)
+// <lsn> is the last journal record the listed files cover, so the data
+// and the point to replay from are committed together. A save writes the
+// dirty segments, then the new manifest (tmp + fsync + rename is the
+// commit point), then deletes files no longer listed. Version 1 manifests
+// have no <lsn>; their checkpoint is in checkpoint.lsn (journal.h).
+//
+// Every mutation marks the segment of the record it touched, next to its
+// journal hook. A save takes the dirty set; a failed save puts it back.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define SEGMENT_SHIFT 12          // 4096 keys per segment
+#define SEGMENT_DIR "segments"
+#define SEGMENT_MANIFEST "MANIFEST"
+
+enum SegmentKind
+{
+    SEG_USERS = 0,
+    SEG_ROADS,
+    SEG_OFFERS,
+    SEG_ACTIVE_RIDES,
+    SEG_HISTORY,
+    SEG_REQUESTS,
+    SEG_KIND_COUNT
+};
+
+struct SegmentEntry
+{
+    int kind;
+    int segment;
+    uint64_t gen;
+};
+
+struct SegmentManifest
+{
+    uint64_t generation = 0;
+    uint64_t lsn = 0;                    // journal records covered
+    bool hasLsn = false;                 // false: version 1 manifest
+    std::vector<SegmentEntry> entries;   // sorted by (kind, segment)
+};
+
+struct SegmentSavePlan
+{
+    std::string dir;
+    bool full;                           // every segment is written
+    SegmentManifest next;                // manifest after the save
+    std::vector<SegmentEntry> write;     // files to write now
+    std::vector<SegmentEntry> drop;      // files to delete after the commit
+};
+
+// Key <-> segment
+int SegmentOfKey(int key);
+int SegmentFirstKey(int segment);
+int SegmentLastKey(int segment);
+
+// Dirty tracking (thread-safe)
+void SegmentMarkDirty(SegmentKind kind, int key);
+void SegmentMarkAllDirty();      // state no longer matches any manifest
+bool SegmentNeedsFullSave(const char* baseDir);
+
+// Files
+std::string SegmentPath(const char* baseDir, const SegmentEntry& e, const char* ext);
+bool ReadSegmentManifest(const char* baseDir, SegmentManifest& m);
+bool WriteSegmentManifest(const char* baseDir, const SegmentManifest& m);
+
+// Save protocol: plan (takes the dirty set), write plan.write, commit the
+// manifest, then report back. `present` lists every segment per kind and
+// is only used for full saves; lsn is the journal checkpoint of the save.
+SegmentSavePlan SegmentPlanSave(const char* baseDir, const std::vector<int> present[SEG_KIND_COUNT],
+                                uint64_t lsn);
+bool SegmentCommit(const SegmentSavePlan& plan);   // manifest + cleanup
+void SegmentSaveDone(const SegmentSavePlan& plan, bool ok);
+
+// LoadAll read exactly this manifest into an empty engine: nothing is dirty.
+void SegmentLoaded(const char* baseDir, const SegmentManifest& m);
+
+#endif
@@ -0,0 +1,535 @@
+#include "server.h"
+
+#include "ride.h"
+#include "user.h"
+#include "history_index.h"
+#include "storage.h"
+#include "journal.h"
+#include "road_graph.h"
+#include "metrics.h"
+#include "trace.h"
+#include "engine.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define SERVER_MAX_TOKENS 8
+
+// -------------------------
+// Connections
+// -------------------------
+struct Connection
+{
+    int fd;
+    string in;
+    size_t inPos = 0;          // first byte not run yet
+    string out;
+    size_t outPos = 0;         // first byte not sent yet
+    bool peerClosed = false;   // EOF: answer what arrived, then close
+    bool closing = false;      // QUIT or a bad line: close once sent
+    bool broken = false;       // socket error: close now
+    uint32_t events = 0;       // registered epoll interest
+};
+
+struct Server
+{
+    int epfd = -1;
+    int listenFd = -1;
+    int stopFd = -1;           // eventfd, written by the signal handler
+    string unixPath;           // unlinked on exit
+    string saveDir;
+    unordered_map<int, Connection*> conns;
+    unsigned long long commands = 0;
+    unsigned long long connections = 0;
+};
+
+static size_t Pending(const Connection& c)
+{
+    return c.out.size() - c.outPos;
+}
+
+// -------------------------
+// Commands
+// -------------------------
+static bool ToInt(const char* s, int& v)
+{
+    char* end;
+    errno = 0;
+    long x = strtol(s, &end, 10);
+    if (end == s || *end || errno || x < INT_MIN || x > INT_MAX)
+        return false;
+    v = (int)x;
+    return true;
+}
+
+static void AppendInt(string& out, long long v)
+{
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), " %lld", v);
+    out.append(buf, n);
+}
+
+// Runs one line (NUL-terminated, modified in place) and appends its answer.
+static void Execute(Server& srv, Connection& c, char* line)
+{
+    char* tok[SERVER_MAX_TOKENS];
+    int n = 0;
+    char* save = nullptr;
+    for (char* p = strtok_r(line, " \t\r", &save); p; p = strtok_r(nullptr, " \t\r", &save))
+    {
+        if (n == SERVER_MAX_TOKENS)
+        {
+            c.out += "ERR too many arguments\n";
+            return;
+        }
+        tok[n++] = p;
+    }
+    if (n == 0)
+        return;                 // blank line, no answer
+    srv.commands++;
+    METRIC_INC(MC_SERVER_COMMANDS);
+
+    const char* cmd = tok[0];
+    string& out = c.out;
+    int a, b, d, e;
+    if (strcasecmp(cmd, "PING") == 0 && n == 1)
+        out += "OK\n";
+    else if (strcasecmp(cmd, "USER") == 0 && n == 4 && ToInt(tok[1], a) && ToInt(tok[3], b) &&
+             (b == 0 || b == 1))
+    {
+        Engine& eng = CurrentEngine();
+        if (SearchUser(eng.userRoot, a))
+            out += "ERR user exists\n";
+        else
+        {
+            eng.userRoot = CreateUser(eng.userRoot, a, tok[2], b);
+            out += "OK\n";
+        }
+    }
+    else if (strcasecmp(cmd, "OFFER") == 0 && n == 7 && ToInt(tok[1], a) && ToInt(tok[2], b) &&
+             ToInt(tok[5], d) && ToInt(tok[6], e))
+        out += CreateRideOffer(a, b, tok[3], tok[4], d, e) ? "OK\n" : "ERR offer rejected\n";
+    else if (strcasecmp(cmd, "REQUEST") == 0 && n == 7 && ToInt(tok[1], a) && ToInt(tok[2], b) &&
+             ToInt(tok[5], d) && ToInt(tok[6], e))
+        out += CreateRideRequest(a, b, tok[3], tok[4], d, e) ? "OK\n" : "ERR request rejected\n";
+    else if (strcasecmp(cmd, "CANCEL") == 0 && n == 2 && ToInt(tok[1], a))
+        out += CancelRideRequest(a) ? "OK\n" : "ERR not pending\n";
+    else if (strcasecmp(cmd, "MATCH") == 0 && (n == 1 || (n == 2 && ToInt(tok[1], a) && a > 0)))
+    {
+        // Unmatched requests go back on top of the heap: stop at the first.
+        int count = (n == 2) ? min(a, SERVER_MAX_MATCH) : 1, matched = 0;
+        while (matched < count && CurrentEngine().requestHead && MatchNextRequest())
+            matched++;
+        out += "OK";
+        AppendInt(out, matched);
+        out += '\n';
+    }
+    else if (strcasecmp(cmd, "HISTORY") == 0 && (n == 2 || n == 4) && ToInt(tok[1], a) &&
+             (n == 2 || (ToInt(tok[2], b) && ToInt(tok[3], d))))
+    {
+        if (!SearchUser(CurrentEngine().userRoot, a))
+        {
+            out += "ERR unknown user\n";
+            return;
+        }
+        static thread_local vector<HistoryRecord> rows;
+        rows.clear();
+        QueryUserRides(a, n == 4 ? b : INT_MIN, n == 4 ? d : INT_MAX, rows);
+        out += "OK";
+        AppendInt(out, (long long)rows.size());
+        for (const HistoryRecord& r : rows)
+        {
+            AppendInt(out, r.rideId);
+            out += ' ';
+            out += r.from;
+            out += ' ';
+            out += r.to;
+            AppendInt(out, r.time);
+        }
+        out += '\n';
+    }
+    else if (strcasecmp(cmd, "TOPK") == 0 && n == 2 && ToInt(tok[1], a) && a > 0)
+    {
+        static thread_local vector<User*> drivers;
+        TopDrivers(a, drivers);
+        out += "OK";
+        AppendInt(out, (long long)drivers.size());
+        for (const User* u : drivers)
+        {
+            AppendInt(out, u->userId);
+            out += ' ';
+            out += u->name;
+            AppendInt(out, u->completedRides);
+        }
+        out += '\n';
+    }
+    else if (strcasecmp(cmd, "SAVE") == 0 && n == 1)
+        out += SaveAllInBackground(srv.saveDir.c_str()) ? "OK queued\n" : "ERR save not started\n";
+    else if (strcasecmp(cmd, "SAVESTATUS") == 0 && n == 1)
+    {
+        // running is cleared after the result is set: read it first
+        if (BackgroundSaveRunning())
+            out += "OK running\n";
+        else
+        {
+            int r = LastBackgroundSaveResult();
+            out += (r < 0) ? "OK none\n" : (r ? "OK saved\n" : "OK failed\n");
+        }
+    }
+    else if (strcasecmp(cmd, "QUIT") == 0 && n == 1)
+    {
+        out += "OK\n";
+        c.closing = true;
+    }
+    else
+        out += "ERR bad command\n";
+}
+
+// Runs the complete lines that arrived, while the answers fit.
+static void RunLines(Server& srv, Connection& c)
+{
+    while (!c.closing && Pending(c) < SERVER_MAX_OUTPUT)
+    {
+        size_t nl = c.in.find('\n', c.inPos);
+        if (nl == string::npos)
+            break;
+        c.in[nl] = '\0';
+        Execute(srv, c, &c.in[c.inPos]);
+        c.inPos = nl + 1;
+    }
+    if (c.inPos == c.in.size())
+    {
+        c.in.clear();
+        c.inPos = 0;
+    }
+    else if (c.inPos >= SERVER_READ_CHUNK)
+    {
+        c.in.erase(0, c.inPos);
+        c.inPos = 0;
+    }
+    if (!c.closing && c.in.size() - c.inPos > SERVER_MAX_LINE &&
+        c.in.find('\n', c.inPos) == string::npos)
+    {
+        c.out += "ERR line too long\n";
+        c.closing = true;
+    }
+}
+
+static void ReadFrom(Connection& c)
+{
+    char buf[16384];
+    size_t got = 0;
+    while (got < SERVER_READ_CHUNK)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            c.in.append(buf, (size_t)n);
+            got += (size_t)n;
+            continue;
+        }
+        if (n == 0)
+            c.peerClosed = true;
+        else if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            c.broken = true;
+        break;
+    }
+}
+
+static void Flush(Connection& c)
+{
+    while (Pending(c) > 0)
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.outPos, Pending(c), MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            c.outPos += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        c.broken = true;
+        break;
+    }
+    if (Pending(c) == 0)
+    {
+        c.out.clear();
+        c.outPos = 0;
+    }
+}
+
+static void CloseConnection(Server& srv, Connection* c)
+{
+    epoll_ctl(srv.epfd, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    srv.conns.erase(c->fd);
+    delete c;
+}
+
+// After a wakeup: run what arrived, send the answers in one go, then
+// listen for what the connection can take next.
+static void Service(Server& srv, Connection* c)
+{
+    while (true)
+    {
+        RunLines(srv, *c);
+        Flush(*c);
+        if (c->broken || c->closing || Pending(*c) > 0 ||
+            c->in.find('\n', c->inPos) == string::npos)
+            break;
+    }
+
+    bool done = (c->closing || c->peerClosed) && Pending(*c) == 0 &&
+                (c->closing || c->in.find('\n', c->inPos) == string::npos);
+    if (c->broken || done)
+    {
+        CloseConnection(srv, c);
+        return;
+    }
+
+    uint32_t want = 0;
+    if (!c->peerClosed && !c->closing && Pending(*c) < SERVER_MAX_OUTPUT)
+        want |= EPOLLIN;
+    if (Pending(*c) > 0)
+        want |= EPOLLOUT;
+    if (want != c->events)
+    {
+        epoll_event ev = {};
+        ev.events = want;
+        ev.data.fd = c->fd;
+        epoll_ctl(srv.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = want;
+    }
+}
+
+static void AcceptAll(Server& srv)
+{
+    while (true)
+    {
+        int fd = accept4(srv.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;         // EAGAIN, or out of descriptors until one closes
+        }
+        if (srv.unixPath.empty())
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        Connection* c = new Connection;
+        c->fd = fd;
+        c->events = EPOLLIN;
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            close(fd);
+            delete c;
+            continue;
+        }
+        srv.conns[fd] = c;
+        srv.connections++;
+        METRIC_INC(MC_SERVER_CONNECTIONS);
+    }
+}
+
+// -------------------------
+// Listening socket
+// -------------------------
+static int ListenOn(Server& srv, const char* address, string& shown)
+{
+    string addr = address;
+    bool isUnix = false;
+    if (addr.compare(0, 5, "unix:") == 0)
+    {
+        addr = addr.substr(5);
+        isUnix = true;
+    }
+    else if (addr.compare(0, 4, "tcp:") == 0)
+        addr = addr.substr(4);
+    else
+        isUnix = addr.find('/') != string::npos;
+
+    if (isUnix)
+    {
+        sockaddr_un sa = {};
+        sa.sun_family = AF_UNIX;
+        if (addr.empty() || addr.size() >= sizeof(sa.sun_path))
+            return -1;
+        memcpy(sa.sun_path, addr.c_str(), addr.size() + 1);
+        struct stat st;
+        if (stat(addr.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(addr.c_str());          // left over from an earlier run
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (bind(fd, (sockaddr*)&sa, sizeof(sa)) != 0 || listen(fd, SOMAXCONN) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        srv.unixPath = addr;
+        shown = "unix:" + addr;
+        return fd;
+    }
+
+    int port;
+    if (!ToInt(addr.c_str(), port) || port < 0 || port > 65535)
+        return -1;
+    sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons((uint16_t)port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    socklen_t len = sizeof(sa);
+    if (bind(fd, (sockaddr*)&sa, sizeof(sa)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+        getsockname(fd, (sockaddr*)&sa, &len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    shown = "127.0.0.1:" + to_string(ntohs(sa.sin_port));
+    return fd;
+}
+
+// Any thread may take the signal, so the handler only pokes the loop.
+static volatile sig_atomic_t gStopFd = -1;
+
+static void OnStopSignal(int)
+{
+    uint64_t one = 1;
+    if (gStopFd >= 0 && write(gStopFd, &one, sizeof(one)) < 0)
+        return;
+}
+
+// -------------------------
+// Public API
+// -------------------------
+bool RunServer(const char* address, const char* saveDir)
+{
+    Server srv;
+    srv.saveDir = saveDir ? saveDir : ".";
+    string shown;
+    srv.listenFd = ListenOn(srv, address, shown);
+    if (srv.listenFd < 0)
+    {
+        cout << "Cannot listen on " << address << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    srv.stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    gStopFd = srv.stopFd;
+    struct sigaction sa = {}, oldInt, oldTerm;
+    sa.sa_handler = OnStopSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &oldInt);
+    sigaction(SIGTERM, &sa, &oldTerm);
+
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = srv.listenFd;
+    epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listenFd, &ev);
+    ev.data.fd = srv.stopFd;
+    epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.stopFd, &ev);
+
+    cout << "Listening on " << shown << "\n";
+    cout.flush();
+
+    epoll_event events[SERVER_MAX_EVENTS];
+    bool running = true;
+    while (running)
+    {
+        int n = epoll_wait(srv.epfd, events, SERVER_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        TRACE_SPAN("server_turn");
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == srv.listenFd)
+            {
+                AcceptAll(srv);
+                continue;
+            }
+            if (fd == srv.stopFd)
+            {
+                running = false;
+                continue;
+            }
+            auto it = srv.conns.find(fd);
+            if (it == srv.conns.end())
+                continue;           // closed earlier in this turn
+            Connection* c = it->second;
+            if (events[i].events & EPOLLERR)
+                c->broken = true;
+            else if (events[i].events & (EPOLLIN | EPOLLHUP))
+                ReadFrom(*c);
+            if (c->broken)
+                CloseConnection(srv, c);
+            else
+                Service(srv, c);
+        }
+        // End of a turn: take in a reloaded map and publish road edits.
+        AdoptRoadGraph();
+        PublishRoadGraph();
+        JournalMaybeCompact();
+    }
+
+    for (auto& kv : srv.conns)
+    {
+        close(kv.first);
+        delete kv.second;
+    }
+    srv.conns.clear();
+    close(srv.epfd);
+    close(srv.listenFd);
+    sigaction(SIGINT, &oldInt, nullptr);
+    sigaction(SIGTERM, &oldTerm, nullptr);
+    gStopFd = -1;
+    close(srv.stopFd);
+    if (!srv.unixPath.empty())
+        unlink(srv.unixPath.c_str());
+    WaitBackgroundSave();
+
+    cout << "Server stopped: " << srv.commands << " commands on "
+         << srv.connections << " connections\n";
+    return true;
+}
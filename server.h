@@ -0,0 +1,46 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Local server mode: one epoll loop drives the engine for many clients.
+//
+// Listens on a Unix domain socket ("unix:/run/rs.sock", or any address
+// containing a '/') or on a localhost TCP port ("tcp:7070" or "7070";
+// port 0 picks a free one). The loop runs on the calling thread, which
+// keeps owning the engine: commands run one at a time, in arrival order
+// per connection, through the core APIs.
+//
+// Protocol: one command per line, space-separated tokens (names have no
+// spaces, as in the menu). Every command gets exactly one answer line,
+// "OK ..." or "ERR <reason>":
+//   PING                                           OK
+//   USER id name driver(0|1)                       OK
+//   OFFER id driver from to depart capacity        OK
+//   REQUEST id passenger from to earliest latest   OK
+//   CANCEL requestId                               OK
+//   MATCH [count]                                  OK matched (stops at the first miss)
+//   HISTORY userId [t1 t2]                         OK n {rideId from to time} x n
+//   TOPK k                                         OK n {userId name rides} x n
+//   SAVE                                           OK queued (background SaveAll)
+//   SAVESTATUS                                     OK running|saved|failed|none
+//   QUIT                                           OK, then the connection closes
+//
+// Clients may pipeline: every complete line that arrived is answered in
+// the same loop turn, with one write per connection for all of them. A
+// connection with more than SERVER_MAX_OUTPUT unsent bytes is not read
+// until they drain. SIGINT/SIGTERM stop the loop; RunServer then returns.
+//
+// SAVE answers once the save is started, not when it is on disk: poll
+// SAVESTATUS until it leaves "running". "saved" and "failed" describe the
+// last save that finished; "none" means none has run yet.
+
+#define SERVER_MAX_LINE 4096              // longer lines close the connection
+#define SERVER_MAX_OUTPUT (1024 * 1024)
+#define SERVER_READ_CHUNK (64 * 1024)     // per connection and loop turn
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_MATCH 4096             // MATCH count cap, per command
+
+// Serves until stopped; SAVE writes to saveDir. False if the address
+// cannot be listened on.
+bool RunServer(const char* address, const char* saveDir = ".");
+
+#endif
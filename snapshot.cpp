@@ -0,0 +1,553 @@
+#include "snapshot.h"
+
+#include "storage.h"
+#include "roads.h"
+#include "ride.h"
+#include "user.h"
+#include "history_index.h"
+#include "journal.h"
+#include "segments.h"
+#include "pool.h"
+#include "offer_store.h"
+#include "engine.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// -------------------------
+// Save helpers
+// -------------------------
+struct SnapshotWriter
+{
+    string strings;
+    unordered_map<string, uint32_t> stringIds;
+
+    vector<SnapPlace> places;
+    vector<uint32_t> edgeOffsets;
+    vector<SnapEdge> edges;
+    vector<SnapRoadProfile> roadProfiles;
+    vector<uint32_t> edgeProfiles;     // empty if no road has a profile
+    vector<SnapUser> users;
+    vector<SnapHistory> history;
+    vector<SnapOffer> offers;
+    vector<SnapActiveRide> rides;
+    vector<int32_t> passengers;
+    vector<SnapRequest> requests;
+
+    unordered_map<Place*, uint32_t> placeIndex;
+    unordered_map<RideOffer*, uint32_t> offerIndex;
+
+    uint32_t Str(const char* s)
+    {
+        auto it = stringIds.find(s);
+        if (it != stringIds.end()) return it->second;
+        uint32_t off = (uint32_t)strings.size();
+        strings.append(s);
+        strings.push_back('\0');
+        stringIds[s] = off;
+        return off;
+    }
+
+    uint32_t PlaceIdx(Place* p)
+    {
+        if (!p) return SNAPSHOT_NONE;
+        auto it = placeIndex.find(p);
+        return (it == placeIndex.end()) ? SNAPSHOT_NONE : it->second;
+    }
+};
+
+static void CollectHistory(SnapshotWriter& w, HistoryNode* root)
+{
+    if (!root) return;
+    CollectHistory(w, root->left);
+    SnapHistory h;
+    h.rideId = root->rideId;
+    h.fromOff = w.Str(root->from);
+    h.toOff = w.Str(root->to);
+    h.time = root->time;
+    w.history.push_back(h);
+    CollectHistory(w, root->right);
+}
+
+static void CollectUsers(SnapshotWriter& w, User* root)
+{
+    if (!root) return;
+    CollectUsers(w, root->left);
+    SnapUser u;
+    u.userId = root->userId;
+    u.nameOff = w.Str(root->name);
+    u.isDriver = root->isDriver;
+    u.rating = root->rating;
+    u.completedRides = root->completedRides;
+    u.historyBegin = (uint32_t)w.history.size();
+    EnsureUserHistory(root);
+    CollectHistory(w, root->history);
+    u.historyCount = (uint32_t)w.history.size() - u.historyBegin;
+    w.users.push_back(u);
+    CollectUsers(w, root->right);
+}
+
+static void CollectGraph(SnapshotWriter& w)
+{
+    const Engine& eng = CurrentEngine();
+    for (Place* p = eng.placeHead; p; p = p->next)
+    {
+        w.placeIndex[p] = (uint32_t)w.places.size();
+        SnapPlace sp;
+        sp.nameOff = w.Str(p->name);
+        w.places.push_back(sp);
+    }
+
+    for (Place* p = eng.placeHead; p; p = p->next)
+    {
+        w.edgeOffsets.push_back((uint32_t)w.edges.size());
+        for (RoadLink* e = p->firstLink; e; e = e->next)
+        {
+            SnapEdge se;
+            se.to = w.PlaceIdx(e->to);
+            se.cost = e->cost;
+            w.edges.push_back(se);
+            if (RoadProfileCount() > 0)
+                w.edgeProfiles.push_back(e->profile >= 0 ? (uint32_t)e->profile : SNAPSHOT_NONE);
+        }
+    }
+    w.edgeOffsets.push_back((uint32_t)w.edges.size());
+
+    w.roadProfiles.resize(RoadProfileCount());
+    if (!w.roadProfiles.empty())
+        memcpy(w.roadProfiles.data(), eng.roadProfiles.data(), eng.roadProfiles.size() * sizeof(int));
+}
+
+static void CollectOffersAndRides(SnapshotWriter& w)
+{
+    for (RideOffer* o = CurrentEngine().offerHead; o; o = o->next)
+    {
+        w.offerIndex[o] = (uint32_t)w.offers.size();
+        SnapOffer so;
+        so.offerId = o->offerId;
+        so.driverId = o->driverId;
+        so.startPlace = w.PlaceIdx(o->startPlace);
+        so.endPlace = w.PlaceIdx(o->endPlace);
+        so.departTime = o->departTime;
+        so.capacity = o->capacity;
+        so.seatsLeft = o->seatsLeft;
+        w.offers.push_back(so);
+    }
+
+    for (int i = 0; i < ActiveRideTableSize(); i++)
+    {
+        for (ActiveRide* ar = ActiveRideBucketHead(i); ar; ar = ar->next)
+        {
+            SnapActiveRide sr;
+            sr.rideId = ar->rideId;
+            auto it = w.offerIndex.find(ar->offer);
+            sr.offer = (it == w.offerIndex.end()) ? SNAPSHOT_NONE : it->second;
+            sr.passengerBegin = (uint32_t)w.passengers.size();
+            for (PassengerNode* p = ar->passengers; p; p = p->next)
+                w.passengers.push_back(p->passengerId);
+            sr.passengerCount = (uint32_t)w.passengers.size() - sr.passengerBegin;
+            w.rides.push_back(sr);
+        }
+    }
+}
+
+static void CollectRequests(SnapshotWriter& w)
+{
+    for (int i = 0; i < PendingRequestCount(); i++)
+    {
+        RideRequest* r = PendingRequestAt(i);
+        SnapRequest sr;
+        sr.requestId = r->requestId;
+        sr.passengerId = r->passengerId;
+        sr.fromPlace = w.PlaceIdx(r->fromPlace);
+        sr.toPlace = w.PlaceIdx(r->toPlace);
+        sr.earliest = r->earliest;
+        sr.latest = r->latest;
+        w.requests.push_back(sr);
+    }
+}
+
+static size_t Align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+struct PendingSection
+{
+    uint32_t kind;
+    uint32_t recordSize;
+    const void* data;
+    uint64_t count;
+};
+
+// -------------------------
+// Public API: save
+// -------------------------
+bool SaveSnapshot(const char* baseDir)
+{
+    SnapshotWriter w;
+    CollectGraph(w);
+    CollectUsers(w, CurrentEngine().userRoot);
+    CollectOffersAndRides(w);
+    CollectRequests(w);
+
+    PendingSection secs[] = {
+        {SNAP_STRINGS, 1, w.strings.data(), w.strings.size()},
+        {SNAP_PLACES, sizeof(SnapPlace), w.places.data(), w.places.size()},
+        {SNAP_EDGE_OFFSETS, sizeof(uint32_t), w.edgeOffsets.data(), w.edgeOffsets.size()},
+        {SNAP_EDGES, sizeof(SnapEdge), w.edges.data(), w.edges.size()},
+        {SNAP_USERS, sizeof(SnapUser), w.users.data(), w.users.size()},
+        {SNAP_HISTORY, sizeof(SnapHistory), w.history.data(), w.history.size()},
+        {SNAP_OFFERS, sizeof(SnapOffer), w.offers.data(), w.offers.size()},
+        {SNAP_ACTIVE_RIDES, sizeof(SnapActiveRide), w.rides.data(), w.rides.size()},
+        {SNAP_PASSENGERS, sizeof(int32_t), w.passengers.data(), w.passengers.size()},
+        {SNAP_REQUESTS, sizeof(SnapRequest), w.requests.data(), w.requests.size()},
+        {SNAP_ROAD_PROFILES, sizeof(SnapRoadProfile), w.roadProfiles.data(), w.roadProfiles.size()},
+        {SNAP_EDGE_PROFILES, sizeof(uint32_t), w.edgeProfiles.data(), w.edgeProfiles.size()},
+    };
+    const uint32_t nsec = sizeof(secs) / sizeof(secs[0]);
+
+    // Lay the file out in one buffer so the checksum is a single pass.
+    size_t tableEnd = sizeof(SnapshotHeader) + nsec * sizeof(SnapshotSection);
+    size_t total = Align8(tableEnd);
+    SnapshotSection table[nsec];
+    for (uint32_t i = 0; i < nsec; i++)
+    {
+        table[i].kind = secs[i].kind;
+        table[i].recordSize = secs[i].recordSize;
+        table[i].offset = total;
+        table[i].count = secs[i].count;
+        total = Align8(total + secs[i].count * secs[i].recordSize);
+    }
+
+    vector<unsigned char> buf(total, 0);
+    memcpy(&buf[sizeof(SnapshotHeader)], table, sizeof(table));
+    for (uint32_t i = 0; i < nsec; i++)
+    {
+        if (secs[i].count)
+            memcpy(&buf[table[i].offset], secs[i].data, secs[i].count * secs[i].recordSize);
+    }
+
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.sectionCount = nsec;
+    h.fileSize = total;
+    h.headerSize = sizeof(SnapshotHeader);
+    h.journalLsn = JournalCurrentLsn(baseDir);
+    h.checksum = Crc32(&buf[sizeof(SnapshotHeader)], total - sizeof(SnapshotHeader));
+    memcpy(&buf[0], &h, sizeof(h));
+
+    // Write to a temp file, then rename over the old snapshot.
+    string path = JoinPath(baseDir, SNAPSHOT_FILE);
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+
+    size_t done = 0;
+    while (done < total)
+    {
+        ssize_t n = write(fd, &buf[done], total - done);
+        if (n <= 0)
+        {
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        done += (size_t)n;
+    }
+    bool ok = (fsync(fd) == 0);
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // The rename is durable only once the directory entry is.
+    int dir = open(baseDir ? baseDir : ".", O_RDONLY);
+    ok = dir >= 0 && fsync(dir) == 0;
+    if (dir >= 0) close(dir);
+    return ok;
+}
+
+// -------------------------
+// Load helpers
+// -------------------------
+struct SnapshotView
+{
+    const unsigned char* base;
+    const SnapshotHeader* header;
+    const SnapshotSection* table;
+};
+
+// Missing or malformed sections read as empty.
+static const void* FindSection(const SnapshotView& v, uint32_t kind, uint32_t recordSize, uint64_t& count)
+{
+    count = 0;
+    for (uint32_t i = 0; i < v.header->sectionCount; i++)
+    {
+        const SnapshotSection& s = v.table[i];
+        if (s.kind != kind) continue;
+        if (s.recordSize != recordSize) return nullptr;
+        if (s.offset > v.header->fileSize ||
+            s.count * s.recordSize > v.header->fileSize - s.offset)
+            return nullptr;
+        count = s.count;
+        return v.base + s.offset;
+    }
+    return nullptr;
+}
+
+static char* CopyName(const char* strings, uint64_t stringsLen, uint32_t off)
+{
+    return CurrentEngine().userStrings.Copy((off < stringsLen) ? strings + off : "");
+}
+
+struct SnapshotSections
+{
+    uint64_t nStr, nPlaces, nOffsets, nEdges, nUsers, nHist, nOffers, nRides, nPass, nReq;
+    uint64_t nProfiles, nEdgeProfiles;
+    const char* strings;
+    const SnapPlace* places;
+    const uint32_t* offsets;
+    const SnapEdge* edges;
+    const SnapUser* users;
+    const SnapHistory* hist;
+    const SnapOffer* offers;
+    const SnapActiveRide* rides;
+    const int32_t* pass;
+    const SnapRequest* reqs;
+    const SnapRoadProfile* profiles;
+    const uint32_t* edgeProfiles;
+};
+
+static void FindSections(const SnapshotView& v, SnapshotSections& s)
+{
+    s.strings = (const char*)FindSection(v, SNAP_STRINGS, 1, s.nStr);
+    s.places = (const SnapPlace*)FindSection(v, SNAP_PLACES, sizeof(SnapPlace), s.nPlaces);
+    s.offsets = (const uint32_t*)FindSection(v, SNAP_EDGE_OFFSETS, sizeof(uint32_t), s.nOffsets);
+    s.edges = (const SnapEdge*)FindSection(v, SNAP_EDGES, sizeof(SnapEdge), s.nEdges);
+    s.users = (const SnapUser*)FindSection(v, SNAP_USERS, sizeof(SnapUser), s.nUsers);
+    s.hist = (const SnapHistory*)FindSection(v, SNAP_HISTORY, sizeof(SnapHistory), s.nHist);
+    s.offers = (const SnapOffer*)FindSection(v, SNAP_OFFERS, sizeof(SnapOffer), s.nOffers);
+    s.rides = (const SnapActiveRide*)FindSection(v, SNAP_ACTIVE_RIDES, sizeof(SnapActiveRide), s.nRides);
+    s.pass = (const int32_t*)FindSection(v, SNAP_PASSENGERS, sizeof(int32_t), s.nPass);
+    s.reqs = (const SnapRequest*)FindSection(v, SNAP_REQUESTS, sizeof(SnapRequest), s.nReq);
+    s.profiles = (const SnapRoadProfile*)FindSection(v, SNAP_ROAD_PROFILES, sizeof(SnapRoadProfile), s.nProfiles);
+    s.edgeProfiles = (const uint32_t*)FindSection(v, SNAP_EDGE_PROFILES, sizeof(uint32_t), s.nEdgeProfiles);
+    if (s.nEdgeProfiles != s.nEdges)
+        s.edgeProfiles = nullptr;
+}
+
+// Every index the rebuild follows, checked before the engine is touched.
+// Dangling place and offer references are not errors: they load as
+// nullptr or are skipped, as the text loader does.
+static bool ValidateSections(const SnapshotSections& s)
+{
+    if (s.nOffsets != s.nPlaces + 1 && !(s.nPlaces == 0 && s.nOffsets <= 1))
+        return false;
+    for (uint64_t i = 0; i < s.nPlaces; i++)
+        if (s.offsets[i] > s.offsets[i + 1] || s.offsets[i + 1] > s.nEdges)
+            return false;
+    for (uint64_t i = 0; i < s.nUsers; i++)
+        if (s.users[i].historyBegin > s.nHist || s.users[i].historyCount > s.nHist - s.users[i].historyBegin)
+            return false;
+    for (uint64_t i = 0; i < s.nRides; i++)
+    {
+        const SnapActiveRide& sr = s.rides[i];
+        if (sr.offer < s.nOffers &&
+            (sr.passengerBegin > s.nPass || sr.passengerCount > s.nPass - sr.passengerBegin))
+            return false;
+    }
+    return true;
+}
+
+static void RebuildFromSections(const SnapshotSections& s)
+{
+    Engine& eng = CurrentEngine();
+
+    // Places + CSR edges -> Place list with RoadLink chains
+    // Profiles are interned again; rows keep their order in a saved state,
+    // but map through the ids to be safe.
+    vector<int> profileByIdx(s.nProfiles);
+    for (uint64_t i = 0; i < s.nProfiles; i++)
+        profileByIdx[i] = InternRoadProfile(s.profiles[i].cost);
+
+    vector<Place*> placeByIdx(s.nPlaces);
+    for (uint64_t i = 0; i < s.nPlaces; i++)
+    {
+        uint32_t off = s.places[i].nameOff;
+        placeByIdx[i] = AppendPlace(off < s.nStr ? s.strings + off : "");
+    }
+    for (uint64_t i = 0; i < s.nPlaces; i++)
+    {
+        RoadLink* last = nullptr;
+        uint32_t b = s.offsets[i], e = s.offsets[i + 1];
+        for (uint32_t k = b; k < e; k++)
+        {
+            if (s.edges[k].to >= s.nPlaces) continue;
+            RoadLink* link = eng.roadLinkPool.Alloc();
+            link->to = placeByIdx[s.edges[k].to];
+            link->cost = s.edges[k].cost;
+            link->profile = (s.edgeProfiles && s.edgeProfiles[k] < s.nProfiles) ? profileByIdx[s.edgeProfiles[k]] : -1;
+            link->next = nullptr;
+            if (last) last->next = link; else placeByIdx[i]->firstLink = link;
+            last = link;
+        }
+    }
+    RoadGraphChanged();
+
+    // Users + history
+    vector<User*> userNodes(s.nUsers);
+    vector<HistoryNode*> histNodes;
+    for (uint64_t i = 0; i < s.nUsers; i++)
+    {
+        const SnapUser& su = s.users[i];
+        User* u = eng.userPool.Alloc();
+        u->userId = su.userId;
+        u->name = CopyName(s.strings, s.nStr, su.nameOff);
+        u->isDriver = su.isDriver;
+        u->rating = su.rating;
+        u->completedRides = su.completedRides;
+        u->history = nullptr;
+        u->historyOffset = -1;
+        u->historyRows = 0;
+        u->historyIndexed = false;
+        u->left = u->right = nullptr;
+        userNodes[i] = u;
+
+        histNodes.resize(su.historyCount);
+        for (uint32_t k = 0; k < su.historyCount; k++)
+        {
+            const SnapHistory& sh = s.hist[su.historyBegin + k];
+            HistoryNode* h = eng.historyPool.Alloc();
+            h->rideId = sh.rideId;
+            h->from = CopyName(s.strings, s.nStr, sh.fromOff);
+            h->to = CopyName(s.strings, s.nStr, sh.toOff);
+            h->time = sh.time;
+            histNodes[k] = h;
+            HistoryIndexAdd(u->userId, u->isDriver, h->rideId, h->from, h->to, h->time);
+        }
+        u->history = BuildHistoryTree(histNodes.data(), (int)su.historyCount);
+    }
+    eng.userRoot = BuildUserTree(userNodes.data(), (int)s.nUsers);
+
+    // Offers (kept in saved list order)
+    vector<RideOffer*> offerByIdx(s.nOffers);
+    RideOffer* otail = nullptr;
+    for (uint64_t i = 0; i < s.nOffers; i++)
+    {
+        const SnapOffer& so = s.offers[i];
+        RideOffer* o = eng.offerPool.Alloc();
+        o->offerId = so.offerId;
+        o->driverId = so.driverId;
+        o->startPlace = (so.startPlace < s.nPlaces) ? placeByIdx[so.startPlace] : nullptr;
+        o->endPlace = (so.endPlace < s.nPlaces) ? placeByIdx[so.endPlace] : nullptr;
+        o->departTime = so.departTime;
+        o->capacity = so.capacity;
+        o->seatsLeft = so.seatsLeft;
+        o->next = nullptr;
+        o->storeRow = -1;
+        o->routeSlot = -1;
+        if (otail) otail->next = o; else eng.offerHead = o;
+        otail = o;
+        offerByIdx[i] = o;
+    }
+    OfferStoreReset();
+
+    // Active rides
+    ClearActiveRides();
+    for (uint64_t i = 0; i < s.nRides; i++)
+    {
+        const SnapActiveRide& sr = s.rides[i];
+        if (sr.offer >= s.nOffers) continue;
+        StorageAttachActiveRide(sr.rideId, offerByIdx[sr.offer],
+                                (const int*)s.pass + sr.passengerBegin, (int)sr.passengerCount);
+    }
+
+    // Pending requests (heap order; older snapshots have none)
+    vector<RideRequest*> heap(s.nReq);
+    for (uint64_t i = 0; i < s.nReq; i++)
+    {
+        const SnapRequest& sq = s.reqs[i];
+        RideRequest* r = eng.requestPool.Alloc();
+        r->requestId = sq.requestId;
+        r->passengerId = sq.passengerId;
+        r->fromPlace = (sq.fromPlace < s.nPlaces) ? placeByIdx[sq.fromPlace] : nullptr;
+        r->toPlace = (sq.toPlace < s.nPlaces) ? placeByIdx[sq.toPlace] : nullptr;
+        r->earliest = sq.earliest;
+        r->latest = sq.latest;
+        r->heapIndex = -1;
+        heap[i] = r;
+    }
+    StorageRestoreRequests(heap.data(), (int)s.nReq);
+}
+
+// -------------------------
+// Public API: load
+// -------------------------
+bool LoadSnapshot(const char* baseDir)
+{
+    const Engine& eng = CurrentEngine();
+    if (eng.placeHead || eng.userRoot || eng.offerHead)
+        return false;
+
+    string path = JoinPath(baseDir, SNAPSHOT_FILE);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    SnapshotView v;
+    v.base = (const unsigned char*)map;
+    v.header = (const SnapshotHeader*)map;
+    v.table = (const SnapshotSection*)(v.base + sizeof(SnapshotHeader));
+
+    bool ok = memcmp(v.header->magic, SNAPSHOT_MAGIC, sizeof(v.header->magic)) == 0 &&
+              v.header->version == SNAPSHOT_VERSION &&
+              v.header->headerSize == sizeof(SnapshotHeader) &&
+              v.header->fileSize == size &&
+              sizeof(SnapshotHeader) + (uint64_t)v.header->sectionCount * sizeof(SnapshotSection) <= size;
+    if (ok)
+    {
+        madvise(map, size, MADV_SEQUENTIAL);
+        ok = Crc32(v.base + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) == v.header->checksum;
+    }
+    SnapshotSections secs;
+    if (ok)
+    {
+        FindSections(v, secs);
+        ok = ValidateSections(secs);
+    }
+    if (ok)
+        RebuildFromSections(secs);
+
+    // The .dat segments on disk do not describe this state.
+    SegmentMarkAllDirty();
+
+    uint64_t lsn = v.header->journalLsn;
+    munmap(map, size);
+    return ok && JournalReplayFrom(baseDir, lsn);
+}
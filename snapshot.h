@@ -0,0 +1,133 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// Binary snapshot — a single versioned, checksummed file written next to
+// the text .dat files.
+//
+// Layout:
+//   SnapshotHeader
+//   SnapshotSection[sectionCount]      (section table)
+//   section payloads, each 8-byte aligned
+//
+// Sections are flat arrays of fixed-size records (places, CSR edge
+// offsets + edges and their time-dependent profiles, users, history, offers, active rides, passengers) and
+// one string blob that every name points into by offset. Pending
+// requests are stored in heap array order and restored without sifting. Loading maps
+// the file, checks the CRC32 and links the structures straight from the
+// arrays — no tokenizing and no per-record searches. Journal records
+// newer than journalLsn are replayed on top.
+
+#include "roads.h"
+
+#include <cstdint>
+
+#define SNAPSHOT_FILE "snapshot.bin"
+#define SNAPSHOT_MAGIC "RSSNAP\0\1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONE 0xFFFFFFFFu
+
+enum SnapshotSectionKind
+{
+    SNAP_STRINGS = 1,
+    SNAP_PLACES,
+    SNAP_EDGE_OFFSETS,   // placeCount + 1 entries (CSR row starts)
+    SNAP_EDGES,
+    SNAP_USERS,
+    SNAP_HISTORY,
+    SNAP_OFFERS,
+    SNAP_ACTIVE_RIDES,
+    SNAP_PASSENGERS,
+    SNAP_REQUESTS,         // requestHeap in array order (optional)
+    SNAP_ROAD_PROFILES,    // roadProfiles rows (optional)
+    SNAP_EDGE_PROFILES     // uint32 per SNAP_EDGES entry: profile row or SNAPSHOT_NONE (optional)
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+    uint32_t checksum;      // CRC32 of everything after the header
+    uint32_t headerSize;
+    uint64_t journalLsn;    // last journal record included
+};
+
+struct SnapshotSection
+{
+    uint32_t kind;
+    uint32_t recordSize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct SnapPlace
+{
+    uint32_t nameOff;
+};
+
+struct SnapEdge
+{
+    uint32_t to;            // place index
+    int32_t cost;
+};
+
+struct SnapRoadProfile
+{
+    int32_t cost[ROAD_PROFILE_POINTS];
+};
+
+struct SnapUser
+{
+    int32_t userId;
+    uint32_t nameOff;
+    int32_t isDriver;
+    int32_t rating;
+    int32_t completedRides;
+    uint32_t historyBegin;  // index into SNAP_HISTORY
+    uint32_t historyCount;
+};
+
+struct SnapHistory
+{
+    int32_t rideId;
+    uint32_t fromOff;
+    uint32_t toOff;
+    int32_t time;
+};
+
+struct SnapOffer
+{
+    int32_t offerId;
+    int32_t driverId;
+    uint32_t startPlace;    // place index or SNAPSHOT_NONE
+    uint32_t endPlace;
+    int32_t departTime;
+    int32_t capacity;
+    int32_t seatsLeft;
+};
+
+struct SnapActiveRide
+{
+    int32_t rideId;
+    uint32_t offer;         // offer index or SNAPSHOT_NONE
+    uint32_t passengerBegin;
+    uint32_t passengerCount;
+};
+
+struct SnapRequest
+{
+    int32_t requestId;
+    int32_t passengerId;
+    uint32_t fromPlace;     // place index or SNAPSHOT_NONE
+    uint32_t toPlace;
+    int32_t earliest;
+    int32_t latest;
+};
+
+bool SaveSnapshot(const char* baseDir = ".");
+
+// Expects an empty in-memory state (see ResetInMemoryState in storage.h).
+bool LoadSnapshot(const char* baseDir = ".");
+
+#endif
@@ -3,60 +3,187 @@
 #include "roads.h"
 #include "ride.h"
 #include "user.h"
+#include "journal.h"
+#include "history_index.h"
+#include "history_segment.h"
+#include "segments.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
+#include "offer_store.h"
+#include "offer_routes.h"
+#include "engine.h"
 
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <cstring>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <iterator>
+#include <charconv>
+#include <unordered_map>
+#include <deque>
+#include <set>
+#include <climits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 // -------------------------
-// MOVED FROM roads.cpp
+// Text parsing
 // -------------------------
-bool loadRoadNetworkFromFile(fstream &roadFile)
+// Files are read whole into one buffer and tokenized in place: each token
+// is NUL-terminated inside the buffer (no std::string per field) and
+// numbers go through std::from_chars.
+struct TextBuffer
+{
+    vector<char> data;   // file bytes + trailing NUL
+    char* pos;
+    char* end;
+};
+
+static bool ReadTextFile(const string& path, TextBuffer& buf)
 {
-    string line;
-    while (getline(roadFile, line))
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
     {
-        if (line.empty()) continue;
-        stringstream ss(line);
-        char from_place[256];
-        char to_place[256];
-        int cost;
-        if (!(ss >> from_place >> to_place >> cost))
-            continue;
-        AddRoad(from_place, to_place, cost);
+        close(fd);
+        return false;
     }
+
+    size_t size = (size_t)st.st_size;
+    buf.data.resize(size + 1);
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = read(fd, buf.data.data() + done, size - done);
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+
+    buf.data[done] = '\0';
+    buf.pos = buf.data.data();
+    buf.end = buf.pos + done;
     return true;
 }
 
+static void TextFromStream(istream& in, TextBuffer& buf)
+{
+    buf.data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    size_t size = buf.data.size();
+    buf.data.push_back('\0');
+    buf.pos = buf.data.data();
+    buf.end = buf.pos + size;
+}
+
+static inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\0';
+}
+
+struct TextLine
+{
+    char* pos;
+    char* end;
+};
+
+// Cuts the next non-empty line out of the buffer ('\n' becomes NUL).
+static bool NextLine(TextBuffer& b, TextLine& line)
+{
+    while (b.pos < b.end)
+    {
+        char* nl = (char*)memchr(b.pos, '\n', (size_t)(b.end - b.pos));
+        char* stop = nl ? nl : b.end;
+        line.pos = b.pos;
+        line.end = stop;
+        *stop = '\0';
+        b.pos = nl ? nl + 1 : b.end;
+
+        char* p = line.pos;
+        while (p < line.end && IsBlank(*p)) p++;
+        if (p < line.end)
+            return true;
+    }
+    return false;
+}
+
+// Next whitespace-separated token of the line, NUL-terminated in place.
+static char* NextToken(TextLine& line)
+{
+    while (line.pos < line.end && IsBlank(*line.pos)) line.pos++;
+    if (line.pos >= line.end)
+        return nullptr;
+    char* tok = line.pos;
+    while (line.pos < line.end && !IsBlank(*line.pos)) line.pos++;
+    if (line.pos < line.end)
+        *line.pos++ = '\0';
+    return tok;
+}
+
+static bool NextInt(TextLine& line, int& value)
+{
+    while (line.pos < line.end && IsBlank(*line.pos)) line.pos++;
+    from_chars_result r = from_chars(line.pos, line.end, value);
+    if (r.ec != errc() || (r.ptr < line.end && !IsBlank(*r.ptr)))
+        return false;
+    line.pos = (char*)r.ptr;
+    return true;
+}
+
+// Leading record count of a .dat file (0 if missing). Capped at the
+// lines the rest of the buffer can hold: callers reserve that many rows.
+static int ReadCount(TextBuffer& b)
+{
+    TextLine line;
+    int n = 0;
+    if (!NextLine(b, line) || !NextInt(line, n) || n < 0)
+        return 0;
+    size_t maxLines = (size_t)(b.end - b.pos) / 2 + 1;   // "x\n" each
+    return (size_t)n > maxLines ? (int)maxLines : n;
+}
+
 // -------------------------
 // Helpers: Users + History
 // -------------------------
-static void SaveHistoryInOrder(ofstream& out, HistoryNode* root, int userId)
+static void CollectHistoryInOrder(HistoryNode* root, vector<HistoryItem>& out)
 {
     if (!root) return;
-    SaveHistoryInOrder(out, root->left, userId);
-    out << userId << ' ' << root->rideId << ' '
-        << root->from << ' ' << root->to << ' '
-        << root->time << '\n';
-    SaveHistoryInOrder(out, root->right, userId);
+    CollectHistoryInOrder(root->left, out);
+    HistoryItem it;
+    it.rideId = root->rideId;
+    it.from = root->from;
+    it.to = root->to;
+    it.time = root->time;
+    out.push_back(it);
+    CollectHistoryInOrder(root->right, out);
 }
 
-static void SaveUsersInOrder(ofstream& out, User* root)
+// Users with lo <= userId <= hi, in order (BST range walk).
+static void CollectUsersInRange(User* root, int lo, int hi, vector<User*>& out)
 {
     if (!root) return;
-    SaveUsersInOrder(out, root->left);
-    out << root->userId << ' ' << root->name << ' '
-        << root->isDriver << ' ' << root->rating << ' ' << root->completedRides << '\n';
-    SaveUsersInOrder(out, root->right);
+    if (lo < root->userId)
+        CollectUsersInRange(root->left, lo, hi, out);
+    if (lo <= root->userId && root->userId <= hi)
+        out.push_back(root);
+    if (root->userId < hi)
+        CollectUsersInRange(root->right, lo, hi, out);
 }
 
-static int CountUsers(User* root)
+static void SaveUsers(ostream& out, const vector<User*>& users)
 {
-    if (!root) return 0;
-    return CountUsers(root->left) + 1 + CountUsers(root->right);
+    for (User* u : users)
+        out << u->userId << ' ' << u->name << ' '
+            << u->isDriver << ' ' << u->rating << ' ' << u->completedRides << '\n';
 }
 
 static int CountHistoryNodes(HistoryNode* root)
@@ -65,18 +192,58 @@ static int CountHistoryNodes(HistoryNode* root)
     return CountHistoryNodes(root->left) + 1 + CountHistoryNodes(root->right);
 }
 
-static int CountAllHistory(User* root)
+static int CountHistory(User* u)
 {
-    if (!root) return 0;
-    return CountAllHistory(root->left) + CountHistoryNodes(root->history) + CountAllHistory(root->right);
+    return HistoryOnDisk(u) ? u->historyRows : CountHistoryNodes(u->history);
 }
 
-static void SaveAllHistory(ofstream& out, User* root)
+// One compact group per user (see history_segment.h); `items` is reused.
+// Users whose history was never loaded get their group copied as is.
+// The offset of every group goes to the .idx file.
+static bool SaveHistory(ostream& out, const vector<User*>& users,
+                        vector<HistoryOffset>& offsets)
 {
-    if (!root) return;
-    SaveAllHistory(out, root->left);
-    SaveHistoryInOrder(out, root->history, root->userId);
-    SaveAllHistory(out, root->right);
+    uint32_t groups = 0;
+    uint64_t rows = 0;
+    for (User* u : users)
+    {
+        int n = CountHistory(u);
+        groups += (n > 0);
+        rows += (uint64_t)n;
+    }
+    if (!WriteHistorySegmentHeader(out, groups, rows))
+        return false;
+
+    vector<HistoryItem> items;
+    string raw;
+    for (User* u : users)
+    {
+        HistoryOffset entry;
+        entry.userId = u->userId;
+        entry.offset = (uint64_t)out.tellp();
+        if (HistoryOnDisk(u))
+        {
+            if (!ReadUserHistoryGroup(u, raw))
+                return false;
+            out.write(raw.data(), (streamsize)raw.size());
+            entry.rows = (uint32_t)u->historyRows;
+        }
+        else if (u->history)
+        {
+            items.clear();
+            CollectHistoryInOrder(u->history, items);
+            if (!WriteHistoryGroup(out, u->userId, items.data(), (int)items.size()))
+                return false;
+            entry.rows = (uint32_t)items.size();
+        }
+        else
+        {
+            continue;
+        }
+        offsets.push_back(entry);
+        if (!out) return false;
+    }
+    return true;
 }
 
 // -------------------------
@@ -85,32 +252,31 @@ static void SaveAllHistory(ofstream& out, User* root)
 static int CountRoadEdges()
 {
     int c = 0;
-    for (Place* p = placeHead; p; p = p->next)
+    for (Place* p = CurrentEngine().placeHead; p; p = p->next)
         for (RoadLink* e = p->firstLink; e; e = e->next)
             c++;
     return c;
 }
 
-static void SaveRoads(ofstream& out)
+static void SaveRoads(ostream& out)
 {
-    for (Place* p = placeHead; p; p = p->next)
+    for (Place* p = CurrentEngine().placeHead; p; p = p->next)
         for (RoadLink* e = p->firstLink; e; e = e->next)
-            out << p->name << ' ' << e->to->name << ' ' << e->cost << '\n';
+        {
+            out << p->name << ' ' << e->to->name << ' ' << e->cost;
+            // Profiled roads carry their hourly costs on the same line.
+            for (int h = 0; e->profile >= 0 && h < ROAD_PROFILE_POINTS; h++)
+                out << ' ' << RoadProfileCosts(e->profile)[h];
+            out << '\n';
+        }
 }
 
 // -------------------------
 // Helpers: Offers
 // -------------------------
-static int CountOffers()
-{
-    int c = 0;
-    for (RideOffer* o = offerHead; o; o = o->next) c++;
-    return c;
-}
-
-static void SaveOffers(ofstream& out)
+static void SaveOffers(ostream& out, const vector<RideOffer*>& offers)
 {
-    for (RideOffer* o = offerHead; o; o = o->next)
+    for (RideOffer* o : offers)
     {
         out << o->offerId << ' ' << o->driverId << ' '
             << (o->startPlace ? o->startPlace->name : "NULL") << ' '
@@ -122,44 +288,76 @@ static void SaveOffers(ofstream& out)
 // -------------------------
 // Helpers: Active rides
 // -------------------------
-static int CountActiveRides()
+static int CountPassengers(PassengerNode* p)
 {
-    int total = 0;
-    for (int i = 0; i < ActiveRideTableSize(); i++)
+    int c = 0;
+    while (p) { c++; p = p->next; }
+    return c;
+}
+
+static void SaveActiveRides(ostream& out, const vector<ActiveRide*>& rides)
+{
+    for (ActiveRide* ar : rides)
     {
-        for (ActiveRide* ar = ActiveRideBucketHead(i); ar; ar = ar->next)
-            total++;
+        int offerId = (ar->offer ? ar->offer->offerId : -1);
+        int pc = CountPassengers(ar->passengers);
+        out << ar->rideId << ' ' << offerId << ' ' << pc;
+        for (PassengerNode* p = ar->passengers; p; p = p->next)
+            out << ' ' << p->passengerId;
+        out << '\n';
     }
-    return total;
 }
 
-static int CountPassengers(PassengerNode* p)
+// -------------------------
+// Helpers: Pending requests
+// -------------------------
+// Heap array order, so loading needs no re-heapify.
+static void SaveRequests(ostream& out)
 {
-    int c = 0;
-    while (p) { c++; p = p->next; }
-    return c;
+    for (int i = 0; i < PendingRequestCount(); i++)
+    {
+        RideRequest* r = PendingRequestAt(i);
+        out << r->requestId << ' ' << r->passengerId << ' '
+            << (r->fromPlace ? r->fromPlace->name : "NULL") << ' '
+            << (r->toPlace ? r->toPlace->name : "NULL") << ' '
+            << r->earliest << ' ' << r->latest << '\n';
+    }
 }
 
-static void SaveActiveRides(ofstream& out)
+// -------------------------
+// CRC32 (IEEE, table driven)
+// -------------------------
+struct CrcTable
 {
-    for (int i = 0; i < ActiveRideTableSize(); i++)
+    uint32_t entry[256];
+
+    CrcTable()
     {
-        for (ActiveRide* ar = ActiveRideBucketHead(i); ar; ar = ar->next)
+        for (uint32_t i = 0; i < 256; i++)
         {
-            int offerId = (ar->offer ? ar->offer->offerId : -1);
-            int pc = CountPassengers(ar->passengers);
-            out << ar->rideId << ' ' << offerId << ' ' << pc;
-            for (PassengerNode* p = ar->passengers; p; p = p->next)
-                out << ' ' << p->passengerId;
-            out << '\n';
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            entry[i] = c;
         }
     }
+};
+
+uint32_t Crc32(const void* data, size_t len)
+{
+    static const CrcTable table;    // shared by every engine's saves
+    const uint32_t* crcTable = table.entry;
+    const unsigned char* p = (const unsigned char*)data;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        c = crcTable[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
 }
 
 // -------------------------
 // Public API
 // -------------------------
-static string JoinPath(const char* baseDir, const char* file)
+string JoinPath(const char* baseDir, const char* file)
 {
     string b = baseDir ? baseDir : ".";
     if (!b.empty() && b.back() != '/')
@@ -167,151 +365,948 @@ static string JoinPath(const char* baseDir, const char* file)
     return b + file;
 }
 
-bool SaveAll(const char* baseDir)
+static bool SyncFile(ofstream& out, const string& path)
 {
-    // 10.1 Save — in required order
+    out.flush();
+    if (!out) return false;
+    out.close();
 
-    // Users → BST traversal
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = (fsync(fd) == 0);
+    close(fd);
+    return ok;
+}
+
+// -------------------------
+// Segments (see segments.h)
+// -------------------------
+// Every segment that holds at least one record (full saves only).
+static void CollectPresentSegments(vector<int> present[SEG_KIND_COUNT])
+{
+    vector<User*> users;
+    CollectUsersInRange(CurrentEngine().userRoot, INT_MIN, INT_MAX, users);
+    for (User* u : users)
     {
-        ofstream out(JoinPath(baseDir, "users.dat"));
-        if (!out) return false;
-        out << CountUsers(userRoot) << '\n';
-        SaveUsersInOrder(out, userRoot);
+        int seg = SegmentOfKey(u->userId);
+        if (present[SEG_USERS].empty() || present[SEG_USERS].back() != seg)
+            present[SEG_USERS].push_back(seg);
+        if ((u->history || HistoryOnDisk(u)) &&
+            (present[SEG_HISTORY].empty() || present[SEG_HISTORY].back() != seg))
+            present[SEG_HISTORY].push_back(seg);
     }
 
-    // Places & roads → list traversal
+    set<int> offers, rides;
+    for (RideOffer* o = CurrentEngine().offerHead; o; o = o->next)
+        offers.insert(SegmentOfKey(o->offerId));
+    for (int i = 0; i < ActiveRideTableSize(); i++)
+        for (ActiveRide* ar = ActiveRideBucketHead(i); ar; ar = ar->next)
+            rides.insert(SegmentOfKey(ar->rideId));
+    present[SEG_OFFERS].assign(offers.begin(), offers.end());
+    present[SEG_ACTIVE_RIDES].assign(rides.begin(), rides.end());
+    present[SEG_ROADS].push_back(0);
+    present[SEG_REQUESTS].push_back(0);
+}
+
+static const char* const kWriteSpanNames[SEG_KIND_COUNT] = {
+    "write_users", "write_roads", "write_offers", "write_active_rides", "write_history", "write_requests"};
+
+// One planned segment formatted in memory. Only the engine thread reads
+// the engine; the files can then be written from any thread.
+struct SegmentImage
+{
+    SegmentEntry entry;
+    string dat;
+    string idx;        // history segments only
+};
+
+static bool FormatSegment(const SegmentEntry& e,
+                          const unordered_map<int, vector<RideOffer*>>& offers,
+                          const unordered_map<int, vector<ActiveRide*>>& rides,
+                          SegmentImage& img)
+{
+    TRACE_SPAN(kWriteSpanNames[e.kind]);
+    TRACE_ARG("segment", e.segment);
+    img.entry = e;
+    img.idx.clear();
+    ostringstream out;
+
+    switch (e.kind)
     {
-        ofstream out(JoinPath(baseDir, "roads.dat"));
-        if (!out) return false;
+    case SEG_USERS:
+    {
+        vector<User*> users;
+        CollectUsersInRange(CurrentEngine().userRoot, SegmentFirstKey(e.segment), SegmentLastKey(e.segment), users);
+        out << users.size() << '\n';
+        SaveUsers(out, users);
+        break;
+    }
+    case SEG_ROADS:
         out << CountRoadEdges() << '\n';
         SaveRoads(out);
+        break;
+    case SEG_REQUESTS:
+        out << PendingRequestCount() << '\n';
+        SaveRequests(out);
+        break;
+    case SEG_OFFERS:
+    {
+        auto it = offers.find(e.segment);
+        out << (it == offers.end() ? 0 : it->second.size()) << '\n';
+        if (it != offers.end())
+            SaveOffers(out, it->second);
+        break;
+    }
+    case SEG_ACTIVE_RIDES:
+    {
+        auto it = rides.find(e.segment);
+        out << (it == rides.end() ? 0 : it->second.size()) << '\n';
+        if (it != rides.end())
+            SaveActiveRides(out, it->second);
+        break;
     }
+    case SEG_HISTORY:
+    {
+        vector<User*> users;
+        vector<HistoryOffset> offsets;
+        CollectUsersInRange(CurrentEngine().userRoot, SegmentFirstKey(e.segment), SegmentLastKey(e.segment), users);
+        if (!SaveHistory(out, users, offsets))
+            return false;
+        ostringstream idx;
+        if (!WriteHistoryOffsets(idx, (uint64_t)out.tellp(), offsets))
+            return false;
+        img.idx = idx.str();
+        break;
+    }
+    }
+    if (!out) return false;
+    img.dat = out.str();
+    return true;
+}
 
-    // Ride offers → linked list
+static bool WriteSynced(const string& path, const string& data)
+{
+    ofstream out(path, ios::binary);
+    if (!out) return false;
+    out.write(data.data(), (streamsize)data.size());
+    return SyncFile(out, path);
+}
+
+// Any thread.
+static bool WriteSegmentImage(const char* baseDir, const SegmentImage& img)
+{
+    if (!WriteSynced(SegmentPath(baseDir, img.entry, ".dat"), img.dat))
+        return false;
+    return img.entry.kind != SEG_HISTORY ||
+           WriteSynced(SegmentPath(baseDir, img.entry, ".idx"), img.idx);
+}
+
+// Formats the planned segments one by one and hands each to `done`.
+static bool FormatPlannedSegments(const SegmentSavePlan& plan,
+                                  const function<bool(SegmentImage&)>& done)
+{
+    TRACE_SPAN("save_write");
+    TRACE_ARG("segments", plan.write.size());
+
+    // Offers and active rides have no ordered index: bucket them in one pass.
+    set<int> offerSegs, rideSegs;
+    for (const SegmentEntry& e : plan.write)
     {
-        ofstream out(JoinPath(baseDir, "offers.dat"));
-        if (!out) return false;
-        out << CountOffers() << '\n';
-        SaveOffers(out);
+        if (e.kind == SEG_OFFERS) offerSegs.insert(e.segment);
+        if (e.kind == SEG_ACTIVE_RIDES) rideSegs.insert(e.segment);
+    }
+    unordered_map<int, vector<RideOffer*>> offers;
+    unordered_map<int, vector<ActiveRide*>> rides;
+    if (!offerSegs.empty())
+        for (RideOffer* o = CurrentEngine().offerHead; o; o = o->next)
+            if (offerSegs.count(SegmentOfKey(o->offerId)))
+                offers[SegmentOfKey(o->offerId)].push_back(o);
+    if (!rideSegs.empty())
+        for (int i = 0; i < ActiveRideTableSize(); i++)
+            for (ActiveRide* ar = ActiveRideBucketHead(i); ar; ar = ar->next)
+                if (rideSegs.count(SegmentOfKey(ar->rideId)))
+                    rides[SegmentOfKey(ar->rideId)].push_back(ar);
+
+    SegmentImage img;
+    for (const SegmentEntry& e : plan.write)
+        if (!FormatSegment(e, offers, rides, img) || !done(img))
+            return false;
+    return true;
+}
+
+// Writes the planned segments under new names; the manifest rename in
+// SegmentCommit is what makes them live.
+static bool SaveAllFiles(const SegmentSavePlan& plan)
+{
+    const char* baseDir = plan.dir.c_str();
+    return FormatPlannedSegments(plan, [&](SegmentImage& img) { return WriteSegmentImage(baseDir, img); }) &&
+           SegmentCommit(plan);
+}
+
+static SegmentSavePlan PlanSave(const char* baseDir, const JournalCheckpoint& cp)
+{
+    TRACE_SPAN("save_plan");
+    vector<int> present[SEG_KIND_COUNT];
+    if (SegmentNeedsFullSave(baseDir))
+        CollectPresentSegments(present);
+    return SegmentPlanSave(baseDir, present, cp.lsn);
+}
+
+// -------------------------
+// Background save
+// -------------------------
+// The engine thread formats the planned segments into memory (the
+// point-in-time copy); a writer thread then writes and fsyncs them,
+// commits the manifest and finishes the journal checkpoint. No fork():
+// a child of a process with running helper threads (journal flusher,
+// ingest matcher, pool) could inherit a held malloc or pool lock.
+struct BackgroundSave
+{
+    thread writer;
+    atomic<bool> running{false};
+    atomic<int> lastResult{-1};    // -1 none, 0 failed, 1 ok
+
+    ~BackgroundSave()
+    {
+        Stop();
     }
 
-    // Active rides → hash table
+    // Engine shutdown (engine.h): lets the save finish.
+    static const int STOP_STAGE = ENGINE_STOP_BACKGROUND;
+    void Stop()
     {
-        ofstream out(JoinPath(baseDir, "active_rides.dat"));
-        if (!out) return false;
-        out << CountActiveRides() << '\n';
-        SaveActiveRides(out);
+        if (writer.joinable())
+            writer.join();
     }
+};
 
-    // History → per-user lists/BST
+static BackgroundSave& BgSave()
+{
+    return EnginePart<BackgroundSave>();
+}
+
+void WaitBackgroundSave()
+{
+    BgSave().Stop();
+}
+
+bool BackgroundSaveRunning()
+{
+    return BgSave().running.load();
+}
+
+int LastBackgroundSaveResult()
+{
+    return BgSave().lastResult.load();
+}
+
+bool SaveAllInBackground(const char* baseDir)
+{
+    WaitBackgroundSave();
+
+    JournalCheckpoint cp = JournalBeginCheckpoint(baseDir);
+    SegmentSavePlan plan = PlanSave(baseDir, cp);
+    vector<SegmentImage> images;
+    images.reserve(plan.write.size());
+    if (!FormatPlannedSegments(plan, [&](SegmentImage& img) { images.push_back(move(img)); return true; }))
     {
-        ofstream out(JoinPath(baseDir, "history.dat"));
-        if (!out) return false;
-        out << CountAllHistory(userRoot) << '\n';
-        SaveAllHistory(out, userRoot);
+        SegmentSaveDone(plan, false);
+        return false;
     }
 
+    BackgroundSave& bg = BgSave();
+    bg.running = true;
+    bg.writer = thread([cp, plan, images = move(images), &bg, eng = &CurrentEngine()]()
+    {
+        EngineScope use(*eng);
+        TRACE_SPAN("save_background");
+        bool ok = true;
+        for (const SegmentImage& img : images)
+            if (!(ok = WriteSegmentImage(plan.dir.c_str(), img)))
+                break;
+        ok = ok && SegmentCommit(plan);
+        if (ok)
+            METRIC_ADD(MC_SEGMENTS_WRITTEN, plan.write.size());
+        SegmentSaveDone(plan, ok);
+        JournalEndCheckpoint(plan.dir.c_str(), cp, ok);
+        bg.lastResult = ok ? 1 : 0;
+        bg.running = false;
+    });
     return true;
 }
 
-bool LoadAll(const char* baseDir)
+bool SaveAll(const char* baseDir)
+{
+    // One save per directory at a time.
+    WaitBackgroundSave();
+    METRIC_INC(MC_SAVES);
+    METRIC_TIMER(MH_SAVE_ALL);
+    TRACE_SPAN("save_all");
+
+    // The saved files become the journal checkpoint.
+    JournalCheckpoint cp = JournalBeginCheckpoint(baseDir);
+    SegmentSavePlan plan = PlanSave(baseDir, cp);
+    bool ok = SaveAllFiles(plan);
+    if (ok)
+        METRIC_ADD(MC_SEGMENTS_WRITTEN, plan.write.size());
+    SegmentSaveDone(plan, ok);
+    JournalEndCheckpoint(baseDir, cp, ok);
+    return ok;
+}
+
+// -------------------------
+// Loader: parse
+// -------------------------
+struct UserRow
 {
-    // 10.2 Load — read in same order; rebuild structures
+    int id;
+    char* name;
+    int isDriver;
+    int rating;
+    int completedRides;
+};
 
-    // Users
+struct RoadRow
+{
+    char* from;
+    char* to;
+    int cost;
+    bool hasProfile;
+    int profile[ROAD_PROFILE_POINTS];
+};
+
+struct OfferRow
+{
+    int offerId;
+    int driverId;
+    char* start;
+    char* end;
+    int departTime;
+    int capacity;
+    int seatsLeft;
+};
+
+struct ActiveRideRow
+{
+    int rideId;
+    int offerId;
+    int passengerBegin;
+    int passengerCount;
+};
+
+struct RequestRow
+{
+    int requestId;
+    int passengerId;
+    char* from;
+    char* to;
+    int earliest;
+    int latest;
+};
+
+struct HistoryFileRow
+{
+    int userId;
+    int rideId;
+    const char* from;
+    const char* to;
+    int time;
+};
+
+// One file's buffer plus the rows parsed out of it; names point into
+// the buffer, so it lives as long as the rows.
+template <typename Row>
+struct ParsedFile
+{
+    deque<TextBuffer> texts;   // one per file (segments)
+    vector<Row> rows;
+    deque<string> names;   // decoded names for binary files
+    bool ok = false;
+};
+
+// limit < 0: parse every line (roads.txt has no count header)
+static void ParseRoadLines(TextBuffer& b, int limit, vector<RoadRow>& rows)
+{
+    if (limit > 0) rows.reserve(limit);
+    TextLine line;
+    while ((limit < 0 || (int)rows.size() < limit) && NextLine(b, line))
     {
-        ifstream in(JoinPath(baseDir, "users.dat"));
-        if (!in) return false;
+        RoadRow r;
+        r.from = NextToken(line);
+        r.to = NextToken(line);
+        if (!r.from || !r.to || !NextInt(line, r.cost))
+            continue;
+        // Optional: ROAD_PROFILE_POINTS hourly costs.
         int n = 0;
-        in >> n;
-        for (int i = 0; i < n; i++)
+        while (n < ROAD_PROFILE_POINTS && NextInt(line, r.profile[n]))
+            n++;
+        r.hasProfile = n == ROAD_PROFILE_POINTS;
+        rows.push_back(r);
+    }
+}
+
+// Each Parse* appends one file's rows to `f`.
+static bool ParseUsers(const string& path, ParsedFile<UserRow>& f)
+{
+    TextBuffer& text = f.texts.emplace_back();
+    if (!ReadTextFile(path, text)) return false;
+    int n = ReadCount(text);
+    f.rows.reserve(f.rows.size() + n);
+    TextLine line;
+    for (int i = 0; i < n && NextLine(text, line); i++)
+    {
+        UserRow r;
+        r.name = nullptr;
+        if (!NextInt(line, r.id) || !(r.name = NextToken(line)) ||
+            !NextInt(line, r.isDriver) || !NextInt(line, r.rating))
+            return false;
+        // Backward compatibility: older files might not have completedRides.
+        if (!NextInt(line, r.completedRides))
+            r.completedRides = 0;
+        f.rows.push_back(r);
+    }
+    return true;
+}
+
+static bool ParseRoads(const string& path, ParsedFile<RoadRow>& f)
+{
+    TextBuffer& text = f.texts.emplace_back();
+    if (!ReadTextFile(path, text)) return false;
+    int n = ReadCount(text);
+    ParseRoadLines(text, n, f.rows);
+    return true;
+}
+
+static bool ParseOffers(const string& path, ParsedFile<OfferRow>& f)
+{
+    TextBuffer& text = f.texts.emplace_back();
+    if (!ReadTextFile(path, text)) return false;
+    int n = ReadCount(text);
+    f.rows.reserve(f.rows.size() + n);
+    TextLine line;
+    for (int i = 0; i < n && NextLine(text, line); i++)
+    {
+        OfferRow r;
+        if (NextInt(line, r.offerId) && NextInt(line, r.driverId) &&
+            (r.start = NextToken(line)) && (r.end = NextToken(line)) &&
+            NextInt(line, r.departTime) && NextInt(line, r.capacity) &&
+            NextInt(line, r.seatsLeft))
+            f.rows.push_back(r);
+    }
+    return true;
+}
+
+static bool ParseActiveRides(const string& path, ParsedFile<ActiveRideRow>& f, vector<int>& passengers)
+{
+    TextBuffer& text = f.texts.emplace_back();
+    if (!ReadTextFile(path, text)) return false;
+    int n = ReadCount(text);
+    f.rows.reserve(f.rows.size() + n);
+    TextLine line;
+    for (int i = 0; i < n && NextLine(text, line); i++)
+    {
+        ActiveRideRow r;
+        int pc;
+        if (!NextInt(line, r.rideId) || !NextInt(line, r.offerId) || !NextInt(line, pc))
+            continue;
+        r.passengerBegin = (int)passengers.size();
+        int id;
+        for (int j = 0; j < pc && NextInt(line, id); j++)
+            passengers.push_back(id);
+        r.passengerCount = (int)passengers.size() - r.passengerBegin;
+        f.rows.push_back(r);
+    }
+    return true;
+}
+
+static bool ParseRequests(const string& path, ParsedFile<RequestRow>& f)
+{
+    TextBuffer& text = f.texts.emplace_back();
+    if (!ReadTextFile(path, text)) return false;
+    int n = ReadCount(text);
+    f.rows.reserve(f.rows.size() + n);
+    TextLine line;
+    for (int i = 0; i < n && NextLine(text, line); i++)
+    {
+        RequestRow r;
+        if (NextInt(line, r.requestId) && NextInt(line, r.passengerId) &&
+            (r.from = NextToken(line)) && (r.to = NextToken(line)) &&
+            NextInt(line, r.earliest) && NextInt(line, r.latest))
+            f.rows.push_back(r);
+    }
+    return true;
+}
+
+static bool ParseHistorySegment(ifstream& in, ParsedFile<HistoryFileRow>& f)
+{
+    uint32_t groups;
+    uint64_t rows, left;
+    if (!ReadHistorySegmentHeader(in, groups, rows, left))
+        return false;
+    f.rows.reserve(f.rows.size() + rows);
+
+    HistoryGroup g;
+    for (uint32_t i = 0; i < groups; i++)
+    {
+        if (!ReadHistoryGroup(in, g, left))
+            return false;
+        size_t base = f.names.size();
+        for (const string& name : g.dict)
+            f.names.push_back(name);
+        for (int k = 0; k < g.Count(); k++)
         {
-            int id, isDriver, rating, completedRides;
-            string name;
-            if (!(in >> id >> name >> isDriver >> rating))
-                return false;
-            // Backward compatibility: older files might not have completedRides.
-            if (!(in >> completedRides))
+            HistoryFileRow r;
+            r.userId = g.userId;
+            r.rideId = g.rideIds[k];
+            r.from = f.names[base + g.fromIdx[k]].c_str();
+            r.to = f.names[base + g.toIdx[k]].c_str();
+            r.time = g.times[k];
+            f.rows.push_back(r);
+        }
+    }
+    return true;
+}
+
+static bool ParseHistory(const string& path, ParsedFile<HistoryFileRow>& f)
+{
+    {
+        ifstream in(path, ios::binary);
+        if (in && IsHistorySegment(in))
+            return ParseHistorySegment(in, f);
+    }
+
+    // Older text format: "userId rideId from to time" per line
+    TextBuffer& text = f.texts.emplace_back();
+    if (!ReadTextFile(path, text)) return false;
+    int n = ReadCount(text);
+    f.rows.reserve(f.rows.size() + n);
+    TextLine line;
+    for (int i = 0; i < n && NextLine(text, line); i++)
+    {
+        HistoryFileRow r;
+        if (NextInt(line, r.userId) && NextInt(line, r.rideId) &&
+            (r.from = NextToken(line)) && (r.to = NextToken(line)) &&
+            NextInt(line, r.time))
+            f.rows.push_back(r);
+    }
+    return true;
+}
+
+// Parses every file of one kind into `f`, in order.
+template <typename Row, typename Parse>
+static void ParseFiles(const vector<string>& paths, ParsedFile<Row>& f, Parse parse)
+{
+    f.ok = true;
+    for (const string& path : paths)
+    {
+        if (!parse(path, f))
+        {
+            f.ok = false;
+            return;
+        }
+    }
+}
+
+bool loadRoadNetworkFromFile(fstream &roadFile)
+{
+    TextBuffer b;
+    TextFromStream(roadFile, b);
+    vector<RoadRow> rows;
+    ParseRoadLines(b, -1, rows);
+    for (const RoadRow& r : rows)
+        SetLinkProfile(AddRoad(r.from, r.to, r.cost), r.hasProfile ? r.profile : nullptr);
+    return true;
+}
+
+bool ForEachRoadInFile(const char* path,
+                       const function<void(const char*, const char*, int, const int*)>& fn)
+{
+    TextBuffer b;
+    if (!ReadTextFile(path, b))
+        return false;
+    vector<RoadRow> rows;
+    ParseRoadLines(b, -1, rows);
+    for (const RoadRow& r : rows)
+        fn(r.from, r.to, r.cost, r.hasProfile ? r.profile : nullptr);
+    return true;
+}
+
+// -------------------------
+// Loader: rebuild
+// -------------------------
+static bool SortedById(const vector<UserRow>& rows)
+{
+    for (size_t i = 1; i < rows.size(); i++)
+        if (rows[i - 1].id > rows[i].id) return false;
+    return true;
+}
+
+static void BuildUsers(const vector<UserRow>& rows)
+{
+    Engine& eng = CurrentEngine();
+    if (eng.userRoot || !SortedById(rows))
+    {
+        for (const UserRow& r : rows)
+        {
+            eng.userRoot = CreateUser(eng.userRoot, r.id, r.name, r.isDriver);
+            User* u = SearchUser(eng.userRoot, r.id);
+            if (u)
             {
-                completedRides = 0;
-                in.clear();
+                u->rating = r.rating;
+                u->completedRides = r.completedRides;
             }
-            userRoot = CreateUser(userRoot, id, name.c_str(), isDriver);
-            User* u = SearchUser(userRoot, id);
-            if (u)
+        }
+        return;
+    }
+
+    // users.dat is written in order: link a balanced tree directly.
+    vector<User*> nodes(rows.size());
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        const UserRow& r = rows[i];
+        User* u = eng.userPool.Alloc();
+        METRIC_INC(MC_ALLOC_USER);
+        u->userId = r.id;
+        u->name = eng.userStrings.Copy(r.name);
+        u->isDriver = r.isDriver;
+        u->rating = r.rating;
+        u->completedRides = r.completedRides;
+        u->history = nullptr;
+        u->historyOffset = -1;
+        u->historyRows = 0;
+        u->historyIndexed = false;
+        u->left = u->right = nullptr;
+        nodes[i] = u;
+    }
+    eng.userRoot = BuildUserTree(nodes.data(), (int)nodes.size());
+}
+
+static HistoryNode* NewHistoryNode(const HistoryFileRow& r)
+{
+    Engine& eng = CurrentEngine();
+    HistoryNode* h = eng.historyPool.Alloc();
+    METRIC_INC(MC_ALLOC_HISTORY_NODE);
+    h->rideId = r.rideId;
+    h->from = eng.userStrings.Copy(r.from);
+    h->to = eng.userStrings.Copy(r.to);
+    h->time = r.time;
+    h->left = h->right = nullptr;
+    return h;
+}
+
+static void BuildHistory(const vector<HistoryFileRow>& rows)
+{
+    // history.dat is grouped by user and sorted by time inside a group.
+    vector<HistoryNode*> nodes;
+    size_t i = 0;
+    while (i < rows.size())
+    {
+        size_t j = i + 1;
+        bool sorted = true;
+        while (j < rows.size() && rows[j].userId == rows[i].userId)
+        {
+            if (rows[j].time < rows[j - 1].time) sorted = false;
+            j++;
+        }
+
+        User* u = SearchUser(CurrentEngine().userRoot, rows[i].userId);
+        if (u && !u->history && sorted)
+        {
+            nodes.clear();
+            for (size_t k = i; k < j; k++)
             {
-                u->rating = rating;
-                u->completedRides = completedRides;
+                nodes.push_back(NewHistoryNode(rows[k]));
+                HistoryIndexAdd(u->userId, u->isDriver, rows[k].rideId,
+                                rows[k].from, rows[k].to, rows[k].time);
             }
+            u->history = BuildHistoryTree(nodes.data(), (int)nodes.size());
+        }
+        else
+        {
+            for (size_t k = i; k < j; k++)
+                AddHistory(rows[k].userId, rows[k].rideId, rows[k].from, rows[k].to, rows[k].time);
         }
+        i = j;
+    }
+}
+
+static void BuildOffersAndRides(const vector<OfferRow>& offers,
+                                const vector<ActiveRideRow>& rides,
+                                const vector<int>& passengers)
+{
+    unordered_map<int, RideOffer*> byId;
+    byId.reserve(offers.size());
+    for (const OfferRow& r : offers)
+    {
+        RideOffer* o = CreateRideOffer(r.offerId, r.driverId, r.start, r.end, r.departTime, r.capacity);
+        if (!o) continue;
+        o->seatsLeft = r.seatsLeft;
+        OfferStoreSeatsChanged(o);
+        byId[r.offerId] = o;   // last one wins, like FindOfferById on the list
     }
 
-    // Roads
+    ClearActiveRides();
+    for (const ActiveRideRow& r : rides)
     {
-        ifstream in(JoinPath(baseDir, "roads.dat"));
-        if (!in) return false;
-        int m = 0;
-        in >> m;
-        for (int i = 0; i < m; i++)
+        auto it = byId.find(r.offerId);
+        if (it == byId.end()) continue;
+        StorageAttachActiveRide(r.rideId, it->second,
+                                passengers.data() + r.passengerBegin, r.passengerCount);
+    }
+}
+
+// Rows are in saved heap order: rebuilt without going through
+// CreateRideRequest (no journaling, no sift-up per request).
+static void BuildRequests(const vector<RequestRow>& rows)
+{
+    vector<RideRequest*> heap(rows.size());
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        const RequestRow& r = rows[i];
+        RideRequest* q = CurrentEngine().requestPool.Alloc();
+        METRIC_INC(MC_ALLOC_REQUEST);
+        q->requestId = r.requestId;
+        q->passengerId = r.passengerId;
+        q->fromPlace = GetOrCreatePlace(r.from);
+        q->toPlace = GetOrCreatePlace(r.to);
+        q->earliest = r.earliest;
+        q->latest = r.latest;
+        q->heapIndex = -1;
+        heap[i] = q;
+    }
+    StorageRestoreRequests(heap.data(), (int)heap.size());
+}
+
+// Files holding each kind of record: the live segments named by the
+// manifest, or the single .dat files of the older layout.
+struct LoadSources
+{
+    bool segmented;
+    bool empty;                     // nothing saved yet: no manifest, no .dat
+    SegmentManifest manifest;
+    vector<string> paths[SEG_KIND_COUNT];
+    vector<string> historyIdx;      // parallel to paths[SEG_HISTORY]
+};
+
+static void FindLoadSources(const char* baseDir, LoadSources& src)
+{
+    src.segmented = ReadSegmentManifest(baseDir, src.manifest);
+    src.empty = false;
+    if (src.segmented)
+    {
+        for (const SegmentEntry& e : src.manifest.entries)
         {
-            string from, to;
-            int cost;
-            in >> from >> to >> cost;
-            AddRoad(from.c_str(), to.c_str(), cost);
+            src.paths[e.kind].push_back(SegmentPath(baseDir, e, ".dat"));
+            if (e.kind == SEG_HISTORY)
+                src.historyIdx.push_back(SegmentPath(baseDir, e, ".idx"));
         }
+        return;
     }
 
-    // Offers
+    src.paths[SEG_USERS].push_back(JoinPath(baseDir, "users.dat"));
+    src.paths[SEG_ROADS].push_back(JoinPath(baseDir, "roads.dat"));
+    src.paths[SEG_OFFERS].push_back(JoinPath(baseDir, "offers.dat"));
+    src.paths[SEG_ACTIVE_RIDES].push_back(JoinPath(baseDir, "active_rides.dat"));
+    src.paths[SEG_HISTORY].push_back(JoinPath(baseDir, "history.dat"));
+    src.historyIdx.push_back(JoinPath(baseDir, HISTORY_OFFSETS_FILE));
+
+    // A manifest that exists but cannot be read is not an empty base.
+    src.empty = access(JoinPath(baseDir, SEGMENT_DIR "/" SEGMENT_MANIFEST).c_str(), F_OK) != 0;
+    for (int k = 0; k < SEG_KIND_COUNT; k++)
+        for (const string& path : src.paths[k])
+            src.empty = src.empty && access(path.c_str(), F_OK) != 0;
+}
+
+// Lazy history: with a matching offset index the groups stay in the
+// history file and users only get their offset; the rows are read on
+// first access. Only used when loading into an empty engine.
+static int OpenLazyHistory(const string& path, const string& idxPath, vector<HistoryOffset>& offsets)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    char magic[8];
+    if (fstat(fd, &st) != 0 || pread(fd, magic, 8, 0) != 8 ||
+        !IsHistorySegmentMagic(magic) ||
+        !ReadHistoryOffsets(idxPath, (uint64_t)st.st_size, offsets))
     {
-        ifstream in(JoinPath(baseDir, "offers.dat"));
-        if (!in) return false;
-        int n = 0;
-        in >> n;
-        for (int i = 0; i < n; i++)
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct LazyHistoryFile
+{
+    int fd;
+    vector<HistoryOffset> offsets;
+};
+
+// All history files or none: a partial index falls back to parsing.
+static bool OpenAllLazyHistory(const LoadSources& src, vector<LazyHistoryFile>& files)
+{
+    const vector<string>& paths = src.paths[SEG_HISTORY];
+    files.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        files[i].fd = OpenLazyHistory(paths[i], src.historyIdx[i], files[i].offsets);
+        if (files[i].fd < 0)
         {
-            int offerId, driverId, departTime, capacity, seatsLeft;
-            string start, end;
-            in >> offerId >> driverId >> start >> end >> departTime >> capacity >> seatsLeft;
-            RideOffer* o = CreateRideOffer(offerId, driverId, start.c_str(), end.c_str(), departTime, capacity);
-            if (o) o->seatsLeft = seatsLeft;
+            for (size_t k = 0; k < i; k++)
+                close(files[k].fd);
+            files.clear();
+            return false;
         }
     }
+    return true;
+}
 
-    // Active rides
+static void AttachHistoryOffsets(const vector<LazyHistoryFile>& files)
+{
+    // Both sides are sorted by userId: merge instead of searching.
+    vector<User*> users;
+    CollectUsersInRange(CurrentEngine().userRoot, INT_MIN, INT_MAX, users);
+    for (const LazyHistoryFile& file : files)
     {
-        ClearActiveRides();
-        ifstream in(JoinPath(baseDir, "active_rides.dat"));
-        if (!in) return false;
-        int n = 0;
-        in >> n;
-        for (int i = 0; i < n; i++)
+        int source = AddHistorySource(file.fd);
+        size_t k = 0;
+        for (const HistoryOffset& e : file.offsets)
         {
-            int rideId, offerId, pc;
-            in >> rideId >> offerId >> pc;
-            int* passengers = (pc > 0) ? new int[pc] : nullptr;
-            for (int j = 0; j < pc; j++)
-                in >> passengers[j];
-            StorageInsertActiveRide(rideId, offerId, passengers, pc);
-            delete[] passengers;
+            while (k < users.size() && users[k]->userId < e.userId)
+                k++;
+            if (k < users.size() && users[k]->userId == e.userId)
+                AttachUserHistory(users[k], source, (long long)e.offset, (int)e.rows);
         }
     }
+}
+
+// Returns the manifest that was loaded in `loaded` (empty, without an
+// LSN, for the single-file layout; empty with LSN 0 if nothing was saved
+// yet, so the journal is replayed from its first record).
+static bool LoadAllFiles(const char* baseDir, SegmentManifest& loaded)
+{
+    // 10.2 Load — every kind is parsed concurrently (each from its
+    // segment files); the rebuild then runs as two independent chains:
+    //   users -> history
+    //   roads (places) -> offers -> active rides -> pending requests
+    Engine& eng = CurrentEngine();
+    LoadSources src;
+    FindLoadSources(baseDir, src);
+    if (src.segmented)
+        loaded = src.manifest;
+    if (src.empty)
+    {
+        loaded.hasLsn = true;
+        loaded.lsn = 0;
+        SegmentMarkAllDirty();
+        return true;
+    }
+    bool wasEmpty = !eng.userRoot && !eng.placeHead && !eng.offerHead;
+
+    ParsedFile<UserRow> users;
+    ParsedFile<RoadRow> roads;
+    ParsedFile<OfferRow> offers;
+    ParsedFile<ActiveRideRow> rides;
+    ParsedFile<HistoryFileRow> history;
+    ParsedFile<RequestRow> requests;
+    vector<int> passengers;
+    vector<LazyHistoryFile> lazy;
+    bool lazyHistory = !eng.userRoot && OpenAllLazyHistory(src, lazy);
 
-    // History
     {
-        ifstream in(JoinPath(baseDir, "history.dat"));
-        if (!in) return false;
-        int n = 0;
-        in >> n;
-        for (int i = 0; i < n; i++)
+        TRACE_SPAN("load_parse");
+        thread t1([&] { TRACE_SPAN("parse_users"); ParseFiles(src.paths[SEG_USERS], users, ParseUsers); });
+        thread t2([&] { TRACE_SPAN("parse_roads"); ParseFiles(src.paths[SEG_ROADS], roads, ParseRoads); });
+        thread t3([&] { TRACE_SPAN("parse_offers"); ParseFiles(src.paths[SEG_OFFERS], offers, ParseOffers); });
+        thread t4([&] { TRACE_SPAN("parse_active_rides");
+                        ParseFiles(src.paths[SEG_ACTIVE_RIDES], rides,
+                                   [&](const string& path, ParsedFile<ActiveRideRow>& f)
+                                   { return ParseActiveRides(path, f, passengers); }); });
+        thread t5([&] { TRACE_SPAN("parse_requests"); ParseFiles(src.paths[SEG_REQUESTS], requests, ParseRequests); });
+        if (lazyHistory)
+            history.ok = true;
+        else
         {
-            int userId, rideId, time;
-            string from, to;
-            in >> userId >> rideId >> from >> to >> time;
-            AddHistory(userId, rideId, from.c_str(), to.c_str(), time);
+            TRACE_SPAN("parse_history");
+            ParseFiles(src.paths[SEG_HISTORY], history, ParseHistory);
         }
+        t1.join();
+        t2.join();
+        t3.join();
+        t4.join();
+        t5.join();
+    }
+
+    if (!users.ok || !roads.ok || !offers.ok || !rides.ok || !history.ok || !requests.ok)
+    {
+        for (const LazyHistoryFile& file : lazy)
+            close(file.fd);
+        return false;
+    }
+
+    thread graphChain([&]
+    {
+        EngineScope use(eng);
+        JournalSuspendScope quiet;
+        TRACE_SPAN("build_graph_chain");
+        for (const RoadRow& r : roads.rows)
+            SetLinkProfile(AddRoad(r.from, r.to, r.cost), r.hasProfile ? r.profile : nullptr);
+        BuildOffersAndRides(offers.rows, rides.rows, passengers);
+        BuildRequests(requests.rows);
+    });
+    {
+        TRACE_SPAN("build_user_chain");
+        BuildUsers(users.rows);
+        if (lazyHistory)
+            AttachHistoryOffsets(lazy);
+        else
+            BuildHistory(history.rows);
     }
+    graphChain.join();
 
+    // The engine now matches the manifest exactly only if it was empty.
+    if (src.segmented && wasEmpty)
+        SegmentLoaded(baseDir, src.manifest);
+    else
+        SegmentMarkAllDirty();
     return true;
 }
 
+bool LoadAll(const char* baseDir)
+{
+    METRIC_INC(MC_LOADS);
+    METRIC_TIMER(MH_LOAD_ALL);
+    TRACE_SPAN("load_all");
+    // Rebuilt records are already on disk; don't journal them again.
+    JournalSuspendScope quiet;
+    SegmentManifest loaded;
+    if (!LoadAllFiles(baseDir, loaded))
+        return false;
+
+    // Then roll forward everything logged after the saved files: from the
+    // LSN committed with them, or checkpoint.lsn for older layouts.
+    return loaded.hasLsn ? JournalReplayFrom(baseDir, loaded.lsn) : JournalReplay(baseDir);
+}
+
+void ResetInMemoryState()
+{
+    // Resets heads/counters so LoadAll() rebuilds cleanly.
+    Engine& eng = CurrentEngine();
+    eng.placeHead = nullptr;
+    ClearPlaceIndex();
+    ClearRoadProfiles();
+    eng.userRoot = nullptr;
+    eng.offerHead = nullptr;
+    OfferStoreReset();
+    OfferRoutesReset();
+    eng.requestHead = nullptr;
+    eng.requestCount = 0;
+    ForgetActiveRides();
+    ClearHistoryIndex();
+    CloseHistorySources();
+    SegmentMarkAllDirty();
 
+    // Nothing points into the pools now: release every node at once.
+    ResetNodePools();
+}
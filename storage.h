@@ -10,14 +10,45 @@
 //   History (per-user lists/BST)
 //
 // Load order: same as save; rebuild all data structures.
+//
+// SaveAll writes the segmented layout (segments.h) and only rewrites
+// segments with changed records. LoadAll reads segments/MANIFEST when it
+// exists and the single .dat files otherwise; with neither (nothing saved
+// yet) it starts from an empty state. It then replays the journal.
 
 // Moved from roads.cpp (Step 10.2 requirement)
 #include <fstream>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 bool loadRoadNetworkFromFile(std::fstream &roadFile);
 
+// Reads a roads.txt-style file ("from to cost [hourly costs]" per line)
+// without touching the engine, so any thread may call it. profile is
+// nullptr for roads without hourly costs.
+bool ForEachRoadInFile(const char* path,
+                       const std::function<void(const char* from, const char* to, int cost,
+                                                const int* profile)>& fn);
+
+// New segment files are fsync'ed, then the manifest is renamed into place.
 bool SaveAll(const char* baseDir = ".");
 bool LoadAll(const char* baseDir = ".");
 
-#endif
+// Background save: the calling thread formats a point-in-time copy of the
+// changed segments into memory, a writer thread writes and commits them
+// while the engine keeps running. Returns false if it could not start.
+bool SaveAllInBackground(const char* baseDir = ".");
+bool BackgroundSaveRunning();
+void WaitBackgroundSave();
+int LastBackgroundSaveResult();   // -1 none yet, 0 failed, 1 ok
 
+// Drops every in-memory structure so LoadAll/LoadSnapshot rebuild from
+// scratch; the node pools are released in bulk (pool.h).
+void ResetInMemoryState();
 
+// Shared by the other storage formats (snapshot.cpp, journal.cpp)
+std::string JoinPath(const char* baseDir, const char* file);
+uint32_t Crc32(const void* data, size_t len);
+
+#endif
@@ -0,0 +1,87 @@
+#include "thread_pool.h"
+#include "engine.h"
+
+#include <algorithm>
+
+using namespace std;
+
+ThreadPool::ThreadPool(int helperCount)
+    : job(nullptr), jobEngine(nullptr), jobWorkers(0), jobSeq(0), pending(0), stopping(false)
+{
+    for (int i = 0; i < helperCount; i++)
+        helpers.emplace_back(&ThreadPool::HelperLoop, this, i + 1);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> g(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread& t : helpers)
+        t.join();
+}
+
+void ThreadPool::HelperLoop(int index)
+{
+    unsigned long long seen = 0;
+    while (true)
+    {
+        const function<void(int)>* fn;
+        Engine* engine;
+        {
+            unique_lock<mutex> g(lock);
+            wake.wait(g, [&] { return stopping || jobSeq != seen; });
+            if (stopping)
+                return;
+            seen = jobSeq;
+            if (index >= jobWorkers)
+                continue;   // not needed for this job
+            fn = job;
+            engine = jobEngine;
+        }
+        {
+            EngineScope use(*engine);
+            (*fn)(index);
+        }
+        {
+            lock_guard<mutex> g(lock);
+            if (--pending == 0)
+                done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::Run(int n, const function<void(int)>& fn)
+{
+    n = max(1, min(n, MaxWorkers()));
+    if (n == 1)
+    {
+        fn(0);
+        return;
+    }
+
+    lock_guard<mutex> serial(runLock);
+    {
+        lock_guard<mutex> g(lock);
+        job = &fn;
+        jobEngine = &CurrentEngine();
+        jobWorkers = n;
+        pending = n - 1;
+        jobSeq++;
+    }
+    wake.notify_all();
+
+    fn(0);
+
+    unique_lock<mutex> g(lock);
+    done.wait(g, [&] { return pending == 0; });
+    job = nullptr;
+}
+
+ThreadPool& SharedThreadPool()
+{
+    static ThreadPool pool(max(3, (int)thread::hardware_concurrency() - 1));
+    return pool;
+}
@@ -0,0 +1,53 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Fixed set of helper threads for fork/join work inside one call.
+//
+// Run(n, fn) calls fn(0) .. fn(n - 1) concurrently — worker 0 on the
+// calling thread, the rest on helpers — and returns when all are done.
+// One Run at a time per pool (callers serialize; a second caller waits).
+// Workers must not call Run on the same pool. Helpers run fn bound to the
+// caller's engine (engine.h).
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Engine;
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int helpers);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Most workers a Run can use (helpers + the caller).
+    int MaxWorkers() const { return (int)helpers.size() + 1; }
+
+    // n is clamped to [1, MaxWorkers()].
+    void Run(int n, const std::function<void(int worker)>& fn);
+
+private:
+    void HelperLoop(int index);
+
+    std::vector<std::thread> helpers;
+    std::mutex runLock;                      // one Run at a time
+    std::mutex lock;
+    std::condition_variable wake, done;
+    const std::function<void(int)>* job;
+    Engine* jobEngine;
+    int jobWorkers;
+    unsigned long long jobSeq;
+    int pending;
+    bool stopping;
+};
+
+// Process-wide pool with hardware_concurrency() - 1 helpers (at least 3,
+// so thread counts can be compared on small machines). Created on first use.
+ThreadPool& SharedThreadPool();
+
+#endif
@@ -0,0 +1,195 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+// -------------------------
+// Ring buffer
+// -------------------------
+// Slot protocol (a per-slot seqlock):
+//   writer: seq = 0, write fields, seq = index + 1 (release)
+//   reader: seq == index + 1 before and after copying the fields
+// Fields are relaxed atomics so a torn read is detected, not undefined.
+struct TraceSlot
+{
+    atomic<uint64_t> seq{0};
+    atomic<const char*> name{nullptr};
+    atomic<const char*> argName{nullptr};
+    atomic<long long> argValue{0};
+    atomic<uint64_t> startNs{0};
+    atomic<uint64_t> durNs{0};
+    atomic<uint32_t> tid{0};
+};
+
+struct TraceEventCopy
+{
+    const char* name;
+    const char* argName;
+    long long argValue;
+    uint64_t startNs;
+    uint64_t durNs;
+    uint32_t tid;
+};
+
+static TraceSlot gRing[TRACE_RING_SIZE];
+static atomic<uint64_t> gHead{0};     // next slot index ever claimed
+static uint64_t gFlushed = 0;          // first index not flushed yet
+static mutex gFlushLock;               // flushes only; writers never take it
+
+atomic<bool> gTraceOn{false};
+
+static uint64_t NowNs()
+{
+    static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+}
+
+void TraceStart()
+{
+    NowNs();   // pin the epoch
+    gTraceOn.store(true, memory_order_relaxed);
+}
+
+void TraceStop()
+{
+    gTraceOn.store(false, memory_order_relaxed);
+}
+
+bool TraceRunning()
+{
+    return gTraceOn.load(memory_order_relaxed);
+}
+
+#if RS_TRACE
+
+static uint32_t ThreadId()
+{
+    static atomic<uint32_t> next{1};
+    static thread_local uint32_t id = next.fetch_add(1, memory_order_relaxed);
+    return id;
+}
+
+static thread_local TraceSpan* tlsOpenSpan = nullptr;
+
+static void Record(const TraceSpan& s, uint64_t endNs)
+{
+    uint64_t idx = gHead.fetch_add(1, memory_order_relaxed);
+    TraceSlot& slot = gRing[idx & (TRACE_RING_SIZE - 1)];
+    slot.seq.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.name.store(s.name, memory_order_relaxed);
+    slot.argName.store(s.argName, memory_order_relaxed);
+    slot.argValue.store(s.argValue, memory_order_relaxed);
+    slot.startNs.store(s.startNs, memory_order_relaxed);
+    slot.durNs.store(endNs - s.startNs, memory_order_relaxed);
+    slot.tid.store(ThreadId(), memory_order_relaxed);
+    slot.seq.store(idx + 1, memory_order_release);
+}
+
+TraceSpan::TraceSpan(const char* spanName)
+    : name(spanName), argName(nullptr), argValue(0), startNs(0), parent(nullptr),
+      active(gTraceOn.load(memory_order_relaxed))
+{
+    if (!active) return;
+    parent = tlsOpenSpan;
+    tlsOpenSpan = this;
+    startNs = NowNs();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (!active) return;
+    Record(*this, NowNs());
+    tlsOpenSpan = parent;
+}
+
+void TraceSetArg(const char* name, long long value)
+{
+    if (!tlsOpenSpan) return;
+    tlsOpenSpan->argName = name;
+    tlsOpenSpan->argValue = value;
+}
+
+#endif
+
+// -------------------------
+// Flush
+// -------------------------
+static bool ReadSlot(uint64_t idx, TraceEventCopy& e)
+{
+    const TraceSlot& slot = gRing[idx & (TRACE_RING_SIZE - 1)];
+    if (slot.seq.load(memory_order_acquire) != idx + 1)
+        return false;   // overwritten by a later lap, or still being written
+    e.name = slot.name.load(memory_order_relaxed);
+    e.argName = slot.argName.load(memory_order_relaxed);
+    e.argValue = slot.argValue.load(memory_order_relaxed);
+    e.startNs = slot.startNs.load(memory_order_relaxed);
+    e.durNs = slot.durNs.load(memory_order_relaxed);
+    e.tid = slot.tid.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    return slot.seq.load(memory_order_relaxed) == idx + 1;
+}
+
+bool TraceFlush(const char* path, uint64_t* written, uint64_t* dropped)
+{
+    lock_guard<mutex> g(gFlushLock);
+    uint64_t head = gHead.load(memory_order_acquire);
+    uint64_t first = max(gFlushed, head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0);
+
+    vector<TraceEventCopy> events;
+    events.reserve((size_t)(head - first));
+    uint64_t lost = first - gFlushed;
+    for (uint64_t i = first; i < head; i++)
+    {
+        TraceEventCopy e;
+        if (ReadSlot(i, e))
+            events.push_back(e);
+        else
+            lost++;
+    }
+    sort(events.begin(), events.end(),
+         [](const TraceEventCopy& a, const TraceEventCopy& b) { return a.startNs < b.startNs; });
+
+    string tmp = string(path) + ".tmp";
+    {
+        ofstream out(tmp);
+        if (!out) return false;
+        char buf[256];
+        int pid = (int)getpid();
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const TraceEventCopy& e = events[i];
+            int n = snprintf(buf, sizeof(buf),
+                             "{\"name\":\"%s\",\"cat\":\"rs\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                             "\"pid\":%d,\"tid\":%u",
+                             e.name, e.startNs / 1000.0, e.durNs / 1000.0, pid, e.tid);
+            out.write(buf, n);
+            if (e.argName)
+            {
+                n = snprintf(buf, sizeof(buf), ",\"args\":{\"%s\":%lld}", e.argName, e.argValue);
+                out.write(buf, n);
+            }
+            out << (i + 1 < events.size() ? "},\n" : "}\n");
+        }
+        out << "]}\n";
+        out.flush();
+        if (!out) return false;
+    }
+    if (rename(tmp.c_str(), path) != 0)
+        return false;
+
+    gFlushed = head;
+    if (written) *written = events.size();
+    if (dropped) *dropped = lost;
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Span tracing in Chrome trace format (chrome://tracing, ui.perfetto.dev).
+//
+// TRACE_SPAN("match") records one complete event covering the rest of the
+// scope; TRACE_ARG("request", id) attaches an integer to the innermost
+// open span of the calling thread. Spans nest per thread.
+//
+// Finished spans go into a fixed ring of TRACE_RING_SIZE slots shared by
+// all threads: a writer claims a slot with one fetch_add and publishes it
+// with a sequence number, so recording never blocks. When the ring wraps,
+// the oldest unflushed spans are overwritten (and counted as dropped).
+//
+// Tracing is off until TraceStart(); while off a span costs one relaxed
+// load. Build with -DRS_TRACE=0 to compile the hooks out entirely.
+
+#include <cstdint>
+
+#ifndef RS_TRACE
+#define RS_TRACE 1
+#endif
+
+#define TRACE_RING_SIZE (1 << 16)     // power of two
+
+void TraceStart();
+void TraceStop();
+bool TraceRunning();
+
+// Writes the spans recorded since the last flush as a JSON trace file and
+// forgets them. `dropped` (optional) receives how many were overwritten.
+bool TraceFlush(const char* path, uint64_t* written = nullptr, uint64_t* dropped = nullptr);
+
+#if RS_TRACE
+
+#include <atomic>
+
+extern std::atomic<bool> gTraceOn;
+
+struct TraceSpan
+{
+    const char* name;
+    const char* argName;
+    long long argValue;
+    uint64_t startNs;
+    TraceSpan* parent;
+    bool active;
+
+    explicit TraceSpan(const char* spanName);
+    ~TraceSpan();
+};
+
+void TraceSetArg(const char* name, long long value);
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name)
+#define TRACE_ARG(name, value) \
+    (gTraceOn.load(std::memory_order_relaxed) ? TraceSetArg((name), (long long)(value)) : (void)0)
+
+#else
+
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_ARG(name, value) ((void)0)
+
+#endif
+
+#endif
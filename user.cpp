@@ -7,22 +7,39 @@
 #include <vector>
 #include <algorithm>
 #include "user.h"
+#include "history_index.h"
+#include "history_segment.h"
+#include "journal.h"
+#include "segments.h"
+#include "metrics.h"
+#include "pool.h"
+#include "engine.h"
+#include "trace.h"
+
+#include <unistd.h>
 //#include <ctring>
 
 using namespace std;
 
 
+
 User* CreateUser(User* root, int userId, const char *name, int isDriver) {
     if (!root) {
-        User* newUser = new User;
+        Engine& eng = CurrentEngine();
+        User* newUser = eng.userPool.Alloc();
+        METRIC_INC(MC_ALLOC_USER);
         newUser->userId = userId;
-        newUser->name = new char[strlen(name)+1];
-        strcpy(newUser->name, name);
+        newUser->name = eng.userStrings.Copy(name);
         newUser->isDriver = isDriver;
         newUser->rating = 5; // default rating
         newUser->completedRides = 0;
         newUser->history = nullptr;
+        newUser->historyOffset = -1;
+        newUser->historyRows = 0;
+        newUser->historyIndexed = false;
         newUser->left = newUser->right = nullptr;
+        JournalUserCreate(userId, name, isDriver);
+        SegmentMarkDirty(SEG_USERS, userId);
         return newUser;
     }
 
@@ -39,6 +56,7 @@ User* CreateUser(User* root, int userId, const char *name, int isDriver) {
 User* SearchUser(User* root, int userId) {
     if (!root)
 	 return nullptr;
+    METRIC_INC(MC_USER_SEARCH_STEPS);
     if (root->userId == userId)
 	 return root;
     if (userId < root->userId)
@@ -75,14 +93,12 @@ HistoryNode* InsertHistoryBST(HistoryNode* root, int rideId,
 {
     if (root == nullptr) {
         // Create a new node
-        HistoryNode* newNode = new HistoryNode;
+        Engine& eng = CurrentEngine();
+        HistoryNode* newNode = eng.historyPool.Alloc();
+        METRIC_INC(MC_ALLOC_HISTORY_NODE);
         newNode->rideId = rideId;
-
-        newNode->from = new char[strlen(from)+1];
-        strcpy(newNode->from, from);
-
-        newNode->to = new char[strlen(to)+1];
-        strcpy(newNode->to, to);
+        newNode->from = eng.userStrings.Copy(from);
+        newNode->to = eng.userStrings.Copy(to);
 
         newNode->time = time;
         newNode->left = newNode->right = nullptr;
@@ -103,13 +119,186 @@ HistoryNode* InsertHistoryBST(HistoryNode* root, int rideId,
 void AddHistory(int userId, int rideId,
                 const char* from, const char* to, int time)
 {
-    User* u = SearchUser(userRoot, userId);
+    User* u = SearchUser(CurrentEngine().userRoot, userId);
     if (!u) {
         cout << "User not found!" << endl;
         return;
     }
 
+    TRACE_SPAN("history_add");
+    EnsureUserHistory(u);
+    METRIC_INC(MC_HISTORY_ADDS);
     u->history = InsertHistoryBST(u->history, rideId, from, to, time);
+    HistoryIndexAdd(userId, u->isDriver, rideId, from, to, time);
+    JournalHistoryAdd(userId, rideId, from, to, time);
+    SegmentMarkDirty(SEG_HISTORY, userId);
+}
+
+static User* LinkUsers(User** nodes, int lo, int hi)
+{
+    if (lo > hi) return nullptr;
+    int mid = lo + (hi - lo) / 2;
+    User* u = nodes[mid];
+    u->left = LinkUsers(nodes, lo, mid - 1);
+    u->right = LinkUsers(nodes, mid + 1, hi);
+    return u;
+}
+
+User* BuildUserTree(User** sorted, int n)
+{
+    return LinkUsers(sorted, 0, n - 1);
+}
+
+static HistoryNode* LinkHistory(HistoryNode** nodes, int lo, int hi)
+{
+    if (lo > hi) return nullptr;
+    int mid = lo + (hi - lo) / 2;
+    HistoryNode* h = nodes[mid];
+    h->left = LinkHistory(nodes, lo, mid - 1);
+    h->right = LinkHistory(nodes, mid + 1, hi);
+    return h;
+}
+
+HistoryNode* BuildHistoryTree(HistoryNode** sorted, int n)
+{
+    return LinkHistory(sorted, 0, n - 1);
+}
+
+// -------------------------
+// Lazy history
+// -------------------------
+struct HistorySources
+{
+    vector<int> fds;            // by source
+    int usersOnDisk = 0;
+    bool allIndexed = false;    // every user on disk is historyIndexed
+
+    ~HistorySources()
+    {
+        for (int fd : fds)
+            close(fd);
+    }
+};
+
+static HistorySources& Sources()
+{
+    return EnginePart<HistorySources>();
+}
+
+int AddHistorySource(int fd)
+{
+    vector<int>& fds = Sources().fds;
+    fds.push_back(fd);
+    return (int)fds.size() - 1;
+}
+
+void CloseHistorySources()
+{
+    HistorySources& s = Sources();
+    for (int fd : s.fds)
+        close(fd);
+    s.fds.clear();
+    s.usersOnDisk = 0;
+    s.allIndexed = false;
+}
+
+void AttachUserHistory(User* u, int source, long long offset, int rows)
+{
+    HistorySources& s = Sources();
+    if (!HistoryOnDisk(u))
+        s.usersOnDisk++;
+    s.allIndexed = false;
+    u->historySource = source;
+    u->historyOffset = offset;
+    u->historyRows = rows;
+    u->historyIndexed = false;
+}
+
+bool HistoryOnDisk(const User* u)
+{
+    return u && u->historyOffset >= 0;
+}
+
+bool ReadUserHistoryGroup(const User* u, string& raw)
+{
+    const vector<int>& fds = Sources().fds;
+    return HistoryOnDisk(u) && u->historySource >= 0 && u->historySource < (int)fds.size() &&
+           ReadHistoryGroupAt(fds[u->historySource], (uint64_t)u->historyOffset, raw);
+}
+
+bool EnsureUserHistory(User* u)
+{
+    if (!HistoryOnDisk(u)) return true;
+    METRIC_INC(MC_HISTORY_LAZY_LOADS);
+    METRIC_TIMER(MH_HISTORY_LOAD);
+    TRACE_SPAN("history_lazy_load");
+    TRACE_ARG("user", u->userId);
+
+    string raw;
+    HistoryGroup g;
+    bool ok = ReadUserHistoryGroup(u, raw) && DecodeHistoryGroup(raw, g) &&
+              g.userId == u->userId;
+    // Either way the user is now in memory, so later adds are not lost
+    // behind a stale offset.
+    bool indexed = u->historyIndexed;
+    u->historyOffset = -1;
+    u->historyRows = 0;
+    u->historyIndexed = false;
+    Sources().usersOnDisk--;
+    if (!ok)
+    {
+        cout << "Ride history of user " << u->userId << " could not be read!" << endl;
+        return false;
+    }
+
+    // Groups are stored in time order.
+    Engine& eng = CurrentEngine();
+    vector<HistoryNode*> nodes(g.Count());
+    for (int i = 0; i < g.Count(); i++)
+    {
+        HistoryNode* h = eng.historyPool.Alloc();
+        h->rideId = g.rideIds[i];
+        h->from = eng.userStrings.Copy(g.From(i));
+        h->to = eng.userStrings.Copy(g.To(i));
+        h->time = g.times[i];
+        nodes[i] = h;
+        if (!indexed)
+            HistoryIndexAdd(u->userId, u->isDriver, h->rideId, h->from, h->to, h->time);
+    }
+    METRIC_ADD(MC_ALLOC_HISTORY_NODE, nodes.size());
+    u->history = BuildHistoryTree(nodes.data(), (int)nodes.size());
+    return true;
+}
+
+static void IndexUsersOnDisk(User* u, bool& all)
+{
+    if (!u) return;
+    IndexUsersOnDisk(u->left, all);
+    if (HistoryOnDisk(u) && !u->historyIndexed)
+    {
+        // An unreadable group stays out; EnsureUserHistory reports it.
+        string raw;
+        HistoryGroup g;
+        if (ReadUserHistoryGroup(u, raw) && DecodeHistoryGroup(raw, g) && g.userId == u->userId)
+        {
+            for (int i = 0; i < g.Count(); i++)
+                HistoryIndexAdd(u->userId, u->isDriver, g.rideIds[i], g.From(i), g.To(i), g.times[i]);
+            u->historyIndexed = true;
+        }
+        else
+            all = false;
+    }
+    IndexUsersOnDisk(u->right, all);
+}
+
+void IndexHistoryOnDisk(User* root)
+{
+    HistorySources& s = Sources();
+    if (s.usersOnDisk == 0 || s.allIndexed) return;
+    TRACE_SPAN("history_index_on_disk");
+    bool all = true;
+    IndexUsersOnDisk(root, all);
+    s.allIndexed = all;
 }
 
 void PrintHistoryBST(HistoryNode* root)
@@ -128,7 +317,7 @@ void PrintHistoryBST(HistoryNode* root)
 
 void PrintUserHistory(int userId)
 {
-    User* u = SearchUser(userRoot, userId);
+    User* u = SearchUser(CurrentEngine().userRoot, userId);
     if (!u) {
         cout << "User not found!" << endl;
         return;
@@ -137,6 +326,7 @@ void PrintUserHistory(int userId)
     cout << "Ride History of " << u->name
          << " (ID " << u->userId << "):" << endl;
 
+    EnsureUserHistory(u);
     if (!u->history) {
         cout << "  No ride history available." << endl;
         return;
@@ -147,7 +337,7 @@ void PrintUserHistory(int userId)
 
 bool PassengerExists(int passengerId)
 {
-    User* u = SearchUser(userRoot, passengerId);
+    User* u = SearchUser(CurrentEngine().userRoot, passengerId);
 
     if (u == nullptr)
         return false;
@@ -165,6 +355,28 @@ static void CollectDrivers(User* root, vector<User*>& out)
     CollectDrivers(root->right, out);
 }
 
+int TopDrivers(int k, vector<User*>& out)
+{
+    out.clear();
+    if (k <= 0)
+        return 0;
+    CollectDrivers(CurrentEngine().userRoot, out);
+
+    size_t limit = min((size_t)k, out.size());
+    partial_sort(out.begin(), out.begin() + limit, out.end(),
+         [](const User* a, const User* b)
+         {
+             if (a->completedRides != b->completedRides)
+                 return a->completedRides > b->completedRides;
+             // tie-breaker: higher rating, then smaller userId
+             if (a->rating != b->rating)
+                 return a->rating > b->rating;
+             return a->userId < b->userId;
+         });
+    out.resize(limit);
+    return (int)limit;
+}
+
 void PrintTopDrivers(int k)
 {
     if (k <= 0)
@@ -174,26 +386,14 @@ void PrintTopDrivers(int k)
     }
 
     vector<User*> drivers;
-    CollectDrivers(userRoot, drivers);
+    int limit = TopDrivers(k, drivers);
 
-    if (drivers.empty())
+    if (limit == 0)
     {
         cout << "No drivers found.\n";
         return;
     }
 
-    sort(drivers.begin(), drivers.end(),
-         [](const User* a, const User* b)
-         {
-             if (a->completedRides != b->completedRides)
-                 return a->completedRides > b->completedRides;
-             // tie-breaker: higher rating, then smaller userId
-             if (a->rating != b->rating)
-                 return a->rating > b->rating;
-             return a->userId < b->userId;
-         });
-
-    int limit = (k < (int)drivers.size()) ? k : (int)drivers.size();
     cout << "Top " << limit << " drivers by completed rides:\n";
     for (int i = 0; i < limit; i++)
     {
@@ -1,6 +1,9 @@
 #ifndef USER_H
 #define USER_H
 
+#include <string>
+#include <vector>
+
 struct HistoryNode
 {
     int rideId;
@@ -19,11 +22,15 @@ struct User
 	int rating;
     int completedRides; // Phase 9: count of completed rides (drivers only)
 	HistoryNode* history;
+	long long historyOffset; // group in a history file not loaded yet; -1 = history is in memory
+	int historyRows;
+	int historySource;       // which history file (AddHistorySource)
+	bool historyIndexed;     // on disk, but its rows are in the history index already
 	User *left; // BST
 	User *right;
 };
 
-extern User* userRoot;
+// The BST root is Engine::userRoot (engine.h).
 
 User* CreateUser(User* root, int userId, const char *name, int isDriver);
 
@@ -38,10 +45,32 @@ HistoryNode* InsertHistoryBST(HistoryNode* root, int rideId,
 void AddHistory(int userId, int rideId,
                 const char* from, const char* to, int time);
 
+// Loaders: link already-sorted nodes into balanced trees
+// (inserting sorted keys one by one degenerates into a list).
+User* BuildUserTree(User** sorted, int n);
+HistoryNode* BuildHistoryTree(HistoryNode** sorted, int n);
+
+// Lazy history: LoadAll leaves each user's group in its history file and
+// EnsureUserHistory reads it on first access.
+int AddHistorySource(int fd);      // takes ownership of fd
+void CloseHistorySources();
+void AttachUserHistory(User* u, int source, long long offset, int rows);
+bool HistoryOnDisk(const User* u);
+// Full dumps (snapshots) call EnsureUserHistory user by user as they
+// walk; queries never load everybody.
+bool EnsureUserHistory(User* u);
+// For the history aggregates: indexes the rows of every user still on
+// disk straight from their groups, without building their trees.
+// EnsureUserHistory then builds the tree only.
+void IndexHistoryOnDisk(User* root);
+bool ReadUserHistoryGroup(const User* u, std::string& raw);   // for saving unloaded users
+
 void PrintHistoryBST(HistoryNode* root);
 
 void PrintUserHistory(int userId);
 
+// The k drivers with the most completed rides (ties: rating, then id).
+int TopDrivers(int k, std::vector<User*>& out);
 void PrintTopDrivers(int k);
 
 bool PassengerExists(int passengerId);